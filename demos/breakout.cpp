@@ -1,92 +1,668 @@
 #include "backend.h"
-
-const char* vert_source = 
-"#version 430\n"
-"layout (location = 0) in vec3 pos;\n"
-"layout (location = 1) in vec3 color_in;\n"
-"layout (location = 0) out vec3 color_out;\n"
-"void main() {\n"
-"  gl_Position = vec4(pos, 1.0);\n"
-"  color_out = color_in;\n"
-"}\n";
-
-const char* frag_source = 
-"#version 430\n"
-"layout (location = 0) in vec3 color;\n"
-"layout (location = 0) out vec4 frag_color;\n"
-"void main() {\n"
-"  frag_color = vec4(color, 1.0);\n"
-"}\n";
+#include "frame.h"
+#include "compute.h"
+#include "descriptors.h"
+#include "cache.h"
+#include "graph.h"
+#include "geometry.h"
+#include "profiler.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 
 const char* app_name = "Breakout";
+// Number of frames rendered before exiting when running with --headless, --resize-stress or a compute load
+// (twice that with --compare-compute)
+constexpr uint32_t n_benchmark_frames = 1000;
+// Size of the buffer written every frame by --compute-load's compute shader
+constexpr VkDeviceSize compute_load_size = 64 * 1024 * 1024;
+
+// --compute-load's shader: writes a push constant over a storage buffer. SPIR-V 1.0, assembled by hand (the
+// demo doesn't link a shader compiler) from
+//   #version 450
+//   layout (local_size_x = 64) in;
+//   layout (set = 0, binding = 0) buffer Values { uint values[]; };
+//   layout (push_constant) uniform Fill { uint value; uint row_length; };
+//   void main() {
+//     values[gl_GlobalInvocationID.y * row_length + gl_GlobalInvocationID.x] = value;
+//   }
+static const uint32_t fill_shader[] = {
+    0x07230203, 0x00010000, 0, 31, 0,   // Magic number, version 1.0, generator, ID bound, schema
+    0x00020011, 1,                      // OpCapability Shader
+    0x0003000e, 0, 1,                   // OpMemoryModel Logical GLSL450
+    0x0006000f, 5, 1, 0x6e69616d, 0, 2, // OpEntryPoint GLCompute %main "main" %gid
+    0x00060010, 1, 17, 64, 1, 1,        // OpExecutionMode %main LocalSize 64 1 1
+    0x00040047, 2, 11, 28,              // OpDecorate %gid BuiltIn GlobalInvocationId
+    0x00040047, 3, 6, 4,                // OpDecorate %values_array ArrayStride 4
+    0x00050048, 4, 0, 35, 0,            // OpMemberDecorate %Values 0 Offset 0
+    0x00030047, 4, 3,                   // OpDecorate %Values BufferBlock
+    0x00040047, 5, 34, 0,               // OpDecorate %values DescriptorSet 0
+    0x00040047, 5, 33, 0,               // OpDecorate %values Binding 0
+    0x00050048, 6, 0, 35, 0,            // OpMemberDecorate %Fill 0 Offset 0
+    0x00050048, 6, 1, 35, 4,            // OpMemberDecorate %Fill 1 Offset 4
+    0x00030047, 6, 2,                   // OpDecorate %Fill Block
+    0x00020013, 8,                      // %void = OpTypeVoid
+    0x00030021, 9, 8,                   // %main_type = OpTypeFunction %void
+    0x00040015, 10, 32, 0,              // %uint = OpTypeInt 32 0
+    0x00040017, 11, 10, 3,              // %uvec3 = OpTypeVector %uint 3
+    0x00040020, 12, 1, 11,              // %uvec3_input = OpTypePointer Input %uvec3
+    0x0004003b, 12, 2, 1,               // %gid = OpVariable %uvec3_input Input
+    0x0003001d, 3, 10,                  // %values_array = OpTypeRuntimeArray %uint
+    0x0003001e, 4, 3,                   // %Values = OpTypeStruct %values_array
+    0x00040020, 13, 2, 4,               // %Values_uniform = OpTypePointer Uniform %Values
+    0x0004003b, 13, 5, 2,               // %values = OpVariable %Values_uniform Uniform
+    0x0004001e, 6, 10, 10,              // %Fill = OpTypeStruct %uint %uint
+    0x00040020, 14, 9, 6,               // %Fill_push = OpTypePointer PushConstant %Fill
+    0x0004003b, 14, 7, 9,               // %fill = OpVariable %Fill_push PushConstant
+    0x00040015, 15, 32, 1,              // %int = OpTypeInt 32 1
+    0x0004002b, 15, 16, 0,              // %int_0 = OpConstant %int 0
+    0x0004002b, 15, 17, 1,              // %int_1 = OpConstant %int 1
+    0x00040020, 18, 9, 10,              // %uint_push = OpTypePointer PushConstant %uint
+    0x00040020, 19, 2, 10,              // %uint_uniform = OpTypePointer Uniform %uint
+    0x00050036, 8, 1, 0, 9,             // %main = OpFunction %void None %main_type
+    0x000200f8, 20,                     // %entry = OpLabel
+    0x0004003d, 11, 21, 2,              // %id = OpLoad %uvec3 %gid
+    0x00050051, 10, 22, 21, 0,          // %x = OpCompositeExtract %uint %id 0
+    0x00050051, 10, 23, 21, 1,          // %y = OpCompositeExtract %uint %id 1
+    0x00050041, 18, 24, 7, 17,          // %row_length_ptr = OpAccessChain %uint_push %fill %int_1
+    0x0004003d, 10, 25, 24,             // %row_length = OpLoad %uint %row_length_ptr
+    0x00050084, 10, 26, 23, 25,         // %row_start = OpIMul %uint %y %row_length
+    0x00050080, 10, 27, 26, 22,         // %index = OpIAdd %uint %row_start %x
+    0x00050041, 18, 28, 7, 16,          // %value_ptr = OpAccessChain %uint_push %fill %int_0
+    0x0004003d, 10, 29, 28,             // %value = OpLoad %uint %value_ptr
+    0x00060041, 19, 30, 5, 16, 27,      // %element = OpAccessChain %uint_uniform %values %int_0 %index
+    0x0003003e, 30, 29,                 // OpStore %element %value
+    0x000100fd,                         // OpReturn
+    0x00010038,                         // OpFunctionEnd
+};
+constexpr uint32_t fill_group_size = 64;
+// The dispatch is split into rows of this many values, since a single row of groups covering the whole buffer
+// would be longer than the 65535 groups maxComputeWorkGroupCount is guaranteed to allow
+constexpr uint32_t fill_row_length = 65536;
+struct FillConstants {
+    uint32_t value;
+    uint32_t row_length;
+};
+
+// Shaders of the paddle, ball and bricks, assembled by hand like fill_shader from
+//   #version 450
+//   layout (location = 0) in vec3 pos;
+//   layout (location = 1) in vec3 color_in;
+//   layout (location = 0) out vec3 color_out;
+//   void main() {
+//     gl_Position = vec4(pos, 1.0);
+//     color_out = color_in;
+//   }
+// (with gl_Position as a variable of its own rather than a member of gl_PerVertex) and
+//   #version 450
+//   layout (location = 0) in vec3 color;
+//   layout (location = 0) out vec4 frag_color;
+//   void main() {
+//     frag_color = vec4(color, 1.0);
+//   }
+static const uint32_t mesh_vertex_shader[] = {
+    0x07230203, 0x00010000, 0, 19, 0,            // Magic number, version 1.0, generator, ID bound, schema
+    0x00020011, 1,                               // OpCapability Shader
+    0x0003000e, 0, 1,                            // OpMemoryModel Logical GLSL450
+    0x0009000f, 0, 1, 0x6e69616d, 0, 2, 3, 4, 5, // OpEntryPoint Vertex %main "main" %pos %color_in %color_out %position
+    0x00040047, 2, 30, 0,                        // OpDecorate %pos Location 0
+    0x00040047, 3, 30, 1,                        // OpDecorate %color_in Location 1
+    0x00040047, 4, 30, 0,                        // OpDecorate %color_out Location 0
+    0x00040047, 5, 11, 0,                        // OpDecorate %position BuiltIn Position
+    0x00020013, 6,                               // %void = OpTypeVoid
+    0x00030021, 7, 6,                            // %main_type = OpTypeFunction %void
+    0x00030016, 8, 32,                           // %float = OpTypeFloat 32
+    0x00040017, 9, 8, 3,                         // %vec3 = OpTypeVector %float 3
+    0x00040017, 10, 8, 4,                        // %vec4 = OpTypeVector %float 4
+    0x00040020, 11, 1, 9,                        // %vec3_input = OpTypePointer Input %vec3
+    0x00040020, 12, 3, 9,                        // %vec3_output = OpTypePointer Output %vec3
+    0x00040020, 13, 3, 10,                       // %vec4_output = OpTypePointer Output %vec4
+    0x0004003b, 11, 2, 1,                        // %pos = OpVariable %vec3_input Input
+    0x0004003b, 11, 3, 1,                        // %color_in = OpVariable %vec3_input Input
+    0x0004003b, 12, 4, 3,                        // %color_out = OpVariable %vec3_output Output
+    0x0004003b, 13, 5, 3,                        // %position = OpVariable %vec4_output Output
+    0x0004002b, 8, 14, 0x3f800000,               // %float_1 = OpConstant %float 1.0
+    0x00050036, 6, 1, 0, 7,                      // %main = OpFunction %void None %main_type
+    0x000200f8, 15,                              // %entry = OpLabel
+    0x0004003d, 9, 16, 2,                        // %p = OpLoad %vec3 %pos
+    0x00050050, 10, 17, 16, 14,                  // %p4 = OpCompositeConstruct %vec4 %p %float_1
+    0x0003003e, 5, 17,                           // OpStore %position %p4
+    0x0004003d, 9, 18, 3,                        // %c = OpLoad %vec3 %color_in
+    0x0003003e, 4, 18,                           // OpStore %color_out %c
+    0x000100fd,                                  // OpReturn
+    0x00010038,                                  // OpFunctionEnd
+};
+static const uint32_t mesh_fragment_shader[] = {
+    0x07230203, 0x00010000, 0, 15, 0,      // Magic number, version 1.0, generator, ID bound, schema
+    0x00020011, 1,                         // OpCapability Shader
+    0x0003000e, 0, 1,                      // OpMemoryModel Logical GLSL450
+    0x0007000f, 4, 1, 0x6e69616d, 0, 2, 3, // OpEntryPoint Fragment %main "main" %color %frag_color
+    0x00030010, 1, 7,                      // OpExecutionMode %main OriginUpperLeft
+    0x00040047, 2, 30, 0,                  // OpDecorate %color Location 0
+    0x00040047, 3, 30, 0,                  // OpDecorate %frag_color Location 0
+    0x00020013, 4,                         // %void = OpTypeVoid
+    0x00030021, 5, 4,                      // %main_type = OpTypeFunction %void
+    0x00030016, 6, 32,                     // %float = OpTypeFloat 32
+    0x00040017, 7, 6, 3,                   // %vec3 = OpTypeVector %float 3
+    0x00040017, 8, 6, 4,                   // %vec4 = OpTypeVector %float 4
+    0x00040020, 9, 1, 7,                   // %vec3_input = OpTypePointer Input %vec3
+    0x00040020, 10, 3, 8,                  // %vec4_output = OpTypePointer Output %vec4
+    0x0004003b, 9, 2, 1,                   // %color = OpVariable %vec3_input Input
+    0x0004003b, 10, 3, 3,                  // %frag_color = OpVariable %vec4_output Output
+    0x0004002b, 6, 11, 0x3f800000,         // %float_1 = OpConstant %float 1.0
+    0x00050036, 4, 1, 0, 5,                // %main = OpFunction %void None %main_type
+    0x000200f8, 12,                        // %entry = OpLabel
+    0x0004003d, 7, 13, 2,                  // %c = OpLoad %vec3 %color
+    0x00050050, 8, 14, 13, 11,             // %c4 = OpCompositeConstruct %vec4 %c %float_1
+    0x0003003e, 3, 14,                     // OpStore %frag_color %c4
+    0x000100fd,                            // OpReturn
+    0x00010038,                            // OpFunctionEnd
+};
+struct MeshVertex {
+    float pos[3];
+    float color[3];
+};
+// Vertices and indices the GeometryArena has room for
+constexpr uint32_t max_mesh_vertices = 1024;
+constexpr uint32_t max_mesh_indices = 3 * max_mesh_vertices;
+constexpr uint32_t n_bricks_per_row = 10;
+constexpr uint32_t n_brick_rows = 4;
 
 using namespace Atlas;
 
-int main() {
+// Returns VK_NULL_HANDLE on failure
+static VkPipeline create_fill_pipeline(Backend::Device& device, VkPipelineLayout layout) {
+    VkShaderModuleCreateInfo module_info = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,    // sType
+        nullptr,                                        // pNext
+        0,                                              // flags
+        sizeof(fill_shader),                            // codeSize
+        fill_shader                                     // pCode
+    };
+    VkShaderModule module;
+    if (!validate(vkCreateShaderModule(device.vk(), &module_info, nullptr, &module))) return VK_NULL_HANDLE;
+
+    VkComputePipelineCreateInfo pipeline_info = {
+        VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,         // sType
+        nullptr,                                                // pNext
+        0,                                                      // flags
+        {   VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,    // stage
+            nullptr,
+            0,
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            module,
+            "main",
+            nullptr
+        },
+        layout,                                                 // layout
+        VK_NULL_HANDLE,                                         // basePipelineHandle
+        -1                                                      // basePipelineIndex
+    };
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult res = vkCreateComputePipelines(device.vk(), device.get_pipeline_cache(), 1, &pipeline_info, nullptr, &pipeline);
+    // The pipeline doesn't need the module once it's created
+    vkDestroyShaderModule(device.vk(), module, nullptr);
+    return validate(res) ? pipeline : VK_NULL_HANDLE;
+}
+
+// Returns VK_NULL_HANDLE on failure
+static VkShaderModule create_shader_module(Backend::Device& device, const uint32_t* code, size_t size) {
+    VkShaderModuleCreateInfo module_info = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,    // sType
+        nullptr,                                        // pNext
+        0,                                              // flags
+        size,                                           // codeSize
+        code                                            // pCode
+    };
+    VkShaderModule module;
+    if (!validate(vkCreateShaderModule(device.vk(), &module_info, nullptr, &module))) return VK_NULL_HANDLE;
+    return module;
+}
+
+// Draws MeshVertex triangles with depth testing; the viewport and scissor are dynamic so the pipeline
+// survives resizes. Returns VK_NULL_HANDLE on failure
+static VkPipeline create_mesh_pipeline(Backend::Device& device, VkPipelineLayout layout, VkRenderPass renderpass) {
+    VkShaderModule vertex_module = create_shader_module(device, mesh_vertex_shader, sizeof(mesh_vertex_shader));
+    VkShaderModule fragment_module = create_shader_module(device, mesh_fragment_shader, sizeof(mesh_fragment_shader));
+    if (!vertex_module || !fragment_module) {
+        vkDestroyShaderModule(device.vk(), vertex_module, nullptr);
+        vkDestroyShaderModule(device.vk(), fragment_module, nullptr);
+        return VK_NULL_HANDLE;
+    }
+
+    const VkPipelineShaderStageCreateInfo stages[2] = {
+        {   VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,    // sType
+            nullptr,                                                // pNext
+            0,                                                      // flags
+            VK_SHADER_STAGE_VERTEX_BIT,                             // stage
+            vertex_module,                                          // module
+            "main",                                                 // pName
+            nullptr                                                 // pSpecializationInfo
+        },
+        {   VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,    // sType
+            nullptr,                                                // pNext
+            0,                                                      // flags
+            VK_SHADER_STAGE_FRAGMENT_BIT,                           // stage
+            fragment_module,                                        // module
+            "main",                                                 // pName
+            nullptr                                                 // pSpecializationInfo
+        }
+    };
+    const VkVertexInputBindingDescription binding = { 0, sizeof(MeshVertex), VK_VERTEX_INPUT_RATE_VERTEX };
+    const VkVertexInputAttributeDescription attributes[2] = {
+        { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(MeshVertex, pos) },
+        { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(MeshVertex, color) }
+    };
+    const VkPipelineVertexInputStateCreateInfo vertex_input = {
+        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,  // sType
+        nullptr,                                                    // pNext
+        0,                                                          // flags
+        1,                                                          // vertexBindingDescriptionCount
+        &binding,                                                   // pVertexBindingDescriptions
+        2,                                                          // vertexAttributeDescriptionCount
+        attributes                                                  // pVertexAttributeDescriptions
+    };
+    const VkPipelineInputAssemblyStateCreateInfo input_assembly = {
+        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,    // sType
+        nullptr,                                                        // pNext
+        0,                                                              // flags
+        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,                            // topology
+        VK_FALSE                                                        // primitiveRestartEnable
+    };
+    const VkPipelineViewportStateCreateInfo viewport = {
+        VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,  // sType
+        nullptr,                                                // pNext
+        0,                                                      // flags
+        1,                                                      // viewportCount
+        nullptr,                                                // pViewports
+        1,                                                      // scissorCount
+        nullptr                                                 // pScissors
+    };
+    const VkPipelineRasterizationStateCreateInfo rasterization = {
+        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO, // sType
+        nullptr,                                                    // pNext
+        0,                                                          // flags
+        VK_FALSE,                                                   // depthClampEnable
+        VK_FALSE,                                                   // rasterizerDiscardEnable
+        VK_POLYGON_MODE_FILL,                                       // polygonMode
+        VK_CULL_MODE_NONE,                                          // cullMode
+        VK_FRONT_FACE_COUNTER_CLOCKWISE,                            // frontFace
+        VK_FALSE,                                                   // depthBiasEnable
+        0.0f,                                                       // depthBiasConstantFactor
+        0.0f,                                                       // depthBiasClamp
+        0.0f,                                                       // depthBiasSlopeFactor
+        1.0f                                                        // lineWidth
+    };
+    const VkPipelineMultisampleStateCreateInfo multisample = {
+        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,   // sType
+        nullptr,                                                    // pNext
+        0,                                                          // flags
+        VK_SAMPLE_COUNT_1_BIT,                                      // rasterizationSamples
+        VK_FALSE,                                                   // sampleShadingEnable
+        0.0f,                                                       // minSampleShading
+        nullptr,                                                    // pSampleMask
+        VK_FALSE,                                                   // alphaToCoverageEnable
+        VK_FALSE                                                    // alphaToOneEnable
+    };
+    VkPipelineDepthStencilStateCreateInfo depth_stencil = {};
+    depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil.depthTestEnable = VK_TRUE;
+    depth_stencil.depthWriteEnable = VK_TRUE;
+    depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil.maxDepthBounds = 1.0f;
+    VkPipelineColorBlendAttachmentState blend_attachment = {};
+    blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    VkPipelineColorBlendStateCreateInfo blend = {};
+    blend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    blend.attachmentCount = 1;
+    blend.pAttachments = &blend_attachment;
+    const VkDynamicState dynamic_states[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    const VkPipelineDynamicStateCreateInfo dynamic = {
+        VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,   // sType
+        nullptr,                                                // pNext
+        0,                                                      // flags
+        2,                                                      // dynamicStateCount
+        dynamic_states                                          // pDynamicStates
+    };
+
+    const VkGraphicsPipelineCreateInfo pipeline_info = {
+        VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,    // sType
+        nullptr,                                            // pNext
+        0,                                                  // flags
+        2,                                                  // stageCount
+        stages,                                             // pStages
+        &vertex_input,                                      // pVertexInputState
+        &input_assembly,                                    // pInputAssemblyState
+        nullptr,                                            // pTessellationState
+        &viewport,                                          // pViewportState
+        &rasterization,                                     // pRasterizationState
+        &multisample,                                       // pMultisampleState
+        &depth_stencil,                                     // pDepthStencilState
+        &blend,                                             // pColorBlendState
+        &dynamic,                                           // pDynamicState
+        layout,                                             // layout
+        renderpass,                                         // renderPass
+        0,                                                  // subpass
+        VK_NULL_HANDLE,                                     // basePipelineHandle
+        -1                                                  // basePipelineIndex
+    };
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult res = vkCreateGraphicsPipelines(device.vk(), device.get_pipeline_cache(), 1, &pipeline_info, nullptr, &pipeline);
+    vkDestroyShaderModule(device.vk(), vertex_module, nullptr);
+    vkDestroyShaderModule(device.vk(), fragment_module, nullptr);
+    return validate(res) ? pipeline : VK_NULL_HANDLE;
+}
+
+// Appends a rectangle in clip space, at a depth in front of the cleared depth buffer
+static void add_quad(std::vector<MeshVertex>& vertices, std::vector<uint32_t>& indices, float x0, float y0, float x1, float y1, const float (&color)[3]) {
+    const uint32_t first = static_cast<uint32_t>(vertices.size());
+    vertices.push_back({ { x0, y0, 0.5f }, { color[0], color[1], color[2] } });
+    vertices.push_back({ { x1, y0, 0.5f }, { color[0], color[1], color[2] } });
+    vertices.push_back({ { x1, y1, 0.5f }, { color[0], color[1], color[2] } });
+    vertices.push_back({ { x0, y1, 0.5f }, { color[0], color[1], color[2] } });
+    const uint32_t quad[6] = { 0, 1, 2, 2, 3, 0 };
+    for (uint32_t index : quad)
+        indices.push_back(first + index);
+}
+
+// Uploads the mesh into the arena, with indices relative to its first vertex as GeometryArena wants them
+static bool add_mesh(Backend::GeometryArena& arena, const std::vector<MeshVertex>& vertices, const std::vector<uint32_t>& indices, Backend::MeshRange& mesh) {
+    return arena.add_mesh(vertices.data(), static_cast<uint32_t>(vertices.size()), indices.data(), static_cast<uint32_t>(indices.size()), mesh);
+}
+
+static void record_fill(VkCommandBuffer command_buffer, VkPipeline pipeline, VkPipelineLayout layout, VkDescriptorSet set, uint32_t value) {
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, 1, &set, 0, nullptr);
+    const FillConstants constants = { value, fill_row_length };
+    vkCmdPushConstants(command_buffer, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    const uint32_t n_values = static_cast<uint32_t>(compute_load_size / sizeof(uint32_t));
+    vkCmdDispatch(command_buffer, fill_row_length / fill_group_size, n_values / fill_row_length, 1);
+}
+
+int main(int argc, char** argv) {
+    bool headless = false;
+    // Resizes the window every frame and reports the worst frame time
+    bool resize_stress = false;
+    // Adds a compute load to every frame, on the universal queue or (with --async-compute) the compute queue
+    bool compute_load = false;
+    bool async_compute = false;
+    // Runs the compute load inline for n_benchmark_frames, then async for as many, and reports both frame rates
+    bool compare_compute = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--resize-stress") == 0)
+            resize_stress = true;
+        else if (strcmp(argv[i], "--compute-load") == 0)
+            compute_load = true;
+        else if (strcmp(argv[i], "--async-compute") == 0)
+            compute_load = async_compute = true;
+        else if (strcmp(argv[i], "--compare-compute") == 0)
+            compute_load = compare_compute = true;
+    }
+    const bool benchmark = headless || resize_stress || compute_load;
+
     Backend::Instance instance(app_name, VK_MAKE_VERSION(0,0,1), VALIDATION_VERBOSE);
     if (!instance.init()) return 1;
 
     Window window(instance, app_name, 1280, 720);
+    window.set_headless(headless);
     //if (!window.set_fullscreen(true)) return 1;
     if (!window.init()) return 1;
 
     Backend::Device device(window);
     if (!device.init()) return 1;
 
+    Backend::FrameRing frames(device, window);
+    if (!frames.init()) return 1;
+
+    Backend::GpuProfiler profiler(device, frames);
+    if (!profiler.init()) return 1;
+
+    // The paddle, ball and bricks share one vertex and one index buffer
+    Backend::UploadManager uploads(device);
+    if (!uploads.init()) return 1;
+    Backend::GeometryArena arena(device, uploads);
+    arena.vertex_stride = sizeof(MeshVertex);
+    arena.max_vertices = max_mesh_vertices;
+    arena.max_indices = max_mesh_indices;
+    if (!arena.init()) return 1;
+    std::vector<Backend::MeshRange> meshes(3);
+    {
+        std::vector<MeshVertex> vertices;
+        std::vector<uint32_t> indices;
+        add_quad(vertices, indices, -0.2f, 0.8f, 0.2f, 0.85f, { 0.9f, 0.9f, 0.9f });
+        if (!add_mesh(arena, vertices, indices, meshes[0])) return 1;
+        vertices.clear();
+        indices.clear();
+        add_quad(vertices, indices, -0.02f, 0.6f, 0.02f, 0.64f, { 1.0f, 0.8f, 0.2f });
+        if (!add_mesh(arena, vertices, indices, meshes[1])) return 1;
+        vertices.clear();
+        indices.clear();
+        const float brick_width = 1.8f / n_bricks_per_row;
+        for (uint32_t row = 0; row < n_brick_rows; ++row) {
+            for (uint32_t i = 0; i < n_bricks_per_row; ++i) {
+                const float x = -0.9f + i * brick_width;
+                const float y = -0.9f + row * 0.1f;
+                add_quad(vertices, indices, x + 0.01f, y + 0.01f, x + brick_width - 0.01f, y + 0.09f, { 0.2f + 0.2f * row, 0.3f, 0.8f - 0.2f * row });
+            }
+        }
+        if (!add_mesh(arena, vertices, indices, meshes[2])) return 1;
+    }
+    // Frames acquire it before drawing
+    if (!uploads.flush()) return 1;
+
+    Backend::AsyncCompute compute(device, frames);
+    // One per frame in flight: compute fills frame N+1's buffer while the universal queue may still be using
+    // frame N's. By the time a buffer comes round again, begin_frame() has waited for its last use
+    std::vector<VkBuffer> compute_buffers;
+    std::vector<VkDescriptorSet> compute_sets;
+    Backend::DescriptorAllocator descriptors(device, frames);
+    VkPipelineLayout fill_layout = VK_NULL_HANDLE;
+    VkPipeline fill_pipeline = VK_NULL_HANDLE;
+    if (compute_load) {
+        if (!descriptors.init()) return 1;
+        const Backend::DescriptorLayout* set_layout = descriptors.get_layout({
+            { 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr }
+        });
+        if (!set_layout) return 1;
+        VkPushConstantRange constant_range = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(FillConstants) };
+        VkPipelineLayoutCreateInfo layout_info = {
+            VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,  // sType
+            nullptr,                                        // pNext
+            0,                                              // flags
+            1,                                              // setLayoutCount
+            &set_layout->layout,                            // pSetLayouts
+            1,                                              // pushConstantRangeCount
+            &constant_range                                 // pPushConstantRanges
+        };
+        fill_layout = device.get_object_cache().get_pipeline_layout(layout_info);
+        if (!fill_layout) return 1;
+        fill_pipeline = create_fill_pipeline(device, fill_layout);
+        if (!fill_pipeline) return 1;
+
+        VkBufferCreateInfo buffer_info = {};
+        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        buffer_info.size = compute_load_size;
+        buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VmaMemoryRequirements buffer_reqs = {};
+        buffer_reqs.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+        compute_buffers.assign(frames.max_frames_in_flight, VK_NULL_HANDLE);
+        for (VkBuffer& buffer : compute_buffers) {
+            if (!validate(vmaCreateBuffer(device.get_allocator(), &buffer_info, &buffer_reqs, &buffer, nullptr, nullptr))) return 1;
+            // The buffers live as long as the allocator, so their sets can be static
+            Backend::DescriptorData data;
+            data.buffer = { buffer, 0, VK_WHOLE_SIZE };
+            VkDescriptorSet set = descriptors.get_static_set(*set_layout, &data);
+            if (!set) return 1;
+            compute_sets.push_back(set);
+        }
+        if ((async_compute || compare_compute) && !compute.is_async())
+            printf("No separate compute queue; async compute runs on the universal queue\n");
+    }
+
+    // The frame: the compute load writes a buffer the draw pass reads, and the draw pass clears the swapchain
+    // image and depth buffer. The graph works out the barriers and render pass dependencies between them
+    Backend::RenderGraph graph(device);
+    // Acquired with a semaphore that frames wait on at the color output stage
+    const Backend::GraphResource color = graph.import_image("swapchain", { window.get_color_format(), window.get_extent(), VK_SAMPLE_COUNT_1_BIT },
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    // The window's one depth buffer, which the previous frame may still be writing
+    const Backend::GraphResource depth = graph.import_image("depth", { window.get_depth_format(), window.get_extent(), VK_SAMPLE_COUNT_1_BIT },
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT);
 
-    Backend::RenderPass renderpass(device);
-    uint32_t color_index = renderpass.add_attachment(window.get_color_format(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE);
-    uint32_t depth_index = renderpass.add_attachment(window.get_depth_format(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_DONT_CARE);
-    
-    VkAttachmentReference color_ref = { color_index, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
-    VkAttachmentReference depth_ref = { depth_index, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
-    VkSubpassDescription subpass = {};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_ref;
-    subpass.pDepthStencilAttachment = &depth_ref;
-    uint32_t subpass_index = renderpass.add_subpass(subpass);
-
-    VkSubpassDependency load_deps = {};
-    load_deps.srcSubpass = VK_SUBPASS_EXTERNAL;
-    load_deps.dstSubpass = subpass_index;
-    load_deps.srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;			
-    load_deps.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;	
-    load_deps.srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-    load_deps.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-    load_deps.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-    renderpass.add_dependency(load_deps);
-    VkSubpassDependency store_deps = {};
-    store_deps.srcSubpass = subpass_index;
-    store_deps.dstSubpass = VK_SUBPASS_EXTERNAL;
-    store_deps.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;	
-    store_deps.dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-    store_deps.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-    store_deps.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-    store_deps.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-    renderpass.add_dependency(store_deps);
-
-    if (!renderpass.init()) return 1;
-    // TODO: framebuffers don't work correctly in fullscreen (at least with xcb)
-    if (!window.init_framebuffers(renderpass)) return 1;
+    uint32_t n_frames = 0, n_rebuilds = 0;
+    Backend::GraphResource compute_resource = Backend::invalid_graph_resource;
+    if (compute_load) {
+        compute_resource = graph.import_buffer("compute load");
+        const uint32_t compute_pass = graph.add_pass("compute load", Backend::GRAPH_PASS_COMPUTE, [&](VkCommandBuffer command_buffer, uint32_t) {
+            if (async_compute) {
+                // Filled on the compute queue; taking the buffer over is the write as far as this queue is concerned
+                compute.acquire(command_buffer);
+                return;
+            }
+            record_fill(command_buffer, fill_pipeline, fill_layout, compute_sets[frames.get_frame_index()], n_frames);
+        });
+        graph.use(compute_pass, compute_resource, Backend::GRAPH_USAGE_STORAGE_WRITE);
+    }
+    VkPipeline mesh_pipeline = VK_NULL_HANDLE;
+    const uint32_t draw_pass = graph.add_pass("draw", Backend::GRAPH_PASS_GRAPHICS, [&](VkCommandBuffer command_buffer, uint32_t) {
+        const VkExtent2D extent = window.get_extent();
+        const VkViewport viewport = { 0.0f, 0.0f, float(extent.width), float(extent.height), 0.0f, 1.0f };
+        const VkRect2D scissor = { { 0, 0 }, extent };
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mesh_pipeline);
+        vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+        vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+        arena.bind(command_buffer);
+        for (const Backend::MeshRange& mesh : meshes)
+            arena.draw(command_buffer, mesh);
+    });
+    VkClearValue clear_color = {};
+    clear_color.color = {{ 0.0f, 0.0f, 0.0f, 1.0f }};
+    VkClearValue clear_depth = {};
+    clear_depth.depthStencil = { 1.0f, 0 };
+    graph.use(draw_pass, color, Backend::GRAPH_USAGE_COLOR_ATTACHMENT, &clear_color);
+    graph.use(draw_pass, depth, Backend::GRAPH_USAGE_DEPTH_ATTACHMENT, &clear_depth);
+    if (compute_load)
+        graph.use(draw_pass, compute_resource, Backend::GRAPH_USAGE_STORAGE_READ);
+    // Each pass gets a GPU scope named after it
+    graph.set_profiler(&profiler);
+    if (!graph.compile()) return 1;
+
+    // The render pass only depends on the formats, so it stays compatible when the graph is compiled again
+    VkPipelineLayoutCreateInfo mesh_layout_info = {};
+    mesh_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    VkPipelineLayout mesh_layout = device.get_object_cache().get_pipeline_layout(mesh_layout_info);
+    if (!mesh_layout) return 1;
+    mesh_pipeline = create_mesh_pipeline(device, mesh_layout, graph.get_renderpass(draw_pass));
+    if (!mesh_pipeline) return 1;
 
+    std::vector<VkCommandBuffer> command_buffers;
+    std::chrono::duration<double, std::milli> worst_frame(0);
+    // Time --compare-compute spent on its inline frames
+    std::chrono::duration<double> inline_elapsed(0);
+    if (benchmark)
+        ATLAS_TRACE_BEGIN_CAPTURE();
+    auto loop_start = std::chrono::high_resolution_clock::now();
+    auto frame_start = loop_start;
     while (!window.should_close()) {
+        ATLAS_TRACE_ZONE("frame");
         window.handle_events();
 
         // Logic here
 
-        window.acquire_next_frame();
+        if (resize_stress)
+            window.set_client_area(800 + (n_frames % 64) * 8, 450 + (n_frames % 64) * 4);
+
         if (window.should_rebuild()) {
+            ++n_rebuilds;
             bool success = true;
-            success &= window.rebuild(renderpass);
+            success &= window.rebuild();
+            graph.set_image_extent(color, window.get_extent());
+            graph.set_image_extent(depth, window.get_extent());
+            success &= graph.compile();
             // success &= rebuild_command_buffers();
             // camera.update_aspect_ratio()
             if (!success) return 1;
         }
 
+        if (!frames.begin_frame()) {
+            // An out-of-date swapchain gets rebuilt on the next iteration
+            if (window.should_rebuild()) continue;
+            return 1;
+        }
+
         // Render here
+        command_buffers.clear();
+        VkCommandBufferBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VkCommandBuffer universal = frames.get_command_buffer(Backend::QUEUE_FAMILY_UNIVERSAL);
+        if (!universal || !validate(vkBeginCommandBuffer(universal, &begin_info))) return 1;
+        if (!profiler.begin_frame(universal)) return 1;
+        if (!uploads.acquire(frames, universal)) return 1;
 
-        window.present();
+        graph.set_image(color, window.get_color_image(), window.get_color_image_view());
+        graph.set_image(depth, window.get_depth_image(), window.get_depth_image_view());
+        if (compute_load) {
+            VkBuffer compute_buffer = compute_buffers[frames.get_frame_index()];
+            graph.set_buffer(compute_resource, compute_buffer);
+            if (async_compute) {
+                // The shader overwrites the whole buffer, so the universal queue doesn't hand it back to the compute
+                // family: the spec says to skip ownership transfers when the contents don't need to survive them
+                VkCommandBuffer compute_commands = compute.begin();
+                if (!compute_commands) return 1;
+                record_fill(compute_commands, fill_pipeline, fill_layout, compute_sets[frames.get_frame_index()], n_frames);
+                compute.release_buffer(compute_buffer, 0, VK_WHOLE_SIZE, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+                if (!compute.submit(compute_commands)) return 1;
+            }
+        }
+        if (!graph.execute(universal)) return 1;
+
+        if (!validate(vkEndCommandBuffer(universal))) return 1;
+        command_buffers.push_back(universal);
+
+        if (!frames.end_frame(command_buffers) && !window.should_rebuild()) return 1;
+
+        auto frame_end = std::chrono::high_resolution_clock::now();
+        worst_frame = std::max(worst_frame, std::chrono::duration<double, std::milli>(frame_end - frame_start));
+        frame_start = frame_end;
+
+        ++n_frames;
+        if (compare_compute && !async_compute && (n_frames == n_benchmark_frames)) {
+            // Same number of frames again, with the load on the compute queue
+            frames.wait_idle();
+            inline_elapsed = std::chrono::high_resolution_clock::now() - loop_start;
+            async_compute = true;
+        }
+        else if (benchmark && (n_frames == (compare_compute ? 2 : 1) * n_benchmark_frames))
+            window.set_should_close(true);
+    }
+
+    if (benchmark) {
+        frames.wait_idle();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - loop_start;
+        ATLAS_TRACE_END_CAPTURE("breakout_trace.json");
+        device.write_memory_stats_json("breakout_memory.json");
+        profiler.write_csv("gpu_timings.csv");
+        printf("%u frames in %.3f s (%.1f frames/s)\n", n_frames, elapsed.count(), n_frames / elapsed.count());
+        printf("Worst frame time %.3f ms over %u swapchain rebuilds\n", worst_frame.count(), n_rebuilds);
+        if (compare_compute) {
+            const double async_seconds = elapsed.count() - inline_elapsed.count();
+            printf("Inline compute: %.1f frames/s\n", n_benchmark_frames / inline_elapsed.count());
+            printf("Async compute:  %.1f frames/s%s\n", n_benchmark_frames / async_seconds, compute.is_async() ? "" : " (no separate compute queue)");
+        }
+    }
+    frames.wait_idle();
+    vkDestroyPipeline(device.vk(), mesh_pipeline, nullptr);
+    if (compute_load) {
+        for (VkBuffer buffer : compute_buffers)
+            vmaDestroyBuffer(device.get_allocator(), buffer);
+        vkDestroyPipeline(device.vk(), fill_pipeline, nullptr);
     }
 
     // Window closes automatically on exit
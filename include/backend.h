@@ -2,10 +2,17 @@
 #define ATLAS_BACKEND_H
 
 #include "window.h"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <stdio.h>
+#include <type_traits>
 // GPUOpen memory allocator
-#define VMA_STATS_STRING_ENABLED 0
+// The stats string is needed for Device::write_memory_stats_json()
+#define VMA_STATS_STRING_ENABLED 1
 #include <string.h>
 
 // vk_mem_alloc explodes if `min` and `max` are existing macros -- which they are in Windows
@@ -14,18 +21,65 @@
 #include "vk_mem_alloc.h"
 
 
+// Messages below this level are compiled out, arguments and all, when logged through the macros below
+// Set with the ATLAS_LOG_LEVEL CMake option, which defaults to ATLAS_LOG_LEVEL_ERROR for Release and MinSizeRel builds
+#define ATLAS_LOG_LEVEL_NONE 0
+#define ATLAS_LOG_LEVEL_ERROR 1
+#define ATLAS_LOG_LEVEL_WARNING 2
+#define ATLAS_LOG_LEVEL_DEBUG 3
+#ifndef ATLAS_LOG_LEVEL
+#define ATLAS_LOG_LEVEL ATLAS_LOG_LEVEL_DEBUG
+#endif
+
+#if ATLAS_LOG_LEVEL >= ATLAS_LOG_LEVEL_DEBUG
+#define ATLAS_LOG(...) ::Atlas::Backend::log(__VA_ARGS__)
+#else
+#define ATLAS_LOG(...) do {} while (0)
+#endif
+#if ATLAS_LOG_LEVEL >= ATLAS_LOG_LEVEL_WARNING
+#define ATLAS_WARNING(...) ::Atlas::Backend::warning(__VA_ARGS__)
+#else
+#define ATLAS_WARNING(...) do {} while (0)
+#endif
+#if ATLAS_LOG_LEVEL >= ATLAS_LOG_LEVEL_ERROR
+#define ATLAS_ERROR(...) ::Atlas::Backend::error(__VA_ARGS__)
+#else
+#define ATLAS_ERROR(...) do {} while (0)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ATLAS_LIKELY(x) __builtin_expect(!!(x), 1)
+#define ATLAS_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define ATLAS_LIKELY(x) (x)
+#define ATLAS_UNLIKELY(x) (x)
+#endif
+
 namespace Atlas {
     enum ValidationLevel {
         VALIDATION_DISABLED = 0,
         VALIDATION_ENABLED,
         VALIDATION_VERBOSE
     };
-    bool validate(VkResult result);
+
+    // Reports anything but VK_SUCCESS (as far as ATLAS_LOG_LEVEL allows) and says whether it's usable
+    // Out of line, so validate() inlines down to a compare
+    bool report_result(VkResult result);
+    // True if the result is a success code. Runs after every Vulkan call, so VK_SUCCESS costs a single
+    // predicted branch: no clock reads and no call
+    inline bool validate(VkResult result) {
+        if (ATLAS_LIKELY(result == VK_SUCCESS))
+            return true;
+        return report_result(result);
+    }
     
     namespace Backend {
+        // Prefer the ATLAS_LOG/ATLAS_WARNING/ATLAS_ERROR macros, which compile out below ATLAS_LOG_LEVEL
         void log(const std::string& message);
         void warning(const std::string& message);
         void error(const std::string& message);
+        // Writes the string in double quotes, escaping quotes, backslashes and control characters, for the JSON dumps
+        void write_json_string(FILE* file, const char* string);
 
         enum VendorID {
             VK_VENDOR_ID_AMD = 0x1002,
@@ -95,6 +149,10 @@ namespace Atlas {
             PFN_vkCreateDebugReportCallbackEXT vkCreateDebugReportCallbackEXT;
             PFN_vkDebugReportMessageEXT vkDebugReportMessageEXT;
             PFN_vkDestroyDebugReportCallbackEXT vkDestroyDebugReportCallbackEXT;
+            // Null unless VK_KHR_get_physical_device_properties2 is enabled
+            PFN_vkGetPhysicalDeviceMemoryProperties2KHR vkGetPhysicalDeviceMemoryProperties2KHR;
+            PFN_vkGetPhysicalDeviceFeatures2KHR vkGetPhysicalDeviceFeatures2KHR;
+            PFN_vkGetPhysicalDeviceProperties2KHR vkGetPhysicalDeviceProperties2KHR;
 
             VkDebugReportCallbackEXT m_dbg_callback;
             std::vector<VkLayerProperties> m_supported_layers;
@@ -113,6 +171,112 @@ namespace Atlas {
             std::vector<PhysicalDevice> m_physical_devices;
         };
 
+        struct MemoryHeapStats {
+            VkDeviceSize size;
+            // From VK_EXT_memory_budget if it's supported; otherwise 80% of the heap size
+            VkDeviceSize budget;
+            // Usage by this process from VK_EXT_memory_budget if it's supported; otherwise allocated_bytes
+            VkDeviceSize usage;
+            // Bytes in VkDeviceMemory blocks allocated through VMA, and the part of them in use
+            VkDeviceSize allocated_bytes;
+            VkDeviceSize used_bytes;
+            uint32_t n_blocks;
+            uint32_t n_allocations;
+            // 0 when all free space in the blocks is one range, approaching 1 as it splinters
+            float fragmentation;
+            bool device_local;
+        };
+
+        struct MemoryStats {
+            std::vector<MemoryHeapStats> heaps;
+            // True if the budget and usage come from the driver
+            bool has_budget;
+        };
+
+        // Kinds of object Device::destroy_deferred() can free
+        enum DeferredObjectType {
+            DEFERRED_BUFFER = 0,
+            DEFERRED_BUFFER_VIEW,
+            DEFERRED_IMAGE,
+            DEFERRED_IMAGE_VIEW,
+            DEFERRED_SAMPLER,
+            DEFERRED_FRAMEBUFFER,
+            DEFERRED_RENDER_PASS,
+            DEFERRED_PIPELINE,
+            DEFERRED_PIPELINE_LAYOUT,
+            DEFERRED_DESCRIPTOR_SET_LAYOUT,
+            DEFERRED_DESCRIPTOR_POOL,
+            DEFERRED_SHADER_MODULE,
+            DEFERRED_QUERY_POOL,
+            DEFERRED_SEMAPHORE,
+            DEFERRED_FENCE,
+            DEFERRED_EVENT,
+            DEFERRED_COMMAND_POOL,
+            DEFERRED_SWAPCHAIN,
+            // Created with vmaCreateBuffer() and vmaCreateImage(); frees their memory too
+            DEFERRED_VMA_BUFFER,
+            DEFERRED_VMA_IMAGE,
+            // Allocated with vmaAllocateMemory()
+            DEFERRED_VMA_MEMORY,
+            // Not an object: a callback from Device::release_deferred()
+            DEFERRED_RELEASE
+        };
+
+        // Non-dispatchable handles are pointers on 64 bit platforms and uint64_t elsewhere; these convert
+        // them to and from the uint64_t Device keeps deferred objects in
+        template <typename T>
+        inline uint64_t handle_to_bits(T* handle) {
+            return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(handle));
+        }
+        inline uint64_t handle_to_bits(uint64_t handle) {
+            return handle;
+        }
+        template <typename T, bool is_pointer = std::is_pointer<T>::value>
+        struct HandleBits {
+            static inline T from(uint64_t bits) {
+                return reinterpret_cast<T>(static_cast<uintptr_t>(bits));
+            }
+        };
+        template <typename T>
+        struct HandleBits<T, false> {
+            static inline T from(uint64_t bits) {
+                return bits;
+            }
+        };
+        template <typename T>
+        inline T handle_from_bits(uint64_t bits) {
+            return HandleBits<T>::from(bits);
+        }
+
+        // Handle type of each DeferredObjectType, so destroy_deferred() only takes the matching handle
+        template <DeferredObjectType Type>
+        struct DeferredHandle;
+#define ATLAS_DEFERRED_HANDLE(object_type, handle_type) \
+        template <> struct DeferredHandle<object_type> { typedef handle_type type; }
+        ATLAS_DEFERRED_HANDLE(DEFERRED_BUFFER, VkBuffer);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_BUFFER_VIEW, VkBufferView);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_IMAGE, VkImage);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_IMAGE_VIEW, VkImageView);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_SAMPLER, VkSampler);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_FRAMEBUFFER, VkFramebuffer);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_RENDER_PASS, VkRenderPass);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_PIPELINE, VkPipeline);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_PIPELINE_LAYOUT, VkPipelineLayout);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_DESCRIPTOR_SET_LAYOUT, VkDescriptorSetLayout);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_DESCRIPTOR_POOL, VkDescriptorPool);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_SHADER_MODULE, VkShaderModule);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_QUERY_POOL, VkQueryPool);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_SEMAPHORE, VkSemaphore);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_FENCE, VkFence);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_EVENT, VkEvent);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_COMMAND_POOL, VkCommandPool);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_SWAPCHAIN, VkSwapchainKHR);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_VMA_BUFFER, VkBuffer);
+        ATLAS_DEFERRED_HANDLE(DEFERRED_VMA_IMAGE, VkImage);
+#undef ATLAS_DEFERRED_HANDLE
+
+        struct ObjectCache;
+
         struct Device {
             // TODO: use VK_KHX_device_group_creation for multi-GPU?
             Device(Window& window);
@@ -121,6 +285,12 @@ namespace Atlas {
 
             VkCommandPoolCreateFlags command_pool_flags;
             uint32_t n_threads;
+            // Directory the pipeline cache is loaded from in init() and saved to on destruction
+            // Leave empty to keep the pipeline cache in memory only
+            std::string pipeline_cache_dir;
+
+            // sample_memory_stats() warns when a heap's usage goes over this fraction of its budget
+            float memory_budget_warning;
 
             // For any required extension, push_back to here before calling init()
             std::vector<const char*> enabled_extensions;
@@ -132,6 +302,23 @@ namespace Atlas {
             inline VkQueue get_queue(QueueFamily family) const {
                 return m_queues[family];
             }
+            // Queues need external synchronization, and one VkQueue may serve several families and the present
+            // queue, with uploads flushing from any thread. Every submission goes through here
+            VkResult submit(VkQueue queue, uint32_t n_submits, const VkSubmitInfo* submits, VkFence fence);
+            // Held by submit(); hold it around any other use of a queue, e.g. presenting or vkDeviceWaitIdle()
+            inline std::mutex& get_queue_mutex() {
+                return m_queue_mutex;
+            }
+            // Family of the queue returned by get_queue(); use it for command pools and ownership transfers
+            inline uint32_t get_queue_family_index(QueueFamily family) const {
+                return m_queue_family_indices[family];
+            }
+            inline bool is_transfer_dedicated() const {
+                return ((m_queue_flags & transfer_is_dedicated) != 0);
+            }
+            inline bool is_compute_dedicated() const {
+                return ((m_queue_flags & compute_is_dedicated) != 0);
+            }
             inline const PhysicalDevice& get_physical_device() const {
                 return m_physical_device;
             }
@@ -141,19 +328,137 @@ namespace Atlas {
             inline VmaAllocator get_allocator() const {
                 return m_allocator;
             }
+            // Pass to vkCreate*Pipelines so compiled pipelines persist between runs
+            inline VkPipelineCache get_pipeline_cache() const {
+                return m_pipeline_cache;
+            }
+            // True if init() found a valid pipeline cache on disk for this device and driver
+            inline bool is_pipeline_cache_warm() const {
+                return m_pipeline_cache_warm;
+            }
+
+            // Shared cache of render passes, framebuffers, samplers and layouts; valid after init()
+            inline ObjectCache& get_object_cache() {
+                return *m_object_cache;
+            }
+
+            // Updates get_memory_stats() from the allocator (and the driver's budget, if supported)
+            // FrameRing calls it every frame
+            bool sample_memory_stats();
+            inline const MemoryStats& get_memory_stats() const {
+                return m_memory_stats;
+            }
+            // Writes VMA's JSON stats string; detailed adds a map of every block
+            bool write_memory_stats_json(const std::string& path, bool detailed = false) const;
+
+            // Null unless VK_KHR_descriptor_update_template is in enabled_extensions at init()
+            PFN_vkCreateDescriptorUpdateTemplateKHR vkCreateDescriptorUpdateTemplateKHR;
+            PFN_vkDestroyDescriptorUpdateTemplateKHR vkDestroyDescriptorUpdateTemplateKHR;
+            PFN_vkUpdateDescriptorSetWithTemplateKHR vkUpdateDescriptorSetWithTemplateKHR;
+
+            // Destroys the object without waiting on the GPU: it's tagged with the serial of the frame being
+            // recorded, and destroyed once that frame's universal submission has finished. Work on other
+            // queues is only covered once it's chained into that frame, as AsyncCompute::submit() is and
+            // UploadManager batches are after acquire(); an upload that was flushed but never acquired isn't.
+            // Any thread may call these
+            template <DeferredObjectType Type>
+            inline void destroy_deferred(typename DeferredHandle<Type>::type handle) {
+                destroy_deferred(Type, handle_to_bits(handle), VkMappedMemoryRange(), nullptr, std::function<void()>());
+            }
+            inline void destroy_deferred(const VkMappedMemoryRange& memory) {
+                destroy_deferred(DEFERRED_VMA_MEMORY, 0, memory, nullptr, std::function<void()>());
+            }
+            // For CPU-side state the GPU may still read, like a range of a shared buffer: calls release once
+            // the frame being recorded retires, the same as destroy_deferred(). It's called on the thread
+            // running FrameRing::begin_frame(), with the deferred objects locked, so it mustn't defer
+            // anything itself. Call cancel_deferred() with the same owner before the owner goes away
+            inline void release_deferred(const void* owner, std::function<void()> release) {
+                destroy_deferred(DEFERRED_RELEASE, 0, VkMappedMemoryRange(), owner, std::move(release));
+            }
+            // Drops the owner's pending releases without calling them
+            void cancel_deferred(const void* owner);
+            // FrameRing calls this every frame: current_serial tags newly deferred objects, and everything
+            // tagged up to retired_serial is destroyed
+            void collect_deferred(uint64_t current_serial, uint64_t retired_serial);
+
+            // True if init() enabled the descriptor indexing features BindlessTable needs
+            // (VK_EXT_descriptor_indexing is enabled by default where it's supported)
+            inline bool supports_bindless() const {
+                return m_bindless_supported;
+            }
+            // Largest update-after-bind arrays of sampled images and storage buffers one shader stage can use
+            inline uint32_t get_max_bindless_images() const {
+                return m_max_bindless_images;
+            }
+            inline uint32_t get_max_bindless_buffers() const {
+                return m_max_bindless_buffers;
+            }
+
+            // True if a memory type is LAZILY_ALLOCATED, which tiled GPUs only back with on-chip memory
+            inline bool supports_lazy_allocation() const {
+                return m_lazy_allocation_supported;
+            }
+            // For attachments whose contents never leave the render pass (cleared or DONT_CARE on load,
+            // DONT_CARE on store), so info.usage may only hold attachment usages. Adds TRANSIENT_ATTACHMENT
+            // usage and puts the image in lazily allocated memory when the device has it, and falls back to
+            // a regular GPU_ONLY image otherwise. lazy_bytes is the memory that isn't committed up front:
+            // the image's size, or 0 after falling back. Destroy with vmaDestroyImage
+            bool create_transient_attachment(const VkImageCreateInfo& info, VkImage& image, VkDeviceSize& lazy_bytes);
         protected:
+            // The cache keeps handles of any type, so it defers them by type and bits
+            friend struct ObjectCache;
+
+            struct DeferredObject {
+                DeferredObjectType type;
+                uint64_t handle;
+                VkMappedMemoryRange memory;
+                uint64_t serial;
+                // Only for DEFERRED_RELEASE
+                const void* owner;
+                std::function<void()> release;
+            };
+            void destroy_deferred(DeferredObjectType type, uint64_t handle, const VkMappedMemoryRange& memory, const void* owner, std::function<void()> release);
+            void destroy_object(const DeferredObject& object);
+
+            bool is_extension_enabled(const char* name) const;
+            // Checks the descriptor indexing features and limits once the device exists
+            void init_bindless_limits();
+            bool init_pipeline_cache();
+            void save_pipeline_cache();
+            // Cache files are keyed by vendor, device, driver version and pipelineCacheUUID,
+            // so a driver update never tries to load a stale cache
+            std::string get_pipeline_cache_path() const;
+
             std::unordered_set<std::string> m_supported_extensions;
             Atlas::Window& m_window;
             const PhysicalDevice& m_physical_device;
             const std::vector<const char*>& m_enabled_layers;
             VkDevice m_device;
             VmaAllocator m_allocator;
+            VkPipelineCache m_pipeline_cache;
+            bool m_pipeline_cache_warm;
+            MemoryStats m_memory_stats;
+            bool m_memory_budget_supported;
+            // Heaps that were over the warning threshold when last sampled, so each crossing warns once
+            std::vector<bool> m_heaps_over_budget;
+            // In the order they were deferred, so serials never decrease
+            std::deque<DeferredObject> m_deferred;
+            std::mutex m_deferred_mutex;
+            uint64_t m_current_serial;
+            uint64_t m_retired_serial;
+            bool m_bindless_supported;
+            uint32_t m_max_bindless_images;
+            uint32_t m_max_bindless_buffers;
+            bool m_lazy_allocation_supported;
+            std::unique_ptr<ObjectCache> m_object_cache;
 
             std::vector<VkCommandPool> m_command_pools;
             union {
                 struct { VkQueue m_universal_queue, m_compute_queue, m_transfer_queue; };
                 VkQueue m_queues[QUEUE_FAMILY_COUNT];
             };
+            uint32_t m_queue_family_indices[QUEUE_FAMILY_COUNT];
+            std::mutex m_queue_mutex;
             static constexpr uint32_t compute_owns_self = 1;
             static constexpr uint32_t compute_is_dedicated = 1 << 1;
             static constexpr uint32_t transfer_owns_self = 1 << 2;
@@ -164,10 +469,12 @@ namespace Atlas {
 
         struct RenderPass {
             RenderPass(Backend::Device& device);
-            ~RenderPass();
+            // Gets the render pass from the device's ObjectCache, which owns it, so identical render passes
+            // share a handle
             bool init();
 
-            // Returns the index of the attachment
+            // Returns the index of the attachment. uses_shared_memory marks it MAY_ALIAS, for attachments
+            // bound to memory another attachment of the same render pass also uses
             uint32_t add_attachment(VkFormat format, VkImageLayout initial_layout, VkImageLayout final_layout, VkAttachmentLoadOp load_op, VkAttachmentStoreOp store_op, VkSampleCountFlagBits n_samples = VK_SAMPLE_COUNT_1_BIT, bool uses_shared_memory = false);
             void enable_attachment_stencil(uint32_t index, VkAttachmentLoadOp load_op, VkAttachmentStoreOp store_op);
             uint32_t add_subpass(VkSubpassDescription subpass);
@@ -185,28 +492,49 @@ namespace Atlas {
             std::vector<VkAttachmentDescription> m_attachments;
             std::vector<VkSubpassDescription> m_subpasses;
             std::vector<VkSubpassDependency> m_dependencies;
-            PFN_vkCreateRenderPass vkCreateRenderPass;
-            PFN_vkDestroyRenderPass vkDestroyRenderPass;
         };
 
         struct Framebuffer {
+            Framebuffer(Backend::Device& device);
+            bool init(const RenderPass& renderpass, uint32_t width, uint32_t height, uint32_t layers = 1);
+
+            // Returns the index of the attachment
             uint32_t add_attachment(VkImageView view);
+
+            // Owned by the device's ObjectCache, like the render pass
+            inline VkFramebuffer vk() const {
+                return m_framebuffer;
+            }
+        protected:
+            Backend::Device& m_device;
+            VkFramebuffer m_framebuffer;
+            std::vector<VkImageView> m_attachments;
         };
 
-        // TODO: Add support for secondary command buffers
         struct CommandBuffer {
-            // Create a primary command buffer
-            CommandBuffer(const Device& device, QueueFamily queue_family, uint32_t thread_index);//, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+            CommandBuffer(const Device& device, QueueFamily queue_family, uint32_t thread_index, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
             ~CommandBuffer();
 
             bool init();
 
+            bool begin(VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+            // Secondary command buffers only: begins recording for execution inside the given subpass
+            // The framebuffer is optional, but lets the driver optimize if it is known
+            bool begin(const RenderPass& renderpass, uint32_t subpass, VkFramebuffer framebuffer = VK_NULL_HANDLE, VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+            bool end();
+
             inline VkCommandBuffer vk() const {
                 return m_buffer;
             }
+            inline VkCommandBufferLevel get_level() const {
+                return m_level;
+            }
         
         protected:
+            const Device& m_device;
+            VkCommandPool m_pool;
             VkQueue m_queue;
+            VkCommandBufferLevel m_level;
             VkCommandBuffer m_buffer;
         };
     }
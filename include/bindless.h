@@ -0,0 +1,70 @@
+#ifndef ATLAS_BINDLESS_H
+#define ATLAS_BINDLESS_H
+
+#include "backend.h"
+#include <limits>
+
+namespace Atlas {
+    namespace Backend {
+        // Index shaders use to find a resource in a BindlessTable
+        typedef uint32_t BindlessHandle;
+        constexpr BindlessHandle invalid_bindless_handle = std::numeric_limits<uint32_t>::max();
+
+        // One big update-after-bind descriptor set holding every texture and storage buffer, bound once per
+        // command buffer, with shaders indexing into it by handle:
+        //
+        //  layout(set = N, binding = 0) uniform sampler2D textures[];
+        //  layout(set = N, binding = 1) buffer Buffers { uint data[]; } buffers[];
+        //  ... texture(textures[nonuniformEXT(handle)], uv) ...
+        //
+        // Handles stay the same for as long as the resource is in the table. Needs Device::supports_bindless()
+        // Not thread safe, and removed handles come back from FrameRing::begin_frame(), so use it on that thread
+        struct BindlessTable {
+            BindlessTable(Device& device);
+            ~BindlessTable();
+            // Fails if the device doesn't support bindless
+            bool init();
+
+            // Set before calling init(); clamped to the device's limits
+            uint32_t max_textures;
+            uint32_t max_buffers;
+
+            static constexpr uint32_t texture_binding = 0;
+            static constexpr uint32_t buffer_binding = 1;
+
+            // The descriptor is written right away; frames recorded from now on can use the handle
+            // Returns invalid_bindless_handle once the table is full
+            BindlessHandle add_texture(VkImageView view, VkSampler sampler, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+            BindlessHandle add_buffer(VkBuffer buffer, VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE);
+            // Frames in flight may still use the handle, so it's only reused once the current frame retires
+            // (through Device::release_deferred())
+            void remove_texture(BindlessHandle handle);
+            void remove_buffer(BindlessHandle handle);
+
+            // Include in pipeline layouts at the set index passed to bind()
+            inline VkDescriptorSetLayout get_layout() const {
+                return m_layout;
+            }
+            void bind(VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point, VkPipelineLayout pipeline_layout, uint32_t set_index) const;
+
+        protected:
+            struct Slots {
+                // Never-used handles start here
+                uint32_t n_used;
+                uint32_t capacity;
+                std::vector<uint32_t> free;
+            };
+            BindlessHandle allocate_slot(Slots& slots);
+            void remove_slot(Slots& slots, BindlessHandle handle);
+
+            Device& m_device;
+            VkDescriptorSetLayout m_layout;
+            VkDescriptorPool m_pool;
+            VkDescriptorSet m_set;
+            Slots m_textures;
+            Slots m_buffers;
+        };
+    }
+}
+
+#endif // ATLAS_BINDLESS_H
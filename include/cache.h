@@ -0,0 +1,87 @@
+#ifndef ATLAS_CACHE_H
+#define ATLAS_CACHE_H
+
+#include "backend.h"
+
+namespace Atlas {
+    namespace Backend {
+        // Hands out render passes, framebuffers, samplers, descriptor set layouts and pipeline layouts keyed by
+        // the contents of their create-info, so asking for the same object twice returns the same handle.
+        // The cache owns every handle it returns: don't destroy them. Handles inside a create-info (render
+        // passes, set layouts, image views) are part of the key, so they have to outlive the objects made from
+        // them; image views are the exception, see evict_image_view(). pNext chains can't be hashed, so create-infos
+        // with one are rejected: create those objects yourself.
+        // Thread safe. Get the device's cache with Device::get_object_cache()
+        struct ObjectCache {
+            ObjectCache(Device& device);
+            // Objects are destroyed once the frame being recorded retires
+            ~ObjectCache();
+
+            // Return VK_NULL_HANDLE on failure, or if the create-info has a pNext chain
+            VkRenderPass get_render_pass(const VkRenderPassCreateInfo& info);
+            VkFramebuffer get_framebuffer(const VkFramebufferCreateInfo& info);
+            VkSampler get_sampler(const VkSamplerCreateInfo& info);
+            VkDescriptorSetLayout get_descriptor_set_layout(const VkDescriptorSetLayoutCreateInfo& info);
+            VkPipelineLayout get_pipeline_layout(const VkPipelineLayoutCreateInfo& info);
+
+            // Call before destroying an image view: the framebuffers using it are dropped (destroyed once the
+            // current frame retires), since a new view could come back with the same handle
+            void evict_image_view(VkImageView view);
+
+            inline uint64_t get_n_hits() const {
+                return m_n_hits;
+            }
+            inline uint64_t get_n_misses() const {
+                return m_n_misses;
+            }
+
+        protected:
+            struct Entry {
+                std::vector<uint32_t> key;
+                DeferredObjectType type;
+                uint64_t handle;
+                // Framebuffers only
+                std::vector<VkImageView> views;
+            };
+
+            // A framebuffer using an image view, in m_framebuffers_by_view
+            struct ViewUse {
+                uint64_t key_hash;
+                uint64_t handle;
+            };
+
+            // The key is built up in m_key, as 32 bit words. Returns false if next is set
+            bool begin_key(DeferredObjectType type, const void* next);
+            inline void add(uint32_t value) {
+                m_key.push_back(value);
+            }
+            inline void add_float(float value) {
+                uint32_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                m_key.push_back(bits);
+            }
+            template <typename T>
+            inline void add_handle(T handle) {
+                const uint64_t value = handle_to_bits(handle);
+                m_key.push_back(static_cast<uint32_t>(value));
+                m_key.push_back(static_cast<uint32_t>(value >> 32));
+            }
+            void add_refs(uint32_t count, const VkAttachmentReference* refs);
+            // Returns 0 if m_key isn't cached
+            uint64_t find();
+            void insert(DeferredObjectType type, uint64_t handle, const VkImageView* views = nullptr, uint32_t n_views = 0);
+
+            Device& m_device;
+            std::mutex m_mutex;
+            std::unordered_multimap<uint64_t, Entry> m_entries;
+            std::vector<uint32_t> m_key;
+            uint64_t m_key_hash;
+            // Keyed by view handle, so evict_image_view() doesn't have to walk every entry
+            std::unordered_multimap<uint64_t, ViewUse> m_framebuffers_by_view;
+            uint64_t m_n_hits;
+            uint64_t m_n_misses;
+        };
+    }
+}
+
+#endif // ATLAS_CACHE_H
@@ -0,0 +1,45 @@
+#ifndef ATLAS_COMPUTE_H
+#define ATLAS_COMPUTE_H
+
+#include "frame.h"
+
+namespace Atlas {
+    namespace Backend {
+        // Submits work to the compute queue (a dedicated one if the device has it), chained to the current
+        // frame's universal submission with a semaphore. Compute for frame N+1 then runs while the universal
+        // queue is still rasterizing frame N. Buffers written by compute and read by graphics should be
+        // duplicated per frame in flight, since two frames' worth of them can be in use at once
+        struct AsyncCompute {
+            AsyncCompute(Device& device, FrameRing& frames);
+
+            // A primary command buffer on the compute family, from the current frame's pool for this thread
+            // Already begun; valid until the current frame retires
+            VkCommandBuffer begin(uint32_t thread_index = 0);
+            // Hands the buffer range over to the universal queue once this frame's compute work is done
+            // Without a separate compute family only the semaphore is needed, so this does nothing
+            void release_buffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkPipelineStageFlags src_stages, VkAccessFlags src_access, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access);
+            // Records the released buffers' barriers, ends the command buffer and submits it. The current frame's
+            // universal submission waits on it at wait_stages and at the released buffers' dst_stages
+            bool submit(VkCommandBuffer compute_buffer, VkPipelineStageFlags wait_stages = 0);
+            // Records the universal queue's half of the ownership transfers of the last submit()
+            // Call in a command buffer of the same frame, before the buffers are used
+            void acquire(VkCommandBuffer universal_buffer);
+
+            // True if the work really runs in parallel with the universal queue
+            inline bool is_async() const {
+                return m_device.get_queue(QUEUE_FAMILY_COMPUTE) != m_device.get_queue(QUEUE_FAMILY_UNIVERSAL);
+            }
+
+        protected:
+            Device& m_device;
+            FrameRing& m_frames;
+
+            std::vector<VkBufferMemoryBarrier> m_release_barriers;
+            VkPipelineStageFlags m_release_stages;
+            std::vector<VkBufferMemoryBarrier> m_acquire_barriers;
+            VkPipelineStageFlags m_acquire_stages;
+        };
+    }
+}
+
+#endif // ATLAS_COMPUTE_H
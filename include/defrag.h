@@ -0,0 +1,118 @@
+#ifndef ATLAS_DEFRAG_H
+#define ATLAS_DEFRAG_H
+
+#include "frame.h"
+#include "tracker.h"
+#include <functional>
+#include <unordered_map>
+
+namespace Atlas {
+    namespace Backend {
+        // Called with the id from register_buffer()/register_image() once the owner's handle points at the
+        // moved resource, to rebuild whatever refers to it (views, descriptor sets, ...)
+        typedef std::function<void(uint32_t id)> MoveCallback;
+
+        // Compacts the allocator's memory blocks by moving a bounded number of bytes of registered resources
+        // per frame. A moved resource is recreated from its create info, which VMA places in the fullest existing
+        // block with room, and copied inside the frame's universal command buffer. The move is dropped unless
+        // that block is fuller than the one it leaves. Blocks that drain are freed by VMA.
+        // The moved-from resource goes through Device::destroy_deferred(), so it's destroyed once its frame retires.
+        // Only register resources the GPU reads but no longer writes, and that aren't mapped. Resources larger
+        // than max_bytes_per_frame are never moved
+        struct Defragmenter {
+            Defragmenter(Device& device, FrameRing& frames);
+
+            // Upper bound on the bytes copied each frame; larger resources stay where they are
+            VkDeviceSize max_bytes_per_frame;
+            // Moves only happen while some heap's fragmentation (as in MemoryHeapStats) is above this
+            float fragmentation_threshold;
+
+            // The handle is overwritten when the resource moves, so it must stay at the same address until
+            // unregister(). Needs TRANSFER_SRC and TRANSFER_DST usage and memory from a VMA block, not its own.
+            // stages and access are how frames read the resource, which the copy waits for and makes the moved
+            // resource visible to. Its last write has to have been a transfer, like an upload's
+            // Returns 0 if the resource can't be moved
+            uint32_t register_buffer(VkBuffer& buffer, const VkMappedMemoryRange& memory, const VkBufferCreateInfo& info, const VmaMemoryRequirements& reqs,
+                VkPipelineStageFlags stages, VkAccessFlags access, const MoveCallback& on_moved = nullptr);
+            // Every mip level and layer is copied; the image has to be in the given layout between frames
+            uint32_t register_image(VkImage& image, const VkMappedMemoryRange& memory, const VkImageCreateInfo& info, const VmaMemoryRequirements& reqs, VkImageLayout layout, VkImageAspectFlags aspect,
+                VkPipelineStageFlags stages, VkAccessFlags access, const MoveCallback& on_moved = nullptr);
+            // The owner destroys the resource itself, as usual
+            void unregister(uint32_t id);
+
+            // Call once per frame after FrameRing::begin_frame(), outside a render pass, before recording
+            // anything that uses registered resources, and records this frame's moves. stats are the ones
+            // begin_frame() sampled (Device::get_memory_stats()), so the allocator isn't walked again
+            bool update(VkCommandBuffer command_buffer, const MemoryStats& stats);
+
+            inline uint64_t get_bytes_moved() const {
+                return m_bytes_moved;
+            }
+            inline uint64_t get_n_moves() const {
+                return m_n_moves;
+            }
+            // Shrinkage of the VkDeviceMemory allocated through VMA between the frames that moved resources and
+            // the first one after the moved-from resources were freed; allocations made meanwhile count against it
+            inline uint64_t get_bytes_reclaimed() const {
+                return m_bytes_reclaimed;
+            }
+
+        protected:
+            struct Resource {
+                bool is_image;
+                VkBuffer* buffer;
+                VkImage* image;
+                VkBufferCreateInfo buffer_info;
+                VkImageCreateInfo image_info;
+                // Backs pQueueFamilyIndices of the create info
+                std::vector<uint32_t> queue_families;
+                VmaMemoryRequirements reqs;
+                VkMappedMemoryRange memory;
+                VkImageLayout layout;
+                VkImageAspectFlags aspect;
+                VkPipelineStageFlags stages;
+                VkAccessFlags access;
+                MoveCallback on_moved;
+            };
+            struct Move {
+                uint32_t id;
+                VkBuffer buffer;
+                VkImage image;
+                VkMappedMemoryRange memory;
+            };
+            uint32_t add_resource(Resource& resource);
+            bool is_fragmented(const MemoryStats& stats) const;
+            bool create_move(uint32_t id, Resource& resource);
+            // True if destination comes before source when blocks are ordered fullest first
+            bool is_better_block(VkDeviceMemory destination, VkDeviceMemory source) const;
+            void record_moves(VkCommandBuffer command_buffer);
+            // Adds to m_bytes_reclaimed once the resources moved out of have been freed
+            void measure_reclaimed(const MemoryStats& stats);
+
+            Device& m_device;
+            FrameRing& m_frames;
+            std::unordered_map<uint32_t, Resource> m_resources;
+            uint32_t m_next_id;
+            // Bytes of registered resources in each VMA block
+            std::unordered_map<VkDeviceMemory, VkDeviceSize> m_block_usage;
+            // Blocks a move landed back in this frame, so the rest of their resources can stay put
+            std::vector<VkDeviceMemory> m_full_blocks;
+            // Reused every frame: (block usage, id) of the resources, then the moves picked from them
+            std::vector<std::pair<VkDeviceSize, uint32_t>> m_candidates;
+            std::vector<Move> m_moves;
+            // Only holds the resources of the moves being recorded
+            ResourceTracker m_tracker;
+            std::vector<VkImageCopy> m_regions;
+            // Last frame that moved resources, until its moved-from resources are freed, and the memory
+            // allocated before its moves
+            uint64_t m_moved_serial;
+            VkDeviceSize m_allocated_before_moves;
+
+            uint64_t m_bytes_moved;
+            uint64_t m_n_moves;
+            uint64_t m_bytes_reclaimed;
+        };
+    }
+}
+
+#endif // ATLAS_DEFRAG_H
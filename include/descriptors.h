@@ -0,0 +1,102 @@
+#ifndef ATLAS_DESCRIPTORS_H
+#define ATLAS_DESCRIPTORS_H
+
+#include "frame.h"
+#include <deque>
+
+namespace Atlas {
+    namespace Backend {
+        // One descriptor's worth of data; which member is used depends on the binding's type
+        union DescriptorData {
+            VkDescriptorImageInfo image;
+            VkDescriptorBufferInfo buffer;
+            VkBufferView texel_buffer;
+        };
+
+        // Set layout created by DescriptorAllocator::get_layout()
+        struct DescriptorLayout {
+            VkDescriptorSetLayout layout;
+            // Writes every descriptor of a set from an array of DescriptorData; null without the extension
+            VkDescriptorUpdateTemplateKHR update_template;
+            // Sorted by binding number
+            std::vector<VkDescriptorSetLayoutBinding> bindings;
+            // Backs the pImmutableSamplers of the bindings
+            std::vector<VkSampler> immutable_samplers;
+            // Length of the DescriptorData array describing a set: the sum of the descriptor counts
+            uint32_t n_descriptors;
+            uint64_t hash;
+        };
+
+        // Descriptor counts for a new pool: usual_sizes, each raised to what one set of the layout needs of its
+        // type (summed over the layout's bindings), plus any types of the layout that usual_sizes leaves out
+        void get_pool_sizes(const std::vector<VkDescriptorPoolSize>& usual_sizes, const DescriptorLayout& layout, std::vector<VkDescriptorPoolSize>& pool_sizes);
+
+        // Creates set layouts, caching them by a hash of their bindings, and hands out descriptor sets:
+        //  - transient sets from pools owned by the current frame in flight, all reset at once when that
+        //    frame comes around again
+        //  - static sets, cached by layout and contents, that live as long as the allocator
+        // Pools are added as they run out. Sets are written with vkUpdateDescriptorSetWithTemplateKHR
+        // when VK_KHR_descriptor_update_template is enabled, and with vkUpdateDescriptorSets otherwise.
+        // Not thread safe; allocate sets before handing recording off to other threads
+        struct DescriptorAllocator {
+            DescriptorAllocator(Device& device, FrameRing& frames);
+            ~DescriptorAllocator();
+            bool init();
+
+            // Set before calling init()
+            uint32_t sets_per_pool;
+
+            // Sorts the bindings. The layout stays valid for the lifetime of the allocator
+            const DescriptorLayout* get_layout(const std::vector<VkDescriptorSetLayoutBinding>& bindings);
+
+            // Call after FrameRing::begin_frame(); recycles the sets of the frame that just retired
+            bool begin_frame();
+            // Data holds layout.n_descriptors entries, in binding order, with each binding's array elements
+            // in a row. The set is valid until the current frame retires. Returns null on failure
+            VkDescriptorSet allocate(const DescriptorLayout& layout, const DescriptorData* data);
+            // Returns the set written with the same data before, if there is one. Static sets are never freed,
+            // so only use them for resources that live as long as the allocator
+            VkDescriptorSet get_static_set(const DescriptorLayout& layout, const DescriptorData* data);
+            // Writes every descriptor of a set
+            void update(VkDescriptorSet set, const DescriptorLayout& layout, const DescriptorData* data);
+
+            inline bool uses_update_templates() const {
+                return (m_device.vkUpdateDescriptorSetWithTemplateKHR != nullptr);
+            }
+
+        protected:
+            struct PoolChain {
+                std::vector<VkDescriptorPool> pools;
+                // Pools before this one have run out
+                uint32_t current;
+            };
+            struct StaticSet {
+                const DescriptorLayout* layout;
+                std::vector<DescriptorData> data;
+                VkDescriptorSet set;
+            };
+
+            VkDescriptorSet allocate_from(PoolChain& chain, const DescriptorLayout& layout);
+            // Copies the fields the layout uses into m_scratch and zeroes the rest, so the data can be
+            // hashed and compared as bytes
+            void normalize(const DescriptorLayout& layout, const DescriptorData* data);
+
+            Device& m_device;
+            FrameRing& m_frames;
+            std::vector<VkDescriptorPoolSize> m_pool_sizes;
+            // Indexed like FrameRing::get_frame_index()
+            std::vector<PoolChain> m_frame_pools;
+            PoolChain m_static_pools;
+
+            // Deques so layouts keep their address
+            std::deque<DescriptorLayout> m_layouts;
+            std::unordered_multimap<uint64_t, DescriptorLayout*> m_layout_cache;
+            std::unordered_multimap<uint64_t, StaticSet> m_static_sets;
+
+            std::vector<DescriptorData> m_scratch;
+            std::vector<VkWriteDescriptorSet> m_writes;
+        };
+    }
+}
+
+#endif // ATLAS_DESCRIPTORS_H
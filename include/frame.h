@@ -0,0 +1,119 @@
+#ifndef ATLAS_FRAME_H
+#define ATLAS_FRAME_H
+
+#include "backend.h"
+#include "staging.h"
+
+namespace Atlas {
+    namespace Backend {
+        // One per worker thread, queue family and frame in flight. Command buffers are never reset or freed
+        // individually; the whole pool is reset when its frame retires and its buffers are handed out again
+        struct FrameCommandPool {
+            VkCommandPool pool;
+            // Indexed by VkCommandBufferLevel
+            std::vector<VkCommandBuffer> buffers[2];
+            uint32_t n_used[2];
+        };
+
+        // Everything that has to stay alive until the GPU is done with one frame
+        struct FrameContext {
+            // Signaled once every submission of the frame has completed
+            VkFence fence;
+            // Signaled by the swapchain acquire; wait on it before writing to the color image
+            VkSemaphore image_available;
+            // Signaled by the frame's submission; present waits on it
+            VkSemaphore render_finished;
+            // Indexed by thread_index * QUEUE_FAMILY_COUNT + family, like Device::get_command_pool()
+            std::vector<FrameCommandPool> command_pools;
+            // Extra semaphores the frame's submission waits on, besides image_available
+            std::vector<VkSemaphore> wait_semaphores;
+            std::vector<VkPipelineStageFlags> wait_stages;
+            // Sync objects borrowed while recording the frame, recycled when it retires
+            std::vector<VkSemaphore> borrowed_semaphores;
+            std::vector<VkFence> borrowed_fences;
+            // Serial of the last frame recorded with this context
+            uint64_t serial;
+            bool submitted;
+        };
+
+        // Ring of frame contexts, so the CPU can record frame N+1 while the GPU executes frame N
+        struct FrameRing {
+            FrameRing(Device& device, Window& window);
+            ~FrameRing();
+            bool init();
+
+            // Set before calling init()
+            uint32_t max_frames_in_flight;
+            VkCommandPoolCreateFlags command_pool_flags;
+            // Size of the ring that allocate_staging() hands out from; 0 disables it
+            VkDeviceSize staging_size;
+            // Calls Device::sample_memory_stats() in every begin_frame()
+            bool sample_memory_stats;
+
+            // Waits for the context's previous frame to retire, recycles its resources,
+            // and acquires the next swapchain image
+            bool begin_frame(uint64_t timeout = std::numeric_limits<uint64_t>::max());
+            // Submits to the universal queue (waiting on image_available and signaling render_finished
+            // and the frame's fence), then presents. Doesn't allocate once the first few frames have sized
+            // the frame's containers
+            bool end_frame(Span<VkCommandBuffer> command_buffers = {});
+
+            // A command buffer in the initial state, from the current frame's pool for this worker thread.
+            // Each thread must only ever pass its own thread_index (less than Device::n_threads)
+            // Valid until the current frame retires; don't free it
+            VkCommandBuffer get_command_buffer(QueueFamily family, uint32_t thread_index = 0, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+
+            // Makes the current frame's submission wait on the semaphore at the given stages,
+            // e.g. for work submitted to another queue that the frame consumes
+            void add_wait_semaphore(VkSemaphore semaphore, VkPipelineStageFlags stages);
+
+            // Persistently mapped memory for uniforms, dynamic vertices and copy sources, valid until the
+            // current frame retires. Flushed automatically by end_frame(). Fails if the frames in flight have
+            // used up the whole ring
+            bool allocate_staging(VkDeviceSize size, VkDeviceSize alignment, StagingAllocation& allocation);
+
+            // Valid until the current frame retires; don't destroy them
+            VkSemaphore borrow_semaphore();
+            // Unsignaled; valid until the current frame retires; don't destroy them
+            VkFence borrow_fence();
+
+            // Blocks until every frame in flight has retired
+            bool wait_idle();
+
+            inline VkCommandPool get_command_pool(QueueFamily family, uint32_t thread_index = 0) const {
+                return m_frames[m_frame_index].command_pools[thread_index * QUEUE_FAMILY_COUNT + family].pool;
+            }
+            inline FrameContext& get_current_frame() {
+                return m_frames[m_frame_index];
+            }
+            inline uint32_t get_frame_index() const {
+                return m_frame_index;
+            }
+            // Serial of the frame currently being recorded. Starts at 1
+            inline uint64_t get_frame_serial() const {
+                return m_frame_serial;
+            }
+            // Every frame up to and including this serial has finished executing on the GPU
+            inline uint64_t get_retired_serial() const {
+                return m_retired_serial;
+            }
+        protected:
+            bool retire(FrameContext& frame, uint64_t timeout);
+
+            Device& m_device;
+            Window& m_window;
+            uint32_t m_n_threads;
+            std::vector<FrameContext> m_frames;
+            uint32_t m_frame_index;
+            uint64_t m_frame_serial;
+            uint64_t m_retired_serial;
+            // Allocations are tagged with the serial of the frame they were made in
+            StagingRing m_staging;
+
+            std::vector<VkSemaphore> m_free_semaphores;
+            std::vector<VkFence> m_free_fences;
+        };
+    }
+}
+
+#endif // ATLAS_FRAME_H
@@ -0,0 +1,105 @@
+#ifndef ATLAS_GEOMETRY_H
+#define ATLAS_GEOMETRY_H
+
+#include "upload.h"
+#include <map>
+
+namespace Atlas {
+    namespace Backend {
+        // Best-fit allocator of ranges of [0, capacity), in whatever units the caller uses
+        // Freed ranges merge with their free neighbours
+        struct RangeAllocator {
+            RangeAllocator()
+                : m_capacity(0), m_free_size(0)
+            { }
+            void init(uint64_t capacity);
+            // False if no free range is large enough
+            bool allocate(uint64_t size, uint64_t& offset);
+            void free(uint64_t offset, uint64_t size);
+
+            inline uint64_t get_capacity() const {
+                return m_capacity;
+            }
+            inline uint64_t get_free_size() const {
+                return m_free_size;
+            }
+            inline uint64_t get_largest_free_range() const {
+                return m_free_by_size.empty() ? 0 : m_free_by_size.rbegin()->first;
+            }
+
+        protected:
+            uint64_t m_capacity;
+            uint64_t m_free_size;
+            std::map<uint64_t, uint64_t> m_free_by_offset;
+            std::multimap<uint64_t, uint64_t> m_free_by_size;
+        };
+
+        // Where a mesh lives in a GeometryArena, in vertices and indices
+        struct MeshRange {
+            uint32_t first_vertex;
+            uint32_t n_vertices;
+            uint32_t first_index;
+            uint32_t n_indices;
+        };
+
+        // Keeps the vertices and 32 bit indices of many meshes of one vertex format in a single pair of
+        // device-local buffers, so a whole pass binds them once and draws each mesh at its offsets.
+        // Shaders can also pull vertices from the vertex buffer as an SSBO instead of using vertex input:
+        // gl_VertexIndex already includes the mesh's first_vertex when drawing with draw().
+        // Not thread safe, and removed ranges come back from FrameRing::begin_frame(), so use it on that thread
+        struct GeometryArena {
+            GeometryArena(Device& device, UploadManager& uploads);
+            ~GeometryArena();
+            bool init();
+
+            // Set before calling init()
+            uint32_t vertex_stride;
+            uint32_t max_vertices;
+            uint32_t max_indices;
+
+            // Uploads through the UploadManager; the frames that draw the mesh have to acquire the upload first
+            // Indices are relative to the mesh's first vertex
+            bool add_mesh(const void* vertices, uint32_t n_vertices, const uint32_t* indices, uint32_t n_indices, MeshRange& mesh);
+            // The range is reused once the current frame retires (through Device::release_deferred()), so the
+            // mesh can still be drawn in it
+            void remove_mesh(const MeshRange& mesh);
+
+            // Binds the vertex buffer to the given binding and the index buffer
+            void bind(VkCommandBuffer command_buffer, uint32_t vertex_binding = 0) const;
+            inline void draw(VkCommandBuffer command_buffer, const MeshRange& mesh, uint32_t n_instances = 1, uint32_t first_instance = 0) const {
+                vkCmdDrawIndexed(command_buffer, mesh.n_indices, n_instances, mesh.first_index, static_cast<int32_t>(mesh.first_vertex), first_instance);
+            }
+
+            inline VkBuffer get_vertex_buffer() const {
+                return m_vertex_buffer;
+            }
+            inline VkBuffer get_index_buffer() const {
+                return m_index_buffer;
+            }
+            // For binding the vertex buffer as a storage buffer, to pull vertices from
+            inline VkDescriptorBufferInfo get_vertex_buffer_info() const {
+                return { m_vertex_buffer, 0, VK_WHOLE_SIZE };
+            }
+            inline uint32_t get_n_meshes() const {
+                return m_n_meshes;
+            }
+            inline const RangeAllocator& get_vertex_ranges() const {
+                return m_vertex_ranges;
+            }
+            inline const RangeAllocator& get_index_ranges() const {
+                return m_index_ranges;
+            }
+
+        protected:
+            Device& m_device;
+            UploadManager& m_uploads;
+            VkBuffer m_vertex_buffer;
+            VkBuffer m_index_buffer;
+            RangeAllocator m_vertex_ranges;
+            RangeAllocator m_index_ranges;
+            uint32_t m_n_meshes;
+        };
+    }
+}
+
+#endif // ATLAS_GEOMETRY_H
@@ -0,0 +1,238 @@
+#ifndef ATLAS_GRAPH_H
+#define ATLAS_GRAPH_H
+
+#include "tracker.h"
+#include <functional>
+
+namespace Atlas {
+    namespace Backend {
+        struct GpuProfiler;
+
+        typedef uint32_t GraphResource;
+        constexpr GraphResource invalid_graph_resource = std::numeric_limits<uint32_t>::max();
+
+        enum GraphPassType {
+            // Runs inside a render pass made of the pass's color and depth attachments
+            GRAPH_PASS_GRAPHICS = 0,
+            GRAPH_PASS_COMPUTE,
+            GRAPH_PASS_TRANSFER
+        };
+
+        // How a pass uses a resource. Shader accesses apply to the vertex and fragment stages in graphics
+        // passes, and the compute stage in compute passes
+        enum GraphUsage {
+            GRAPH_USAGE_COLOR_ATTACHMENT = 0,
+            GRAPH_USAGE_DEPTH_ATTACHMENT,
+            // Depth test without depth writes
+            GRAPH_USAGE_DEPTH_READ,
+            GRAPH_USAGE_SAMPLED,
+            GRAPH_USAGE_STORAGE_READ,
+            GRAPH_USAGE_STORAGE_WRITE,
+            GRAPH_USAGE_UNIFORM,
+            // Vertex or index buffer
+            GRAPH_USAGE_VERTEX,
+            GRAPH_USAGE_INDIRECT,
+            GRAPH_USAGE_TRANSFER_SRC,
+            GRAPH_USAGE_TRANSFER_DST,
+            GRAPH_USAGE_COUNT
+        };
+
+        struct GraphImageInfo {
+            VkFormat format;
+            VkExtent2D extent;
+            VkSampleCountFlagBits samples;
+        };
+
+        // Called while executing the graph; graphics passes are recorded inside their render pass
+        typedef std::function<void(VkCommandBuffer command_buffer, uint32_t pass)> PassRecordFunction;
+
+        // Frame graph: passes declare the resources they read and write, and compile() works out the rest
+        //  - passes whose results nobody uses are culled
+        //  - transient images are created with the usage flags their passes need, and images whose lifetimes
+        //    don't overlap share memory; attachments only one pass uses are lazily allocated instead
+        //  - the barriers before each pass are precomputed and issued as one vkCmdPipelineBarrier, skipping
+        //    reads that an earlier barrier already covered
+        //  - attachment layout transitions happen in the render passes, whose external subpass dependencies
+        //    are generated from the previous use of each attachment
+        // Passes execute in the order they were added. Declare the graph once and call compile() again only
+        // when it changes (e.g. when transient images need a new size); execute() it every frame
+        struct RenderGraph {
+            RenderGraph(Device& device);
+            // Without a device the graph can only plan(), e.g. to check it offline
+            RenderGraph();
+            ~RenderGraph();
+
+            // Lives and dies with the graph; contents don't survive between frames
+            GraphResource create_image(const char* name, const GraphImageInfo& info);
+            // The graph moves the image from initial_layout to final_layout, waiting on initial_stages before
+            // its first use (e.g. COLOR_ATTACHMENT_OUTPUT for a swapchain image acquired with a semaphore)
+            // Pass the handles to set_image() before each execute(). Framebuffers come from the device's
+            // ObjectCache, so evict imported views from it before destroying them
+            GraphResource import_image(const char* name, const GraphImageInfo& info, VkImageLayout initial_layout, VkImageLayout final_layout, VkPipelineStageFlags initial_stages = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+            // Writes from outside the graph must already be visible to the passes reading the buffer
+            GraphResource import_buffer(const char* name, VkBuffer buffer = VK_NULL_HANDLE);
+            void set_image(GraphResource resource, VkImage image, VkImageView view);
+            void set_buffer(GraphResource resource, VkBuffer buffer);
+            // E.g. after the window was resized; the graph has to be compiled again
+            void set_image_extent(GraphResource resource, VkExtent2D extent);
+            // Keeps the passes writing the resource from being culled. Imported images with a final layout
+            // other than UNDEFINED are outputs already
+            void mark_output(GraphResource resource);
+
+            uint32_t add_pass(const char* name, GraphPassType type, const PassRecordFunction& record);
+            // Use each resource once per pass. clear_value only applies to attachments, which are cleared
+            // when the render pass begins instead of loaded
+            void use(uint32_t pass, GraphResource resource, GraphUsage usage, const VkClearValue* clear_value = nullptr);
+            // Never culled, e.g. because it writes to something outside the graph
+            void set_side_effects(uint32_t pass);
+
+            // Times each pass in a GPU scope named after it, from the barriers before it to the end of its
+            // render pass. Null to stop timing
+            inline void set_profiler(GpuProfiler* profiler) {
+                m_profiler = profiler;
+            }
+
+            bool compile();
+            // What compile() works out on the CPU, with reqs standing in for the memory requirements of each
+            // transient image: culling, lifetimes, memory slots, barriers and render pass dependencies. Creates
+            // nothing and leaves the graph uncompiled
+            bool plan(const std::vector<VkMemoryRequirements>& reqs);
+            // Imported resources must have their handles set
+            bool execute(VkCommandBuffer command_buffer);
+
+            // Valid after compile(); for creating the pass's pipelines. Owned by the device's ObjectCache
+            inline VkRenderPass get_renderpass(uint32_t pass) const {
+                return m_passes[pass].renderpass;
+            }
+            // Valid after compile(); for sampling transient images in later passes
+            inline VkImageView get_view(GraphResource resource) const {
+                return m_resources[resource].view;
+            }
+            inline bool is_culled(uint32_t pass) const {
+                return m_passes[pass].culled;
+            }
+            // Valid after compile() or plan(); transients sharing a slot share memory
+            inline uint32_t get_slot(GraphResource resource) const {
+                return m_resources[resource].slot;
+            }
+            // Valid after compile() or plan(); the external dependency of a graphics pass's render pass,
+            // without stages if it needs none
+            inline const VkSubpassDependency& get_dependency(uint32_t pass) const {
+                return m_passes[pass].dependency;
+            }
+            // Memory backing the transient images, and what it would take without aliasing
+            inline VkDeviceSize get_transient_bytes() const {
+                return m_transient_bytes;
+            }
+            inline VkDeviceSize get_unaliased_bytes() const {
+                return m_unaliased_bytes;
+            }
+            // Transient attachments only used by one pass are lazily allocated where the device supports it
+            inline VkDeviceSize get_lazy_bytes() const {
+                return m_lazy_bytes;
+            }
+
+        protected:
+            struct Use {
+                GraphResource resource;
+                GraphUsage usage;
+                bool clear;
+                VkClearValue clear_value;
+            };
+            struct Barrier {
+                GraphResource resource;
+                VkPipelineStageFlags src_stages;
+                VkPipelineStageFlags dst_stages;
+                VkAccessFlags src_access;
+                VkAccessFlags dst_access;
+                VkImageLayout old_layout;
+                VkImageLayout new_layout;
+            };
+            struct Resource {
+                const char* name;
+                bool is_image;
+                bool transient;
+                bool output;
+                GraphImageInfo info;
+                VkImageLayout initial_layout;
+                VkImageLayout final_layout;
+                VkPipelineStageFlags initial_stages;
+                VkImage image;
+                VkImageView view;
+                VkBuffer buffer;
+                // Filled in by compile()
+                VkImageUsageFlags usage;
+                uint32_t first_pass;
+                uint32_t last_pass;
+                uint32_t slot;
+                // Created by Device::create_transient_attachment(), alone in a slot without memory
+                bool lazy;
+            };
+            struct Pass {
+                const char* name;
+                GraphPassType type;
+                PassRecordFunction record;
+                std::vector<Use> uses;
+                bool side_effects;
+                bool culled;
+                // Filled in by compile()
+                std::vector<Barrier> barriers;
+                VkRenderPass renderpass;
+                std::vector<GraphResource> attachments;
+                std::vector<VkAttachmentDescription> descriptions;
+                VkSubpassDependency dependency;
+                std::vector<VkClearValue> clear_values;
+                VkExtent2D extent;
+            };
+            // Memory shared by transient images with disjoint lifetimes
+            struct MemorySlot {
+                VkMemoryRequirements reqs;
+                // In order of first use
+                std::vector<GraphResource> residents;
+                VkMappedMemoryRange memory;
+            };
+            // Where a transient's first use has to wait for the previous frame's last user of its memory
+            struct WrapPatch {
+                uint32_t pass;
+                // Barrier index, or the render pass dependency if it's invalid
+                uint32_t barrier;
+                uint32_t slot;
+            };
+
+            void release_compiled();
+            void cull();
+            // Culls and finds the passes each resource lives between
+            void find_lifetimes();
+            // Creates the transient images and fills in their memory requirements
+            bool create_transients(std::vector<VkMemoryRequirements>& reqs);
+            // Packs transients with disjoint lifetimes into shared memory slots
+            void assign_slots(const std::vector<VkMemoryRequirements>& reqs);
+            // Allocates the slots, and binds and creates views for their images
+            bool bind_transients();
+            // Barriers, attachment descriptions and render pass dependencies
+            void plan_barriers();
+            bool create_renderpass(Pass& pass);
+            // From the device's ObjectCache
+            VkFramebuffer get_framebuffer(const Pass& pass);
+            void record_barriers(VkCommandBuffer command_buffer, const std::vector<Barrier>& barriers);
+
+            // Null for graphs that only plan()
+            Device* m_device;
+            GpuProfiler* m_profiler;
+            std::vector<Resource> m_resources;
+            std::vector<Pass> m_passes;
+            std::vector<MemorySlot> m_slots;
+            // Barriers that finish the imported images off in their final layout
+            std::vector<Barrier> m_final_barriers;
+            bool m_compiled;
+            VkDeviceSize m_transient_bytes;
+            VkDeviceSize m_unaliased_bytes;
+            VkDeviceSize m_lazy_bytes;
+
+            std::vector<VkImageMemoryBarrier> m_image_barriers;
+            std::vector<VkImageView> m_views;
+        };
+    }
+}
+
+#endif // ATLAS_GRAPH_H
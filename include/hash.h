@@ -0,0 +1,27 @@
+#ifndef ATLAS_HASH_H
+#define ATLAS_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Atlas {
+    // 64 bit FNV-1a, for keying caches on the contents of Vulkan structs
+    // Only hash fields that are meaningful: padding and unused union members are uninitialized
+    constexpr uint64_t hash_seed = 14695981039346656037ull;
+
+    inline uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = hash_seed) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    inline uint64_t hash_value(const T& value, uint64_t hash = hash_seed) {
+        return hash_bytes(&value, sizeof(T), hash);
+    }
+}
+
+#endif // ATLAS_HASH_H
@@ -0,0 +1,111 @@
+#ifndef ATLAS_JOBS_H
+#define ATLAS_JOBS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace Atlas {
+    namespace Backend {
+        struct Job;
+        typedef void (*JobFunction)(uint32_t worker_index, const Job& job);
+
+        // Counts unfinished jobs. Jobs can wait on a counter before they start (a dependency),
+        // and threads can wait on one while helping run other jobs
+        struct JobCounter {
+            JobCounter() : value(0) {}
+            inline bool is_done() const {
+                return (value.load(std::memory_order_acquire) == 0);
+            }
+            std::atomic<uint32_t> value;
+        };
+
+        struct Job {
+            JobFunction function;
+            void* data;
+            // Free for the job's own use, e.g. the range of a parallel_for batch
+            uint32_t first, count;
+            // Decremented once the job has finished; may be null
+            JobCounter* counter;
+            // The job doesn't start until this counter reaches zero; may be null
+            const JobCounter* dependency;
+            // Set while the job is queued or running, so its storage isn't handed out again. Owned by the job system
+            std::atomic<bool> in_flight;
+        };
+
+        // Work-stealing scheduler. Worker 0 is the thread that called init(), and the other workers are
+        // threads owned by the job system. Worker indices are meant to be used directly as thread indices,
+        // e.g. in Device::get_command_pool() and FrameRing::get_command_buffer(), so construct it with
+        // Device::n_threads workers
+        struct JobSystem {
+            JobSystem(uint32_t n_workers);
+            ~JobSystem();
+            bool init();
+
+            // Only call from worker threads (including worker 0, the thread that called init()). Other threads
+            // would share worker 0's deque, which only its owner may push to
+            void run(JobFunction function, void* data, uint32_t first, uint32_t count, JobCounter* counter, const JobCounter* dependency = nullptr);
+            // Runs other jobs until the counter reaches zero
+            void wait(const JobCounter& counter);
+            // Splits [0, count) into batches of at least min_batch items, runs them on every worker and waits for them
+            void parallel_for(uint32_t count, uint32_t min_batch, const std::function<void(uint32_t worker_index, uint32_t first, uint32_t count)>& function);
+
+            inline uint32_t get_n_workers() const {
+                return m_n_workers;
+            }
+            // Index of the calling worker thread, or invalid_worker_index for threads the job system doesn't know
+            static uint32_t get_worker_index();
+
+            static constexpr uint32_t invalid_worker_index = ~0u;
+
+            // Jobs each worker can have outstanding at once; run() helps with other work while they're all in
+            // flight. Must be a power of two
+            static constexpr uint32_t max_jobs_per_worker = 4096;
+
+        protected:
+            // Chase-Lev deque: the owning worker pushes and pops at the bottom, thieves steal from the top
+            struct JobDeque {
+                JobDeque() : top(0), bottom(0) {}
+                bool push(Job* job);
+                Job* pop();
+                Job* steal();
+
+                alignas(64) std::atomic<int64_t> top;
+                alignas(64) std::atomic<int64_t> bottom;
+                std::atomic<Job*> jobs[max_jobs_per_worker];
+            };
+            struct Worker {
+                JobDeque deque;
+                // Job storage, so running a job never allocates. Slots are handed out round-robin, skipping any
+                // that are still in flight (a stolen or re-queued job can outlive younger ones)
+                Job jobs[max_jobs_per_worker];
+                uint32_t next_job;
+                std::thread thread;
+            };
+
+            void worker_main(uint32_t worker_index);
+            Job* find_job(uint32_t worker_index);
+            // Returns false if the job's dependency isn't done yet, in which case it is queued again
+            bool execute(Job* job, uint32_t worker_index);
+            void invoke(Job* job, uint32_t worker_index);
+            void push(Job* job, uint32_t worker_index);
+            Job* allocate_job(uint32_t worker_index);
+
+            uint32_t m_n_workers;
+            std::vector<std::unique_ptr<Worker>> m_workers;
+
+            std::atomic<bool> m_shutdown;
+            std::atomic<uint32_t> m_n_queued;
+            std::atomic<uint32_t> m_n_sleeping;
+            std::mutex m_sleep_mutex;
+            std::condition_variable m_wake;
+        };
+    }
+}
+
+#endif // ATLAS_JOBS_H
@@ -0,0 +1,41 @@
+#ifndef ATLAS_LOG_H
+#define ATLAS_LOG_H
+
+#include <stdint.h>
+
+// Asynchronous output for Backend::log/warning/error, validate() and the validation layers' messages
+// Any thread can write a message without blocking or allocating: it's copied into a fixed-size record in
+// a lock-free ring, and a background thread timestamps, filters and prints it. The writer thread:
+//  - collapses a message repeated back to back into one line and a count
+//  - prints each distinct message at most max_repeats_per_second times a second, counting the rest; the
+//    count is printed with the next repeat, or once the writer goes idle after the second is up or stops
+//  - reports how many messages were dropped because the ring was full
+// Warnings and below can only fill part of the ring, so errors still get through validation spam. Errors from
+// validate() and the debug callback are flushed before returning
+// Messages still in the ring are lost if the process crashes; call flush() before anything risky
+
+namespace Atlas {
+    namespace Log {
+        // Longer messages are truncated
+        constexpr uint32_t max_message_length = 1000;
+        constexpr uint32_t max_repeats_per_second = 10;
+
+        // Starts the writer thread. Calls nest; the thread runs until the matching number of stop() calls,
+        // which print everything still queued. Messages written while it isn't running are printed
+        // synchronously. Instance does this for its lifetime
+        void start();
+        void stop();
+
+        // flags are VkDebugReportFlagsEXT and prefix is the layer prefix, as passed to a debug report callback
+        // Never blocks: if the ring is full the message is dropped and counted
+        void write(uint32_t flags, const char* prefix, int32_t code, const char* message);
+        // Blocks until everything written before the call has been printed and the streams flushed
+        void flush();
+
+        // Messages lost to a full ring, and repeats held back by the deduplication and rate limit
+        uint64_t get_n_dropped();
+        uint64_t get_n_suppressed();
+    }
+}
+
+#endif // ATLAS_LOG_H
@@ -0,0 +1,96 @@
+#ifndef ATLAS_PROFILER_H
+#define ATLAS_PROFILER_H
+
+#include "frame.h"
+
+namespace Atlas {
+    namespace Backend {
+        struct GpuTiming {
+            // The pointer passed to begin_scope()
+            const char* name;
+            // Number of scopes open when this one began
+            uint32_t depth;
+            // Relative to the frame's first timestamp
+            double begin_ms;
+            double duration_ms;
+        };
+
+        struct GpuFrameTimings {
+            uint64_t frame_serial;
+            // From the frame's first timestamp to its last
+            double frame_ms;
+            // In the order the scopes began
+            std::vector<GpuTiming> scopes;
+        };
+
+        // Times named scopes (render passes, dispatches, ...) on the universal queue with timestamp queries
+        // Each frame in flight has its own query pool, read back once FrameRing has retired that frame, so
+        // reading the results never waits on the GPU. Results lag max_frames_in_flight frames behind
+        struct GpuProfiler {
+            GpuProfiler(Device& device, FrameRing& frames);
+            ~GpuProfiler();
+            // Does nothing but warn if the universal queue doesn't support timestamps
+            bool init();
+
+            // Set before calling init()
+            uint32_t max_scopes_per_frame;
+            // Number of frames of results kept for get_history() and the dumps
+            uint32_t history_length;
+
+            // Call after FrameRing::begin_frame(), with the frame's first universal command buffer
+            // Collects the results of the frame that just retired and resets its queries; must be outside a render pass
+            bool begin_frame(VkCommandBuffer command_buffer);
+            // Names must stay valid while they are in the history, e.g. string literals
+            // Scopes may nest, but must be recorded in submission order from a single thread
+            // Returns the scope's index to pass to end_scope()
+            uint32_t begin_scope(VkCommandBuffer command_buffer, const char* name, VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+            void end_scope(VkCommandBuffer command_buffer, uint32_t scope, VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+            inline bool is_enabled() const {
+                return !m_pools.empty();
+            }
+            // Zero until the first frame has been read back
+            inline uint32_t get_history_size() const {
+                return m_history_size;
+            }
+            // Oldest first, so index get_history_size() - 1 is the latest frame read back
+            inline const GpuFrameTimings& get_history(uint32_t index) const {
+                return m_history[(m_history_first + index) % m_history.size()];
+            }
+
+            // One row per scope: frame, scope, depth, begin_ms, duration_ms
+            bool write_csv(const std::string& path) const;
+            // An array of frames, each with its scopes
+            bool write_json(const std::string& path) const;
+
+        protected:
+            struct FrameQueries {
+                VkQueryPool pool;
+                uint64_t frame_serial;
+                // Scopes recorded this frame; the timestamps of scope i are queries 2i and 2i + 1
+                std::vector<GpuTiming> scopes;
+                uint32_t n_scopes;
+                bool pending;
+            };
+
+            bool read_back(FrameQueries& queries);
+
+            Device& m_device;
+            FrameRing& m_frames;
+            std::vector<FrameQueries> m_pools;
+            // Indexed like FrameRing::get_frame_index()
+            uint32_t m_current;
+            uint32_t m_depth;
+            // Nanoseconds per tick, and the bits of each timestamp that are valid
+            double m_timestamp_period;
+            uint64_t m_timestamp_mask;
+            std::vector<uint64_t> m_timestamps;
+            // Ring of history_length frames, allocated up front so recording doesn't allocate
+            std::vector<GpuFrameTimings> m_history;
+            uint32_t m_history_first;
+            uint32_t m_history_size;
+        };
+    }
+}
+
+#endif // ATLAS_PROFILER_H
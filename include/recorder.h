@@ -0,0 +1,49 @@
+#ifndef ATLAS_RECORDER_H
+#define ATLAS_RECORDER_H
+
+#include "frame.h"
+#include "jobs.h"
+#include <atomic>
+
+namespace Atlas {
+    namespace Backend {
+        // Splits the draws of a subpass into batches that run as jobs. Each batch is recorded into a
+        // secondary command buffer from its worker's own pool, and the primary executes them in order
+        struct SubpassRecorder {
+            // Records draws [first, first + count) into a secondary command buffer that has already begun
+            // Called concurrently, once per batch, on the worker whose index is passed in, with the data
+            // given to record(). A plain function rather than a std::function, so recording a frame never
+            // allocates to hold a closure
+            typedef void (*RecordFunction)(VkCommandBuffer buffer, uint32_t thread_index, uint32_t first, uint32_t count, void* data);
+
+            // The job system's worker indices are used as thread indices, so it must have Device::n_threads workers
+            SubpassRecorder(Device& device, FrameRing& frames, JobSystem& jobs);
+            bool init();
+
+            // Below this many draws per batch, the draws are split into fewer batches
+            uint32_t min_draws_per_batch;
+
+            // Must be called from worker 0. The primary must be inside the given subpass, begun with
+            // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+            bool record(VkCommandBuffer primary, const RenderPass& renderpass, uint32_t subpass, VkFramebuffer framebuffer, uint32_t n_draws, RecordFunction record_draws, void* data);
+
+        protected:
+            static void record_batch(uint32_t worker_index, const Job& job);
+
+            Device& m_device;
+            FrameRing& m_frames;
+            JobSystem& m_jobs;
+
+            // The subpass being recorded; only written while no batch is running
+            VkCommandBufferInheritanceInfo m_inheritance;
+            RecordFunction m_record_draws;
+            void* m_record_data;
+            uint32_t m_batch_size;
+            // Indexed by batch
+            std::vector<VkCommandBuffer> m_secondaries;
+            std::atomic<bool> m_failed;
+        };
+    }
+}
+
+#endif // ATLAS_RECORDER_H
@@ -0,0 +1,52 @@
+#ifndef ATLAS_SPAN_H
+#define ATLAS_SPAN_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace Atlas {
+    // Read-only view of elements stored somewhere else, for parameters that are only looked at during the call
+    // Converts from vectors, arrays and pointer + count, so callers don't have to build a
+    // container (and allocate) just to pass a few handles. Don't keep one around after the call returns
+    template <typename T>
+    struct Span {
+        Span()
+            : m_data(nullptr), m_size(0)
+        { }
+        Span(const T* data, size_t size)
+            : m_data(data), m_size(size)
+        { }
+        Span(const std::vector<T>& vector)
+            : m_data(vector.data()), m_size(vector.size())
+        { }
+        template <size_t N>
+        Span(const T (&array)[N])
+            : m_data(array), m_size(N)
+        { }
+
+        inline const T* data() const {
+            return m_data;
+        }
+        inline size_t size() const {
+            return m_size;
+        }
+        inline bool empty() const {
+            return (m_size == 0);
+        }
+        inline const T* begin() const {
+            return m_data;
+        }
+        inline const T* end() const {
+            return m_data + m_size;
+        }
+        inline const T& operator[](size_t index) const {
+            return m_data[index];
+        }
+
+    protected:
+        const T* m_data;
+        size_t m_size;
+    };
+}
+
+#endif // ATLAS_SPAN_H
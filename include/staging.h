@@ -0,0 +1,77 @@
+#ifndef ATLAS_STAGING_H
+#define ATLAS_STAGING_H
+
+#include "backend.h"
+
+namespace Atlas {
+    namespace Backend {
+        struct StagingAllocation {
+            VkBuffer buffer;
+            // Offset into buffer; pass it as the dynamic offset of uniform buffers
+            VkDeviceSize offset;
+            VkDeviceSize size;
+            // Persistently mapped; write to it, then flush the ring before the GPU reads it
+            void* data;
+        };
+
+        // A large, persistently mapped buffer handed out as aligned sub-allocations. Each allocation is
+        // tagged with a serial (e.g. a frame serial), and reclaim() frees everything up to a serial once
+        // the GPU is done with it. Nothing is allocated from the driver after init()
+        struct StagingRing {
+            StagingRing(Device& device);
+            ~StagingRing();
+            bool init();
+
+            // Set before calling init(). The size is rounded up to a multiple of 4 KiB
+            VkDeviceSize size;
+            VkBufferUsageFlags usage;
+
+            // Serials must never decrease between calls. Fails if the ring is too full; reclaim and retry
+            bool allocate(VkDeviceSize allocation_size, VkDeviceSize alignment, uint64_t serial, StagingAllocation& allocation);
+            // Frees every allocation whose serial is less than or equal to the given one
+            void reclaim(uint64_t completed_serial);
+            // Flushes everything written since the last flush in at most two ranges
+            // Does nothing on coherent memory. Call before submitting work that reads the allocations
+            bool flush();
+
+            inline VkBuffer vk() const {
+                return m_buffer;
+            }
+            inline VkDeviceSize get_used_size() const {
+                return static_cast<VkDeviceSize>(m_head - m_tail);
+            }
+            inline bool is_coherent() const {
+                return m_coherent;
+            }
+
+        protected:
+            Device& m_device;
+            VkBuffer m_buffer;
+            VkMappedMemoryRange m_memory;
+            uint8_t* m_data;
+            bool m_coherent;
+            VkDeviceSize m_atom_size;
+
+            // Positions only ever increase; the offset in the buffer is the position modulo size
+            uint64_t m_head;
+            uint64_t m_tail;
+            uint64_t m_flushed;
+            // End position of the last allocation of each serial still in use, oldest first
+            struct Marker {
+                uint64_t serial;
+                uint64_t end;
+            };
+            // A ring rather than a deque, so that cycling through frames doesn't allocate; it only grows
+            // when more serials are in flight than ever before
+            void push_marker(const Marker& marker);
+            inline Marker& get_marker(size_t index) {
+                return m_markers[(m_first_marker + index) % m_markers.size()];
+            }
+            std::vector<Marker> m_markers;
+            size_t m_first_marker;
+            size_t m_n_markers;
+        };
+    }
+}
+
+#endif // ATLAS_STAGING_H
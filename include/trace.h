@@ -0,0 +1,65 @@
+#ifndef ATLAS_TRACE_H
+#define ATLAS_TRACE_H
+
+// CPU instrumentation, written out as Chrome trace_event JSON (open it in chrome://tracing or Perfetto)
+// Everything here compiles out unless ATLAS_TRACE_ENABLED is defined (the ATLAS_TRACE CMake option)
+//
+//  ATLAS_TRACE_ZONE("name");            times the rest of the enclosing scope; name must be a string literal
+//  ATLAS_TRACE_BEGIN_CAPTURE();         starts recording zones, discarding any previous capture
+//  ATLAS_TRACE_END_CAPTURE("out.json"); stops recording and writes the capture
+
+#ifdef ATLAS_TRACE_ENABLED
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+namespace Atlas {
+    namespace Trace {
+        void begin_capture();
+        bool end_capture(const std::string& path);
+
+        // Nanoseconds on a monotonic clock
+        uint64_t now();
+        // Appends a complete zone to the calling thread's buffer. Lock-free; drops the zone if the buffer is full
+        void record(const char* name, uint64_t begin, uint64_t end);
+
+        extern std::atomic<bool> capturing;
+        inline bool is_capturing() {
+            return capturing.load(std::memory_order_relaxed);
+        }
+
+        struct Zone {
+            Zone(const char* name)
+                : m_name(name), m_active(is_capturing()), m_begin(m_active ? now() : 0)
+            { }
+            ~Zone() {
+                if (m_active)
+                    record(m_name, m_begin, now());
+            }
+            Zone(const Zone&) = delete;
+            Zone& operator=(const Zone&) = delete;
+
+        protected:
+            const char* m_name;
+            bool m_active;
+            uint64_t m_begin;
+        };
+    }
+}
+
+#define ATLAS_TRACE_CONCAT_(a, b) a##b
+#define ATLAS_TRACE_CONCAT(a, b) ATLAS_TRACE_CONCAT_(a, b)
+#define ATLAS_TRACE_ZONE(name) ::Atlas::Trace::Zone ATLAS_TRACE_CONCAT(atlas_trace_zone_, __LINE__)(name)
+#define ATLAS_TRACE_BEGIN_CAPTURE() ::Atlas::Trace::begin_capture()
+#define ATLAS_TRACE_END_CAPTURE(path) ::Atlas::Trace::end_capture(path)
+
+#else
+
+#define ATLAS_TRACE_ZONE(name) do {} while (0)
+#define ATLAS_TRACE_BEGIN_CAPTURE() do {} while (0)
+#define ATLAS_TRACE_END_CAPTURE(path) do {} while (0)
+
+#endif // ATLAS_TRACE_ENABLED
+
+#endif // ATLAS_TRACE_H
@@ -0,0 +1,116 @@
+#ifndef ATLAS_TRACKER_H
+#define ATLAS_TRACKER_H
+
+#include "backend.h"
+
+namespace Atlas {
+    namespace Backend {
+        // What has been done to a resource (or one image subresource) so far, in submission order
+        struct AccessState {
+            VkImageLayout layout;
+            VkPipelineStageFlags write_stages;
+            VkAccessFlags write_access;
+            // Stages and accesses the last write has been made visible to
+            VkPipelineStageFlags read_stages;
+            VkAccessFlags read_access;
+        };
+
+        // The two halves of a barrier
+        struct AccessTransition {
+            VkPipelineStageFlags src_stages;
+            VkPipelineStageFlags dst_stages;
+            VkAccessFlags src_access;
+            VkAccessFlags dst_access;
+            VkImageLayout old_layout;
+            VkImageLayout new_layout;
+        };
+
+        // Accesses that write; read bits in a source access mask do nothing
+        constexpr VkAccessFlags write_access_mask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+            | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT
+            | VK_ACCESS_MEMORY_WRITE_BIT;
+
+        // Moves state to a new access and fills in the barrier it needs, returning false if it needs none:
+        //  - reads wait for the last write, unless an earlier barrier already made it visible to them
+        //  - writes and layout transitions wait for every access since the last write
+        // Layout is ignored for buffers
+        bool update_access_state(AccessState& state, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout,
+            bool is_write, bool is_image, AccessTransition& transition);
+
+        // Tracks the layout and accesses of each image subresource and buffer registered with it, so callers
+        // ask for the state they need and get the minimal barrier to it. Requests are batched until flush(),
+        // which records all of them as one vkCmdPipelineBarrier:
+        //
+        //  tracker.use_image(src, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        //  tracker.use_image(dst, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, nullptr, true);
+        //  tracker.flush(command_buffer);
+        //  vkCmdBlitImage(command_buffer, src, ..., dst, ...);
+        //
+        // States follow the order commands are recorded in, which has to be the order they're submitted in,
+        // so use one tracker per queue and record from one thread. Request each subresource at most once per
+        // batch. Not thread safe
+        struct ResourceTracker {
+            ResourceTracker();
+
+            // The resource starts out in the given state; stages left at 0 mean earlier writes are already
+            // visible. Remove resources before destroying them
+            void add_image(VkImage image, VkImageAspectFlags aspect, uint32_t n_levels, uint32_t n_layers,
+                VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED, VkPipelineStageFlags stages = 0, VkAccessFlags access = 0);
+            void add_buffer(VkBuffer buffer, VkPipelineStageFlags stages = 0, VkAccessFlags access = 0);
+            void remove_image(VkImage image);
+            void remove_buffer(VkBuffer buffer);
+
+            // Requests a state for the subresources in range (all of them if it's null); whether it writes
+            // comes from the access mask. discard throws the current contents away, transitioning from UNDEFINED
+            void use_image(VkImage image, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout,
+                const VkImageSubresourceRange* range = nullptr, bool discard = false);
+            void use_buffer(VkBuffer buffer, VkPipelineStageFlags stages, VkAccessFlags access);
+            // For state changed by something the tracker didn't see, e.g. a render pass's final layout.
+            // Doesn't record a barrier
+            void set_image_state(VkImage image, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout,
+                const VkImageSubresourceRange* range = nullptr);
+
+            // Records the pending barriers, if any
+            void flush(VkCommandBuffer command_buffer);
+            inline bool has_pending() const {
+                return (m_src_stages != 0);
+            }
+
+            // Requests made and vkCmdPipelineBarrier calls recorded so far, for checking that batching pays off
+            inline uint64_t get_n_requests() const {
+                return m_n_requests;
+            }
+            inline uint64_t get_n_barriers() const {
+                return m_n_barriers;
+            }
+
+        protected:
+            struct TrackedImage {
+                VkImageAspectFlags aspect;
+                uint32_t n_levels;
+                uint32_t n_layers;
+                // Indexed by level * n_layers + layer
+                std::vector<AccessState> states;
+            };
+
+            TrackedImage* find_image(VkImage image);
+            // Queues a barrier for a run of layers in one level, extending the last barrier if it's the same
+            // run one level up
+            void push_image_barrier(VkImage image, const TrackedImage& tracked, uint32_t level, uint32_t layer, uint32_t n_layers, const AccessTransition& transition);
+
+            std::unordered_map<VkImage, TrackedImage> m_images;
+            std::unordered_map<VkBuffer, AccessState> m_buffers;
+
+            // The pending batch
+            VkPipelineStageFlags m_src_stages;
+            VkPipelineStageFlags m_dst_stages;
+            VkMemoryBarrier m_memory_barrier;
+            std::vector<VkImageMemoryBarrier> m_image_barriers;
+
+            uint64_t m_n_requests;
+            uint64_t m_n_barriers;
+        };
+    }
+}
+
+#endif // ATLAS_TRACKER_H
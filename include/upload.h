@@ -0,0 +1,110 @@
+#ifndef ATLAS_UPLOAD_H
+#define ATLAS_UPLOAD_H
+
+#include "frame.h"
+#include "staging.h"
+#include <mutex>
+
+namespace Atlas {
+    namespace Backend {
+        // Identifies a flushed batch of uploads. Tickets increase by one with every flush; 0 is never issued
+        typedef uint64_t UploadTicket;
+
+        // Streams buffer and image data through a persistently mapped staging ring, copying on the transfer
+        // queue (a dedicated one if the device has it) so uploads don't stall the universal queue.
+        // Uploads are batched until flush(); the universal queue then takes ownership of them in acquire().
+        // Every method may be called from any thread
+        struct UploadManager {
+            UploadManager(Device& device);
+            ~UploadManager();
+            bool init();
+
+            // Set before calling init()
+            VkDeviceSize staging_size;
+            // More batches are added if flushes get this far ahead of acquire() or of threads in wait()
+            uint32_t max_batches_in_flight;
+
+            // The data is copied to staging before returning, so the caller can free it right away
+            // dst_stages and dst_access describe how the universal queue uses the buffer afterwards
+            bool upload_buffer(VkBuffer buffer, VkDeviceSize offset, const void* data, VkDeviceSize size, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access);
+            // Uploads tightly packed texels into one mip level of the image. The previous contents of that
+            // mip level (for the given layers) are discarded, and it ends up in final_layout
+            bool upload_image(VkImage image, const VkImageSubresourceLayers& subresource, VkOffset3D offset, VkExtent3D extent, const void* data, VkDeviceSize size, VkImageLayout final_layout, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access);
+
+            // Submits everything uploaded since the last flush to the transfer queue
+            // Returns its ticket, the previous ticket if there was nothing to submit, or 0 on failure
+            UploadTicket flush();
+            // Records the universal queue's half of the ownership transfers of every flushed batch into the
+            // command buffer, and makes the current frame wait on those batches. Call it once per frame, in a
+            // command buffer submitted before anything that uses the uploads
+            bool acquire(FrameRing& frames, VkCommandBuffer universal_buffer);
+
+            // True once the ticket's batch has finished executing on the transfer queue
+            bool is_complete(UploadTicket ticket);
+            // Doesn't hold up other threads' uploads while it blocks
+            bool wait(UploadTicket ticket, uint64_t timeout = std::numeric_limits<uint64_t>::max());
+
+        protected:
+            struct UploadBatch {
+                VkCommandPool pool;
+                VkCommandBuffer buffer;
+                // Reset when the batch is reused rather than when it retires, since wait() may still be waiting on it
+                VkFence fence;
+                // Signaled by the batch's submission; acquire() makes the universal queue wait on it
+                VkSemaphore semaphore;
+                UploadTicket ticket;
+                // Union of the dst_stages of every upload in the batch
+                VkPipelineStageFlags dst_stages;
+                // Universal queue halves of the ownership transfers, recorded in acquire()
+                std::vector<VkBufferMemoryBarrier> acquire_buffer_barriers;
+                std::vector<VkImageMemoryBarrier> acquire_image_barriers;
+                // Threads blocked on the fence in wait(), without the lock
+                uint32_t n_waiters;
+                bool recording;
+                bool submitted;
+                bool needs_acquire;
+            };
+
+            bool init_batch(UploadBatch& batch);
+            // Returns the batch being recorded, beginning one if there isn't one. If the next batch in the ring
+            // can't be reused yet, a new one is inserted in its place
+            UploadBatch* get_recording_batch();
+            // Reserves staging memory, flushing and retiring batches if the ring is full
+            uint8_t* allocate_staging(VkDeviceSize size, VkDeviceSize& offset);
+            bool submit(UploadBatch& batch);
+            bool retire(UploadBatch& batch, uint64_t timeout);
+            // Retires every batch that has completed, without blocking
+            bool poll();
+            // Null if no batch is in flight
+            UploadBatch* get_oldest_submitted_batch();
+
+            Device& m_device;
+            std::mutex m_mutex;
+            // True if the transfer queue belongs to a different family from the universal queue
+            bool m_transfers_ownership;
+
+            // Allocations are tagged with the ticket of the batch they belong to
+            StagingRing m_staging;
+            VkDeviceSize m_staging_alignment;
+
+            // Batches are used in ring order, so starting at m_batch_index visits them from oldest to newest
+            std::vector<UploadBatch> m_batches;
+            uint32_t m_batch_index;
+            UploadTicket m_next_ticket;
+            UploadTicket m_completed_ticket;
+            // Transfer queue halves of the ownership transfers of the batch being recorded
+            std::vector<VkBufferMemoryBarrier> m_release_buffer_barriers;
+            std::vector<VkImageMemoryBarrier> m_release_image_barriers;
+
+            // Semaphores handed to a frame by acquire() can't be signaled again until that frame retires
+            struct WaitedSemaphore {
+                VkSemaphore semaphore;
+                uint64_t frame_serial;
+            };
+            std::vector<WaitedSemaphore> m_waited_semaphores;
+            std::vector<VkSemaphore> m_free_semaphores;
+        };
+    }
+}
+
+#endif // ATLAS_UPLOAD_H
@@ -17,6 +17,8 @@
 #undef min
 #undef max
 
+#include "span.h"
+
 namespace Atlas {
     namespace Backend {
         struct Instance;
@@ -28,16 +30,18 @@ namespace Atlas {
         //
         // Generic window stuff
         // TODO: expand
-        // void set_client_area(uint32_t width, uint32_t height)
         //
 
         Window(const Backend::Instance& instance, const std::string& name, uint32_t width, uint32_t height);
         Window(const Backend::Instance& instance, uint32_t physical_device_index, const std::string& name, uint32_t width, uint32_t height);
         ~Window();
         bool init();
-        bool init_framebuffers(const Backend::RenderPass& renderpass, const std::vector<VkImageView>& attachments = {});
+        bool init_framebuffers(const Backend::RenderPass& renderpass, Span<VkImageView> attachments = {});
         void close();
 
+        // Asks for a new client area size; the surface is flagged for rebuilding once it takes effect
+        bool set_client_area(uint32_t width, uint32_t height);
+
         bool set_fullscreen(bool full);
         inline bool get_fullscreen() const {
             return (m_flags & current_fullscreen);
@@ -65,20 +69,38 @@ namespace Atlas {
             set_vsync(!get_vsync());
         }
 
+        // Render without a display server. Must be called before init()
+        // Presents through VK_EXT_headless_surface when the instance supports it,
+        // and otherwise cycles through offscreen images standing in for the swapchain
+        inline void set_headless(bool enable) {
+            if (enable)
+                m_flags |= headless;
+            else
+                m_flags &= (~headless);
+        }
+        inline bool is_headless() const {
+            return (m_flags & headless);
+        }
+
         //
         // Presentation
         //
-        bool present(const std::vector<VkSemaphore> semaphores_wait_before_presenting = {});
+        // Waits on at most max_present_wait_semaphores semaphores
+        bool present(Span<VkSemaphore> semaphores_wait_before_presenting = {});
+        static constexpr uint32_t max_present_wait_semaphores = 8;
 
         // Probably asynchronous, but the spec doesn't guarantee it
-        // Returns 
-        bool acquire_next_frame(uint64_t timeout = std::numeric_limits<uint64_t>::max(), VkFence fence_signal_when_done = VK_NULL_HANDLE);
+        // Signals the window's own image-available semaphore unless another one is given
+        bool acquire_next_frame(uint64_t timeout = std::numeric_limits<uint64_t>::max(), VkFence fence_signal_when_done = VK_NULL_HANDLE, VkSemaphore semaphore_signal_when_done = VK_NULL_HANDLE);
 
 
         inline bool should_rebuild() const {
             return (m_flags & surface_changed);
         }
-        bool rebuild(const Backend::RenderPass& renderpass, const std::vector<VkImageView>& attachments = {});
+        bool rebuild(const Backend::RenderPass& renderpass, Span<VkImageView> attachments = {});
+        // Recreates the swapchain without framebuffers, for renderers that make their own (e.g. a RenderGraph
+        // importing get_color_image_view() and get_depth_image_view())
+        bool rebuild();
 
 
         inline uint32_t get_frame_index() const {
@@ -110,6 +132,18 @@ namespace Atlas {
         inline VkImageView get_depth_image_view() const {
             return m_depth_view;
         }
+        // Framebuffer made by init_framebuffers() or rebuild() for the current swapchain image
+        inline VkFramebuffer get_framebuffer() const {
+            return m_framebuffers[m_frame_index];
+        }
+        inline VkExtent2D get_extent() const {
+            return { m_width, m_height };
+        }
+
+        // Size of the depth buffer if it's in lazily allocated memory, i.e. the memory that was saved
+        inline VkDeviceSize get_lazy_depth_bytes() const {
+            return m_lazy_depth_bytes;
+        }
 
         inline VkFormat get_depth_format() const {
             return m_depth_format;
@@ -130,7 +164,20 @@ namespace Atlas {
         void shutdown_xcb();
 #endif
         bool init_surface();
+        bool init_offscreen_target();
         bool init_swapchain(Backend::Device* device);
+        bool init_offscreen_images(VkExtent2D extent);
+        // Creates the depth buffer and the image-available semaphores
+        bool init_frame_resources(VkExtent2D extent);
+        inline bool uses_offscreen_images() const {
+            return (m_flags & headless) && !m_surface;
+        }
+
+        // Hands the current swapchain resources over to a fence which signals once all the work
+        // already submitted is done with them, instead of waiting for the device to go idle
+        bool retire_swapchain();
+        // Destroys the retired resources whose fence has signaled
+        void release_retired_swapchains(bool wait);
 
         const std::string m_name;
         uint32_t m_width, m_height;
@@ -163,10 +210,25 @@ namespace Atlas {
         std::vector<VkImageView> m_image_views;
         VkImage m_depth;
         VkImageView m_depth_view;
+        VkDeviceSize m_lazy_depth_bytes;
         std::vector<VkSemaphore> m_image_available_semaphores;
 
         std::vector<VkFramebuffer> m_framebuffers;
 
+        struct RetiredSwapchain {
+            // Signaled by the universal queue and, if it's a different queue, the present queue
+            VkFence fences[2];
+            uint32_t n_fences;
+            VkSwapchainKHR swapchain;
+            // Only owned by the window for offscreen images; otherwise released with the swapchain
+            std::vector<VkImage> images;
+            std::vector<VkImageView> image_views;
+            std::vector<VkSemaphore> semaphores;
+            VkImage depth;
+            VkImageView depth_view;
+        };
+        std::vector<RetiredSwapchain> m_retired_swapchains;
+
 
         // Surface functions
         PFN_vkDestroySurfaceKHR vkDestroySurfaceKHR;
@@ -179,6 +241,9 @@ namespace Atlas {
         PFN_vkCreateWin32SurfaceKHR vkCreateWin32SurfaceKHR;
 #else
         PFN_vkCreateXcbSurfaceKHR vkCreateXcbSurfaceKHR;
+#endif
+#ifdef VK_EXT_headless_surface
+        PFN_vkCreateHeadlessSurfaceEXT vkCreateHeadlessSurfaceEXT;
 #endif
         // Swapchain functions
         PFN_vkCreateSwapchainKHR vkCreateSwapchainKHR;
@@ -187,9 +252,6 @@ namespace Atlas {
         PFN_vkQueuePresentKHR vkQueuePresentKHR;
         PFN_vkDestroyImageView vkDestroyImageView;
         PFN_vkDestroySwapchainKHR vkDestroySwapchainKHR;
-        // Framebuffer functions
-        PFN_vkCreateFramebuffer vkCreateFramebuffer;
-        PFN_vkDestroyFramebuffer vkDestroyFramebuffer;
         // Semaphore functions
         PFN_vkCreateSemaphore vkCreateSemaphore;
         PFN_vkDestroySemaphore vkDestroySemaphore;
@@ -201,6 +263,7 @@ namespace Atlas {
         static constexpr uint32_t surface_changed = 1 << 3;
         static constexpr uint32_t vsync = 1 << 4;
         static constexpr uint32_t resizing = 1 << 5;
+        static constexpr uint32_t headless = 1 << 6;
         // Used in update_fullscreen
         static constexpr uint32_t _NET_WM_STATE_REMOVE = 0; // Remove/unset property
         static constexpr uint32_t _NET_WM_STATE_ADD = 1;    // Add/set property
@@ -1,15 +1,15 @@
 #define VMA_IMPLEMENTATION
 #include <algorithm>
 #include "backend.h"
+#include "cache.h"
+#include "log.h"
+#include "trace.h"
 #include <stdio.h>
 #include <assert.h>
 #include <chrono>
 
 using namespace Atlas;
 
-std::chrono::high_resolution_clock::time_point g_startup;
-uint32_t g_hr=0, g_min=0, g_sec=0, g_ms=0;
-
 void Backend::log(const std::string& message) {
     Instance::default_dbg_callback(VK_DEBUG_REPORT_DEBUG_BIT_EXT, VK_DEBUG_REPORT_OBJECT_TYPE_UNKNOWN_EXT, 0, 0, 0, "App", message.c_str(), nullptr);
 }
@@ -22,142 +22,136 @@ void Backend::error(const std::string& message) {
     Instance::default_dbg_callback(VK_DEBUG_REPORT_ERROR_BIT_EXT, VK_DEBUG_REPORT_OBJECT_TYPE_UNKNOWN_EXT, 0, 0, 0, "App", message.c_str(), nullptr);
 }
 
-bool Atlas::validate(VkResult result) {
-    auto duration = std::chrono::high_resolution_clock::now() - g_startup;
-    g_hr = std::chrono::duration_cast<std::chrono::hours>(duration).count();
-    g_min = std::chrono::duration_cast<std::chrono::minutes>(duration).count() - g_hr*60;
-    g_sec = std::chrono::duration_cast<std::chrono::seconds>(duration).count() - g_hr*360 - g_min*60;
-    g_ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() - g_hr*360000 - g_min*60000 - g_sec*1000;
+void Backend::write_json_string(FILE* file, const char* string) {
+    fputc('"', file);
+    for (const char* c = string; *c; ++c) {
+        switch (*c) {
+            case '"':  fputs("\\\"", file); break;
+            case '\\': fputs("\\\\", file); break;
+            case '\n': fputs("\\n", file); break;
+            case '\r': fputs("\\r", file); break;
+            case '\t': fputs("\\t", file); break;
+            default:
+                if (static_cast<unsigned char>(*c) < 0x20)
+                    fprintf(file, "\\u%04x", static_cast<unsigned char>(*c));
+                else
+                    fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
 
+bool Atlas::report_result(VkResult result) {
+    const char* description = nullptr;
+    bool usable = false;
     switch (result) {
     case VK_SUCCESS:
     case VK_EVENT_SET:
     case VK_EVENT_RESET:
         return true;
     case VK_NOT_READY:
-        printf("%02d:%02d:%02d.%03d [*] Warning: A fence or query not yet completed.\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stdout);
-        return true;
+        description = "A fence or query not yet completed.";
+        usable = true;
+        break;
     case VK_TIMEOUT:
-        printf("%02d:%02d:%02d.%03d [*] Warning: A wait operation has not completed in the specified time.\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stdout);
-        return true;
+        description = "A wait operation has not completed in the specified time.";
+        usable = true;
+        break;
     case VK_INCOMPLETE:
-        printf("%02d:%02d:%02d.%03d [*] Warning: A return array was too small for the result.\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stdout);
-        return true;
+        description = "A return array was too small for the result.";
+        usable = true;
+        break;
     case VK_SUBOPTIMAL_KHR:
-        printf("%02d:%02d:%02d.%03d [*] Warning: A swapchain no longer matches the surface properties exactly, but can still be used to present successfully.\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stdout);
-        return true;
+        description = "A swapchain no longer matches the surface properties exactly, but can still be used to present successfully.";
+        usable = true;
+        break;
     case VK_ERROR_OUT_OF_HOST_MEMORY:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A host memory allocation has failed!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A host memory allocation has failed!";
+        break;
     case VK_ERROR_OUT_OF_DEVICE_MEMORY:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A device memory allocation has failed!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A device memory allocation has failed!";
+        break;
     case VK_ERROR_INITIALIZATION_FAILED:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: Initialization of an object could not be completed for implementation-specific reasons!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "Initialization of an object could not be completed for implementation-specific reasons!";
+        break;
     case VK_ERROR_DEVICE_LOST:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: The logical or physical device has been lost!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "The logical or physical device has been lost!";
+        break;
     case VK_ERROR_MEMORY_MAP_FAILED:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: Mapping of a memory object has failed!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "Mapping of a memory object has failed!";
+        break;
     case VK_ERROR_LAYER_NOT_PRESENT:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A requested layer is not present or could not be loaded!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A requested layer is not present or could not be loaded!";
+        break;
     case VK_ERROR_EXTENSION_NOT_PRESENT:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A requested extension is not supported!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A requested extension is not supported!";
+        break;
     case VK_ERROR_FEATURE_NOT_PRESENT:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A requested feature is not supported!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A requested feature is not supported!";
+        break;
     case VK_ERROR_INCOMPATIBLE_DRIVER:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: The requested version of Vulkan is not supported by the driver or is otherwise incompatible for implementation-sepcific reasons!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "The requested version of Vulkan is not supported by the driver or is otherwise incompatible for implementation-sepcific reasons!";
+        break;
     case VK_ERROR_TOO_MANY_OBJECTS:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: Too many objects of the type have already been created!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "Too many objects of the type have already been created!";
+        break;
     case VK_ERROR_FORMAT_NOT_SUPPORTED:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A requested format is not supported on this device!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A requested format is not supported on this device!";
+        break;
     case VK_ERROR_FRAGMENTED_POOL:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A requested pool allocation has failed due to fragmentation of the pool's memory!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A requested pool allocation has failed due to fragmentation of the pool's memory!";
+        break;
     case VK_ERROR_SURFACE_LOST_KHR:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A surface is no longer available!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A surface is no longer available!";
+        break;
     case VK_ERROR_NATIVE_WINDOW_IN_USE_KHR:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: The requested window is already connected to a VkSurfaceKHR, or to some other non-Vulkan API!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "The requested window is already connected to a VkSurfaceKHR, or to some other non-Vulkan API!";
+        break;
     case VK_ERROR_OUT_OF_DATE_KHR:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: A surface has changed in such a way that it is no longer compatible with the swapchain, and further presentation requests using the swapchain will fail! Applications must query the new surface properties and recreate their swapchain if they wish to continue presenting to the surface.\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "A surface has changed in such a way that it is no longer compatible with the swapchain, and further presentation requests using the swapchain will fail! Applications must query the new surface properties and recreate their swapchain if they wish to continue presenting to the surface.";
+        break;
     case VK_ERROR_INCOMPATIBLE_DISPLAY_KHR:
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error: The display used by a swapchain does not use the same presentable image layout, or is incompatible in a way that prevents sharing an image!\n", g_hr, g_min, g_sec, g_ms);
-        fflush(stderr);
-        return false;
+        description = "The display used by a swapchain does not use the same presentable image layout, or is incompatible in a way that prevents sharing an image!";
+        break;
+    default:
+        // Newer than these headers; success codes are positive and errors negative
+        description = "Unrecognized result code.";
+        usable = (result > 0);
+        break;
     }
+
+    // Queued for the logger thread, so a failing call on a render thread doesn't wait on stdio
+    if (usable) {
+#if ATLAS_LOG_LEVEL >= ATLAS_LOG_LEVEL_WARNING
+        Log::write(VK_DEBUG_REPORT_WARNING_BIT_EXT, "VkResult", result, description);
+#endif
+    }
+    else {
+#if ATLAS_LOG_LEVEL >= ATLAS_LOG_LEVEL_ERROR
+        // Errors are often the last thing before a crash, so wait for them to be printed
+        Log::write(VK_DEBUG_REPORT_ERROR_BIT_EXT, "VkResult", result, description);
+        Log::flush();
+#endif
+    }
+    (void)description;
+    return usable;
 }
 
 
 using namespace Backend;
 
 VkBool32 Instance::default_dbg_callback(VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objType, uint64_t srcObject, size_t location, int32_t msgCode, const char* pLayerPrefix, const char* pMsg, void* pUserData) {
-    auto duration = std::chrono::high_resolution_clock::now() - g_startup;
-    g_hr = std::chrono::duration_cast<std::chrono::hours>(duration).count();
-    g_min = std::chrono::duration_cast<std::chrono::minutes>(duration).count() - g_hr*60;
-    g_sec = std::chrono::duration_cast<std::chrono::seconds>(duration).count() - g_hr*360 - g_min*60;
-    g_ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() - g_hr*360000 - g_min*60000 - g_sec*1000;
-
-    
-    // Select prefix depending on flags passed to the callback
-    // Note that multiple flags may be set for a single validation message
-    std::string desc;
-
-    // Diagnostic info from the Vulkan loader and layers
-    // Usually not helpful in terms of API usage, but may help to debug layer and loader problems 
-    if (flags & VK_DEBUG_REPORT_DEBUG_BIT_EXT) {
-        desc += " Diagnostics";
-    }
-    // May indicate sub-optimal usage of the API
-    if (flags & VK_DEBUG_REPORT_PERFORMANCE_WARNING_BIT_EXT) {
-        desc += " Performance Warning";
-    }
-    // Warnings may hint at unexpected / non-spec API usage
-    else if (flags & VK_DEBUG_REPORT_WARNING_BIT_EXT) {
-        desc += " Warning";
-    }
-    // Informal messages that may become handy during debugging
-    if (flags & VK_DEBUG_REPORT_INFORMATION_BIT_EXT) {
-        desc += " Info";
-    }
-
-    if (flags & VK_DEBUG_REPORT_ERROR_BIT_EXT) {
-        fprintf(stderr, "%02d:%02d:%02d.%03d [!] Error (%s, code %d): %s\n", g_hr, g_min, g_sec, g_ms, pLayerPrefix, msgCode, pMsg);
-        //fflush(stderr);
-    }
-    else {
-        printf("%02d:%02d:%02d.%03d [*]%s (%s, code %d): %s\n", g_hr, g_min, g_sec, g_ms, desc.c_str(), pLayerPrefix, msgCode, pMsg);
-        //fflush(stdout);
-    }
+    // Messages below the compile-time log level are dropped before doing any work
+    const int level = (flags & VK_DEBUG_REPORT_ERROR_BIT_EXT) ? ATLAS_LOG_LEVEL_ERROR
+        : (flags & (VK_DEBUG_REPORT_WARNING_BIT_EXT | VK_DEBUG_REPORT_PERFORMANCE_WARNING_BIT_EXT)) ? ATLAS_LOG_LEVEL_WARNING
+        : ATLAS_LOG_LEVEL_DEBUG;
+    if (level > ATLAS_LOG_LEVEL)
+        return VK_FALSE;
+
+    // Formatted and printed on the logger thread; errors are waited for, in case a crash follows
+    Log::write(flags, pLayerPrefix, msgCode, pMsg);
+    if (flags & VK_DEBUG_REPORT_ERROR_BIT_EXT)
+        Log::flush();
 
     // The return value of this callback controls whether the Vulkan call that caused
     // the validation message will be aborted or not
@@ -169,11 +163,11 @@ VkBool32 Instance::default_dbg_callback(VkDebugReportFlagsEXT flags, VkDebugRepo
 }
 
 Instance::Instance(const std::string& app_name, uint32_t app_version, ValidationLevel validation_level)
-    : m_dbg_callback(VK_NULL_HANDLE), m_instance(VK_NULL_HANDLE), instance_flags(0), m_validation(validation_level)
+    : m_dbg_callback(VK_NULL_HANDLE), vkGetPhysicalDeviceMemoryProperties2KHR(nullptr), vkGetPhysicalDeviceFeatures2KHR(nullptr), vkGetPhysicalDeviceProperties2KHR(nullptr), m_instance(VK_NULL_HANDLE), instance_flags(0), m_validation(validation_level)
     , m_app_name(app_name), m_app_version(app_version)
 {
-    // Record app startup time
-    g_startup = std::chrono::high_resolution_clock::now();
+    // Messages go through the logger thread while an instance exists, and timestamps count from here
+    Log::start();
 
     // Enumerate layers
     uint32_t n_supported_layers;
@@ -223,6 +217,11 @@ Instance::Instance(const std::string& app_name, uint32_t app_version, Validation
 
     if (is_extension_supported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME))
         enabled_extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+#ifdef VK_EXT_headless_surface
+    // Lets headless windows keep a real swapchain
+    if (is_extension_supported(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME))
+        enabled_extensions.push_back(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+#endif
 
     // Ensure that the debug report extension uses debug layers to intercept calls
     m_extension_providers[VK_EXT_DEBUG_REPORT_EXTENSION_NAME].layer_name = "VK_LAYER_LUNARG_standard_validation";
@@ -233,6 +232,7 @@ Instance::~Instance() {
         vkDestroyDebugReportCallbackEXT(m_instance, m_dbg_callback, NULL);
     if (m_instance)
         vkDestroyInstance(m_instance, NULL);
+    Log::stop();
 }
 
 bool Instance::init() {
@@ -241,7 +241,9 @@ bool Instance::init() {
         if (pair.second.layer_name != NULL) {
             // Loader eliminates duplicates, so don't bother to check
             m_enabled_layers.push_back(pair.second.layer_name);
-            printf("Enabled layer %s for extension %s\n", pair.second.layer_name, pair.first.c_str());
+            char message[256];
+            snprintf(message, sizeof(message), "Enabled layer %s for extension %s", pair.second.layer_name, pair.first.c_str());
+            ATLAS_LOG(message);
         }
     }
 
@@ -378,6 +380,10 @@ void Instance::load_func_pointers() {
     vkCreateDebugReportCallbackEXT = reinterpret_cast<PFN_vkCreateDebugReportCallbackEXT>( vkGetInstanceProcAddr(m_instance, "vkCreateDebugReportCallbackEXT") );
     vkDebugReportMessageEXT = reinterpret_cast<PFN_vkDebugReportMessageEXT>( vkGetInstanceProcAddr(m_instance, "vkDebugReportMessageEXT") );
     vkDestroyDebugReportCallbackEXT = reinterpret_cast<PFN_vkDestroyDebugReportCallbackEXT>( vkGetInstanceProcAddr(m_instance, "vkDestroyDebugReportCallbackEXT") );
+    // Physical device queries
+    vkGetPhysicalDeviceMemoryProperties2KHR = reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>( vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceMemoryProperties2KHR") );
+    vkGetPhysicalDeviceFeatures2KHR = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>( vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceFeatures2KHR") );
+    vkGetPhysicalDeviceProperties2KHR = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>( vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceProperties2KHR") );
 
     //
 }
@@ -410,7 +416,11 @@ Device::Device(Window& window)
     , m_device(VK_NULL_HANDLE), m_universal_queue(VK_NULL_HANDLE)
     , m_compute_queue(VK_NULL_HANDLE), m_transfer_queue(VK_NULL_HANDLE)
     , m_queue_flags(0), m_allocator(VK_NULL_HANDLE)
-    , command_pool_flags(0), n_threads(1)
+    , m_pipeline_cache(VK_NULL_HANDLE), m_pipeline_cache_warm(false), m_memory_stats(), m_memory_budget_supported(false)
+    , command_pool_flags(0), n_threads(1), pipeline_cache_dir("."), memory_budget_warning(0.9f)
+    , vkCreateDescriptorUpdateTemplateKHR(nullptr), vkDestroyDescriptorUpdateTemplateKHR(nullptr), vkUpdateDescriptorSetWithTemplateKHR(nullptr)
+    , m_current_serial(0), m_retired_serial(0), m_bindless_supported(false), m_max_bindless_images(0), m_max_bindless_buffers(0)
+    , m_lazy_allocation_supported(false)
 {
     uint32_t n_supported_extensions;
     const char* layer_name = NULL;
@@ -434,12 +444,36 @@ Device::Device(Window& window)
         }
     }
 
-    enabled_extensions = {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME
-    };
+    // Headless windows without a surface render to offscreen images instead of a swapchain
+    if (!m_window.uses_offscreen_images() || is_extension_supported(VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
+        enabled_extensions = {
+            VK_KHR_SWAPCHAIN_EXTENSION_NAME
+        };
+    }
+#ifdef VK_EXT_memory_budget
+    // Lets sample_memory_stats() report the driver's budget instead of an estimate
+    if (is_extension_supported(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) && m_window.m_instance.vkGetPhysicalDeviceMemoryProperties2KHR) {
+        enabled_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        m_memory_budget_supported = true;
+    }
+#endif
+    // Lets DescriptorAllocator write whole sets from one block of memory
+    if (is_extension_supported(VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME))
+        enabled_extensions.push_back(VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME);
+#ifdef VK_EXT_descriptor_indexing
+    // For BindlessTable; init() checks the features it needs are there too
+    if (is_extension_supported(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) && is_extension_supported(VK_KHR_MAINTENANCE3_EXTENSION_NAME)
+        && m_window.m_instance.vkGetPhysicalDeviceFeatures2KHR && m_window.m_instance.vkGetPhysicalDeviceProperties2KHR) {
+        enabled_extensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+        enabled_extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+    }
+#endif
 }
 
 bool Device::init() {
+    ATLAS_TRACE_ZONE("Device::init");
+    auto init_start = std::chrono::high_resolution_clock::now();
+
     std::vector<VkDeviceQueueCreateInfo> queue_info;
     const float default_queue_priority = 0.0f;
     VkDeviceQueueCreateInfo queue = {
@@ -539,9 +573,48 @@ bool Device::init() {
         }
     }
     else {
-        // Default to 1 universal queue
+        // Default to 1 universal queue, plus a dedicated transfer queue for streaming if there is one
         queue_info.push_back(queue);
+        if (m_physical_device.queue_families.transfer_count > 0) {
+            m_queue_flags |= transfer_owns_self;
+            m_queue_flags |= transfer_is_dedicated;
+
+            queue.queueFamilyIndex = m_physical_device.queue_families.transfer;
+            queue_info.push_back(queue);
+        }
+    }
+
+#ifdef VK_EXT_descriptor_indexing
+    // Bindless sets are only ever partially written, and get new descriptors while frames using them are in flight
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT, // sType
+        nullptr                                                             // pNext
+        // Filled in by the driver
+    };
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT bindless_features = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT, // sType
+        nullptr                                                             // pNext
+        // Fill rest with 0s
+    };
+    if (is_extension_enabled(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+        VkPhysicalDeviceFeatures2KHR features = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR,   // sType
+            &indexing_features                                  // pNext
+        };
+        m_window.m_instance.vkGetPhysicalDeviceFeatures2KHR(m_physical_device.device, &features);
+        m_bindless_supported = (indexing_features.runtimeDescriptorArray && indexing_features.descriptorBindingPartiallyBound
+            && indexing_features.descriptorBindingUpdateUnusedWhilePending && indexing_features.shaderSampledImageArrayNonUniformIndexing
+            && indexing_features.descriptorBindingSampledImageUpdateAfterBind && indexing_features.descriptorBindingStorageBufferUpdateAfterBind);
     }
+    if (m_bindless_supported) {
+        bindless_features.runtimeDescriptorArray = VK_TRUE;
+        bindless_features.descriptorBindingPartiallyBound = VK_TRUE;
+        bindless_features.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+        bindless_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+        bindless_features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+        bindless_features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+    }
+#endif
 
     VkDeviceCreateInfo device_info = {
         VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,   // sType
@@ -555,9 +628,28 @@ bool Device::init() {
         enabled_extensions.data(),              // ppEnabledExtensionNames
 
     };
+#ifdef VK_EXT_descriptor_indexing
+    if (m_bindless_supported)
+        device_info.pNext = &bindless_features;
+#endif
     VkResult res = vkCreateDevice(m_physical_device.device, &device_info, NULL, &m_device);
     if (!validate(res)) return false;
 
+    if (is_extension_enabled(VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME)) {
+        vkCreateDescriptorUpdateTemplateKHR = reinterpret_cast<PFN_vkCreateDescriptorUpdateTemplateKHR>( vkGetDeviceProcAddr(m_device, "vkCreateDescriptorUpdateTemplateKHR") );
+        vkDestroyDescriptorUpdateTemplateKHR = reinterpret_cast<PFN_vkDestroyDescriptorUpdateTemplateKHR>( vkGetDeviceProcAddr(m_device, "vkDestroyDescriptorUpdateTemplateKHR") );
+        vkUpdateDescriptorSetWithTemplateKHR = reinterpret_cast<PFN_vkUpdateDescriptorSetWithTemplateKHR>( vkGetDeviceProcAddr(m_device, "vkUpdateDescriptorSetWithTemplateKHR") );
+    }
+    init_bindless_limits();
+    m_object_cache.reset(new ObjectCache(*this));
+
+    VkPhysicalDeviceMemoryProperties memory_props;
+    vkGetPhysicalDeviceMemoryProperties(m_physical_device.device, &memory_props);
+    for (uint32_t i = 0; i < memory_props.memoryTypeCount; ++i) {
+        if (memory_props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)
+            m_lazy_allocation_supported = true;
+    }
+
     // Store queues
     vkGetDeviceQueue(m_device, m_physical_device.queue_families.universal, universal_index, &m_universal_queue);
     
@@ -573,6 +665,11 @@ bool Device::init() {
     else
         m_transfer_queue = m_universal_queue;
 
+    // Roles without a dedicated family of their own run on a queue of the universal family
+    m_queue_family_indices[QUEUE_FAMILY_UNIVERSAL] = m_physical_device.queue_families.universal;
+    m_queue_family_indices[QUEUE_FAMILY_COMPUTE] = (m_queue_flags & compute_is_dedicated) ? m_physical_device.queue_families.compute : m_physical_device.queue_families.universal;
+    m_queue_family_indices[QUEUE_FAMILY_TRANSFER] = (m_queue_flags & transfer_is_dedicated) ? m_physical_device.queue_families.transfer : m_physical_device.queue_families.universal;
+
     // The present queue gets stored in the window
     vkGetDeviceQueue(m_device, present_family, present_index, &m_window.m_present_queue);
 
@@ -584,6 +681,7 @@ bool Device::init() {
     res = vmaCreateAllocator(&allocator_info, &m_allocator);
     if (!validate(res)) return false;
 
+    if (!init_pipeline_cache()) return false;
 
     // Create command pools
     VkCommandPoolCreateInfo pool_info = {
@@ -592,10 +690,10 @@ bool Device::init() {
         command_pool_flags                          // flags
     };
 
-    m_command_pools.resize(QUEUE_FAMILY_COUNT);
+    m_command_pools.resize(n_threads * QUEUE_FAMILY_COUNT);
     for (uint32_t i = QUEUE_FAMILY_FIRST; i < QUEUE_FAMILY_COUNT; ++i) {
         for (uint32_t j = 0; j < n_threads; ++j) {
-            pool_info.queueFamilyIndex = m_physical_device.queue_families.index_of[i];
+            pool_info.queueFamilyIndex = m_queue_family_indices[i];
             res = vkCreateCommandPool(m_device, &pool_info, NULL, &m_command_pools[j * QUEUE_FAMILY_COUNT + i]);
             if (!validate(res)) return false;
         }
@@ -607,28 +705,35 @@ bool Device::init() {
     m_window.vkAcquireNextImageKHR = reinterpret_cast<PFN_vkAcquireNextImageKHR>( vkGetDeviceProcAddr(m_device, "vkAcquireNextImageKHR") );
     m_window.vkQueuePresentKHR = reinterpret_cast<PFN_vkQueuePresentKHR>( vkGetDeviceProcAddr(m_device, "vkQueuePresentKHR") );
     m_window.vkCreateSemaphore = reinterpret_cast<PFN_vkCreateSemaphore>( vkGetDeviceProcAddr(m_device, "vkCreateSemaphore") );
-    m_window.vkCreateFramebuffer = reinterpret_cast<PFN_vkCreateFramebuffer>( vkGetDeviceProcAddr(m_device, "vkCreateFramebuffer") );
     // The destroy functions are also stored there, even though they are called in *our* destructor
     // If the window needs to call them in recreate_swapchain, it needs access to them
     m_window.vkDestroyImageView = reinterpret_cast<PFN_vkDestroyImageView>( vkGetDeviceProcAddr(m_device, "vkDestroyImageView") );
     m_window.vkDestroySwapchainKHR = reinterpret_cast<PFN_vkDestroySwapchainKHR>( vkGetDeviceProcAddr(m_device, "vkDestroySwapchainKHR") );
     m_window.vkDestroySemaphore = reinterpret_cast<PFN_vkDestroySemaphore>( vkGetDeviceProcAddr(m_device, "vkDestroySemaphore") );
-    m_window.vkDestroyFramebuffer = reinterpret_cast<PFN_vkDestroyFramebuffer>( vkGetDeviceProcAddr(m_device, "vkDestroyFramebuffer") );
 
     // Oh and make sure to initialize the window's swapchain, now that we have a device
     if (!m_window.init_swapchain(this)) return false;
-    
+
+    // Report startup time so cold and warm pipeline cache launches can be compared
+    auto init_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - init_start);
+    char message[128];
+    snprintf(message, sizeof(message), "Device initialized in %.3f ms (%s pipeline cache)", init_time.count() / 1000.0, m_pipeline_cache_warm ? "warm" : "cold");
+    ATLAS_LOG(message);
+
     return true;
 }
 
 Device::~Device() {
     vkDeviceWaitIdle(m_device);
+    // Swapchains replaced by rebuilds that hadn't been released yet
+    m_window.release_retired_swapchains(true);
+    // Cached objects (including the window's framebuffers) are deferred, so they go with the rest
+    m_object_cache.reset();
+    // Everything is idle, so whatever is still deferred can go
+    for (const auto& object : m_deferred)
+        destroy_object(object);
+    m_deferred.clear();
     // Release the resources that windows can't do themselves (since the device will be invalid before their destructor)
-    for (auto iter = m_window.m_framebuffers.rbegin(); iter != m_window.m_framebuffers.rend(); ++iter) {
-        if (*iter)
-            m_window.vkDestroyFramebuffer(m_device, *iter, nullptr);
-    }
-
     for (auto iter = m_window.m_image_available_semaphores.rbegin(); iter != m_window.m_image_available_semaphores.rend(); ++iter) {
         if (*iter)
             m_window.vkDestroySemaphore(m_device, *iter, nullptr);
@@ -645,12 +750,28 @@ Device::~Device() {
         }
         m_window.vkDestroySwapchainKHR(m_device, m_window.m_swapchain, nullptr);
     }
+    else {
+        // Offscreen images standing in for the swapchain in headless mode
+        for (auto view = m_window.m_image_views.rbegin(); view != m_window.m_image_views.rend(); ++view) {
+            if (*view)
+                m_window.vkDestroyImageView(m_device, *view, NULL);
+        }
+        for (auto image = m_window.m_images.rbegin(); image != m_window.m_images.rend(); ++image) {
+            if (*image)
+                vmaDestroyImage(m_allocator, *image);
+        }
+    }
 
     for (auto iter = m_command_pools.rbegin(); iter != m_command_pools.rend(); ++iter) {
         if (*iter)
             vkDestroyCommandPool(m_device, *iter, NULL);
     }
 
+    if (m_pipeline_cache) {
+        save_pipeline_cache();
+        vkDestroyPipelineCache(m_device, m_pipeline_cache, NULL);
+    }
+
     if (m_allocator)
         vmaDestroyAllocator(m_allocator);
 
@@ -660,10 +781,357 @@ Device::~Device() {
         vkDestroyDevice(m_device, NULL);
 }
 
+bool Device::sample_memory_stats() {
+    ATLAS_TRACE_ZONE("Device::sample_memory_stats");
+    VmaStats stats;
+    vmaCalculateStats(m_allocator, &stats);
+    VkPhysicalDeviceMemoryProperties memory_props;
+    vkGetPhysicalDeviceMemoryProperties(m_physical_device.device, &memory_props);
+
+#ifdef VK_EXT_memory_budget
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT, // sType
+        nullptr                                                         // pNext
+        // Filled in by the driver
+    };
+    if (m_memory_budget_supported) {
+        VkPhysicalDeviceMemoryProperties2KHR memory_props2 = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR,  // sType
+            &budget                                                     // pNext
+        };
+        m_window.m_instance.vkGetPhysicalDeviceMemoryProperties2KHR(m_physical_device.device, &memory_props2);
+    }
+#endif
+
+    m_memory_stats.heaps.resize(memory_props.memoryHeapCount);
+    m_memory_stats.has_budget = m_memory_budget_supported;
+    m_heaps_over_budget.resize(memory_props.memoryHeapCount, false);
+    for (uint32_t i = 0; i < memory_props.memoryHeapCount; ++i) {
+        const VmaStatInfo& info = stats.memoryHeap[i];
+        MemoryHeapStats& heap = m_memory_stats.heaps[i];
+        heap.size = memory_props.memoryHeaps[i].size;
+        heap.device_local = ((memory_props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0);
+        heap.n_blocks = info.AllocationCount;
+        heap.n_allocations = info.SuballocationCount;
+        heap.used_bytes = info.UsedBytes;
+        heap.allocated_bytes = info.UsedBytes + info.UnusedBytes;
+        heap.fragmentation = (info.UnusedBytes > 0) ? (1.0f - static_cast<float>(info.UnusedRangeSizeMax) / info.UnusedBytes) : 0.0f;
+        // Other processes share the heap too, so don't plan on all of it
+        heap.budget = heap.size / 10 * 8;
+        heap.usage = heap.allocated_bytes;
+#ifdef VK_EXT_memory_budget
+        if (m_memory_budget_supported) {
+            heap.budget = budget.heapBudget[i];
+            heap.usage = budget.heapUsage[i];
+        }
+#endif
+
+        const bool over_budget = (heap.usage > heap.budget * memory_budget_warning);
+        if (over_budget && !m_heaps_over_budget[i]) {
+            char message[160];
+            snprintf(message, sizeof(message), "Memory heap %u is at %.1f of %.1f MiB budgeted (%u blocks, %.0f%% fragmented)",
+                i, heap.usage / 1048576.0, heap.budget / 1048576.0, heap.n_blocks, heap.fragmentation * 100.0f);
+            ATLAS_WARNING(message);
+        }
+        m_heaps_over_budget[i] = over_budget;
+    }
+    return true;
+}
+
+bool Device::write_memory_stats_json(const std::string& path, bool detailed) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        ATLAS_WARNING("Could not open " + path + " to write memory stats");
+        return false;
+    }
+    char* stats = nullptr;
+    vmaBuildStatsString(m_allocator, &stats, detailed ? VK_TRUE : VK_FALSE);
+    bool written = (fputs(stats, file) >= 0);
+    vmaFreeStatsString(m_allocator, stats);
+    written &= (fclose(file) == 0);
+    return written;
+}
+
+VkResult Device::submit(VkQueue queue, uint32_t n_submits, const VkSubmitInfo* submits, VkFence fence) {
+    std::lock_guard<std::mutex> lock(m_queue_mutex);
+    return vkQueueSubmit(queue, n_submits, submits, fence);
+}
+
 bool Device::is_extension_supported(const std::string& name) const {
     return (m_supported_extensions.find(name) != m_supported_extensions.end());
 }
 
+void Device::destroy_deferred(DeferredObjectType type, uint64_t handle, const VkMappedMemoryRange& memory, const void* owner, std::function<void()> release) {
+    std::lock_guard<std::mutex> lock(m_deferred_mutex);
+    m_deferred.push_back({ type, handle, memory, m_current_serial, owner, std::move(release) });
+}
+
+void Device::cancel_deferred(const void* owner) {
+    std::lock_guard<std::mutex> lock(m_deferred_mutex);
+    m_deferred.erase(std::remove_if(m_deferred.begin(), m_deferred.end(), [owner](const DeferredObject& object) {
+        return object.type == DEFERRED_RELEASE && object.owner == owner;
+    }), m_deferred.end());
+}
+
+void Device::collect_deferred(uint64_t current_serial, uint64_t retired_serial) {
+    std::lock_guard<std::mutex> lock(m_deferred_mutex);
+    m_current_serial = current_serial;
+    m_retired_serial = retired_serial;
+    while (!m_deferred.empty() && m_deferred.front().serial <= m_retired_serial) {
+        destroy_object(m_deferred.front());
+        m_deferred.pop_front();
+    }
+}
+
+void Device::destroy_object(const DeferredObject& object) {
+    switch (object.type) {
+    case DEFERRED_BUFFER:
+        vkDestroyBuffer(m_device, handle_from_bits<VkBuffer>(object.handle), nullptr);
+        break;
+    case DEFERRED_BUFFER_VIEW:
+        vkDestroyBufferView(m_device, handle_from_bits<VkBufferView>(object.handle), nullptr);
+        break;
+    case DEFERRED_IMAGE:
+        vkDestroyImage(m_device, handle_from_bits<VkImage>(object.handle), nullptr);
+        break;
+    case DEFERRED_IMAGE_VIEW:
+        vkDestroyImageView(m_device, handle_from_bits<VkImageView>(object.handle), nullptr);
+        break;
+    case DEFERRED_SAMPLER:
+        vkDestroySampler(m_device, handle_from_bits<VkSampler>(object.handle), nullptr);
+        break;
+    case DEFERRED_FRAMEBUFFER:
+        vkDestroyFramebuffer(m_device, handle_from_bits<VkFramebuffer>(object.handle), nullptr);
+        break;
+    case DEFERRED_RENDER_PASS:
+        vkDestroyRenderPass(m_device, handle_from_bits<VkRenderPass>(object.handle), nullptr);
+        break;
+    case DEFERRED_PIPELINE:
+        vkDestroyPipeline(m_device, handle_from_bits<VkPipeline>(object.handle), nullptr);
+        break;
+    case DEFERRED_PIPELINE_LAYOUT:
+        vkDestroyPipelineLayout(m_device, handle_from_bits<VkPipelineLayout>(object.handle), nullptr);
+        break;
+    case DEFERRED_DESCRIPTOR_SET_LAYOUT:
+        vkDestroyDescriptorSetLayout(m_device, handle_from_bits<VkDescriptorSetLayout>(object.handle), nullptr);
+        break;
+    case DEFERRED_DESCRIPTOR_POOL:
+        vkDestroyDescriptorPool(m_device, handle_from_bits<VkDescriptorPool>(object.handle), nullptr);
+        break;
+    case DEFERRED_SHADER_MODULE:
+        vkDestroyShaderModule(m_device, handle_from_bits<VkShaderModule>(object.handle), nullptr);
+        break;
+    case DEFERRED_QUERY_POOL:
+        vkDestroyQueryPool(m_device, handle_from_bits<VkQueryPool>(object.handle), nullptr);
+        break;
+    case DEFERRED_SEMAPHORE:
+        vkDestroySemaphore(m_device, handle_from_bits<VkSemaphore>(object.handle), nullptr);
+        break;
+    case DEFERRED_FENCE:
+        vkDestroyFence(m_device, handle_from_bits<VkFence>(object.handle), nullptr);
+        break;
+    case DEFERRED_EVENT:
+        vkDestroyEvent(m_device, handle_from_bits<VkEvent>(object.handle), nullptr);
+        break;
+    case DEFERRED_COMMAND_POOL:
+        vkDestroyCommandPool(m_device, handle_from_bits<VkCommandPool>(object.handle), nullptr);
+        break;
+    case DEFERRED_SWAPCHAIN:
+        m_window.vkDestroySwapchainKHR(m_device, handle_from_bits<VkSwapchainKHR>(object.handle), nullptr);
+        break;
+    case DEFERRED_VMA_BUFFER:
+        vmaDestroyBuffer(m_allocator, handle_from_bits<VkBuffer>(object.handle));
+        break;
+    case DEFERRED_VMA_IMAGE:
+        vmaDestroyImage(m_allocator, handle_from_bits<VkImage>(object.handle));
+        break;
+    case DEFERRED_VMA_MEMORY:
+        vmaFreeMemory(m_allocator, &object.memory);
+        break;
+    case DEFERRED_RELEASE:
+        object.release();
+        break;
+    }
+}
+
+bool Device::is_extension_enabled(const char* name) const {
+    return (std::find_if(enabled_extensions.begin(), enabled_extensions.end(), [name](const char* extension) {
+        return (strcmp(extension, name) == 0);
+    }) != enabled_extensions.end());
+}
+
+void Device::init_bindless_limits() {
+#ifdef VK_EXT_descriptor_indexing
+    if (!m_bindless_supported)
+        return;
+
+    VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexing_props = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT,   // sType
+        nullptr                                                                 // pNext
+        // Filled in by the driver
+    };
+    VkPhysicalDeviceProperties2KHR props = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR, // sType
+        &indexing_props                                     // pNext
+    };
+    m_window.m_instance.vkGetPhysicalDeviceProperties2KHR(m_physical_device.device, &props);
+    // Combined image samplers count as both a sampler and a sampled image
+    m_max_bindless_images = std::min({ indexing_props.maxPerStageDescriptorUpdateAfterBindSampledImages, indexing_props.maxDescriptorSetUpdateAfterBindSampledImages,
+        indexing_props.maxPerStageDescriptorUpdateAfterBindSamplers, indexing_props.maxDescriptorSetUpdateAfterBindSamplers });
+    m_max_bindless_buffers = std::min(indexing_props.maxPerStageDescriptorUpdateAfterBindStorageBuffers, indexing_props.maxDescriptorSetUpdateAfterBindStorageBuffers);
+#endif
+}
+
+bool Device::create_transient_attachment(const VkImageCreateInfo& info, VkImage& image, VkDeviceSize& lazy_bytes) {
+    lazy_bytes = 0;
+    if (m_lazy_allocation_supported) {
+        VkImageCreateInfo lazy_info = info;
+        lazy_info.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+        VmaMemoryRequirements lazy_reqs = {
+            VK_TRUE,                                    // ownMemory
+            VMA_MEMORY_USAGE_UNKNOWN,                   // usage
+            VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT     // requiredFlags
+            // Fill rest with 0s
+        };
+        VkMappedMemoryRange memory;
+        if (vmaCreateImage(m_allocator, &lazy_info, &lazy_reqs, &image, &memory, nullptr) == VK_SUCCESS) {
+            lazy_bytes = memory.size;
+            return true;
+        }
+        // The lazily allocated types don't have to suit every format
+    }
+
+    VmaMemoryRequirements reqs = {
+        VK_TRUE,                    // ownMemory
+        VMA_MEMORY_USAGE_GPU_ONLY   // usage
+        // Fill rest with 0s
+    };
+    return validate(vmaCreateImage(m_allocator, &info, &reqs, &image, nullptr, nullptr));
+}
+
+// Layout of the header at the start of the data returned by vkGetPipelineCacheData
+// (VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+struct PipelineCacheHeader {
+    uint32_t length;
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint8_t uuid[VK_UUID_SIZE];
+};
+
+std::string Device::get_pipeline_cache_path() const {
+    const VkPhysicalDeviceProperties& props = m_physical_device.props;
+    char name[128];
+    int len = snprintf(name, sizeof(name), "/atlas_%04x_%04x_%08x_", props.vendorID, props.deviceID, props.driverVersion);
+    for (uint32_t i = 0; i < VK_UUID_SIZE; ++i)
+        len += snprintf(name + len, sizeof(name) - len, "%02x", props.pipelineCacheUUID[i]);
+
+    return pipeline_cache_dir + name + ".bin";
+}
+
+bool Device::init_pipeline_cache() {
+    std::vector<uint8_t> data;
+    std::string path;
+    if (!pipeline_cache_dir.empty()) {
+        path = get_pipeline_cache_path();
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file) {
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+            if (size > 0) {
+                data.resize(size);
+                if (fread(data.data(), 1, data.size(), file) != data.size())
+                    data.clear();
+            }
+            fclose(file);
+        }
+    }
+
+    // Never hand the driver a cache that was produced by a different device or driver
+    if (!data.empty()) {
+        const VkPhysicalDeviceProperties& props = m_physical_device.props;
+        PipelineCacheHeader header;
+        bool valid = (data.size() >= sizeof(header));
+        if (valid) {
+            memcpy(&header, data.data(), sizeof(header));
+            valid = (header.length >= sizeof(header))
+                && (header.version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+                && (header.vendor_id == props.vendorID)
+                && (header.device_id == props.deviceID)
+                && (memcmp(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE) == 0);
+        }
+        if (!valid) {
+            ATLAS_WARNING("Discarding pipeline cache " + path + " (header does not match this device)");
+            data.clear();
+        }
+    }
+
+    VkPipelineCacheCreateInfo cache_info = {
+        VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,   // sType
+        nullptr,                                        // pNext
+        0,                                              // flags (reserved)
+        data.size(),                                    // initialDataSize
+        data.empty() ? nullptr : data.data()            // pInitialData
+    };
+    VkResult res = vkCreatePipelineCache(m_device, &cache_info, NULL, &m_pipeline_cache);
+    if ( (res != VK_SUCCESS) && !data.empty() ) {
+        // The driver may still reject data with a valid header; start from a cold cache instead
+        ATLAS_WARNING("Driver rejected pipeline cache " + path);
+        data.clear();
+        cache_info.initialDataSize = 0;
+        cache_info.pInitialData = nullptr;
+        res = vkCreatePipelineCache(m_device, &cache_info, NULL, &m_pipeline_cache);
+    }
+    if (!validate(res)) return false;
+
+    m_pipeline_cache_warm = !data.empty();
+    if (m_pipeline_cache_warm)
+        ATLAS_LOG("Loaded pipeline cache " + path + " (" + std::to_string(data.size()) + " bytes)");
+    return true;
+}
+
+void Device::save_pipeline_cache() {
+    if (pipeline_cache_dir.empty())
+        return;
+
+    size_t size = 0;
+    VkResult res = vkGetPipelineCacheData(m_device, m_pipeline_cache, &size, nullptr);
+    if (!validate(res) || (size == 0)) return;
+    std::vector<uint8_t> data(size);
+    res = vkGetPipelineCacheData(m_device, m_pipeline_cache, &size, data.data());
+    if (!validate(res)) return;
+
+    // Write to a temporary file and move it over the old cache, so that a crash
+    // in the middle of writing can never leave a truncated cache behind
+    const std::string path = get_pipeline_cache_path();
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        ATLAS_WARNING("Could not open " + tmp_path + " to save the pipeline cache");
+        return;
+    }
+    bool written = (fwrite(data.data(), 1, size, file) == size);
+    written &= (fflush(file) == 0);
+    written &= (fclose(file) == 0);
+    if (!written) {
+        ATLAS_WARNING("Could not write the pipeline cache to " + tmp_path);
+        remove(tmp_path.c_str());
+        return;
+    }
+
+#ifdef _WIN32
+    // rename() refuses to replace an existing file on Windows
+    remove(path.c_str());
+#endif
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ATLAS_WARNING("Could not move the pipeline cache to " + path);
+        remove(tmp_path.c_str());
+        return;
+    }
+    ATLAS_LOG("Saved pipeline cache " + path + " (" + std::to_string(size) + " bytes)");
+}
+
 //
 //
 // Render pass
@@ -672,16 +1140,14 @@ bool Device::is_extension_supported(const std::string& name) const {
 
 
 RenderPass::RenderPass(Backend::Device& device)
- : m_device(device), m_renderpass(VK_NULL_HANDLE) {
-    vkCreateRenderPass = reinterpret_cast<PFN_vkCreateRenderPass>( vkGetDeviceProcAddr(device.vk(), "vkCreateRenderPass") );
-    vkDestroyRenderPass = reinterpret_cast<PFN_vkDestroyRenderPass>( vkGetDeviceProcAddr(device.vk(), "vkDestroyRenderPass") );
-}
+ : m_device(device), m_renderpass(VK_NULL_HANDLE)
+{ }
 
 uint32_t RenderPass::add_attachment(VkFormat format, VkImageLayout initial_layout, VkImageLayout final_layout, VkAttachmentLoadOp load_op, VkAttachmentStoreOp store_op, VkSampleCountFlagBits n_samples, bool uses_shared_memory) {
     // Check if the sample count is supported
     VkSampleCountFlags supported_n_samples = std::min(m_device.get_physical_device().props.limits.framebufferColorSampleCounts, m_device.get_physical_device().props.limits.framebufferDepthSampleCounts);
     if (!(supported_n_samples & n_samples)) {
-        Backend::error("Failed to add an attachment (requested an unsupported sample count)!");
+        ATLAS_ERROR("Failed to add an attachment (requested an unsupported sample count)!");
         return std::numeric_limits<uint32_t>::max();
     }
 
@@ -723,12 +1189,112 @@ bool RenderPass::init() {
         m_attachments.data(),                       // pAttachments
         static_cast<uint32_t>(m_subpasses.size()),  // subpassCount
         m_subpasses.data(),                         // pSubpasses
+        static_cast<uint32_t>(m_dependencies.size()),// dependencyCount
+        m_dependencies.data()                       // pDependencies
     };
 
-    return validate(vkCreateRenderPass(m_device.vk(), &rp_info, nullptr, &m_renderpass));
+    m_renderpass = m_device.get_object_cache().get_render_pass(rp_info);
+    return (m_renderpass != VK_NULL_HANDLE);
+}
+
+//
+//
+// Framebuffer
+//
+//
+
+Framebuffer::Framebuffer(Backend::Device& device)
+    : m_device(device), m_framebuffer(VK_NULL_HANDLE)
+{ }
+
+uint32_t Framebuffer::add_attachment(VkImageView view) {
+    m_attachments.push_back(view);
+    return static_cast<uint32_t>(m_attachments.size() - 1);
+}
+
+bool Framebuffer::init(const RenderPass& renderpass, uint32_t width, uint32_t height, uint32_t layers) {
+    VkFramebufferCreateInfo framebuffer_info = {
+        VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,          // sType
+        nullptr,                                            // pNext
+        0,                                                  // flags
+        renderpass.vk(),                                    // renderPass
+        static_cast<uint32_t>(m_attachments.size()),        // attachmentCount
+        m_attachments.data(),                               // pAttachments
+        width,                                              // width
+        height,                                             // height
+        layers                                              // layers
+    };
+    m_framebuffer = m_device.get_object_cache().get_framebuffer(framebuffer_info);
+    return (m_framebuffer != VK_NULL_HANDLE);
 }
 
-RenderPass::~RenderPass() {
-    if (m_renderpass)
-        vkDestroyRenderPass(m_device.vk(), m_renderpass, nullptr);
-}
\ No newline at end of file
+//
+//
+// Command buffer
+//
+//
+
+CommandBuffer::CommandBuffer(const Device& device, QueueFamily queue_family, uint32_t thread_index, VkCommandBufferLevel level)
+    : m_device(device), m_pool(device.get_command_pool(queue_family, thread_index)), m_queue(device.get_queue(queue_family))
+    , m_level(level), m_buffer(VK_NULL_HANDLE)
+{ }
+
+CommandBuffer::~CommandBuffer() {
+    if (m_buffer)
+        vkFreeCommandBuffers(m_device.vk(), m_pool, 1, &m_buffer);
+}
+
+bool CommandBuffer::init() {
+    VkCommandBufferAllocateInfo alloc_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, // sType
+        nullptr,                                        // pNext
+        m_pool,                                         // commandPool
+        m_level,                                        // level
+        1                                               // commandBufferCount
+    };
+    return validate(vkAllocateCommandBuffers(m_device.vk(), &alloc_info, &m_buffer));
+}
+
+bool CommandBuffer::begin(VkCommandBufferUsageFlags flags) {
+    // Secondary command buffers must always provide inheritance info, even outside a render pass
+    VkCommandBufferInheritanceInfo inheritance_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO   // sType
+        // Fill rest with 0s
+    };
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        flags,                                          // flags
+        (m_level == VK_COMMAND_BUFFER_LEVEL_SECONDARY) ? &inheritance_info : nullptr   // pInheritanceInfo
+    };
+    return validate(vkBeginCommandBuffer(m_buffer, &begin_info));
+}
+
+bool CommandBuffer::begin(const RenderPass& renderpass, uint32_t subpass, VkFramebuffer framebuffer, VkCommandBufferUsageFlags flags) {
+    if (m_level != VK_COMMAND_BUFFER_LEVEL_SECONDARY) {
+        ATLAS_ERROR("Only secondary command buffers can continue a render pass!");
+        return false;
+    }
+
+    VkCommandBufferInheritanceInfo inheritance_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,  // sType
+        nullptr,                                            // pNext
+        renderpass.vk(),                                    // renderPass
+        subpass,                                            // subpass
+        framebuffer,                                        // framebuffer
+        VK_FALSE,                                           // occlusionQueryEnable
+        0,                                                  // queryFlags
+        0                                                   // pipelineStatistics
+    };
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,            // sType
+        nullptr,                                                // pNext
+        flags | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT, // flags
+        &inheritance_info                                       // pInheritanceInfo
+    };
+    return validate(vkBeginCommandBuffer(m_buffer, &begin_info));
+}
+
+bool CommandBuffer::end() {
+    return validate(vkEndCommandBuffer(m_buffer));
+}
@@ -0,0 +1,185 @@
+#include "bindless.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+BindlessTable::BindlessTable(Device& device)
+    : m_device(device), m_layout(VK_NULL_HANDLE), m_pool(VK_NULL_HANDLE), m_set(VK_NULL_HANDLE)
+    , m_textures(), m_buffers()
+    , max_textures(16384), max_buffers(4096)
+{ }
+
+BindlessTable::~BindlessTable() {
+    m_device.cancel_deferred(this);
+    // Destroying the pool frees the set, which frames in flight may still have bound
+    if (m_pool)
+        m_device.destroy_deferred<DEFERRED_DESCRIPTOR_POOL>(m_pool);
+    if (m_layout)
+        m_device.destroy_deferred<DEFERRED_DESCRIPTOR_SET_LAYOUT>(m_layout);
+}
+
+bool BindlessTable::init() {
+#ifdef VK_EXT_descriptor_indexing
+    if (!m_device.supports_bindless()) {
+        ATLAS_ERROR("BindlessTable needs VK_EXT_descriptor_indexing with update-after-bind and partially bound descriptors!");
+        return false;
+    }
+    max_textures = std::max(1u, std::min(max_textures, m_device.get_max_bindless_images()));
+    max_buffers = std::max(1u, std::min(max_buffers, m_device.get_max_bindless_buffers()));
+    m_textures.capacity = max_textures;
+    m_buffers.capacity = max_buffers;
+
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {
+            texture_binding,                            // binding
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  // descriptorType
+            max_textures,                               // descriptorCount
+            VK_SHADER_STAGE_ALL,                        // stageFlags
+            nullptr                                     // pImmutableSamplers
+        },
+        {
+            buffer_binding,                             // binding
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,          // descriptorType
+            max_buffers,                                // descriptorCount
+            VK_SHADER_STAGE_ALL,                        // stageFlags
+            nullptr                                     // pImmutableSamplers
+        }
+    };
+    // Slots that no frame in flight uses can be written while those frames execute, and unwritten slots are fine
+    const VkDescriptorBindingFlagsEXT binding_flags[] = {
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT,
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT
+    };
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flags_info = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,  // sType
+        nullptr,                                                                // pNext
+        2,                                                                      // bindingCount
+        binding_flags                                                           // pBindingFlags
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,            // sType
+        &flags_info,                                                    // pNext
+        VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT, // flags
+        2,                                                              // bindingCount
+        bindings                                                        // pBindings
+    };
+    VkResult res = vkCreateDescriptorSetLayout(m_device.vk(), &layout_info, nullptr, &m_layout);
+    if (!validate(res)) return false;
+
+    const VkDescriptorPoolSize pool_sizes[] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, max_textures },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, max_buffers }
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,          // sType
+        nullptr,                                                // pNext
+        VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT,    // flags
+        1,                                                      // maxSets
+        2,                                                      // poolSizeCount
+        pool_sizes                                              // pPoolSizes
+    };
+    res = vkCreateDescriptorPool(m_device.vk(), &pool_info, nullptr, &m_pool);
+    if (!validate(res)) return false;
+
+    VkDescriptorSetAllocateInfo set_info = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, // sType
+        nullptr,                                        // pNext
+        m_pool,                                         // descriptorPool
+        1,                                              // descriptorSetCount
+        &m_layout                                       // pSetLayouts
+    };
+    res = vkAllocateDescriptorSets(m_device.vk(), &set_info, &m_set);
+    if (!validate(res)) return false;
+
+    return true;
+#else
+    ATLAS_ERROR("BindlessTable needs Vulkan headers with VK_EXT_descriptor_indexing!");
+    return false;
+#endif
+}
+
+BindlessHandle BindlessTable::allocate_slot(Slots& slots) {
+    if (!slots.free.empty()) {
+        const BindlessHandle handle = slots.free.back();
+        slots.free.pop_back();
+        return handle;
+    }
+    if (slots.n_used == slots.capacity) {
+        ATLAS_WARNING("Bindless table is full");
+        return invalid_bindless_handle;
+    }
+    return slots.n_used++;
+}
+
+BindlessHandle BindlessTable::add_texture(VkImageView view, VkSampler sampler, VkImageLayout layout) {
+    const BindlessHandle handle = allocate_slot(m_textures);
+    if (handle == invalid_bindless_handle)
+        return handle;
+
+    const VkDescriptorImageInfo image_info = {
+        sampler,    // sampler
+        view,       // imageView
+        layout      // imageLayout
+    };
+    VkWriteDescriptorSet write = {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,     // sType
+        nullptr,                                    // pNext
+        m_set,                                      // dstSet
+        texture_binding,                            // dstBinding
+        handle,                                     // dstArrayElement
+        1,                                          // descriptorCount
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  // descriptorType
+        &image_info,                                // pImageInfo
+        nullptr,                                    // pBufferInfo
+        nullptr                                     // pTexelBufferView
+    };
+    vkUpdateDescriptorSets(m_device.vk(), 1, &write, 0, nullptr);
+    return handle;
+}
+
+BindlessHandle BindlessTable::add_buffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range) {
+    const BindlessHandle handle = allocate_slot(m_buffers);
+    if (handle == invalid_bindless_handle)
+        return handle;
+
+    const VkDescriptorBufferInfo buffer_info = {
+        buffer, // buffer
+        offset, // offset
+        range   // range
+    };
+    VkWriteDescriptorSet write = {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, // sType
+        nullptr,                                // pNext
+        m_set,                                  // dstSet
+        buffer_binding,                         // dstBinding
+        handle,                                 // dstArrayElement
+        1,                                      // descriptorCount
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,      // descriptorType
+        nullptr,                                // pImageInfo
+        &buffer_info,                           // pBufferInfo
+        nullptr                                 // pTexelBufferView
+    };
+    vkUpdateDescriptorSets(m_device.vk(), 1, &write, 0, nullptr);
+    return handle;
+}
+
+void BindlessTable::remove_slot(Slots& slots, BindlessHandle handle) {
+    if (handle == invalid_bindless_handle)
+        return;
+    m_device.release_deferred(this, [&slots, handle]() {
+        slots.free.push_back(handle);
+    });
+}
+
+void BindlessTable::remove_texture(BindlessHandle handle) {
+    remove_slot(m_textures, handle);
+}
+
+void BindlessTable::remove_buffer(BindlessHandle handle) {
+    remove_slot(m_buffers, handle);
+}
+
+void BindlessTable::bind(VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point, VkPipelineLayout pipeline_layout, uint32_t set_index) const {
+    vkCmdBindDescriptorSets(command_buffer, bind_point, pipeline_layout, set_index, 1, &m_set, 0, nullptr);
+}
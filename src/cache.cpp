@@ -0,0 +1,241 @@
+#include "cache.h"
+#include "hash.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+ObjectCache::ObjectCache(Device& device)
+    : m_device(device), m_key_hash(0), m_n_hits(0), m_n_misses(0)
+{ }
+
+ObjectCache::~ObjectCache() {
+    for (const auto& entry : m_entries)
+        m_device.destroy_deferred(entry.second.type, entry.second.handle, VkMappedMemoryRange(), nullptr, std::function<void()>());
+}
+
+bool ObjectCache::begin_key(DeferredObjectType type, const void* next) {
+    if (next) {
+        ATLAS_ERROR("ObjectCache can't key create-infos with a pNext chain, create the object directly!");
+        return false;
+    }
+    m_key.clear();
+    add(type);
+    return true;
+}
+
+void ObjectCache::add_refs(uint32_t count, const VkAttachmentReference* refs) {
+    add(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        add(refs[i].attachment);
+        add(refs[i].layout);
+    }
+}
+
+uint64_t ObjectCache::find() {
+    m_key_hash = hash_bytes(m_key.data(), m_key.size() * sizeof(uint32_t));
+    auto range = m_entries.equal_range(m_key_hash);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second.key == m_key) {
+            ++m_n_hits;
+            return iter->second.handle;
+        }
+    }
+    ++m_n_misses;
+    return 0;
+}
+
+void ObjectCache::insert(DeferredObjectType type, uint64_t handle, const VkImageView* views, uint32_t n_views) {
+    Entry entry;
+    entry.key = m_key;
+    entry.type = type;
+    entry.handle = handle;
+    entry.views.assign(views, views + n_views);
+    m_entries.emplace(m_key_hash, std::move(entry));
+    for (uint32_t i = 0; i < n_views; ++i)
+        m_framebuffers_by_view.emplace(handle_to_bits(views[i]), ViewUse{ m_key_hash, handle });
+}
+
+VkRenderPass ObjectCache::get_render_pass(const VkRenderPassCreateInfo& info) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!begin_key(DEFERRED_RENDER_PASS, info.pNext)) return VK_NULL_HANDLE;
+    add(info.flags);
+    add(info.attachmentCount);
+    for (uint32_t i = 0; i < info.attachmentCount; ++i) {
+        const VkAttachmentDescription& attachment = info.pAttachments[i];
+        add(attachment.flags);
+        add(attachment.format);
+        add(attachment.samples);
+        add(attachment.loadOp);
+        add(attachment.storeOp);
+        add(attachment.stencilLoadOp);
+        add(attachment.stencilStoreOp);
+        add(attachment.initialLayout);
+        add(attachment.finalLayout);
+    }
+    add(info.subpassCount);
+    for (uint32_t i = 0; i < info.subpassCount; ++i) {
+        const VkSubpassDescription& subpass = info.pSubpasses[i];
+        add(subpass.flags);
+        add(subpass.pipelineBindPoint);
+        add_refs(subpass.inputAttachmentCount, subpass.pInputAttachments);
+        add_refs(subpass.colorAttachmentCount, subpass.pColorAttachments);
+        add_refs(subpass.pResolveAttachments ? subpass.colorAttachmentCount : 0, subpass.pResolveAttachments);
+        add_refs(subpass.pDepthStencilAttachment ? 1 : 0, subpass.pDepthStencilAttachment);
+        add(subpass.preserveAttachmentCount);
+        for (uint32_t j = 0; j < subpass.preserveAttachmentCount; ++j)
+            add(subpass.pPreserveAttachments[j]);
+    }
+    add(info.dependencyCount);
+    for (uint32_t i = 0; i < info.dependencyCount; ++i) {
+        const VkSubpassDependency& dependency = info.pDependencies[i];
+        add(dependency.srcSubpass);
+        add(dependency.dstSubpass);
+        add(dependency.srcStageMask);
+        add(dependency.dstStageMask);
+        add(dependency.srcAccessMask);
+        add(dependency.dstAccessMask);
+        add(dependency.dependencyFlags);
+    }
+    if (uint64_t handle = find())
+        return handle_from_bits<VkRenderPass>(handle);
+
+    VkRenderPass renderpass;
+    if (!validate(vkCreateRenderPass(m_device.vk(), &info, nullptr, &renderpass)))
+        return VK_NULL_HANDLE;
+    insert(DEFERRED_RENDER_PASS, handle_to_bits(renderpass));
+    return renderpass;
+}
+
+VkFramebuffer ObjectCache::get_framebuffer(const VkFramebufferCreateInfo& info) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!begin_key(DEFERRED_FRAMEBUFFER, info.pNext)) return VK_NULL_HANDLE;
+    add(info.flags);
+    add_handle(info.renderPass);
+    add(info.attachmentCount);
+    for (uint32_t i = 0; i < info.attachmentCount; ++i)
+        add_handle(info.pAttachments[i]);
+    add(info.width);
+    add(info.height);
+    add(info.layers);
+    if (uint64_t handle = find())
+        return handle_from_bits<VkFramebuffer>(handle);
+
+    VkFramebuffer framebuffer;
+    if (!validate(vkCreateFramebuffer(m_device.vk(), &info, nullptr, &framebuffer)))
+        return VK_NULL_HANDLE;
+    insert(DEFERRED_FRAMEBUFFER, handle_to_bits(framebuffer), info.pAttachments, info.attachmentCount);
+    return framebuffer;
+}
+
+VkSampler ObjectCache::get_sampler(const VkSamplerCreateInfo& info) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!begin_key(DEFERRED_SAMPLER, info.pNext)) return VK_NULL_HANDLE;
+    add(info.flags);
+    add(info.magFilter);
+    add(info.minFilter);
+    add(info.mipmapMode);
+    add(info.addressModeU);
+    add(info.addressModeV);
+    add(info.addressModeW);
+    add_float(info.mipLodBias);
+    add(info.anisotropyEnable);
+    add_float(info.maxAnisotropy);
+    add(info.compareEnable);
+    add(info.compareOp);
+    add_float(info.minLod);
+    add_float(info.maxLod);
+    add(info.borderColor);
+    add(info.unnormalizedCoordinates);
+    if (uint64_t handle = find())
+        return handle_from_bits<VkSampler>(handle);
+
+    VkSampler sampler;
+    if (!validate(vkCreateSampler(m_device.vk(), &info, nullptr, &sampler)))
+        return VK_NULL_HANDLE;
+    insert(DEFERRED_SAMPLER, handle_to_bits(sampler));
+    return sampler;
+}
+
+VkDescriptorSetLayout ObjectCache::get_descriptor_set_layout(const VkDescriptorSetLayoutCreateInfo& info) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!begin_key(DEFERRED_DESCRIPTOR_SET_LAYOUT, info.pNext)) return VK_NULL_HANDLE;
+    add(info.flags);
+    add(info.bindingCount);
+    for (uint32_t i = 0; i < info.bindingCount; ++i) {
+        const VkDescriptorSetLayoutBinding& binding = info.pBindings[i];
+        add(binding.binding);
+        add(binding.descriptorType);
+        add(binding.descriptorCount);
+        add(binding.stageFlags);
+        // Immutable samplers are ignored for other types
+        const bool has_samplers = binding.pImmutableSamplers && (binding.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER
+            || binding.descriptorType == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        add(has_samplers ? 1 : 0);
+        for (uint32_t j = 0; has_samplers && j < binding.descriptorCount; ++j)
+            add_handle(binding.pImmutableSamplers[j]);
+    }
+    if (uint64_t handle = find())
+        return handle_from_bits<VkDescriptorSetLayout>(handle);
+
+    VkDescriptorSetLayout layout;
+    if (!validate(vkCreateDescriptorSetLayout(m_device.vk(), &info, nullptr, &layout)))
+        return VK_NULL_HANDLE;
+    insert(DEFERRED_DESCRIPTOR_SET_LAYOUT, handle_to_bits(layout));
+    return layout;
+}
+
+VkPipelineLayout ObjectCache::get_pipeline_layout(const VkPipelineLayoutCreateInfo& info) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!begin_key(DEFERRED_PIPELINE_LAYOUT, info.pNext)) return VK_NULL_HANDLE;
+    add(info.flags);
+    add(info.setLayoutCount);
+    for (uint32_t i = 0; i < info.setLayoutCount; ++i)
+        add_handle(info.pSetLayouts[i]);
+    add(info.pushConstantRangeCount);
+    for (uint32_t i = 0; i < info.pushConstantRangeCount; ++i) {
+        add(info.pPushConstantRanges[i].stageFlags);
+        add(info.pPushConstantRanges[i].offset);
+        add(info.pPushConstantRanges[i].size);
+    }
+    if (uint64_t handle = find())
+        return handle_from_bits<VkPipelineLayout>(handle);
+
+    VkPipelineLayout layout;
+    if (!validate(vkCreatePipelineLayout(m_device.vk(), &info, nullptr, &layout)))
+        return VK_NULL_HANDLE;
+    insert(DEFERRED_PIPELINE_LAYOUT, handle_to_bits(layout));
+    return layout;
+}
+
+void ObjectCache::evict_image_view(VkImageView view) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto uses = m_framebuffers_by_view.equal_range(handle_to_bits(view));
+    std::vector<ViewUse> evicted;
+    for (auto iter = uses.first; iter != uses.second; ++iter)
+        evicted.push_back(iter->second);
+    m_framebuffers_by_view.erase(uses.first, uses.second);
+
+    for (const ViewUse& use : evicted) {
+        auto entries = m_entries.equal_range(use.key_hash);
+        auto entry = std::find_if(entries.first, entries.second, [&](const std::pair<const uint64_t, Entry>& item) {
+            return item.second.handle == use.handle;
+        });
+        if (entry == entries.second)
+            continue;
+        // The framebuffer's other views stop pointing at it
+        for (VkImageView other : entry->second.views) {
+            if (other == view)
+                continue;
+            auto others = m_framebuffers_by_view.equal_range(handle_to_bits(other));
+            for (auto iter = others.first; iter != others.second; ++iter) {
+                if (iter->second.handle == use.handle) {
+                    m_framebuffers_by_view.erase(iter);
+                    break;
+                }
+            }
+        }
+        m_device.destroy_deferred(entry->second.type, entry->second.handle, VkMappedMemoryRange(), nullptr, std::function<void()>());
+        m_entries.erase(entry);
+    }
+}
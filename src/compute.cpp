@@ -0,0 +1,99 @@
+#include "compute.h"
+
+using namespace Atlas;
+using namespace Backend;
+
+AsyncCompute::AsyncCompute(Device& device, FrameRing& frames)
+    : m_device(device), m_frames(frames), m_release_stages(0), m_acquire_stages(0)
+{ }
+
+VkCommandBuffer AsyncCompute::begin(uint32_t thread_index) {
+    VkCommandBuffer buffer = m_frames.get_command_buffer(QUEUE_FAMILY_COMPUTE, thread_index);
+    if (!buffer)
+        return VK_NULL_HANDLE;
+
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,    // flags
+        nullptr                                         // pInheritanceInfo
+    };
+    if (!validate(vkBeginCommandBuffer(buffer, &begin_info)))
+        return VK_NULL_HANDLE;
+    return buffer;
+}
+
+void AsyncCompute::release_buffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkPipelineStageFlags src_stages, VkAccessFlags src_access, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access) {
+    m_acquire_stages |= dst_stages;
+
+    const uint32_t compute_family = m_device.get_queue_family_index(QUEUE_FAMILY_COMPUTE);
+    const uint32_t universal_family = m_device.get_queue_family_index(QUEUE_FAMILY_UNIVERSAL);
+    if (compute_family == universal_family)
+        return;
+
+    VkBufferMemoryBarrier barrier = {
+        VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,    // sType
+        nullptr,                                    // pNext
+        src_access,                                 // srcAccessMask
+        0,                                          // dstAccessMask
+        compute_family,                             // srcQueueFamilyIndex
+        universal_family,                           // dstQueueFamilyIndex
+        buffer,                                     // buffer
+        offset,                                     // offset
+        size                                        // size
+    };
+    m_release_barriers.push_back(barrier);
+    m_release_stages |= src_stages;
+
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = dst_access;
+    m_acquire_barriers.push_back(barrier);
+}
+
+bool AsyncCompute::submit(VkCommandBuffer compute_buffer, VkPipelineStageFlags wait_stages) {
+    if (!m_release_barriers.empty()) {
+        vkCmdPipelineBarrier(compute_buffer, m_release_stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+            0, nullptr,
+            static_cast<uint32_t>(m_release_barriers.size()), m_release_barriers.data(),
+            0, nullptr);
+        m_release_barriers.clear();
+        m_release_stages = 0;
+    }
+    VkResult res = vkEndCommandBuffer(compute_buffer);
+    if (!validate(res)) return false;
+
+    // Recycled by the frame ring once the frame retires, by which point the universal queue has waited on it
+    VkSemaphore finished = m_frames.borrow_semaphore();
+    if (!finished) return false;
+
+    VkSubmitInfo submit_info = {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,  // sType
+        nullptr,                        // pNext
+        0,                              // waitSemaphoreCount
+        nullptr,                        // pWaitSemaphores
+        nullptr,                        // pWaitDstStageMask
+        1,                              // commandBufferCount
+        &compute_buffer,                // pCommandBuffers
+        1,                              // signalSemaphoreCount
+        &finished                       // pSignalSemaphores
+    };
+    res = m_device.submit(m_device.get_queue(QUEUE_FAMILY_COMPUTE), 1, &submit_info, VK_NULL_HANDLE);
+    if (!validate(res)) return false;
+
+    // The frame's fence then also covers this submission, so its command pool is reset safely
+    wait_stages |= m_acquire_stages;
+    m_frames.add_wait_semaphore(finished, wait_stages ? wait_stages : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    return true;
+}
+
+void AsyncCompute::acquire(VkCommandBuffer universal_buffer) {
+    // The source stages match the semaphore wait, so the barrier chains after it
+    if (!m_acquire_barriers.empty()) {
+        vkCmdPipelineBarrier(universal_buffer, m_acquire_stages, m_acquire_stages, 0,
+            0, nullptr,
+            static_cast<uint32_t>(m_acquire_barriers.size()), m_acquire_barriers.data(),
+            0, nullptr);
+        m_acquire_barriers.clear();
+    }
+    m_acquire_stages = 0;
+}
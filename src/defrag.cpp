@@ -0,0 +1,311 @@
+#include "defrag.h"
+#include "trace.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+static VkDeviceSize get_allocated_bytes(const MemoryStats& stats) {
+    VkDeviceSize allocated = 0;
+    for (const MemoryHeapStats& heap : stats.heaps)
+        allocated += heap.allocated_bytes;
+    return allocated;
+}
+
+Defragmenter::Defragmenter(Device& device, FrameRing& frames)
+    : m_device(device), m_frames(frames), m_next_id(1), m_moved_serial(0), m_allocated_before_moves(0)
+    , m_bytes_moved(0), m_n_moves(0), m_bytes_reclaimed(0)
+    , max_bytes_per_frame(8 * 1024 * 1024), fragmentation_threshold(0.5f)
+{ }
+
+uint32_t Defragmenter::add_resource(Resource& resource) {
+    if (resource.reqs.ownMemory) {
+        ATLAS_WARNING("Resources with their own memory have nothing to be compacted into; not registering");
+        return 0;
+    }
+
+    const uint32_t id = m_next_id++;
+    m_block_usage[resource.memory.memory] += resource.memory.size;
+    m_resources[id] = std::move(resource);
+    return id;
+}
+
+uint32_t Defragmenter::register_buffer(VkBuffer& buffer, const VkMappedMemoryRange& memory, const VkBufferCreateInfo& info, const VmaMemoryRequirements& reqs,
+    VkPipelineStageFlags stages, VkAccessFlags access, const MoveCallback& on_moved) {
+    const VkBufferUsageFlags transfer_usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if ((info.usage & transfer_usage) != transfer_usage) {
+        ATLAS_WARNING("Buffers need TRANSFER_SRC and TRANSFER_DST usage to be moved; not registering");
+        return 0;
+    }
+
+    Resource resource = {};
+    resource.is_image = false;
+    resource.buffer = &buffer;
+    resource.buffer_info = info;
+    resource.buffer_info.pNext = nullptr;
+    resource.queue_families.assign(info.pQueueFamilyIndices, info.pQueueFamilyIndices + info.queueFamilyIndexCount);
+    resource.reqs = reqs;
+    resource.memory = memory;
+    resource.stages = stages;
+    resource.access = access;
+    resource.on_moved = on_moved;
+    return add_resource(resource);
+}
+
+uint32_t Defragmenter::register_image(VkImage& image, const VkMappedMemoryRange& memory, const VkImageCreateInfo& info, const VmaMemoryRequirements& reqs, VkImageLayout layout, VkImageAspectFlags aspect,
+    VkPipelineStageFlags stages, VkAccessFlags access, const MoveCallback& on_moved) {
+    const VkImageUsageFlags transfer_usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    if ((info.usage & transfer_usage) != transfer_usage) {
+        ATLAS_WARNING("Images need TRANSFER_SRC and TRANSFER_DST usage to be moved; not registering");
+        return 0;
+    }
+
+    Resource resource = {};
+    resource.is_image = true;
+    resource.image = &image;
+    resource.image_info = info;
+    resource.image_info.pNext = nullptr;
+    // The copy starts out in TRANSFER_DST_OPTIMAL
+    resource.image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resource.queue_families.assign(info.pQueueFamilyIndices, info.pQueueFamilyIndices + info.queueFamilyIndexCount);
+    resource.reqs = reqs;
+    resource.memory = memory;
+    resource.layout = layout;
+    resource.aspect = aspect;
+    resource.stages = stages;
+    resource.access = access;
+    resource.on_moved = on_moved;
+    return add_resource(resource);
+}
+
+void Defragmenter::unregister(uint32_t id) {
+    auto iter = m_resources.find(id);
+    if (iter == m_resources.end())
+        return;
+
+    auto usage = m_block_usage.find(iter->second.memory.memory);
+    usage->second -= iter->second.memory.size;
+    if (usage->second == 0)
+        m_block_usage.erase(usage);
+    m_resources.erase(iter);
+}
+
+bool Defragmenter::is_fragmented(const MemoryStats& stats) const {
+    for (const MemoryHeapStats& heap : stats.heaps) {
+        if (heap.fragmentation > fragmentation_threshold)
+            return true;
+    }
+    return false;
+}
+
+void Defragmenter::measure_reclaimed(const MemoryStats& stats) {
+    // Moved-from resources are freed as their frames retire, before begin_frame() samples the stats
+    if (m_moved_serial == 0 || m_frames.get_retired_serial() < m_moved_serial)
+        return;
+    // Blocks are only returned to the driver once they're empty
+    const VkDeviceSize allocated = get_allocated_bytes(stats);
+    if (allocated < m_allocated_before_moves)
+        m_bytes_reclaimed += m_allocated_before_moves - allocated;
+    m_moved_serial = 0;
+}
+
+bool Defragmenter::create_move(uint32_t id, Resource& resource) {
+    Move move = {};
+    move.id = id;
+    uint32_t memory_type;
+    // Only existing blocks are worth moving into; a block created for the move would just add another
+    // mostly empty one
+    VmaMemoryRequirements reqs = resource.reqs;
+    reqs.neverAllocate = VK_TRUE;
+    VkResult res;
+    if (resource.is_image) {
+        resource.image_info.pQueueFamilyIndices = resource.queue_families.data();
+        res = vmaCreateImage(m_device.get_allocator(), &resource.image_info, &reqs, &move.image, &move.memory, &memory_type);
+    }
+    else {
+        resource.buffer_info.pQueueFamilyIndices = resource.queue_families.data();
+        res = vmaCreateBuffer(m_device.get_allocator(), &resource.buffer_info, &reqs, &move.buffer, &move.memory, &memory_type);
+    }
+    if ((res == VK_ERROR_OUT_OF_DEVICE_MEMORY) || (res == VK_ERROR_OUT_OF_HOST_MEMORY)) {
+        // No other block has room
+        m_full_blocks.push_back(resource.memory.memory);
+        return true;
+    }
+    if (!validate(res)) return false;
+
+    if (!is_better_block(move.memory.memory, resource.memory.memory)) {
+        // Moving into a block that isn't fuller would only shuffle resources around (or back and forth
+        // between frames). VMA picked the fullest block with room, so the rest of this block stays put too
+        if (move.image)
+            vmaDestroyImage(m_device.get_allocator(), move.image);
+        else
+            vmaDestroyBuffer(m_device.get_allocator(), move.buffer);
+        m_full_blocks.push_back(resource.memory.memory);
+        return true;
+    }
+    m_moves.push_back(move);
+    return true;
+}
+
+bool Defragmenter::is_better_block(VkDeviceMemory destination, VkDeviceMemory source) const {
+    if (destination == source)
+        return false;
+
+    // Fullest first, ties broken by handle, so any two blocks are ordered the same way every frame
+    auto destination_usage = m_block_usage.find(destination);
+    auto source_usage = m_block_usage.find(source);
+    const VkDeviceSize destination_bytes = (destination_usage != m_block_usage.end()) ? destination_usage->second : 0;
+    const VkDeviceSize source_bytes = (source_usage != m_block_usage.end()) ? source_usage->second : 0;
+    if (destination_bytes != source_bytes)
+        return (destination_bytes > source_bytes);
+    return (destination < source);
+}
+
+void Defragmenter::record_moves(VkCommandBuffer command_buffer) {
+    // Registered resources were last written by a transfer and are read in their registered stages, so the
+    // copies wait for those (or only for the transfer, when a buffer's reads can't conflict with them)
+    for (const auto& move : m_moves) {
+        const Resource& resource = m_resources[move.id];
+        if (resource.is_image) {
+            const VkImageCreateInfo& info = resource.image_info;
+            m_tracker.add_image(*resource.image, resource.aspect, info.mipLevels, info.arrayLayers);
+            m_tracker.set_image_state(*resource.image, VK_PIPELINE_STAGE_TRANSFER_BIT | resource.stages, VK_ACCESS_TRANSFER_WRITE_BIT | resource.access, resource.layout);
+            m_tracker.add_image(move.image, resource.aspect, info.mipLevels, info.arrayLayers);
+            m_tracker.use_image(*resource.image, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+            m_tracker.use_image(move.image, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        }
+        else {
+            m_tracker.add_buffer(*resource.buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+            m_tracker.add_buffer(move.buffer);
+            m_tracker.use_buffer(*resource.buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+            m_tracker.use_buffer(move.buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+        }
+    }
+    m_tracker.flush(command_buffer);
+
+    for (const auto& move : m_moves) {
+        const Resource& resource = m_resources[move.id];
+        if (resource.is_image) {
+            const VkImageCreateInfo& info = resource.image_info;
+            m_regions.clear();
+            for (uint32_t level = 0; level < info.mipLevels; ++level) {
+                const VkImageSubresourceLayers subresource = {
+                    resource.aspect,    // aspectMask
+                    level,              // mipLevel
+                    0,                  // baseArrayLayer
+                    info.arrayLayers    // layerCount
+                };
+                const VkExtent3D extent = {
+                    std::max(1u, info.extent.width >> level),
+                    std::max(1u, info.extent.height >> level),
+                    std::max(1u, info.extent.depth >> level)
+                };
+                m_regions.push_back({ subresource, { 0, 0, 0 }, subresource, { 0, 0, 0 }, extent });
+            }
+            vkCmdCopyImage(command_buffer, *resource.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, move.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                static_cast<uint32_t>(m_regions.size()), m_regions.data());
+        }
+        else {
+            const VkBufferCopy region = {
+                0,                              // srcOffset
+                0,                              // dstOffset
+                resource.buffer_info.size       // size
+            };
+            vkCmdCopyBuffer(command_buffer, *resource.buffer, move.buffer, 1, &region);
+        }
+    }
+
+    // The rest of the frame reads the new resources where it read the old ones, in their usual layouts
+    for (const auto& move : m_moves) {
+        const Resource& resource = m_resources[move.id];
+        if (resource.is_image)
+            m_tracker.use_image(move.image, resource.stages, resource.access, resource.layout);
+        else
+            m_tracker.use_buffer(move.buffer, resource.stages, resource.access);
+    }
+    m_tracker.flush(command_buffer);
+
+    for (const auto& move : m_moves) {
+        const Resource& resource = m_resources[move.id];
+        if (resource.is_image) {
+            m_tracker.remove_image(*resource.image);
+            m_tracker.remove_image(move.image);
+        }
+        else {
+            m_tracker.remove_buffer(*resource.buffer);
+            m_tracker.remove_buffer(move.buffer);
+        }
+    }
+}
+
+bool Defragmenter::update(VkCommandBuffer command_buffer, const MemoryStats& stats) {
+    ATLAS_TRACE_ZONE("Defragmenter::update");
+    measure_reclaimed(stats);
+    if (m_resources.empty())
+        return true;
+
+    if (!is_fragmented(stats))
+        return true;
+
+    // Drain the emptiest blocks first, and leave the fullest one alone: it's where moves should land
+    m_candidates.clear();
+    VkDeviceSize fullest = 0;
+    for (const auto& usage : m_block_usage)
+        fullest = std::max(fullest, usage.second);
+    for (const auto& resource : m_resources) {
+        const VkDeviceSize usage = m_block_usage[resource.second.memory.memory];
+        if (usage < fullest)
+            m_candidates.push_back({ usage, resource.first });
+    }
+    std::sort(m_candidates.begin(), m_candidates.end());
+
+    m_full_blocks.clear();
+    m_moves.clear();
+    VkDeviceSize budget = max_bytes_per_frame;
+    bool success = true;
+    for (const auto& candidate : m_candidates) {
+        Resource& resource = m_resources[candidate.second];
+        if (resource.memory.size > budget)
+            continue;
+        if (std::find(m_full_blocks.begin(), m_full_blocks.end(), resource.memory.memory) != m_full_blocks.end())
+            continue;
+        if (!create_move(candidate.second, resource)) {
+            success = false;
+            break;
+        }
+        budget -= std::min(budget, resource.memory.size);
+    }
+    if (m_moves.empty())
+        return success;
+
+    record_moves(command_buffer);
+
+    // Point the owners at the new resources; the old ones live until this frame retires
+    if (m_moved_serial == 0)
+        m_allocated_before_moves = get_allocated_bytes(stats);
+    m_moved_serial = m_frames.get_frame_serial();
+    for (const auto& move : m_moves) {
+        Resource& resource = m_resources[move.id];
+        if (resource.is_image) {
+            m_device.destroy_deferred<DEFERRED_VMA_IMAGE>(*resource.image);
+            *resource.image = move.image;
+        }
+        else {
+            m_device.destroy_deferred<DEFERRED_VMA_BUFFER>(*resource.buffer);
+            *resource.buffer = move.buffer;
+        }
+
+        auto usage = m_block_usage.find(resource.memory.memory);
+        usage->second -= resource.memory.size;
+        if (usage->second == 0)
+            m_block_usage.erase(usage);
+        m_block_usage[move.memory.memory] += move.memory.size;
+        m_bytes_moved += resource.memory.size;
+        ++m_n_moves;
+        resource.memory = move.memory;
+
+        if (resource.on_moved)
+            resource.on_moved(move.id);
+    }
+    return success;
+}
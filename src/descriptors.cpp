@@ -0,0 +1,359 @@
+#include "descriptors.h"
+#include "cache.h"
+#include "hash.h"
+#include "trace.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+// vkUpdateDescriptorSets reads arrays of these with their own stride
+static_assert(sizeof(DescriptorData) == sizeof(VkDescriptorImageInfo), "DescriptorData must be laid out like VkDescriptorImageInfo");
+static_assert(sizeof(DescriptorData) == sizeof(VkDescriptorBufferInfo), "DescriptorData must be laid out like VkDescriptorBufferInfo");
+
+// Descriptors of each type to make room for per set in a pool
+static const struct {
+    VkDescriptorType type;
+    float per_set;
+} pool_ratios[] = {
+    { VK_DESCRIPTOR_TYPE_SAMPLER,                   0.5f },
+    { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,    4.0f },
+    { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,             4.0f },
+    { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,             1.0f },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER,      1.0f },
+    { VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,      1.0f },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,            2.0f },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,            2.0f },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,    1.0f },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,    1.0f },
+    { VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,          0.5f }
+};
+
+static bool is_image_type(VkDescriptorType type) {
+    return (type == VK_DESCRIPTOR_TYPE_SAMPLER || type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER || type == VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE
+        || type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE || type == VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT);
+}
+
+static bool is_texel_buffer_type(VkDescriptorType type) {
+    return (type == VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER || type == VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER);
+}
+
+void Backend::get_pool_sizes(const std::vector<VkDescriptorPoolSize>& usual_sizes, const DescriptorLayout& layout, std::vector<VkDescriptorPoolSize>& pool_sizes) {
+    pool_sizes = usual_sizes;
+    // Bindings of types the usual sizes leave out are totalled in entries appended past them
+    std::vector<uint32_t> needed(pool_sizes.size(), 0);
+    for (const auto& binding : layout.bindings) {
+        if (binding.descriptorCount == 0)
+            continue;
+        auto size = std::find_if(pool_sizes.begin(), pool_sizes.end(), [&binding](const VkDescriptorPoolSize& size) {
+            return size.type == binding.descriptorType;
+        });
+        if (size == pool_sizes.end()) {
+            pool_sizes.push_back({ binding.descriptorType, 0 });
+            needed.push_back(0);
+            size = pool_sizes.end() - 1;
+        }
+        needed[size - pool_sizes.begin()] += binding.descriptorCount;
+    }
+    for (size_t i = 0; i < pool_sizes.size(); ++i)
+        pool_sizes[i].descriptorCount = std::max(pool_sizes[i].descriptorCount, needed[i]);
+}
+
+DescriptorAllocator::DescriptorAllocator(Device& device, FrameRing& frames)
+    : m_device(device), m_frames(frames), m_static_pools()
+    , sets_per_pool(256)
+{ }
+
+DescriptorAllocator::~DescriptorAllocator() {
+    // Destroying the pools frees their sets
+    for (auto& chain : m_frame_pools) {
+        for (auto iter = chain.pools.rbegin(); iter != chain.pools.rend(); ++iter)
+            vkDestroyDescriptorPool(m_device.vk(), *iter, nullptr);
+    }
+    for (auto iter = m_static_pools.pools.rbegin(); iter != m_static_pools.pools.rend(); ++iter)
+        vkDestroyDescriptorPool(m_device.vk(), *iter, nullptr);
+
+    // The set layouts belong to the device's ObjectCache
+    for (auto iter = m_layouts.rbegin(); iter != m_layouts.rend(); ++iter) {
+        if (iter->update_template)
+            m_device.vkDestroyDescriptorUpdateTemplateKHR(m_device.vk(), iter->update_template, nullptr);
+    }
+}
+
+bool DescriptorAllocator::init() {
+    if (sets_per_pool == 0) {
+        ATLAS_ERROR("DescriptorAllocator needs room for at least one set per pool!");
+        return false;
+    }
+    for (const auto& ratio : pool_ratios)
+        m_pool_sizes.push_back({ ratio.type, std::max(1u, static_cast<uint32_t>(ratio.per_set * sets_per_pool)) });
+    m_frame_pools.resize(m_frames.max_frames_in_flight, PoolChain());
+    return true;
+}
+
+const DescriptorLayout* DescriptorAllocator::get_layout(const std::vector<VkDescriptorSetLayoutBinding>& bindings) {
+    std::vector<VkDescriptorSetLayoutBinding> sorted = bindings;
+    std::sort(sorted.begin(), sorted.end(), [](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) {
+        return a.binding < b.binding;
+    });
+
+    std::vector<VkSampler> immutable_samplers;
+    uint64_t hash = hash_seed;
+    for (const auto& binding : sorted) {
+        hash = hash_value(binding.binding, hash);
+        hash = hash_value(binding.descriptorType, hash);
+        hash = hash_value(binding.descriptorCount, hash);
+        hash = hash_value(binding.stageFlags, hash);
+        if (binding.pImmutableSamplers) {
+            hash = hash_bytes(binding.pImmutableSamplers, binding.descriptorCount * sizeof(VkSampler), hash);
+            immutable_samplers.insert(immutable_samplers.end(), binding.pImmutableSamplers, binding.pImmutableSamplers + binding.descriptorCount);
+        }
+    }
+
+    auto cached = m_layout_cache.equal_range(hash);
+    for (auto iter = cached.first; iter != cached.second; ++iter) {
+        const DescriptorLayout& layout = *iter->second;
+        bool equal = (layout.bindings.size() == sorted.size() && layout.immutable_samplers == immutable_samplers);
+        for (size_t i = 0; equal && i < sorted.size(); ++i) {
+            equal = (layout.bindings[i].binding == sorted[i].binding && layout.bindings[i].descriptorType == sorted[i].descriptorType
+                && layout.bindings[i].descriptorCount == sorted[i].descriptorCount && layout.bindings[i].stageFlags == sorted[i].stageFlags
+                && (layout.bindings[i].pImmutableSamplers != nullptr) == (sorted[i].pImmutableSamplers != nullptr));
+        }
+        if (equal)
+            return &layout;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,    // sType
+        nullptr,                                                // pNext
+        0,                                                      // flags
+        static_cast<uint32_t>(sorted.size()),                   // bindingCount
+        sorted.data()                                           // pBindings
+    };
+    // Shared with any identical layout created elsewhere
+    const VkDescriptorSetLayout vk_layout = m_device.get_object_cache().get_descriptor_set_layout(layout_info);
+    if (!vk_layout)
+        return nullptr;
+
+    m_layouts.push_back(DescriptorLayout());
+    DescriptorLayout& layout = m_layouts.back();
+    layout.layout = vk_layout;
+    layout.update_template = VK_NULL_HANDLE;
+    layout.bindings = std::move(sorted);
+    layout.immutable_samplers = std::move(immutable_samplers);
+    layout.n_descriptors = 0;
+    layout.hash = hash;
+    // Keep pointing at the samplers, now that the caller's arrays may go away
+    const VkSampler* samplers = layout.immutable_samplers.data();
+    for (auto& binding : layout.bindings) {
+        if (binding.pImmutableSamplers) {
+            binding.pImmutableSamplers = samplers;
+            samplers += binding.descriptorCount;
+        }
+    }
+
+    std::vector<VkDescriptorUpdateTemplateEntryKHR> entries;
+    for (const auto& binding : layout.bindings) {
+        if (binding.descriptorCount == 0)
+            continue;
+        entries.push_back({
+            binding.binding,                                    // dstBinding
+            0,                                                  // dstArrayElement
+            binding.descriptorCount,                            // descriptorCount
+            binding.descriptorType,                             // descriptorType
+            layout.n_descriptors * sizeof(DescriptorData),      // offset
+            sizeof(DescriptorData)                              // stride
+        });
+        layout.n_descriptors += binding.descriptorCount;
+    }
+
+    if (uses_update_templates() && !entries.empty()) {
+        VkDescriptorUpdateTemplateCreateInfoKHR template_info = {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO_KHR,   // sType
+            nullptr,                                                        // pNext
+            0,                                                              // flags (reserved)
+            static_cast<uint32_t>(entries.size()),                          // descriptorUpdateEntryCount
+            entries.data(),                                                 // pDescriptorUpdateEntries
+            VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET_KHR,          // templateType
+            layout.layout,                                                  // descriptorSetLayout
+            VK_PIPELINE_BIND_POINT_GRAPHICS,                                // pipelineBindPoint (unused for set templates)
+            VK_NULL_HANDLE,                                                 // pipelineLayout (unused for set templates)
+            0                                                               // set (unused for set templates)
+        };
+        VkResult res = m_device.vkCreateDescriptorUpdateTemplateKHR(m_device.vk(), &template_info, nullptr, &layout.update_template);
+        if (!validate(res)) return nullptr;
+    }
+
+    m_layout_cache.insert({ hash, &layout });
+    return &layout;
+}
+
+bool DescriptorAllocator::begin_frame() {
+    // FrameRing::begin_frame() has retired this context's previous frame, so nothing uses its sets anymore
+    PoolChain& chain = m_frame_pools[m_frames.get_frame_index()];
+    for (auto pool : chain.pools) {
+        VkResult res = vkResetDescriptorPool(m_device.vk(), pool, 0);
+        if (!validate(res)) return false;
+    }
+    chain.current = 0;
+    return true;
+}
+
+VkDescriptorSet DescriptorAllocator::allocate_from(PoolChain& chain, const DescriptorLayout& layout) {
+    while (true) {
+        const bool new_pool = (chain.current == chain.pools.size());
+        if (new_pool) {
+            // Make sure a set of this layout fits even if it's bigger than the usual proportions
+            std::vector<VkDescriptorPoolSize> pool_sizes;
+            get_pool_sizes(m_pool_sizes, layout, pool_sizes);
+            VkDescriptorPoolCreateInfo pool_info = {
+                VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,  // sType
+                nullptr,                                        // pNext
+                0,                                              // flags
+                sets_per_pool,                                  // maxSets
+                static_cast<uint32_t>(pool_sizes.size()),       // poolSizeCount
+                pool_sizes.data()                               // pPoolSizes
+            };
+            VkDescriptorPool pool;
+            VkResult res = vkCreateDescriptorPool(m_device.vk(), &pool_info, nullptr, &pool);
+            if (!validate(res)) return VK_NULL_HANDLE;
+            chain.pools.push_back(pool);
+        }
+
+        VkDescriptorSetAllocateInfo set_info = {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, // sType
+            nullptr,                                        // pNext
+            chain.pools[chain.current],                     // descriptorPool
+            1,                                              // descriptorSetCount
+            &layout.layout                                  // pSetLayouts
+        };
+        VkDescriptorSet set;
+        VkResult res = vkAllocateDescriptorSets(m_device.vk(), &set_info, &set);
+        if (res == VK_SUCCESS)
+            return set;
+        // A full pool isn't an error, just a reason to move on to the next one
+        if (new_pool || (res != VK_ERROR_OUT_OF_POOL_MEMORY_KHR && res != VK_ERROR_FRAGMENTED_POOL)) {
+            validate(res);
+            return VK_NULL_HANDLE;
+        }
+        ++chain.current;
+    }
+}
+
+void DescriptorAllocator::update(VkDescriptorSet set, const DescriptorLayout& layout, const DescriptorData* data) {
+    if (layout.n_descriptors == 0)
+        return;
+    if (layout.update_template) {
+        m_device.vkUpdateDescriptorSetWithTemplateKHR(m_device.vk(), set, layout.update_template, data);
+        return;
+    }
+
+    VkWriteDescriptorSet write = {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, // sType
+        nullptr,                                // pNext
+        set,                                    // dstSet
+        0,                                      // dstBinding
+        0,                                      // dstArrayElement
+        0,                                      // descriptorCount
+        VK_DESCRIPTOR_TYPE_SAMPLER,             // descriptorType
+        nullptr,                                // pImageInfo
+        nullptr,                                // pBufferInfo
+        nullptr                                 // pTexelBufferView
+    };
+    m_writes.clear();
+    uint32_t index = 0;
+    for (const auto& binding : layout.bindings) {
+        if (binding.descriptorCount == 0)
+            continue;
+        write.dstBinding = binding.binding;
+        write.descriptorType = binding.descriptorType;
+        write.pImageInfo = nullptr;
+        write.pBufferInfo = nullptr;
+        write.pTexelBufferView = nullptr;
+        if (is_texel_buffer_type(binding.descriptorType)) {
+            // Buffer views are smaller than DescriptorData, so they can't be read as one array
+            write.descriptorCount = 1;
+            for (uint32_t i = 0; i < binding.descriptorCount; ++i) {
+                write.dstArrayElement = i;
+                write.pTexelBufferView = &data[index + i].texel_buffer;
+                m_writes.push_back(write);
+            }
+            write.dstArrayElement = 0;
+        }
+        else {
+            write.descriptorCount = binding.descriptorCount;
+            if (is_image_type(binding.descriptorType))
+                write.pImageInfo = &data[index].image;
+            else
+                write.pBufferInfo = &data[index].buffer;
+            m_writes.push_back(write);
+        }
+        index += binding.descriptorCount;
+    }
+    vkUpdateDescriptorSets(m_device.vk(), static_cast<uint32_t>(m_writes.size()), m_writes.data(), 0, nullptr);
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(const DescriptorLayout& layout, const DescriptorData* data) {
+    ATLAS_TRACE_ZONE("DescriptorAllocator::allocate");
+    VkDescriptorSet set = allocate_from(m_frame_pools[m_frames.get_frame_index()], layout);
+    if (set)
+        update(set, layout, data);
+    return set;
+}
+
+void DescriptorAllocator::normalize(const DescriptorLayout& layout, const DescriptorData* data) {
+    DescriptorData zero;
+    memset(&zero, 0, sizeof(zero));
+    m_scratch.assign(layout.n_descriptors, zero);
+
+    uint32_t index = 0;
+    for (const auto& binding : layout.bindings) {
+        for (uint32_t i = index; i < index + binding.descriptorCount; ++i) {
+            switch (binding.descriptorType) {
+            case VK_DESCRIPTOR_TYPE_SAMPLER:
+                m_scratch[i].image.sampler = binding.pImmutableSamplers ? VK_NULL_HANDLE : data[i].image.sampler;
+                break;
+            case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+                m_scratch[i].image.sampler = binding.pImmutableSamplers ? VK_NULL_HANDLE : data[i].image.sampler;
+                m_scratch[i].image.imageView = data[i].image.imageView;
+                m_scratch[i].image.imageLayout = data[i].image.imageLayout;
+                break;
+            case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+            case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+            case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+                m_scratch[i].image.imageView = data[i].image.imageView;
+                m_scratch[i].image.imageLayout = data[i].image.imageLayout;
+                break;
+            case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+            case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
+                m_scratch[i].texel_buffer = data[i].texel_buffer;
+                break;
+            default:
+                m_scratch[i].buffer.buffer = data[i].buffer.buffer;
+                m_scratch[i].buffer.offset = data[i].buffer.offset;
+                m_scratch[i].buffer.range = data[i].buffer.range;
+                break;
+            }
+        }
+        index += binding.descriptorCount;
+    }
+}
+
+VkDescriptorSet DescriptorAllocator::get_static_set(const DescriptorLayout& layout, const DescriptorData* data) {
+    normalize(layout, data);
+    const size_t data_size = m_scratch.size() * sizeof(DescriptorData);
+    const uint64_t hash = hash_bytes(m_scratch.data(), data_size, layout.hash);
+
+    auto cached = m_static_sets.equal_range(hash);
+    for (auto iter = cached.first; iter != cached.second; ++iter) {
+        if (iter->second.layout == &layout && memcmp(iter->second.data.data(), m_scratch.data(), data_size) == 0)
+            return iter->second.set;
+    }
+
+    VkDescriptorSet set = allocate_from(m_static_pools, layout);
+    if (!set)
+        return VK_NULL_HANDLE;
+    update(set, layout, m_scratch.data());
+    m_static_sets.insert({ hash, { &layout, m_scratch, set } });
+    return set;
+}
@@ -0,0 +1,270 @@
+#include "frame.h"
+#include "trace.h"
+#include <algorithm>
+#include <assert.h>
+
+using namespace Atlas;
+using namespace Backend;
+
+// Command buffers are allocated this many at a time, so a frame that records more than the last one
+// doesn't pay for an allocation per buffer
+constexpr uint32_t command_buffer_batch_size = 4;
+
+FrameRing::FrameRing(Device& device, Window& window)
+    : m_device(device), m_window(window), m_n_threads(0), m_frame_index(0), m_frame_serial(1), m_retired_serial(0)
+    , m_staging(device)
+    , max_frames_in_flight(2), command_pool_flags(VK_COMMAND_POOL_CREATE_TRANSIENT_BIT), staging_size(8 * 1024 * 1024), sample_memory_stats(true)
+{ }
+
+FrameRing::~FrameRing() {
+    wait_idle();
+
+    for (auto iter = m_frames.rbegin(); iter != m_frames.rend(); ++iter) {
+        for (auto semaphore : iter->borrowed_semaphores)
+            vkDestroySemaphore(m_device.vk(), semaphore, nullptr);
+        for (auto fence : iter->borrowed_fences)
+            vkDestroyFence(m_device.vk(), fence, nullptr);
+        // Destroying the pools also frees their command buffers
+        for (auto pool = iter->command_pools.rbegin(); pool != iter->command_pools.rend(); ++pool) {
+            if (pool->pool)
+                vkDestroyCommandPool(m_device.vk(), pool->pool, nullptr);
+        }
+        if (iter->render_finished)
+            vkDestroySemaphore(m_device.vk(), iter->render_finished, nullptr);
+        if (iter->image_available)
+            vkDestroySemaphore(m_device.vk(), iter->image_available, nullptr);
+        if (iter->fence)
+            vkDestroyFence(m_device.vk(), iter->fence, nullptr);
+    }
+
+    for (auto semaphore : m_free_semaphores)
+        vkDestroySemaphore(m_device.vk(), semaphore, nullptr);
+    for (auto fence : m_free_fences)
+        vkDestroyFence(m_device.vk(), fence, nullptr);
+}
+
+bool FrameRing::init() {
+    if (max_frames_in_flight == 0) {
+        ATLAS_ERROR("FrameRing needs at least one frame in flight!");
+        return false;
+    }
+
+    VkFenceCreateInfo fence_info = {
+        VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,    // sType
+        nullptr,                                // pNext
+        0                                       // flags
+    };
+    VkSemaphoreCreateInfo semaphore_info = {
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,    // sType
+        nullptr,                                    // pNext
+        0                                           // flags
+    };
+    VkCommandPoolCreateInfo pool_info = {
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, // sType
+        nullptr,                                    // pNext
+        command_pool_flags                          // flags
+    };
+
+    if (staging_size > 0) {
+        m_staging.size = staging_size;
+        if (!m_staging.init()) return false;
+    }
+
+    // Zero everything first, so the destructor can clean up after a partial init
+    m_n_threads = m_device.n_threads;
+    FrameContext empty = {};
+    FrameCommandPool empty_pool = {};
+    empty.command_pools.assign(m_n_threads * QUEUE_FAMILY_COUNT, empty_pool);
+    m_frames.assign(max_frames_in_flight, empty);
+    VkResult res;
+    for (auto& frame : m_frames) {
+        res = vkCreateFence(m_device.vk(), &fence_info, nullptr, &frame.fence);
+        if (!validate(res)) return false;
+        res = vkCreateSemaphore(m_device.vk(), &semaphore_info, nullptr, &frame.image_available);
+        if (!validate(res)) return false;
+        res = vkCreateSemaphore(m_device.vk(), &semaphore_info, nullptr, &frame.render_finished);
+        if (!validate(res)) return false;
+
+        for (uint32_t thread = 0; thread < m_n_threads; ++thread) {
+            for (uint32_t i = QUEUE_FAMILY_FIRST; i < QUEUE_FAMILY_COUNT; ++i) {
+                pool_info.queueFamilyIndex = m_device.get_queue_family_index(static_cast<QueueFamily>(i));
+                res = vkCreateCommandPool(m_device.vk(), &pool_info, nullptr, &frame.command_pools[thread * QUEUE_FAMILY_COUNT + i].pool);
+                if (!validate(res)) return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool FrameRing::retire(FrameContext& frame, uint64_t timeout) {
+    VkResult res = vkWaitForFences(m_device.vk(), 1, &frame.fence, VK_TRUE, timeout);
+    if (res == VK_TIMEOUT || !validate(res)) return false;
+    res = vkResetFences(m_device.vk(), 1, &frame.fence);
+    if (!validate(res)) return false;
+    frame.submitted = false;
+
+    // Everything the frame recorded is done, so its pools and sync objects can be reused wholesale
+    for (auto& pool : frame.command_pools) {
+        if ( (pool.n_used[VK_COMMAND_BUFFER_LEVEL_PRIMARY] == 0) && (pool.n_used[VK_COMMAND_BUFFER_LEVEL_SECONDARY] == 0) )
+            continue;
+        // Returns every command buffer in the pool to the initial state, without freeing them
+        res = vkResetCommandPool(m_device.vk(), pool.pool, 0);
+        if (!validate(res)) return false;
+        pool.n_used[VK_COMMAND_BUFFER_LEVEL_PRIMARY] = 0;
+        pool.n_used[VK_COMMAND_BUFFER_LEVEL_SECONDARY] = 0;
+    }
+    if (!frame.borrowed_fences.empty()) {
+        res = vkResetFences(m_device.vk(), static_cast<uint32_t>(frame.borrowed_fences.size()), frame.borrowed_fences.data());
+        if (!validate(res)) return false;
+    }
+    m_free_semaphores.insert(m_free_semaphores.end(), frame.borrowed_semaphores.begin(), frame.borrowed_semaphores.end());
+    m_free_fences.insert(m_free_fences.end(), frame.borrowed_fences.begin(), frame.borrowed_fences.end());
+    frame.borrowed_semaphores.clear();
+    frame.borrowed_fences.clear();
+
+    // Frames are submitted to a single queue, so they retire in order
+    m_retired_serial = std::max(m_retired_serial, frame.serial);
+    m_staging.reclaim(m_retired_serial);
+    return true;
+}
+
+bool FrameRing::begin_frame(uint64_t timeout) {
+    ATLAS_TRACE_ZONE("FrameRing::begin_frame");
+    FrameContext& frame = m_frames[m_frame_index];
+    if (frame.submitted && !retire(frame, timeout))
+        return false;
+
+    frame.serial = m_frame_serial;
+    m_device.collect_deferred(m_frame_serial, m_retired_serial);
+    if (sample_memory_stats)
+        m_device.sample_memory_stats();
+    return m_window.acquire_next_frame(timeout, VK_NULL_HANDLE, frame.image_available);
+}
+
+bool FrameRing::end_frame(Span<VkCommandBuffer> command_buffers) {
+    ATLAS_TRACE_ZONE("FrameRing::end_frame");
+    FrameContext& frame = m_frames[m_frame_index];
+
+    if (m_staging.vk() && !m_staging.flush())
+        return false;
+
+    // The wait lists are cleared rather than freed, so they stop allocating once they've grown to fit
+    frame.wait_semaphores.push_back(frame.image_available);
+    frame.wait_stages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    VkSubmitInfo submit_info = {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,                      // sType
+        nullptr,                                            // pNext
+        static_cast<uint32_t>(frame.wait_semaphores.size()),    // waitSemaphoreCount
+        frame.wait_semaphores.data(),                       // pWaitSemaphores
+        frame.wait_stages.data(),                           // pWaitDstStageMask
+        static_cast<uint32_t>(command_buffers.size()),      // commandBufferCount
+        command_buffers.data(),                             // pCommandBuffers
+        1,                                                  // signalSemaphoreCount
+        &frame.render_finished                              // pSignalSemaphores
+    };
+    VkResult res = m_device.submit(m_device.get_queue(QUEUE_FAMILY_UNIVERSAL), 1, &submit_info, frame.fence);
+    frame.wait_semaphores.clear();
+    frame.wait_stages.clear();
+    if (!validate(res)) return false;
+    frame.submitted = true;
+
+    m_frame_index = (m_frame_index + 1) % m_frames.size();
+    ++m_frame_serial;
+
+    return m_window.present(Span<VkSemaphore>(&frame.render_finished, 1));
+}
+
+VkCommandBuffer FrameRing::get_command_buffer(QueueFamily family, uint32_t thread_index, VkCommandBufferLevel level) {
+    assert(thread_index < m_n_threads);
+    FrameCommandPool& pool = m_frames[m_frame_index].command_pools[thread_index * QUEUE_FAMILY_COUNT + family];
+    std::vector<VkCommandBuffer>& buffers = pool.buffers[level];
+
+    if (pool.n_used[level] == buffers.size()) {
+        VkCommandBufferAllocateInfo alloc_info = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, // sType
+            nullptr,                                        // pNext
+            pool.pool,                                      // commandPool
+            level,                                          // level
+            command_buffer_batch_size                       // commandBufferCount
+        };
+        buffers.resize(buffers.size() + command_buffer_batch_size);
+        VkResult res = vkAllocateCommandBuffers(m_device.vk(), &alloc_info, &buffers[pool.n_used[level]]);
+        if (!validate(res)) {
+            buffers.resize(pool.n_used[level]);
+            return VK_NULL_HANDLE;
+        }
+    }
+
+    return buffers[pool.n_used[level]++];
+}
+
+bool FrameRing::allocate_staging(VkDeviceSize size, VkDeviceSize alignment, StagingAllocation& allocation) {
+    if (!m_staging.vk()) {
+        ATLAS_ERROR("FrameRing was initialized without a staging ring!");
+        return false;
+    }
+    if (!m_staging.allocate(size, alignment, m_frame_serial, allocation)) {
+        ATLAS_ERROR("FrameRing staging ring is full; increase staging_size");
+        return false;
+    }
+    return true;
+}
+
+void FrameRing::add_wait_semaphore(VkSemaphore semaphore, VkPipelineStageFlags stages) {
+    FrameContext& frame = m_frames[m_frame_index];
+    frame.wait_semaphores.push_back(semaphore);
+    frame.wait_stages.push_back(stages);
+}
+
+VkSemaphore FrameRing::borrow_semaphore() {
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    if (!m_free_semaphores.empty()) {
+        semaphore = m_free_semaphores.back();
+        m_free_semaphores.pop_back();
+    }
+    else {
+        VkSemaphoreCreateInfo semaphore_info = {
+            VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,    // sType
+            nullptr,                                    // pNext
+            0                                           // flags
+        };
+        if (!validate(vkCreateSemaphore(m_device.vk(), &semaphore_info, nullptr, &semaphore)))
+            return VK_NULL_HANDLE;
+    }
+
+    m_frames[m_frame_index].borrowed_semaphores.push_back(semaphore);
+    return semaphore;
+}
+
+VkFence FrameRing::borrow_fence() {
+    VkFence fence = VK_NULL_HANDLE;
+    if (!m_free_fences.empty()) {
+        fence = m_free_fences.back();
+        m_free_fences.pop_back();
+    }
+    else {
+        VkFenceCreateInfo fence_info = {
+            VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,    // sType
+            nullptr,                                // pNext
+            0                                       // flags
+        };
+        if (!validate(vkCreateFence(m_device.vk(), &fence_info, nullptr, &fence)))
+            return VK_NULL_HANDLE;
+    }
+
+    m_frames[m_frame_index].borrowed_fences.push_back(fence);
+    return fence;
+}
+
+bool FrameRing::wait_idle() {
+    bool success = true;
+    // Oldest first, so the retired serial only ever moves forward
+    for (uint32_t i = 1; i <= m_frames.size(); ++i) {
+        FrameContext& frame = m_frames[(m_frame_index + i) % m_frames.size()];
+        if (frame.submitted)
+            success &= retire(frame, std::numeric_limits<uint64_t>::max());
+    }
+    m_device.collect_deferred(m_frame_serial, m_retired_serial);
+    return success;
+}
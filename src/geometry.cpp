@@ -0,0 +1,170 @@
+#include "geometry.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+void RangeAllocator::init(uint64_t capacity) {
+    m_capacity = capacity;
+    m_free_size = 0;
+    m_free_by_offset.clear();
+    m_free_by_size.clear();
+    if (capacity > 0)
+        free(0, capacity);
+}
+
+bool RangeAllocator::allocate(uint64_t size, uint64_t& offset) {
+    if (size == 0) {
+        offset = 0;
+        return true;
+    }
+    // Smallest free range that fits
+    auto best = m_free_by_size.lower_bound(size);
+    if (best == m_free_by_size.end())
+        return false;
+
+    const uint64_t range_size = best->first;
+    offset = best->second;
+    m_free_by_size.erase(best);
+    m_free_by_offset.erase(offset);
+    if (range_size > size) {
+        m_free_by_offset[offset + size] = range_size - size;
+        m_free_by_size.insert({ range_size - size, offset + size });
+    }
+    m_free_size -= size;
+    return true;
+}
+
+static void erase_by_size(std::multimap<uint64_t, uint64_t>& free_by_size, uint64_t size, uint64_t offset) {
+    auto sizes = free_by_size.equal_range(size);
+    for (auto iter = sizes.first; iter != sizes.second; ++iter) {
+        if (iter->second == offset) {
+            free_by_size.erase(iter);
+            return;
+        }
+    }
+}
+
+void RangeAllocator::free(uint64_t offset, uint64_t size) {
+    if (size == 0)
+        return;
+    m_free_size += size;
+
+    // Merge with the free ranges on either side
+    auto next = m_free_by_offset.lower_bound(offset);
+    if (next != m_free_by_offset.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            erase_by_size(m_free_by_size, prev->second, prev->first);
+            offset = prev->first;
+            size += prev->second;
+            m_free_by_offset.erase(prev);
+        }
+    }
+    if (next != m_free_by_offset.end() && offset + size == next->first) {
+        erase_by_size(m_free_by_size, next->second, next->first);
+        size += next->second;
+        m_free_by_offset.erase(next);
+    }
+    m_free_by_offset[offset] = size;
+    m_free_by_size.insert({ size, offset });
+}
+
+GeometryArena::GeometryArena(Device& device, UploadManager& uploads)
+    : m_device(device), m_uploads(uploads)
+    , m_vertex_buffer(VK_NULL_HANDLE), m_index_buffer(VK_NULL_HANDLE), m_n_meshes(0)
+    , vertex_stride(32), max_vertices(4 * 1024 * 1024), max_indices(12 * 1024 * 1024)
+{ }
+
+GeometryArena::~GeometryArena() {
+    // Ranges still waiting to come back don't matter anymore, but frames in flight may still draw from the buffers
+    m_device.cancel_deferred(this);
+    if (m_index_buffer)
+        m_device.destroy_deferred<DEFERRED_VMA_BUFFER>(m_index_buffer);
+    if (m_vertex_buffer)
+        m_device.destroy_deferred<DEFERRED_VMA_BUFFER>(m_vertex_buffer);
+}
+
+bool GeometryArena::init() {
+    if (vertex_stride == 0 || max_vertices == 0 || max_indices == 0) {
+        ATLAS_ERROR("GeometryArena needs a vertex stride and room for vertices and indices!");
+        return false;
+    }
+
+    VkBufferCreateInfo buffer_info = {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,   // sType
+        nullptr,                                // pNext
+        0,                                      // flags
+        VkDeviceSize(max_vertices) * vertex_stride, // size
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,       // usage
+        VK_SHARING_MODE_EXCLUSIVE,              // sharingMode
+        0,                                      // queueFamilyIndexCount
+        nullptr                                 // pQueueFamilyIndices
+    };
+    // Big enough to get blocks of their own anyway
+    VmaMemoryRequirements buffer_reqs = {
+        VK_TRUE,                    // ownMemory
+        VMA_MEMORY_USAGE_GPU_ONLY   // usage
+        // Fill rest with 0s
+    };
+    VkResult res = vmaCreateBuffer(m_device.get_allocator(), &buffer_info, &buffer_reqs, &m_vertex_buffer, nullptr, nullptr);
+    if (!validate(res)) return false;
+
+    buffer_info.size = VkDeviceSize(max_indices) * sizeof(uint32_t);
+    buffer_info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    res = vmaCreateBuffer(m_device.get_allocator(), &buffer_info, &buffer_reqs, &m_index_buffer, nullptr, nullptr);
+    if (!validate(res)) return false;
+
+    m_vertex_ranges.init(max_vertices);
+    m_index_ranges.init(max_indices);
+    return true;
+}
+
+bool GeometryArena::add_mesh(const void* vertices, uint32_t n_vertices, const uint32_t* indices, uint32_t n_indices, MeshRange& mesh) {
+    uint64_t first_vertex, first_index;
+    if (!m_vertex_ranges.allocate(n_vertices, first_vertex)) {
+        ATLAS_ERROR("GeometryArena is out of room for " + std::to_string(n_vertices) + " vertices!");
+        return false;
+    }
+    if (!m_index_ranges.allocate(n_indices, first_index)) {
+        m_vertex_ranges.free(first_vertex, n_vertices);
+        ATLAS_ERROR("GeometryArena is out of room for " + std::to_string(n_indices) + " indices!");
+        return false;
+    }
+    mesh = {
+        static_cast<uint32_t>(first_vertex),    // first_vertex
+        n_vertices,                             // n_vertices
+        static_cast<uint32_t>(first_index),     // first_index
+        n_indices                               // n_indices
+    };
+
+    bool success = m_uploads.upload_buffer(m_vertex_buffer, first_vertex * vertex_stride, vertices, VkDeviceSize(n_vertices) * vertex_stride,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+    success = success && m_uploads.upload_buffer(m_index_buffer, first_index * sizeof(uint32_t), indices, VkDeviceSize(n_indices) * sizeof(uint32_t),
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+    if (!success) {
+        // Nothing drew it yet, so the ranges can go straight back
+        m_vertex_ranges.free(first_vertex, n_vertices);
+        m_index_ranges.free(first_index, n_indices);
+        return false;
+    }
+
+    ++m_n_meshes;
+    return true;
+}
+
+void GeometryArena::remove_mesh(const MeshRange& mesh) {
+    m_device.release_deferred(this, [this, mesh]() {
+        m_vertex_ranges.free(mesh.first_vertex, mesh.n_vertices);
+        m_index_ranges.free(mesh.first_index, mesh.n_indices);
+    });
+    --m_n_meshes;
+}
+
+void GeometryArena::bind(VkCommandBuffer command_buffer, uint32_t vertex_binding) const {
+    const VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, vertex_binding, 1, &m_vertex_buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, m_index_buffer, 0, VK_INDEX_TYPE_UINT32);
+}
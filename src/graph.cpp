@@ -0,0 +1,804 @@
+#include "graph.h"
+#include "cache.h"
+#include "profiler.h"
+#include "trace.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+namespace {
+    struct UsageInfo {
+        // Zero for shader accesses, whose stages depend on the pass type
+        VkPipelineStageFlags stages;
+        VkAccessFlags access;
+        VkImageLayout layout;
+        VkImageUsageFlags image_usage;
+        bool is_write;
+        bool is_attachment;
+    };
+
+    const UsageInfo usage_infos[GRAPH_USAGE_COUNT] = {
+        // GRAPH_USAGE_COLOR_ATTACHMENT
+        {   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+            true, true },
+        // GRAPH_USAGE_DEPTH_ATTACHMENT
+        {   VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+            true, true },
+        // GRAPH_USAGE_DEPTH_READ
+        {   VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+            false, true },
+        // GRAPH_USAGE_SAMPLED
+        {   0,
+            VK_ACCESS_SHADER_READ_BIT,
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_IMAGE_USAGE_SAMPLED_BIT,
+            false, false },
+        // GRAPH_USAGE_STORAGE_READ
+        {   0,
+            VK_ACCESS_SHADER_READ_BIT,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_USAGE_STORAGE_BIT,
+            false, false },
+        // GRAPH_USAGE_STORAGE_WRITE
+        {   0,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_USAGE_STORAGE_BIT,
+            true, false },
+        // GRAPH_USAGE_UNIFORM
+        {   0,
+            VK_ACCESS_UNIFORM_READ_BIT,
+            VK_IMAGE_LAYOUT_UNDEFINED,
+            0,
+            false, false },
+        // GRAPH_USAGE_VERTEX
+        {   VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+            VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT,
+            VK_IMAGE_LAYOUT_UNDEFINED,
+            0,
+            false, false },
+        // GRAPH_USAGE_INDIRECT
+        {   VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+            VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+            VK_IMAGE_LAYOUT_UNDEFINED,
+            0,
+            false, false },
+        // GRAPH_USAGE_TRANSFER_SRC
+        {   VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_TRANSFER_READ_BIT,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            false, false },
+        // GRAPH_USAGE_TRANSFER_DST
+        {   VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+            true, false }
+    };
+
+    // TRANSIENT_ATTACHMENT images can't have any other usage
+    const VkImageUsageFlags lazy_usage_mask = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+        | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+
+    VkPipelineStageFlags get_stages(const UsageInfo& info, GraphPassType type) {
+        if (info.stages)
+            return info.stages;
+        switch (type) {
+        case GRAPH_PASS_GRAPHICS:
+            return VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        case GRAPH_PASS_COMPUTE:
+            return VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        default:
+            return VK_PIPELINE_STAGE_TRANSFER_BIT;
+        }
+    }
+
+    bool has_depth(VkFormat format) {
+        switch (format) {
+        case VK_FORMAT_D16_UNORM:
+        case VK_FORMAT_X8_D24_UNORM_PACK32:
+        case VK_FORMAT_D32_SFLOAT:
+        case VK_FORMAT_D16_UNORM_S8_UINT:
+        case VK_FORMAT_D24_UNORM_S8_UINT:
+        case VK_FORMAT_D32_SFLOAT_S8_UINT:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool has_stencil(VkFormat format) {
+        switch (format) {
+        case VK_FORMAT_S8_UINT:
+        case VK_FORMAT_D16_UNORM_S8_UINT:
+        case VK_FORMAT_D24_UNORM_S8_UINT:
+        case VK_FORMAT_D32_SFLOAT_S8_UINT:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    VkImageAspectFlags get_aspect(VkFormat format) {
+        VkImageAspectFlags aspect = 0;
+        if (has_depth(format))
+            aspect |= VK_IMAGE_ASPECT_DEPTH_BIT;
+        if (has_stencil(format))
+            aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+        return aspect ? aspect : VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+}
+
+RenderGraph::RenderGraph(Device& device)
+    : m_device(&device), m_profiler(nullptr), m_compiled(false), m_transient_bytes(0), m_unaliased_bytes(0), m_lazy_bytes(0)
+{ }
+
+RenderGraph::RenderGraph()
+    : m_device(nullptr), m_profiler(nullptr), m_compiled(false), m_transient_bytes(0), m_unaliased_bytes(0), m_lazy_bytes(0)
+{ }
+
+RenderGraph::~RenderGraph() {
+    release_compiled();
+}
+
+GraphResource RenderGraph::create_image(const char* name, const GraphImageInfo& info) {
+    Resource resource = {};
+    resource.name = name;
+    resource.is_image = true;
+    resource.transient = true;
+    resource.info = info;
+    resource.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resource.final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    m_resources.push_back(resource);
+    m_compiled = false;
+    return static_cast<GraphResource>(m_resources.size() - 1);
+}
+
+GraphResource RenderGraph::import_image(const char* name, const GraphImageInfo& info, VkImageLayout initial_layout, VkImageLayout final_layout, VkPipelineStageFlags initial_stages) {
+    Resource resource = {};
+    resource.name = name;
+    resource.is_image = true;
+    resource.output = (final_layout != VK_IMAGE_LAYOUT_UNDEFINED);
+    resource.info = info;
+    resource.initial_layout = initial_layout;
+    resource.final_layout = final_layout;
+    resource.initial_stages = initial_stages;
+    m_resources.push_back(resource);
+    m_compiled = false;
+    return static_cast<GraphResource>(m_resources.size() - 1);
+}
+
+GraphResource RenderGraph::import_buffer(const char* name, VkBuffer buffer) {
+    Resource resource = {};
+    resource.name = name;
+    resource.buffer = buffer;
+    resource.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resource.final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    m_resources.push_back(resource);
+    m_compiled = false;
+    return static_cast<GraphResource>(m_resources.size() - 1);
+}
+
+void RenderGraph::set_image(GraphResource resource, VkImage image, VkImageView view) {
+    m_resources[resource].image = image;
+    m_resources[resource].view = view;
+}
+
+void RenderGraph::set_buffer(GraphResource resource, VkBuffer buffer) {
+    m_resources[resource].buffer = buffer;
+}
+
+void RenderGraph::set_image_extent(GraphResource resource, VkExtent2D extent) {
+    m_resources[resource].info.extent = extent;
+    m_compiled = false;
+}
+
+void RenderGraph::mark_output(GraphResource resource) {
+    m_resources[resource].output = true;
+    m_compiled = false;
+}
+
+uint32_t RenderGraph::add_pass(const char* name, GraphPassType type, const PassRecordFunction& record) {
+    Pass pass = {};
+    pass.name = name;
+    pass.type = type;
+    pass.record = record;
+    m_passes.push_back(pass);
+    m_compiled = false;
+    return static_cast<uint32_t>(m_passes.size() - 1);
+}
+
+void RenderGraph::use(uint32_t pass, GraphResource resource, GraphUsage usage, const VkClearValue* clear_value) {
+    Use use = {};
+    use.resource = resource;
+    use.usage = usage;
+    if (clear_value) {
+        use.clear = true;
+        use.clear_value = *clear_value;
+    }
+    m_passes[pass].uses.push_back(use);
+    m_compiled = false;
+}
+
+void RenderGraph::set_side_effects(uint32_t pass) {
+    m_passes[pass].side_effects = true;
+    m_compiled = false;
+}
+
+void RenderGraph::release_compiled() {
+    // Render passes and framebuffers belong to the object cache
+    for (Pass& pass : m_passes) {
+        pass.renderpass = VK_NULL_HANDLE;
+        pass.barriers.clear();
+        pass.attachments.clear();
+        pass.descriptions.clear();
+        pass.clear_values.clear();
+        pass.dependency = VkSubpassDependency();
+    }
+    for (Resource& resource : m_resources) {
+        if (!resource.transient)
+            continue;
+        if (resource.view) {
+            m_device->get_object_cache().evict_image_view(resource.view);
+            m_device->destroy_deferred<DEFERRED_IMAGE_VIEW>(resource.view);
+        }
+        if (resource.image && resource.lazy)
+            m_device->destroy_deferred<DEFERRED_VMA_IMAGE>(resource.image);
+        else if (resource.image)
+            m_device->destroy_deferred<DEFERRED_IMAGE>(resource.image);
+        resource.view = VK_NULL_HANDLE;
+        resource.image = VK_NULL_HANDLE;
+    }
+    for (const MemorySlot& slot : m_slots) {
+        if (slot.memory.memory)
+            m_device->destroy_deferred(slot.memory);
+    }
+    m_slots.clear();
+    m_final_barriers.clear();
+    m_transient_bytes = 0;
+    m_unaliased_bytes = 0;
+    m_lazy_bytes = 0;
+    m_compiled = false;
+}
+
+void RenderGraph::cull() {
+    // Walk backwards from the outputs, keeping the passes that write something a kept pass needs
+    std::vector<bool> needed(m_resources.size());
+    for (size_t i = 0; i < m_resources.size(); ++i)
+        needed[i] = m_resources[i].output;
+
+    for (size_t i = m_passes.size(); i-- > 0;) {
+        Pass& pass = m_passes[i];
+        pass.culled = !pass.side_effects;
+        for (const Use& use : pass.uses) {
+            if (usage_infos[use.usage].is_write && needed[use.resource])
+                pass.culled = false;
+        }
+        if (pass.culled)
+            continue;
+        // Anything not cleared may be loaded, so earlier writers are needed too
+        for (const Use& use : pass.uses) {
+            if (!use.clear)
+                needed[use.resource] = true;
+        }
+    }
+}
+
+void RenderGraph::find_lifetimes() {
+    cull();
+    for (Resource& resource : m_resources) {
+        resource.first_pass = invalid_graph_resource;
+        resource.last_pass = invalid_graph_resource;
+        resource.usage = 0;
+        resource.slot = invalid_graph_resource;
+        resource.lazy = false;
+    }
+    for (uint32_t p = 0; p < m_passes.size(); ++p) {
+        if (m_passes[p].culled)
+            continue;
+        for (const Use& use : m_passes[p].uses) {
+            Resource& resource = m_resources[use.resource];
+            if (resource.first_pass == invalid_graph_resource)
+                resource.first_pass = p;
+            resource.last_pass = p;
+            resource.usage |= usage_infos[use.usage].image_usage;
+        }
+    }
+}
+
+bool RenderGraph::create_transients(std::vector<VkMemoryRequirements>& reqs) {
+    reqs.assign(m_resources.size(), VkMemoryRequirements());
+    for (GraphResource i = 0; i < m_resources.size(); ++i) {
+        Resource& resource = m_resources[i];
+        if (!resource.transient || resource.first_pass == invalid_graph_resource)
+            continue;
+
+        VkImageCreateInfo image_info = {
+            VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,    // sType
+            nullptr,                                // pNext
+            0,                                      // flags
+            VK_IMAGE_TYPE_2D,                       // imageType
+            resource.info.format,                   // format
+            {   resource.info.extent.width,
+                resource.info.extent.height,
+                1
+            },                                      // extent
+            1,                                      // mipLevels
+            1,                                      // arrayLayers
+            resource.info.samples,                  // samples
+            VK_IMAGE_TILING_OPTIMAL,                // tiling
+            resource.usage,                         // usage
+            VK_SHARING_MODE_EXCLUSIVE,              // sharingMode
+            0,                                      // queueFamilyIndexCount
+            nullptr,                                // pQueueFamilyIndices
+            VK_IMAGE_LAYOUT_UNDEFINED               // initialLayout
+        };
+        // Attachments that live and die inside one render pass don't need memory of their own on tiled GPUs
+        resource.lazy = m_device->supports_lazy_allocation() && (resource.first_pass == resource.last_pass) && !(resource.usage & ~lazy_usage_mask);
+        if (resource.lazy) {
+            VkDeviceSize lazy_bytes;
+            if (!m_device->create_transient_attachment(image_info, resource.image, lazy_bytes))
+                return false;
+            m_lazy_bytes += lazy_bytes;
+            continue;
+        }
+        VkResult res = vkCreateImage(m_device->vk(), &image_info, nullptr, &resource.image);
+        if (!validate(res)) return false;
+        vkGetImageMemoryRequirements(m_device->vk(), resource.image, &reqs[i]);
+    }
+    return true;
+}
+
+void RenderGraph::assign_slots(const std::vector<VkMemoryRequirements>& reqs) {
+    std::vector<GraphResource> order;
+    for (GraphResource i = 0; i < m_resources.size(); ++i) {
+        Resource& resource = m_resources[i];
+        if (!resource.transient || resource.first_pass == invalid_graph_resource)
+            continue;
+        // Lazy images get a slot to themselves, which has no memory (and so no memory types to match)
+        if (resource.lazy) {
+            MemorySlot slot = {};
+            slot.residents.push_back(i);
+            m_slots.push_back(slot);
+            resource.slot = static_cast<uint32_t>(m_slots.size() - 1);
+            continue;
+        }
+        m_unaliased_bytes += reqs[i].size;
+        order.push_back(i);
+    }
+
+    // Biggest first, so smaller images fill in around them
+    std::stable_sort(order.begin(), order.end(), [&reqs](GraphResource a, GraphResource b) {
+        return reqs[a].size > reqs[b].size;
+    });
+    for (GraphResource i : order) {
+        Resource& resource = m_resources[i];
+        uint32_t slot_index = 0;
+        for (; slot_index < m_slots.size(); ++slot_index) {
+            const MemorySlot& slot = m_slots[slot_index];
+            if (!(slot.reqs.memoryTypeBits & reqs[i].memoryTypeBits))
+                continue;
+            const bool overlaps = std::any_of(slot.residents.begin(), slot.residents.end(), [this, &resource](GraphResource other) {
+                return m_resources[other].first_pass <= resource.last_pass && resource.first_pass <= m_resources[other].last_pass;
+            });
+            if (!overlaps)
+                break;
+        }
+        if (slot_index == m_slots.size()) {
+            MemorySlot slot = {};
+            slot.reqs = reqs[i];
+            m_slots.push_back(slot);
+        }
+        MemorySlot& slot = m_slots[slot_index];
+        slot.reqs.size = std::max(slot.reqs.size, reqs[i].size);
+        slot.reqs.alignment = std::max(slot.reqs.alignment, reqs[i].alignment);
+        slot.reqs.memoryTypeBits &= reqs[i].memoryTypeBits;
+        slot.residents.push_back(i);
+        resource.slot = slot_index;
+    }
+
+    for (MemorySlot& slot : m_slots) {
+        std::sort(slot.residents.begin(), slot.residents.end(), [this](GraphResource a, GraphResource b) {
+            return m_resources[a].first_pass < m_resources[b].first_pass;
+        });
+        if (!m_resources[slot.residents.front()].lazy)
+            m_transient_bytes += slot.reqs.size;
+    }
+}
+
+bool RenderGraph::bind_transients() {
+    VmaMemoryRequirements mem_reqs = {
+        VK_FALSE,                   // ownMemory
+        VMA_MEMORY_USAGE_GPU_ONLY   // usage
+        // Fill rest with 0s
+    };
+    for (MemorySlot& slot : m_slots) {
+        if (m_resources[slot.residents.front()].lazy)
+            continue;
+        VkResult res = vmaAllocateMemory(m_device->get_allocator(), &slot.reqs, &mem_reqs, &slot.memory, nullptr);
+        if (!validate(res)) return false;
+
+        for (GraphResource i : slot.residents) {
+            res = vkBindImageMemory(m_device->vk(), m_resources[i].image, slot.memory.memory, slot.memory.offset);
+            if (!validate(res)) return false;
+        }
+    }
+
+    for (Resource& resource : m_resources) {
+        if (!resource.transient || !resource.image)
+            continue;
+        VkImageViewCreateInfo view_info = {
+            VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,   // sType
+            nullptr,                                    // pNext
+            0,                                          // flags
+            resource.image,                             // image
+            VK_IMAGE_VIEW_TYPE_2D,                      // viewType
+            resource.info.format,                       // format
+            {   VK_COMPONENT_SWIZZLE_R,
+                VK_COMPONENT_SWIZZLE_G,
+                VK_COMPONENT_SWIZZLE_B,
+                VK_COMPONENT_SWIZZLE_A
+            },                                          // components
+            {   get_aspect(resource.info.format),       // aspectMask
+                0,                                      // baseMipLevel
+                1,                                      // levelCount
+                0,                                      // baseArrayLayer
+                1,                                      // layerCount
+            }                                           // subresourceRange
+        };
+        VkResult res = vkCreateImageView(m_device->vk(), &view_info, nullptr, &resource.view);
+        if (!validate(res)) return false;
+    }
+    return true;
+}
+
+void RenderGraph::plan_barriers() {
+    std::vector<AccessState> states(m_resources.size());
+    std::vector<bool> has_content(m_resources.size());
+    for (size_t i = 0; i < m_resources.size(); ++i) {
+        const Resource& resource = m_resources[i];
+        AccessState& state = states[i];
+        state = {};
+        state.layout = resource.initial_layout;
+        // Imported buffers are synchronized by whoever wrote them
+        if (resource.is_image && !resource.transient) {
+            state.write_stages = resource.initial_stages;
+            state.write_access = VK_ACCESS_MEMORY_WRITE_BIT;
+        }
+        has_content[i] = !resource.transient && (!resource.is_image || resource.initial_layout != VK_IMAGE_LAYOUT_UNDEFINED);
+    }
+
+    std::vector<WrapPatch> patches;
+    for (uint32_t p = 0; p < m_passes.size(); ++p) {
+        Pass& pass = m_passes[p];
+        if (pass.culled)
+            continue;
+        pass.dependency = {
+            VK_SUBPASS_EXTERNAL,    // srcSubpass
+            0,                      // dstSubpass
+            0,                      // srcStageMask
+            0,                      // dstStageMask
+            0,                      // srcAccessMask
+            0,                      // dstAccessMask
+            0                       // dependencyFlags
+        };
+
+        for (const Use& use : pass.uses) {
+            const Resource& resource = m_resources[use.resource];
+            const UsageInfo& info = usage_infos[use.usage];
+            AccessState& state = states[use.resource];
+
+            // Aliased memory has to wait for the image that used it before; the first image in a slot
+            // waits for the last one of the previous frame, which is patched in below
+            bool wraps = false;
+            if (resource.transient && resource.first_pass == p) {
+                const std::vector<GraphResource>& residents = m_slots[resource.slot].residents;
+                const auto iter = std::find(residents.begin(), residents.end(), use.resource);
+                if (iter == residents.begin()) {
+                    wraps = true;
+                } else {
+                    const AccessState& previous = states[*(iter - 1)];
+                    state.write_stages = previous.write_stages | previous.read_stages;
+                    state.write_access = previous.write_access;
+                }
+                if (!info.is_write && !use.clear)
+                    ATLAS_WARNING("Render graph image " + std::string(resource.name) + " is read before anything writes it");
+            }
+
+            const VkImageLayout old_layout = state.layout;
+            AccessTransition transition;
+            const bool needs_barrier = update_access_state(state, get_stages(info, pass.type), info.access, resource.is_image ? info.layout : VK_IMAGE_LAYOUT_UNDEFINED,
+                info.is_write || use.clear, resource.is_image, transition);
+            const Barrier barrier = {
+                use.resource,               // resource
+                transition.src_stages,      // src_stages
+                transition.dst_stages,      // dst_stages
+                transition.src_access,      // src_access
+                transition.dst_access,      // dst_access
+                transition.old_layout,      // old_layout
+                transition.new_layout       // new_layout
+            };
+
+            if (info.is_attachment && pass.type == GRAPH_PASS_GRAPHICS) {
+                // The render pass does the layout transition, synchronized by its external dependency
+                if (needs_barrier) {
+                    pass.dependency.srcStageMask |= barrier.src_stages;
+                    pass.dependency.dstStageMask |= barrier.dst_stages;
+                    pass.dependency.srcAccessMask |= barrier.src_access;
+                    pass.dependency.dstAccessMask |= barrier.dst_access;
+                    if (wraps)
+                        patches.push_back({ p, invalid_graph_resource, resource.slot });
+                }
+                const VkAttachmentLoadOp load_op = use.clear ? VK_ATTACHMENT_LOAD_OP_CLEAR
+                    : (has_content[use.resource] ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE);
+                // Nobody looks at transients after their last pass
+                const VkAttachmentStoreOp store_op = (!resource.transient || resource.last_pass > p) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                const bool stencil = has_stencil(resource.info.format);
+                const VkAttachmentDescription attachment = {
+                    0,                                                                      // flags
+                    resource.info.format,                                                   // format
+                    resource.info.samples,                                                  // samples
+                    load_op,                                                                // loadOp
+                    store_op,                                                               // storeOp
+                    stencil ? load_op : VK_ATTACHMENT_LOAD_OP_DONT_CARE,                    // stencilLoadOp
+                    stencil ? store_op : VK_ATTACHMENT_STORE_OP_DONT_CARE,                  // stencilStoreOp
+                    (load_op == VK_ATTACHMENT_LOAD_OP_LOAD) ? old_layout : VK_IMAGE_LAYOUT_UNDEFINED, // initialLayout
+                    info.layout                                                             // finalLayout
+                };
+                pass.descriptions.push_back(attachment);
+                pass.attachments.push_back(use.resource);
+                pass.clear_values.push_back(use.clear_value);
+                pass.extent = resource.info.extent;
+            } else if (needs_barrier) {
+                pass.barriers.push_back(barrier);
+                if (wraps)
+                    patches.push_back({ p, static_cast<uint32_t>(pass.barriers.size() - 1), resource.slot });
+            }
+            if (info.is_write || use.clear)
+                has_content[use.resource] = true;
+        }
+    }
+
+    for (const WrapPatch& patch : patches) {
+        const AccessState& last = states[m_slots[patch.slot].residents.back()];
+        if (patch.barrier == invalid_graph_resource) {
+            m_passes[patch.pass].dependency.srcStageMask |= last.write_stages | last.read_stages;
+            m_passes[patch.pass].dependency.srcAccessMask |= last.write_access;
+        } else {
+            m_passes[patch.pass].barriers[patch.barrier].src_stages |= last.write_stages | last.read_stages;
+            m_passes[patch.pass].barriers[patch.barrier].src_access |= last.write_access;
+        }
+    }
+
+    // Hand imported images back in the layout they're expected in
+    for (GraphResource i = 0; i < m_resources.size(); ++i) {
+        const Resource& resource = m_resources[i];
+        const AccessState& state = states[i];
+        if (!resource.is_image || resource.transient || resource.final_layout == VK_IMAGE_LAYOUT_UNDEFINED || state.layout == resource.final_layout)
+            continue;
+        const VkPipelineStageFlags src_stages = state.write_stages | state.read_stages;
+        const Barrier barrier = {
+            i,                                                          // resource
+            src_stages ? src_stages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,// src_stages
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,                       // dst_stages
+            state.write_access,                                         // src_access
+            0,                                                          // dst_access
+            state.layout,                                               // old_layout
+            resource.final_layout                                       // new_layout
+        };
+        m_final_barriers.push_back(barrier);
+    }
+}
+
+bool RenderGraph::plan(const std::vector<VkMemoryRequirements>& reqs) {
+    release_compiled();
+    find_lifetimes();
+    assign_slots(reqs);
+    plan_barriers();
+    return true;
+}
+
+bool RenderGraph::compile() {
+    ATLAS_TRACE_ZONE("RenderGraph::compile");
+    if (!m_device) {
+        ATLAS_ERROR("Render graph needs a device to be compiled!");
+        return false;
+    }
+    release_compiled();
+    find_lifetimes();
+    std::vector<VkMemoryRequirements> reqs;
+    if (!create_transients(reqs))
+        return false;
+    assign_slots(reqs);
+    if (!bind_transients())
+        return false;
+    plan_barriers();
+
+    for (Pass& pass : m_passes) {
+        if (pass.culled || pass.type != GRAPH_PASS_GRAPHICS)
+            continue;
+        if (pass.attachments.empty()) {
+            ATLAS_ERROR("Render graph pass " + std::string(pass.name) + " is a graphics pass without attachments!");
+            return false;
+        }
+        if (!create_renderpass(pass))
+            return false;
+    }
+
+    m_compiled = true;
+    return true;
+}
+
+bool RenderGraph::create_renderpass(Pass& pass) {
+    const std::vector<VkAttachmentDescription>& attachments = pass.descriptions;
+    const VkSubpassDependency* dependency = pass.dependency.srcStageMask ? &pass.dependency : nullptr;
+    std::vector<VkAttachmentReference> color_refs;
+    VkAttachmentReference depth_ref = { VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_UNDEFINED };
+    for (uint32_t i = 0; i < attachments.size(); ++i) {
+        if (attachments[i].finalLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+            color_refs.push_back({ i, attachments[i].finalLayout });
+        else
+            depth_ref = { i, attachments[i].finalLayout };
+    }
+
+    VkSubpassDescription subpass = {
+        0,                                                                              // flags
+        VK_PIPELINE_BIND_POINT_GRAPHICS,                                                // pipelineBindPoint
+        0,                                                                              // inputAttachmentCount
+        nullptr,                                                                        // pInputAttachments
+        static_cast<uint32_t>(color_refs.size()),                                       // colorAttachmentCount
+        color_refs.data(),                                                              // pColorAttachments
+        nullptr,                                                                        // pResolveAttachments
+        (depth_ref.attachment != VK_ATTACHMENT_UNUSED) ? &depth_ref : nullptr,          // pDepthStencilAttachment
+        0,                                                                              // preserveAttachmentCount
+        nullptr                                                                         // pPreserveAttachments
+    };
+    VkRenderPassCreateInfo rp_info = {
+        VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,      // sType
+        nullptr,                                        // pNext
+        0,                                              // flags
+        static_cast<uint32_t>(attachments.size()),      // attachmentCount
+        attachments.data(),                             // pAttachments
+        1,                                              // subpassCount
+        &subpass,                                       // pSubpasses
+        dependency ? 1u : 0u,                           // dependencyCount
+        dependency                                      // pDependencies
+    };
+    pass.renderpass = m_device->get_object_cache().get_render_pass(rp_info);
+    return (pass.renderpass != VK_NULL_HANDLE);
+}
+
+VkFramebuffer RenderGraph::get_framebuffer(const Pass& pass) {
+    m_views.clear();
+    for (GraphResource i : pass.attachments) {
+        const VkImageView view = m_resources[i].view;
+        if (!view) {
+            ATLAS_ERROR("Render graph image " + std::string(m_resources[i].name) + " has no view!");
+            return VK_NULL_HANDLE;
+        }
+        m_views.push_back(view);
+    }
+
+    VkFramebufferCreateInfo framebuffer_info = {
+        VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,  // sType
+        nullptr,                                    // pNext
+        0,                                          // flags
+        pass.renderpass,                            // renderPass
+        static_cast<uint32_t>(m_views.size()),      // attachmentCount
+        m_views.data(),                             // pAttachments
+        pass.extent.width,                          // width
+        pass.extent.height,                         // height
+        1                                           // layers
+    };
+    return m_device->get_object_cache().get_framebuffer(framebuffer_info);
+}
+
+void RenderGraph::record_barriers(VkCommandBuffer command_buffer, const std::vector<Barrier>& barriers) {
+    if (barriers.empty())
+        return;
+
+    // Buffers share a single global barrier; images need one each for their layouts
+    VkMemoryBarrier memory_barrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,   // sType
+        nullptr,                            // pNext
+        0,                                  // srcAccessMask
+        0                                   // dstAccessMask
+    };
+    VkPipelineStageFlags src_stages = 0;
+    VkPipelineStageFlags dst_stages = 0;
+    m_image_barriers.clear();
+    for (const Barrier& barrier : barriers) {
+        const Resource& resource = m_resources[barrier.resource];
+        src_stages |= barrier.src_stages;
+        dst_stages |= barrier.dst_stages;
+        if (!resource.is_image) {
+            memory_barrier.srcAccessMask |= barrier.src_access;
+            memory_barrier.dstAccessMask |= barrier.dst_access;
+            continue;
+        }
+        const VkImageMemoryBarrier image_barrier = {
+            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,     // sType
+            nullptr,                                    // pNext
+            barrier.src_access,                         // srcAccessMask
+            barrier.dst_access,                         // dstAccessMask
+            barrier.old_layout,                         // oldLayout
+            barrier.new_layout,                         // newLayout
+            VK_QUEUE_FAMILY_IGNORED,                    // srcQueueFamilyIndex
+            VK_QUEUE_FAMILY_IGNORED,                    // dstQueueFamilyIndex
+            resource.image,                             // image
+            {   get_aspect(resource.info.format),       // aspectMask
+                0,                                      // baseMipLevel
+                VK_REMAINING_MIP_LEVELS,                // levelCount
+                0,                                      // baseArrayLayer
+                VK_REMAINING_ARRAY_LAYERS               // layerCount
+            }                                           // subresourceRange
+        };
+        m_image_barriers.push_back(image_barrier);
+    }
+    const uint32_t n_memory_barriers = (memory_barrier.srcAccessMask || memory_barrier.dstAccessMask) ? 1 : 0;
+    vkCmdPipelineBarrier(command_buffer, src_stages, dst_stages, 0,
+        n_memory_barriers, &memory_barrier,
+        0, nullptr,
+        static_cast<uint32_t>(m_image_barriers.size()), m_image_barriers.data());
+}
+
+bool RenderGraph::execute(VkCommandBuffer command_buffer) {
+    ATLAS_TRACE_ZONE("RenderGraph::execute");
+    if (!m_compiled) {
+        ATLAS_ERROR("Render graph has to be compiled before it's executed!");
+        return false;
+    }
+    for (const Resource& resource : m_resources) {
+        if (resource.is_image && !resource.transient && !resource.image && (resource.first_pass != invalid_graph_resource || resource.final_layout != VK_IMAGE_LAYOUT_UNDEFINED)) {
+            ATLAS_ERROR("Render graph image " + std::string(resource.name) + " was imported without setting its image!");
+            return false;
+        }
+    }
+
+    for (uint32_t p = 0; p < m_passes.size(); ++p) {
+        Pass& pass = m_passes[p];
+        if (pass.culled)
+            continue;
+        const uint32_t scope = m_profiler ? m_profiler->begin_scope(command_buffer, pass.name) : 0;
+        record_barriers(command_buffer, pass.barriers);
+        if (pass.type != GRAPH_PASS_GRAPHICS) {
+            pass.record(command_buffer, p);
+            if (m_profiler)
+                m_profiler->end_scope(command_buffer, scope);
+            continue;
+        }
+
+        const VkFramebuffer framebuffer = get_framebuffer(pass);
+        if (!framebuffer)
+            return false;
+        VkRenderPassBeginInfo begin_info = {
+            VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,               // sType
+            nullptr,                                                // pNext
+            pass.renderpass,                                        // renderPass
+            framebuffer,                                            // framebuffer
+            {   { 0, 0 },
+                pass.extent
+            },                                                      // renderArea
+            static_cast<uint32_t>(pass.clear_values.size()),        // clearValueCount
+            pass.clear_values.data()                                // pClearValues
+        };
+        vkCmdBeginRenderPass(command_buffer, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+        pass.record(command_buffer, p);
+        vkCmdEndRenderPass(command_buffer);
+        if (m_profiler)
+            m_profiler->end_scope(command_buffer, scope);
+    }
+    record_barriers(command_buffer, m_final_barriers);
+    return true;
+}
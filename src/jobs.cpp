@@ -0,0 +1,257 @@
+#include "jobs.h"
+#include <algorithm>
+#include <chrono>
+#include <assert.h>
+
+using namespace Atlas;
+using namespace Backend;
+
+constexpr int64_t job_index_mask = JobSystem::max_jobs_per_worker - 1;
+// Times an idle worker looks for work before going to sleep
+constexpr uint32_t n_idle_spins = 64;
+
+// Set to 0 by init() for the calling thread and to the worker's index for job system threads
+static thread_local uint32_t t_worker_index = JobSystem::invalid_worker_index;
+
+//
+// Chase-Lev deque
+// (see "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al. 2013)
+//
+
+bool JobSystem::JobDeque::push(Job* job) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= static_cast<int64_t>(max_jobs_per_worker))
+        return false;
+
+    jobs[b & job_index_mask].store(job, std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+Job* JobSystem::JobDeque::pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Job* job = jobs[b & job_index_mask].load(std::memory_order_relaxed);
+    if (t == b) {
+        // Last job; race any thieves for it
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            job = nullptr;
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return job;
+}
+
+Job* JobSystem::JobDeque::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b)
+        return nullptr;
+
+    Job* job = jobs[t & job_index_mask].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return nullptr;
+    return job;
+}
+
+//
+// Job system
+//
+
+JobSystem::JobSystem(uint32_t n_workers)
+    : m_n_workers(std::max(1u, n_workers)), m_shutdown(false), m_n_queued(0), m_n_sleeping(0)
+{ }
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_shutdown = true;
+    }
+    m_wake.notify_all();
+    for (auto& worker : m_workers) {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+}
+
+bool JobSystem::init() {
+    m_workers.reserve(m_n_workers);
+    for (uint32_t i = 0; i < m_n_workers; ++i) {
+        m_workers.emplace_back(new Worker());
+        m_workers.back()->next_job = 0;
+        for (Job& job : m_workers.back()->jobs)
+            job.in_flight.store(false, std::memory_order_relaxed);
+    }
+
+    // Worker 0 is the calling thread
+    t_worker_index = 0;
+    for (uint32_t i = 1; i < m_n_workers; ++i)
+        m_workers[i]->thread = std::thread(&JobSystem::worker_main, this, i);
+
+    return true;
+}
+
+uint32_t JobSystem::get_worker_index() {
+    return t_worker_index;
+}
+
+void JobSystem::worker_main(uint32_t worker_index) {
+    t_worker_index = worker_index;
+
+    uint32_t n_spins = 0;
+    while (!m_shutdown.load(std::memory_order_relaxed)) {
+        Job* job = find_job(worker_index);
+        if (job) {
+            execute(job, worker_index);
+            n_spins = 0;
+        }
+        else if (++n_spins < n_idle_spins) {
+            std::this_thread::yield();
+        }
+        else {
+            // Sleep until more work is queued. The timeout covers a push racing with falling asleep
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            ++m_n_sleeping;
+            m_wake.wait_for(lock, std::chrono::milliseconds(1), [&] {
+                return m_shutdown.load(std::memory_order_relaxed) || (m_n_queued.load(std::memory_order_relaxed) > 0);
+            });
+            --m_n_sleeping;
+            n_spins = 0;
+        }
+    }
+}
+
+Job* JobSystem::find_job(uint32_t worker_index) {
+    Job* job = m_workers[worker_index]->deque.pop();
+    if (!job) {
+        // Steal from the other workers, starting with the next one so thieves spread out
+        for (uint32_t i = 1; i < m_n_workers && !job; ++i)
+            job = m_workers[(worker_index + i) % m_n_workers]->deque.steal();
+    }
+    if (job)
+        m_n_queued.fetch_sub(1, std::memory_order_relaxed);
+    return job;
+}
+
+void JobSystem::push(Job* job, uint32_t worker_index) {
+    // If the deque is full, make room by running jobs until one fits
+    while (!m_workers[worker_index]->deque.push(job)) {
+        Job* other = find_job(worker_index);
+        if (other)
+            execute(other, worker_index);
+    }
+
+    m_n_queued.fetch_add(1, std::memory_order_relaxed);
+    if (m_n_sleeping.load(std::memory_order_relaxed) > 0)
+        m_wake.notify_one();
+}
+
+bool JobSystem::execute(Job* job, uint32_t worker_index) {
+    if (job->dependency && !job->dependency->is_done()) {
+        // Popping would hand this job straight back, so give the oldest queued job a turn first
+        // (that's usually what it's waiting for)
+        Job* oldest = m_workers[worker_index]->deque.steal();
+        push(job, worker_index);
+        if (oldest) {
+            m_n_queued.fetch_sub(1, std::memory_order_relaxed);
+            if (oldest->dependency && !oldest->dependency->is_done())
+                push(oldest, worker_index);
+            else
+                invoke(oldest, worker_index);
+        }
+        return false;
+    }
+
+    invoke(job, worker_index);
+    return true;
+}
+
+void JobSystem::invoke(Job* job, uint32_t worker_index) {
+    job->function(worker_index, *job);
+
+    // The slot can be reused as soon as it's released, so read the counter first
+    JobCounter* counter = job->counter;
+    job->in_flight.store(false, std::memory_order_release);
+    if (counter)
+        counter->value.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+Job* JobSystem::allocate_job(uint32_t worker_index) {
+    Worker& worker = *m_workers[worker_index];
+    for (;;) {
+        // Only the owning worker hands out its slots, so finding a free one is enough to claim it
+        for (uint32_t i = 0; i < max_jobs_per_worker; ++i) {
+            Job* job = &worker.jobs[worker.next_job++ & job_index_mask];
+            if (!job->in_flight.load(std::memory_order_acquire)) {
+                job->in_flight.store(true, std::memory_order_relaxed);
+                return job;
+            }
+        }
+
+        // Every slot is queued or running somewhere; help out until one finishes
+        Job* other = find_job(worker_index);
+        if (other)
+            execute(other, worker_index);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void JobSystem::run(JobFunction function, void* data, uint32_t first, uint32_t count, JobCounter* counter, const JobCounter* dependency) {
+    const uint32_t worker_index = t_worker_index;
+    assert(worker_index < m_n_workers && "JobSystem::run() called from a thread that isn't a worker");
+
+    Job* job = allocate_job(worker_index);
+    job->function = function;
+    job->data = data;
+    job->first = first;
+    job->count = count;
+    job->counter = counter;
+    job->dependency = dependency;
+
+    if (counter)
+        counter->value.fetch_add(1, std::memory_order_relaxed);
+    push(job, worker_index);
+}
+
+void JobSystem::wait(const JobCounter& counter) {
+    const uint32_t worker_index = t_worker_index;
+    assert(worker_index < m_n_workers && "JobSystem::wait() called from a thread that isn't a worker");
+    while (!counter.is_done()) {
+        Job* job = find_job(worker_index);
+        if (job)
+            execute(job, worker_index);
+        else
+            std::this_thread::yield();
+    }
+}
+
+typedef std::function<void(uint32_t worker_index, uint32_t first, uint32_t count)> ParallelForFunction;
+
+static void parallel_for_batch(uint32_t worker_index, const Job& job) {
+    (*static_cast<const ParallelForFunction*>(job.data))(worker_index, job.first, job.count);
+}
+
+void JobSystem::parallel_for(uint32_t count, uint32_t min_batch, const ParallelForFunction& function) {
+    if (count == 0)
+        return;
+
+    // A few batches per worker leaves room for stealing to even out the load
+    const uint32_t n_batches = std::max(1u, std::min(m_n_workers * 4, count / std::max(1u, min_batch)));
+    const uint32_t batch_size = (count + n_batches - 1) / n_batches;
+
+    JobCounter counter;
+    for (uint32_t first = 0; first < count; first += batch_size)
+        run(parallel_for_batch, const_cast<ParallelForFunction*>(&function), first, std::min(batch_size, count - first), &counter);
+    wait(counter);
+}
@@ -0,0 +1,366 @@
+#include "log.h"
+#include "backend.h"
+#include "hash.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <stdio.h>
+#include <string.h>
+
+using namespace Atlas;
+
+// Records in the ring, about 1 KiB each
+constexpr uint64_t queue_size = 1024;
+// Warnings and below are dropped once this many records are queued, leaving the rest for errors
+constexpr uint64_t non_error_limit = queue_size * 3 / 4;
+constexpr uint64_t rate_window_ns = 1000000000ull;
+// The rate limit forgets every message once it has seen this many distinct ones
+constexpr size_t max_rate_entries = 4096;
+// How much of a rate-limited message the writer quotes when it reports the repeats it held back
+constexpr size_t excerpt_length = 80;
+// How long the writer sleeps when a producer doesn't wake it
+constexpr std::chrono::milliseconds writer_timeout(10);
+
+// Bounded multi-producer queue after Dmitry Vyukov's: each record's sequence says whether it's free for
+// the producer claiming its position or written and waiting for the writer thread
+struct LogRecord {
+    // The position it's free for, or one past it once written
+    std::atomic<uint64_t> sequence;
+    uint64_t time;
+    uint32_t flags;
+    int32_t code;
+    char prefix[16];
+    char message[Log::max_message_length + 1];
+};
+
+static LogRecord g_records[queue_size];
+static std::atomic<uint64_t> g_enqueue_position(0);
+// Only the writer thread moves these
+static std::atomic<uint64_t> g_dequeue_position(0);
+static std::atomic<uint64_t> g_flushed_position(0);
+static std::atomic<uint64_t> g_n_dropped(0);
+static std::atomic<uint64_t> g_n_suppressed(0);
+
+// Producers that saw the writer running and haven't finished their record yet; stop() waits for them
+static std::atomic<uint32_t> g_n_writing(0);
+static std::atomic<bool> g_running(false);
+static std::atomic<bool> g_stopping(false);
+
+// Guards start() and stop()
+static std::mutex g_mutex;
+static uint32_t g_n_starts = 0;
+static bool g_initialized = false;
+// Heap allocated, so a process that never calls stop() doesn't terminate on a joinable std::thread at exit
+static std::thread* g_thread = nullptr;
+
+static std::mutex g_wake_mutex;
+static std::condition_variable g_wake;
+static std::atomic<bool> g_sleeping(false);
+
+// Owned by the writer thread
+struct RateState {
+    uint64_t window_start;
+    uint32_t n_printed;
+    uint32_t n_suppressed;
+    // Of the first suppressed repeat
+    uint32_t flags;
+    char excerpt[excerpt_length + 1];
+};
+static std::unordered_map<uint64_t, RateState> g_rates;
+// Entries in g_rates with suppressed repeats that haven't been reported yet
+static uint32_t g_n_pending_suppressed = 0;
+static uint64_t g_last_key = 0;
+static uint32_t g_last_flags = 0;
+static uint64_t g_n_repeats = 0;
+static uint64_t g_last_repeat_time = 0;
+static uint64_t g_n_reported_dropped = 0;
+
+static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Timestamps count from here: the first start(), or until then, the program's static initialization
+static std::atomic<uint64_t> g_start_time(now());
+
+static void copy_truncated(char* destination, size_t capacity, const char* source) {
+    size_t length = 0;
+    for (; source && source[length] && (length + 1 < capacity); ++length)
+        destination[length] = source[length];
+    destination[length] = '\0';
+    if (source && source[length] && (capacity > 4))
+        memcpy(destination + capacity - 4, "...", 4);
+}
+
+// Time since g_start_time, as hh:mm:ss.mmm
+static void format_timestamp(uint64_t time, char* buffer, size_t size) {
+    const uint64_t start = g_start_time.load(std::memory_order_relaxed);
+    const uint64_t ms = (time > start) ? (time - start) / 1000000 : 0;
+    snprintf(buffer, size, "%02u:%02u:%02u.%03u", static_cast<uint32_t>(ms / 3600000), static_cast<uint32_t>(ms / 60000 % 60),
+        static_cast<uint32_t>(ms / 1000 % 60), static_cast<uint32_t>(ms % 1000));
+}
+
+static void print_message(uint64_t time, uint32_t flags, const char* prefix, int32_t code, const char* message) {
+    char timestamp[32];
+    format_timestamp(time, timestamp, sizeof(timestamp));
+
+    if (flags & VK_DEBUG_REPORT_ERROR_BIT_EXT) {
+        fprintf(stderr, "%s [!] Error (%s, code %d): %s\n", timestamp, prefix, code, message);
+        return;
+    }
+
+    // Select prefix depending on flags passed to the callback
+    // Note that multiple flags may be set for a single validation message
+    char desc[64] = "";
+
+    // Diagnostic info from the Vulkan loader and layers
+    // Usually not helpful in terms of API usage, but may help to debug layer and loader problems
+    if (flags & VK_DEBUG_REPORT_DEBUG_BIT_EXT) {
+        strcat(desc, " Diagnostics");
+    }
+    // May indicate sub-optimal usage of the API
+    if (flags & VK_DEBUG_REPORT_PERFORMANCE_WARNING_BIT_EXT) {
+        strcat(desc, " Performance Warning");
+    }
+    // Warnings may hint at unexpected / non-spec API usage
+    else if (flags & VK_DEBUG_REPORT_WARNING_BIT_EXT) {
+        strcat(desc, " Warning");
+    }
+    // Informal messages that may become handy during debugging
+    if (flags & VK_DEBUG_REPORT_INFORMATION_BIT_EXT) {
+        strcat(desc, " Info");
+    }
+
+    printf("%s [*]%s (%s, code %d): %s\n", timestamp, desc, prefix, code, message);
+}
+
+static void report_repeats(uint64_t time) {
+    if (g_n_repeats == 0)
+        return;
+    const std::string message = "Last message repeated " + std::to_string(g_n_repeats) + " more times";
+    print_message(time, g_last_flags, "Log", 0, message.c_str());
+    g_n_repeats = 0;
+}
+
+static void report_dropped() {
+    const uint64_t n_dropped = g_n_dropped.load(std::memory_order_relaxed);
+    if (n_dropped == g_n_reported_dropped)
+        return;
+    const std::string message = "Log queue was full; dropped " + std::to_string(n_dropped - g_n_reported_dropped) + " messages";
+    print_message(now(), VK_DEBUG_REPORT_WARNING_BIT_EXT, "Log", 0, message.c_str());
+    g_n_reported_dropped = n_dropped;
+}
+
+// Reports the repeats held back in rate windows that have ended, or in all of them, so a message that stops
+// coming still has its count printed
+static void report_suppressed(uint64_t time, bool all) {
+    if (g_n_pending_suppressed == 0)
+        return;
+    for (auto& pair : g_rates) {
+        RateState& state = pair.second;
+        if ( (state.n_suppressed == 0) || (!all && (time < state.window_start + rate_window_ns)) )
+            continue;
+        const std::string message = "Suppressed " + std::to_string(state.n_suppressed) + " repeats of \"" + state.excerpt + "\"";
+        print_message(time, state.flags, "Log", 0, message.c_str());
+        state.n_suppressed = 0;
+        --g_n_pending_suppressed;
+    }
+}
+
+static void process(const LogRecord& record) {
+    uint64_t key = hash_value(record.flags);
+    key = hash_value(record.code, key);
+    key = hash_bytes(record.prefix, strlen(record.prefix), key);
+    key = hash_bytes(record.message, strlen(record.message), key);
+
+    // Back-to-back repeats become a count, printed once something else comes along
+    if (g_last_key && (key == g_last_key)) {
+        ++g_n_repeats;
+        g_last_repeat_time = record.time;
+        g_n_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    report_repeats(record.time);
+    g_last_key = 0;
+
+    if (g_rates.size() >= max_rate_entries) {
+        report_suppressed(record.time, true);
+        g_rates.clear();
+    }
+    RateState& state = g_rates[key];
+    if (record.time >= state.window_start + rate_window_ns) {
+        if (state.n_suppressed) {
+            const std::string message = "Suppressed " + std::to_string(state.n_suppressed) + " repeats of the next message in the last second";
+            print_message(record.time, record.flags, "Log", 0, message.c_str());
+            --g_n_pending_suppressed;
+        }
+        state.window_start = record.time;
+        state.n_printed = 0;
+        state.n_suppressed = 0;
+    }
+    if (state.n_printed == Log::max_repeats_per_second) {
+        if (state.n_suppressed++ == 0) {
+            state.flags = record.flags;
+            copy_truncated(state.excerpt, sizeof(state.excerpt), record.message);
+            ++g_n_pending_suppressed;
+        }
+        g_n_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ++state.n_printed;
+
+    print_message(record.time, record.flags, record.prefix, record.code, record.message);
+    g_last_key = key;
+    g_last_flags = record.flags;
+}
+
+// Returns the number of records processed
+static uint64_t drain() {
+    uint64_t position = g_dequeue_position.load(std::memory_order_relaxed);
+    const uint64_t first = position;
+    for (;;) {
+        LogRecord& record = g_records[position % queue_size];
+        if (record.sequence.load(std::memory_order_acquire) != position + 1)
+            break;
+        process(record);
+        // Free for whoever claims the position one lap later
+        record.sequence.store(position + queue_size, std::memory_order_release);
+        g_dequeue_position.store(++position, std::memory_order_release);
+    }
+    return position - first;
+}
+
+static void writer_main() {
+    for (;;) {
+        // Read before draining, so everything written before stop() is printed before the thread exits
+        const bool stopping = g_stopping.load(std::memory_order_acquire);
+        const uint64_t n_processed = drain();
+        report_dropped();
+        // A run of repeats is reported once it ends, or once it has gone quiet for a while
+        const uint64_t time = now();
+        if ( (n_processed == 0) && (stopping || (time >= g_last_repeat_time + rate_window_ns)) )
+            report_repeats(time);
+        // Likewise for rate-limited messages, whose counts would otherwise wait for the next repeat
+        if (n_processed == 0)
+            report_suppressed(time, stopping);
+        fflush(stdout);
+        fflush(stderr);
+        g_flushed_position.store(g_dequeue_position.load(std::memory_order_relaxed), std::memory_order_release);
+        if (n_processed > 0)
+            continue;
+        if (stopping)
+            break;
+
+        // Producers only notify while the flag is set, and a missed notification just costs a timeout
+        std::unique_lock<std::mutex> lock(g_wake_mutex);
+        g_sleeping.store(true, std::memory_order_relaxed);
+        g_wake.wait_for(lock, writer_timeout);
+        g_sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+void Log::start() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (g_n_starts++ > 0)
+        return;
+    if (!g_initialized) {
+        for (uint64_t i = 0; i < queue_size; ++i)
+            g_records[i].sequence.store(i, std::memory_order_relaxed);
+        g_start_time.store(now(), std::memory_order_relaxed);
+        g_initialized = true;
+    }
+    g_stopping.store(false, std::memory_order_relaxed);
+    g_thread = new std::thread(writer_main);
+    g_running.store(true);
+}
+
+void Log::stop() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if ( (g_n_starts == 0) || (--g_n_starts > 0) )
+        return;
+    // New messages are printed synchronously from here on; wait for the ones already going into the ring
+    g_running.store(false);
+    while (g_n_writing.load() != 0)
+        std::this_thread::yield();
+
+    g_stopping.store(true, std::memory_order_release);
+    g_wake.notify_one();
+    g_thread->join();
+    delete g_thread;
+    g_thread = nullptr;
+}
+
+void Log::write(uint32_t flags, const char* prefix, int32_t code, const char* message) {
+    const uint64_t time = now();
+    // Sequentially consistent with stop(): either it waits for this message or this sees it stopped
+    g_n_writing.fetch_add(1);
+    if (!g_running.load()) {
+        g_n_writing.fetch_sub(1);
+        print_message(time, flags, prefix, code, message);
+        return;
+    }
+
+    const bool is_error = ((flags & VK_DEBUG_REPORT_ERROR_BIT_EXT) != 0);
+    uint64_t position = g_enqueue_position.load(std::memory_order_relaxed);
+    LogRecord* record = nullptr;
+    for (;;) {
+        if (!is_error) {
+            const uint64_t dequeue_position = g_dequeue_position.load(std::memory_order_relaxed);
+            if ( (position > dequeue_position) && (position - dequeue_position >= non_error_limit) )
+                break;
+        }
+        LogRecord& candidate = g_records[position % queue_size];
+        const uint64_t sequence = candidate.sequence.load(std::memory_order_acquire);
+        const int64_t difference = static_cast<int64_t>(sequence - position);
+        if (difference == 0) {
+            if (g_enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                record = &candidate;
+                break;
+            }
+        }
+        // The writer hasn't freed the record from the last lap: the ring is full
+        else if (difference < 0)
+            break;
+        // Another producer claimed this position first
+        else
+            position = g_enqueue_position.load(std::memory_order_relaxed);
+    }
+
+    if (record) {
+        record->time = time;
+        record->flags = flags;
+        record->code = code;
+        copy_truncated(record->prefix, sizeof(record->prefix), prefix);
+        copy_truncated(record->message, sizeof(record->message), message);
+        record->sequence.store(position + 1, std::memory_order_release);
+    }
+    else {
+        g_n_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    g_n_writing.fetch_sub(1);
+
+    if (record && g_sleeping.load(std::memory_order_relaxed))
+        g_wake.notify_one();
+}
+
+void Log::flush() {
+    if (!g_running.load()) {
+        fflush(stdout);
+        fflush(stderr);
+        return;
+    }
+    const uint64_t target = g_enqueue_position.load(std::memory_order_acquire);
+    g_wake.notify_one();
+    while (g_flushed_position.load(std::memory_order_acquire) < target)
+        std::this_thread::yield();
+}
+
+uint64_t Log::get_n_dropped() {
+    return g_n_dropped.load(std::memory_order_relaxed);
+}
+
+uint64_t Log::get_n_suppressed() {
+    return g_n_suppressed.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,195 @@
+#include "profiler.h"
+#include <algorithm>
+#include <stdio.h>
+
+using namespace Atlas;
+using namespace Backend;
+
+constexpr uint32_t invalid_scope = std::numeric_limits<uint32_t>::max();
+
+// Quotes a CSV field, doubling any quotes inside it (newlines are fine within quotes)
+static void write_csv_string(FILE* file, const char* string) {
+    fputc('"', file);
+    for (const char* c = string; *c; ++c) {
+        if (*c == '"')
+            fputc('"', file);
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+GpuProfiler::GpuProfiler(Device& device, FrameRing& frames)
+    : m_device(device), m_frames(frames), m_current(0), m_depth(0), m_timestamp_period(1.0), m_timestamp_mask(0)
+    , m_history_first(0), m_history_size(0)
+    , max_scopes_per_frame(256), history_length(120)
+{ }
+
+GpuProfiler::~GpuProfiler() {
+    for (auto iter = m_pools.rbegin(); iter != m_pools.rend(); ++iter) {
+        if (iter->pool)
+            vkDestroyQueryPool(m_device.vk(), iter->pool, nullptr);
+    }
+}
+
+bool GpuProfiler::init() {
+    // Timestamp support is per queue family
+    const PhysicalDevice& physical_device = m_device.get_physical_device();
+    uint32_t n_families;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device.device, &n_families, nullptr);
+    std::vector<VkQueueFamilyProperties> families(n_families);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device.device, &n_families, families.data());
+    const uint32_t valid_bits = families[m_device.get_queue_family_index(QUEUE_FAMILY_UNIVERSAL)].timestampValidBits;
+    if (valid_bits == 0) {
+        ATLAS_WARNING("The universal queue doesn't support timestamps; GPU profiling is disabled");
+        return true;
+    }
+    m_timestamp_mask = (valid_bits >= 64) ? std::numeric_limits<uint64_t>::max() : ((uint64_t(1) << valid_bits) - 1);
+    m_timestamp_period = physical_device.props.limits.timestampPeriod;
+    history_length = std::max(1u, history_length);
+
+    VkQueryPoolCreateInfo pool_info = {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,   // sType
+        nullptr,                                    // pNext
+        0,                                          // flags (reserved)
+        VK_QUERY_TYPE_TIMESTAMP,                    // queryType
+        max_scopes_per_frame * 2,                   // queryCount
+        0                                           // pipelineStatistics
+    };
+    // Zero everything first, so the destructor can clean up after a partial init
+    FrameQueries empty = {};
+    empty.scopes.resize(max_scopes_per_frame);
+    m_pools.assign(m_frames.max_frames_in_flight, empty);
+    for (auto& queries : m_pools) {
+        VkResult res = vkCreateQueryPool(m_device.vk(), &pool_info, nullptr, &queries.pool);
+        if (!validate(res)) {
+            m_pools.clear();
+            return false;
+        }
+    }
+    m_timestamps.resize(max_scopes_per_frame * 2);
+    m_history.resize(history_length);
+    for (auto& timings : m_history)
+        timings.scopes.reserve(max_scopes_per_frame);
+
+    return true;
+}
+
+bool GpuProfiler::read_back(FrameQueries& queries) {
+    queries.pending = false;
+    if (queries.n_scopes == 0)
+        return true;
+
+    // The frame has retired, so this only returns VK_NOT_READY for scopes that were never ended
+    const uint32_t n_queries = queries.n_scopes * 2;
+    VkResult res = vkGetQueryPoolResults(m_device.vk(), queries.pool, 0, n_queries, n_queries * sizeof(uint64_t), m_timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (res == VK_NOT_READY) {
+        ATLAS_WARNING("GPU profiler scope was never ended; dropping frame " + std::to_string(queries.frame_serial));
+        return true;
+    }
+    if (!validate(res)) return false;
+
+    // Overwrite the oldest frame once the history is full
+    GpuFrameTimings& timings = m_history[(m_history_first + m_history_size) % history_length];
+    if (m_history_size < history_length)
+        ++m_history_size;
+    else
+        m_history_first = (m_history_first + 1) % history_length;
+    timings.frame_serial = queries.frame_serial;
+    timings.frame_ms = 0.0;
+    timings.scopes.assign(queries.scopes.begin(), queries.scopes.begin() + queries.n_scopes);
+
+    // Ticks can wrap around timestampValidBits, so only ever look at the masked difference
+    const double ms_per_tick = m_timestamp_period / 1000000.0;
+    const uint64_t base = m_timestamps[0];
+    for (uint32_t i = 0; i < queries.n_scopes; ++i) {
+        const uint64_t begin = m_timestamps[i * 2];
+        const uint64_t end = m_timestamps[i * 2 + 1];
+        timings.scopes[i].begin_ms = ((begin - base) & m_timestamp_mask) * ms_per_tick;
+        timings.scopes[i].duration_ms = ((end - begin) & m_timestamp_mask) * ms_per_tick;
+        timings.frame_ms = std::max(timings.frame_ms, timings.scopes[i].begin_ms + timings.scopes[i].duration_ms);
+    }
+    return true;
+}
+
+bool GpuProfiler::begin_frame(VkCommandBuffer command_buffer) {
+    if (!is_enabled())
+        return true;
+
+    m_current = m_frames.get_frame_index();
+    FrameQueries& queries = m_pools[m_current];
+    // FrameRing::begin_frame() has retired this context's previous frame, so its results are ready
+    bool success = true;
+    if (queries.pending)
+        success = read_back(queries);
+
+    vkCmdResetQueryPool(command_buffer, queries.pool, 0, max_scopes_per_frame * 2);
+    queries.frame_serial = m_frames.get_frame_serial();
+    queries.n_scopes = 0;
+    queries.pending = true;
+    m_depth = 0;
+    return success;
+}
+
+uint32_t GpuProfiler::begin_scope(VkCommandBuffer command_buffer, const char* name, VkPipelineStageFlagBits stage) {
+    if (!is_enabled())
+        return invalid_scope;
+    FrameQueries& queries = m_pools[m_current];
+    if (queries.n_scopes == max_scopes_per_frame)
+        return invalid_scope;
+
+    const uint32_t scope = queries.n_scopes++;
+    queries.scopes[scope].name = name;
+    queries.scopes[scope].depth = m_depth++;
+    vkCmdWriteTimestamp(command_buffer, stage, queries.pool, scope * 2);
+    return scope;
+}
+
+void GpuProfiler::end_scope(VkCommandBuffer command_buffer, uint32_t scope, VkPipelineStageFlagBits stage) {
+    if (scope == invalid_scope)
+        return;
+
+    --m_depth;
+    vkCmdWriteTimestamp(command_buffer, stage, m_pools[m_current].pool, scope * 2 + 1);
+}
+
+bool GpuProfiler::write_csv(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        ATLAS_WARNING("Could not open " + path + " to write GPU timings");
+        return false;
+    }
+
+    fprintf(file, "frame,scope,depth,begin_ms,duration_ms\n");
+    for (uint32_t i = 0; i < m_history_size; ++i) {
+        const GpuFrameTimings& frame = get_history(i);
+        for (const auto& scope : frame.scopes) {
+            fprintf(file, "%llu,", static_cast<unsigned long long>(frame.frame_serial));
+            write_csv_string(file, scope.name);
+            fprintf(file, ",%u,%.6f,%.6f\n", scope.depth, scope.begin_ms, scope.duration_ms);
+        }
+    }
+    return (fclose(file) == 0);
+}
+
+bool GpuProfiler::write_json(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        ATLAS_WARNING("Could not open " + path + " to write GPU timings");
+        return false;
+    }
+
+    fprintf(file, "[\n");
+    for (uint32_t i = 0; i < m_history_size; ++i) {
+        const GpuFrameTimings& frame = get_history(i);
+        fprintf(file, "  {\"frame\": %llu, \"frame_ms\": %.6f, \"scopes\": [", static_cast<unsigned long long>(frame.frame_serial), frame.frame_ms);
+        for (size_t j = 0; j < frame.scopes.size(); ++j) {
+            const GpuTiming& scope = frame.scopes[j];
+            fprintf(file, "%s\n    {\"name\": ", (j == 0) ? "" : ",");
+            write_json_string(file, scope.name);
+            fprintf(file, ", \"depth\": %u, \"begin_ms\": %.6f, \"duration_ms\": %.6f}", scope.depth, scope.begin_ms, scope.duration_ms);
+        }
+        fprintf(file, "%s]}%s\n", frame.scopes.empty() ? "" : "\n  ", (i + 1 == m_history_size) ? "" : ",");
+    }
+    fprintf(file, "]\n");
+    return (fclose(file) == 0);
+}
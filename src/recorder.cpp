@@ -0,0 +1,91 @@
+#include "recorder.h"
+#include "trace.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+// Batches per worker; a few leave room for stealing to even out uneven draws
+constexpr uint32_t batches_per_worker = 4;
+
+SubpassRecorder::SubpassRecorder(Device& device, FrameRing& frames, JobSystem& jobs)
+    : m_device(device), m_frames(frames), m_jobs(jobs)
+    , m_inheritance(), m_record_draws(nullptr), m_record_data(nullptr), m_batch_size(0), m_failed(false)
+    , min_draws_per_batch(64)
+{ }
+
+bool SubpassRecorder::init() {
+    if (m_jobs.get_n_workers() != m_device.n_threads) {
+        ATLAS_ERROR("SubpassRecorder needs a job system with one worker per device thread!");
+        return false;
+    }
+    m_secondaries.reserve(m_jobs.get_n_workers() * batches_per_worker);
+    return true;
+}
+
+void SubpassRecorder::record_batch(uint32_t worker_index, const Job& job) {
+    ATLAS_TRACE_ZONE("SubpassRecorder::record_batch");
+    SubpassRecorder& self = *static_cast<SubpassRecorder*>(job.data);
+    const uint32_t batch = job.first / self.m_batch_size;
+
+    VkCommandBuffer buffer = self.m_frames.get_command_buffer(QUEUE_FAMILY_UNIVERSAL, worker_index, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+    if (!buffer) {
+        self.m_failed = true;
+        return;
+    }
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+        VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT, // flags
+        &self.m_inheritance                             // pInheritanceInfo
+    };
+    if (!validate(vkBeginCommandBuffer(buffer, &begin_info))) {
+        self.m_failed = true;
+        return;
+    }
+    self.m_record_draws(buffer, worker_index, job.first, job.count, self.m_record_data);
+    if (!validate(vkEndCommandBuffer(buffer))) {
+        self.m_failed = true;
+        return;
+    }
+
+    self.m_secondaries[batch] = buffer;
+}
+
+bool SubpassRecorder::record(VkCommandBuffer primary, const RenderPass& renderpass, uint32_t subpass, VkFramebuffer framebuffer, uint32_t n_draws, RecordFunction record_draws, void* data) {
+    ATLAS_TRACE_ZONE("SubpassRecorder::record");
+    if (n_draws == 0)
+        return true;
+
+    m_inheritance = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,  // sType
+        nullptr,                                            // pNext
+        renderpass.vk(),                                    // renderPass
+        subpass,                                            // subpass
+        framebuffer,                                        // framebuffer
+        VK_FALSE,                                           // occlusionQueryEnable
+        0,                                                  // queryFlags
+        0                                                   // pipelineStatistics
+    };
+    m_record_draws = record_draws;
+    m_record_data = data;
+    m_failed = false;
+
+    const uint32_t max_batches = m_jobs.get_n_workers() * batches_per_worker;
+    const uint32_t n_batches = std::max(1u, std::min(max_batches, n_draws / std::max(1u, min_draws_per_batch)));
+    m_batch_size = (n_draws + n_batches - 1) / n_batches;
+    m_secondaries.assign((n_draws + m_batch_size - 1) / m_batch_size, VK_NULL_HANDLE);
+
+    JobCounter counter;
+    for (uint32_t first = 0; first < n_draws; first += m_batch_size)
+        m_jobs.run(record_batch, this, first, std::min(m_batch_size, n_draws - first), &counter);
+    // The calling thread records batches too while it waits
+    m_jobs.wait(counter);
+    if (m_failed)
+        return false;
+
+    // Execute in batch order, so the draws keep their original order
+    vkCmdExecuteCommands(primary, static_cast<uint32_t>(m_secondaries.size()), m_secondaries.data());
+    return true;
+}
@@ -0,0 +1,142 @@
+#include "staging.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+// A multiple of every alignment Vulkan asks of buffer offsets, so aligned positions stay aligned when they wrap
+constexpr VkDeviceSize ring_granularity = 4096;
+
+static inline uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+StagingRing::StagingRing(Device& device)
+    : m_device(device), m_buffer(VK_NULL_HANDLE), m_memory(), m_data(nullptr), m_coherent(true), m_atom_size(1)
+    , m_head(0), m_tail(0), m_flushed(0), m_first_marker(0), m_n_markers(0)
+    , size(16 * 1024 * 1024)
+    , usage(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+{ }
+
+StagingRing::~StagingRing() {
+    if (m_buffer) {
+        if (m_data)
+            vmaUnmapBufferMemory(m_device.get_allocator(), m_buffer);
+        vmaDestroyBuffer(m_device.get_allocator(), m_buffer);
+    }
+}
+
+bool StagingRing::init() {
+    size = align_up(std::max<VkDeviceSize>(size, 1), ring_granularity);
+    m_atom_size = std::max<VkDeviceSize>(1, m_device.get_physical_device().props.limits.nonCoherentAtomSize);
+
+    VkBufferCreateInfo buffer_info = {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,   // sType
+        nullptr,                                // pNext
+        0,                                      // flags
+        size,                                   // size
+        usage,                                  // usage
+        VK_SHARING_MODE_EXCLUSIVE,              // sharingMode
+        0,                                      // queueFamilyIndexCount
+        nullptr                                 // pQueueFamilyIndices
+    };
+    // Own memory, so the mapped range starts at offset 0 and flushes can be aligned to nonCoherentAtomSize
+    VmaMemoryRequirements buffer_reqs = {
+        VK_TRUE,                    // ownMemory
+        VMA_MEMORY_USAGE_CPU_TO_GPU // usage
+        // Fill rest with 0s
+    };
+    uint32_t memory_type;
+    VkResult res = vmaCreateBuffer(m_device.get_allocator(), &buffer_info, &buffer_reqs, &m_buffer, &m_memory, &memory_type);
+    if (!validate(res)) return false;
+    res = vmaMapBufferMemory(m_device.get_allocator(), m_buffer, reinterpret_cast<void**>(&m_data));
+    if (!validate(res)) return false;
+
+    VkPhysicalDeviceMemoryProperties memory_props;
+    vkGetPhysicalDeviceMemoryProperties(m_device.get_physical_device().device, &memory_props);
+    m_coherent = ((memory_props.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0);
+
+    return true;
+}
+
+bool StagingRing::allocate(VkDeviceSize allocation_size, VkDeviceSize alignment, uint64_t serial, StagingAllocation& allocation) {
+    if (allocation_size > size) {
+        ATLAS_ERROR("Staging allocation is larger than the whole ring!");
+        return false;
+    }
+
+    uint64_t position = align_up(m_head, std::max<VkDeviceSize>(alignment, 1));
+    // Allocations never straddle the end of the buffer
+    if ((position % size) + allocation_size > size)
+        position = align_up(position, size);
+
+    if (position + allocation_size - m_tail > size) {
+        if (m_n_markers)
+            return false;
+        // Nothing is in use, so start over at the beginning of the buffer
+        m_head = m_tail = m_flushed = align_up(m_head, size);
+        position = m_head;
+    }
+
+    m_head = position + allocation_size;
+    if (m_n_markers && (get_marker(m_n_markers - 1).serial == serial))
+        get_marker(m_n_markers - 1).end = m_head;
+    else
+        push_marker({serial, m_head});
+
+    allocation.buffer = m_buffer;
+    allocation.offset = position % size;
+    allocation.size = allocation_size;
+    allocation.data = m_data + allocation.offset;
+    return true;
+}
+
+void StagingRing::reclaim(uint64_t completed_serial) {
+    while (m_n_markers && (get_marker(0).serial <= completed_serial)) {
+        m_tail = get_marker(0).end;
+        m_first_marker = (m_first_marker + 1) % m_markers.size();
+        --m_n_markers;
+    }
+}
+
+void StagingRing::push_marker(const Marker& marker) {
+    if (m_n_markers == m_markers.size()) {
+        // Unwrap into a bigger ring, oldest first
+        std::vector<Marker> markers(std::max<size_t>(4, m_markers.size() * 2));
+        for (size_t i = 0; i < m_n_markers; ++i)
+            markers[i] = get_marker(i);
+        m_markers.swap(markers);
+        m_first_marker = 0;
+    }
+    get_marker(m_n_markers++) = marker;
+}
+
+bool StagingRing::flush() {
+    const uint64_t begin = m_flushed;
+    m_flushed = m_head;
+    if (m_coherent || (begin == m_head))
+        return true;
+
+    // Ranges must start and end on multiples of nonCoherentAtomSize (or at the end of the memory),
+    // and the written positions may wrap around the end of the buffer
+    const VkDeviceSize length = std::min<uint64_t>(m_head - begin, size);
+    const VkDeviceSize first = begin % size;
+    const uint32_t n_ranges = (first + length > size) ? 2 : 1;
+    const VkDeviceSize starts[2] = { first, 0 };
+    const VkDeviceSize ends[2] = { std::min<VkDeviceSize>(first + length, size), (first + length > size) ? (first + length - size) : 0 };
+
+    VkMappedMemoryRange ranges[2];
+    const VkDeviceSize memory_end = m_memory.offset + m_memory.size;
+    for (uint32_t i = 0; i < n_ranges; ++i) {
+        const VkDeviceSize range_begin = (m_memory.offset + starts[i]) / m_atom_size * m_atom_size;
+        const VkDeviceSize range_end = std::min<VkDeviceSize>(align_up(m_memory.offset + ends[i], m_atom_size), memory_end);
+        ranges[i] = {
+            VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,  // sType
+            nullptr,                                // pNext
+            m_memory.memory,                        // memory
+            range_begin,                            // offset
+            range_end - range_begin                 // size
+        };
+    }
+    return validate(vkFlushMappedMemoryRanges(m_device.vk(), n_ranges, ranges));
+}
@@ -0,0 +1,122 @@
+#include "trace.h"
+
+#ifdef ATLAS_TRACE_ENABLED
+
+#include "backend.h"
+#include <chrono>
+#include <stdio.h>
+
+using namespace Atlas;
+
+// Zones each thread can record per capture before it starts dropping them
+constexpr uint32_t events_per_thread = 1 << 16;
+
+struct TraceEvent {
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Only the owning thread writes events; end_capture() reads the first `count` of them
+struct ThreadBuffer {
+    TraceEvent events[events_per_thread];
+    std::atomic<uint32_t> count;
+    // Capture the events belong to; a stale buffer is emptied on its next write
+    std::atomic<uint32_t> generation;
+    uint32_t thread_id;
+    ThreadBuffer* next;
+};
+
+std::atomic<bool> Trace::capturing(false);
+
+// Push-only list of every thread's buffer. Buffers outlive their threads, so they are never freed
+static std::atomic<ThreadBuffer*> g_buffers(nullptr);
+static std::atomic<uint32_t> g_n_threads(0);
+static std::atomic<uint32_t> g_generation(0);
+static std::atomic<uint32_t> g_n_dropped(0);
+static uint64_t g_capture_start = 0;
+static thread_local ThreadBuffer* t_buffer = nullptr;
+
+static ThreadBuffer* get_thread_buffer() {
+    if (!t_buffer) {
+        t_buffer = new ThreadBuffer();
+        t_buffer->count.store(0, std::memory_order_relaxed);
+        t_buffer->generation.store(g_generation.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        t_buffer->thread_id = g_n_threads.fetch_add(1, std::memory_order_relaxed);
+
+        ThreadBuffer* head = g_buffers.load(std::memory_order_relaxed);
+        do {
+            t_buffer->next = head;
+        } while (!g_buffers.compare_exchange_weak(head, t_buffer, std::memory_order_release, std::memory_order_relaxed));
+    }
+    return t_buffer;
+}
+
+uint64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char* name, uint64_t begin, uint64_t end) {
+    ThreadBuffer* buffer = get_thread_buffer();
+    const uint32_t generation = g_generation.load(std::memory_order_acquire);
+    if (buffer->generation.load(std::memory_order_relaxed) != generation) {
+        buffer->count.store(0, std::memory_order_relaxed);
+        buffer->generation.store(generation, std::memory_order_release);
+    }
+
+    const uint32_t index = buffer->count.load(std::memory_order_relaxed);
+    if (index == events_per_thread) {
+        g_n_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer->events[index] = { name, begin, end };
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void Trace::begin_capture() {
+    capturing.store(false, std::memory_order_relaxed);
+    g_capture_start = now();
+    g_n_dropped.store(0, std::memory_order_relaxed);
+    g_generation.fetch_add(1, std::memory_order_release);
+    capturing.store(true, std::memory_order_release);
+}
+
+bool Trace::end_capture(const std::string& path) {
+    capturing.store(false, std::memory_order_relaxed);
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        ATLAS_WARNING("Could not open " + path + " to write the trace");
+        return false;
+    }
+
+    // Complete ("X") events, with timestamps in microseconds from the start of the capture
+    const uint32_t generation = g_generation.load(std::memory_order_acquire);
+    uint64_t n_events = 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (ThreadBuffer* buffer = g_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        if (buffer->generation.load(std::memory_order_acquire) != generation)
+            continue;
+        const uint32_t count = buffer->count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < count; ++i) {
+            const TraceEvent& event = buffer->events[i];
+            // Zones that straddle the start of the capture began during the previous one
+            if (event.begin < g_capture_start)
+                continue;
+            fprintf(file, "%s\n{\"name\": ", (n_events++ == 0) ? "" : ",");
+            Backend::write_json_string(file, event.name);
+            fprintf(file, ", \"ph\": \"X\", \"pid\": 0, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}", buffer->thread_id,
+                (event.begin - g_capture_start) / 1000.0, (event.end - event.begin) / 1000.0);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    bool written = (fclose(file) == 0);
+
+    const uint32_t n_dropped = g_n_dropped.load(std::memory_order_relaxed);
+    if (n_dropped > 0)
+        ATLAS_WARNING("Trace buffers filled up; dropped " + std::to_string(n_dropped) + " zones");
+    ATLAS_LOG("Wrote " + std::to_string(n_events) + " trace zones to " + path);
+    return written;
+}
+
+#endif // ATLAS_TRACE_ENABLED
@@ -0,0 +1,250 @@
+#include "tracker.h"
+
+using namespace Atlas;
+using namespace Backend;
+
+static bool same_transition(const AccessTransition& a, const AccessTransition& b) {
+    return (a.src_stages == b.src_stages && a.dst_stages == b.dst_stages && a.src_access == b.src_access
+        && a.dst_access == b.dst_access && a.old_layout == b.old_layout && a.new_layout == b.new_layout);
+}
+
+bool Backend::update_access_state(AccessState& state, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout,
+    bool is_write, bool is_image, AccessTransition& transition) {
+    transition = {
+        0,              // src_stages
+        stages,         // dst_stages
+        0,              // src_access
+        access,         // dst_access
+        state.layout,   // old_layout
+        layout          // new_layout
+    };
+    const bool layout_change = is_image && (state.layout != layout);
+
+    if (!is_write && !layout_change) {
+        // Reads only wait for the last write, and not at all if an earlier barrier made it visible to them
+        const bool covered = ((state.read_stages & stages) == stages) && ((state.read_access & access) == access);
+        state.read_stages |= stages;
+        state.read_access |= access;
+        if (covered || !state.write_stages)
+            return false;
+        transition.src_stages = state.write_stages;
+        transition.src_access = state.write_access;
+        return true;
+    }
+
+    // Writes and layout transitions wait for every earlier access
+    transition.src_stages = state.write_stages | state.read_stages;
+    transition.src_access = state.write_access;
+    state.layout = layout;
+    state.write_stages = stages;
+    if (is_write) {
+        state.write_access = access & write_access_mask;
+        state.read_stages = 0;
+        state.read_access = 0;
+    } else {
+        // The transition is the write; later reads in other stages only need to wait for this one
+        state.write_access = 0;
+        state.read_stages = stages;
+        state.read_access = access;
+    }
+    if (!transition.src_stages) {
+        if (!layout_change)
+            return false;
+        transition.src_stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    }
+    return true;
+}
+
+ResourceTracker::ResourceTracker()
+    : m_src_stages(0), m_dst_stages(0), m_n_requests(0), m_n_barriers(0)
+{
+    m_memory_barrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,   // sType
+        nullptr,                            // pNext
+        0,                                  // srcAccessMask
+        0                                   // dstAccessMask
+    };
+}
+
+void ResourceTracker::add_image(VkImage image, VkImageAspectFlags aspect, uint32_t n_levels, uint32_t n_layers,
+    VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access) {
+    const AccessState state = {
+        layout,                         // layout
+        stages,                         // write_stages
+        access & write_access_mask,     // write_access
+        0,                              // read_stages
+        0                               // read_access
+    };
+    TrackedImage& tracked = m_images[image];
+    tracked.aspect = aspect;
+    tracked.n_levels = n_levels;
+    tracked.n_layers = n_layers;
+    tracked.states.assign(n_levels * n_layers, state);
+}
+
+void ResourceTracker::add_buffer(VkBuffer buffer, VkPipelineStageFlags stages, VkAccessFlags access) {
+    const AccessState state = {
+        VK_IMAGE_LAYOUT_UNDEFINED,      // layout
+        stages,                         // write_stages
+        access & write_access_mask,     // write_access
+        0,                              // read_stages
+        0                               // read_access
+    };
+    m_buffers[buffer] = state;
+}
+
+void ResourceTracker::remove_image(VkImage image) {
+    m_images.erase(image);
+}
+
+void ResourceTracker::remove_buffer(VkBuffer buffer) {
+    m_buffers.erase(buffer);
+}
+
+ResourceTracker::TrackedImage* ResourceTracker::find_image(VkImage image) {
+    auto iter = m_images.find(image);
+    if (iter == m_images.end()) {
+        ATLAS_WARNING("ResourceTracker was asked about an image it doesn't track");
+        return nullptr;
+    }
+    return &iter->second;
+}
+
+void ResourceTracker::push_image_barrier(VkImage image, const TrackedImage& tracked, uint32_t level, uint32_t layer, uint32_t n_layers, const AccessTransition& transition) {
+    m_src_stages |= transition.src_stages;
+    m_dst_stages |= transition.dst_stages;
+
+    // Extend the last barrier to this level if it covers the same layers the same way
+    if (!m_image_barriers.empty()) {
+        VkImageMemoryBarrier& last = m_image_barriers.back();
+        VkImageSubresourceRange& range = last.subresourceRange;
+        if (last.image == image && range.baseMipLevel + range.levelCount == level && range.baseArrayLayer == layer && range.layerCount == n_layers
+            && last.srcAccessMask == transition.src_access && last.dstAccessMask == transition.dst_access
+            && last.oldLayout == transition.old_layout && last.newLayout == transition.new_layout) {
+            ++range.levelCount;
+            return;
+        }
+    }
+
+    const VkImageMemoryBarrier barrier = {
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,     // sType
+        nullptr,                                    // pNext
+        transition.src_access,                      // srcAccessMask
+        transition.dst_access,                      // dstAccessMask
+        transition.old_layout,                      // oldLayout
+        transition.new_layout,                      // newLayout
+        VK_QUEUE_FAMILY_IGNORED,                    // srcQueueFamilyIndex
+        VK_QUEUE_FAMILY_IGNORED,                    // dstQueueFamilyIndex
+        image,                                      // image
+        {   tracked.aspect,                         // aspectMask
+            level,                                  // baseMipLevel
+            1,                                      // levelCount
+            layer,                                  // baseArrayLayer
+            n_layers                                // layerCount
+        }                                           // subresourceRange
+    };
+    m_image_barriers.push_back(barrier);
+}
+
+void ResourceTracker::use_image(VkImage image, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout,
+    const VkImageSubresourceRange* range, bool discard) {
+    TrackedImage* tracked = find_image(image);
+    if (!tracked)
+        return;
+    ++m_n_requests;
+
+    const uint32_t first_level = range ? range->baseMipLevel : 0;
+    const uint32_t end_level = (!range || range->levelCount == VK_REMAINING_MIP_LEVELS) ? tracked->n_levels : first_level + range->levelCount;
+    const uint32_t first_layer = range ? range->baseArrayLayer : 0;
+    const uint32_t end_layer = (!range || range->layerCount == VK_REMAINING_ARRAY_LAYERS) ? tracked->n_layers : first_layer + range->layerCount;
+    const bool is_write = ((access & write_access_mask) != 0);
+
+    for (uint32_t level = first_level; level < end_level; ++level) {
+        // Runs of layers that need the same barrier become one
+        AccessTransition run;
+        uint32_t run_start = 0;
+        uint32_t run_length = 0;
+        for (uint32_t layer = first_layer; layer < end_layer; ++layer) {
+            AccessState& state = tracked->states[level * tracked->n_layers + layer];
+            if (discard)
+                state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            AccessTransition transition;
+            if (!update_access_state(state, stages, access, layout, is_write, true, transition)) {
+                if (run_length)
+                    push_image_barrier(image, *tracked, level, run_start, run_length, run);
+                run_length = 0;
+                continue;
+            }
+            if (run_length && same_transition(run, transition)) {
+                ++run_length;
+                continue;
+            }
+            if (run_length)
+                push_image_barrier(image, *tracked, level, run_start, run_length, run);
+            run = transition;
+            run_start = layer;
+            run_length = 1;
+        }
+        if (run_length)
+            push_image_barrier(image, *tracked, level, run_start, run_length, run);
+    }
+}
+
+void ResourceTracker::use_buffer(VkBuffer buffer, VkPipelineStageFlags stages, VkAccessFlags access) {
+    auto iter = m_buffers.find(buffer);
+    if (iter == m_buffers.end()) {
+        ATLAS_WARNING("ResourceTracker was asked about a buffer it doesn't track");
+        return;
+    }
+    ++m_n_requests;
+
+    // Buffers share one global barrier, which drivers handle as well as per-buffer ones
+    AccessTransition transition;
+    if (!update_access_state(iter->second, stages, access, VK_IMAGE_LAYOUT_UNDEFINED, (access & write_access_mask) != 0, false, transition))
+        return;
+    m_src_stages |= transition.src_stages;
+    m_dst_stages |= transition.dst_stages;
+    m_memory_barrier.srcAccessMask |= transition.src_access;
+    m_memory_barrier.dstAccessMask |= transition.dst_access;
+}
+
+void ResourceTracker::set_image_state(VkImage image, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout,
+    const VkImageSubresourceRange* range) {
+    TrackedImage* tracked = find_image(image);
+    if (!tracked)
+        return;
+
+    const uint32_t first_level = range ? range->baseMipLevel : 0;
+    const uint32_t end_level = (!range || range->levelCount == VK_REMAINING_MIP_LEVELS) ? tracked->n_levels : first_level + range->levelCount;
+    const uint32_t first_layer = range ? range->baseArrayLayer : 0;
+    const uint32_t end_layer = (!range || range->layerCount == VK_REMAINING_ARRAY_LAYERS) ? tracked->n_layers : first_layer + range->layerCount;
+    const AccessState state = {
+        layout,                         // layout
+        stages,                         // write_stages
+        access & write_access_mask,     // write_access
+        stages,                         // read_stages
+        access & ~write_access_mask     // read_access
+    };
+    for (uint32_t level = first_level; level < end_level; ++level) {
+        for (uint32_t layer = first_layer; layer < end_layer; ++layer)
+            tracked->states[level * tracked->n_layers + layer] = state;
+    }
+}
+
+void ResourceTracker::flush(VkCommandBuffer command_buffer) {
+    if (!m_src_stages)
+        return;
+
+    const bool has_memory_barrier = (m_memory_barrier.srcAccessMask || m_memory_barrier.dstAccessMask);
+    vkCmdPipelineBarrier(command_buffer, m_src_stages, m_dst_stages, 0,
+        has_memory_barrier ? 1 : 0, &m_memory_barrier,
+        0, nullptr,
+        static_cast<uint32_t>(m_image_barriers.size()), m_image_barriers.data());
+    ++m_n_barriers;
+
+    m_src_stages = 0;
+    m_dst_stages = 0;
+    m_memory_barrier.srcAccessMask = 0;
+    m_memory_barrier.dstAccessMask = 0;
+    m_image_barriers.clear();
+}
@@ -0,0 +1,429 @@
+#include "upload.h"
+#include <algorithm>
+
+using namespace Atlas;
+using namespace Backend;
+
+UploadManager::UploadManager(Device& device)
+    : m_device(device), m_transfers_ownership(false), m_staging(device), m_staging_alignment(16)
+    , m_batch_index(0), m_next_ticket(1), m_completed_ticket(0)
+    , staging_size(32 * 1024 * 1024), max_batches_in_flight(4)
+{ }
+
+UploadManager::~UploadManager() {
+    // Frames may still be waiting on semaphores handed out by acquire()
+    if (m_device.vk()) {
+        std::lock_guard<std::mutex> lock(m_device.get_queue_mutex());
+        vkDeviceWaitIdle(m_device.vk());
+    }
+
+    for (auto semaphore : m_free_semaphores)
+        vkDestroySemaphore(m_device.vk(), semaphore, nullptr);
+    for (auto& waited : m_waited_semaphores)
+        vkDestroySemaphore(m_device.vk(), waited.semaphore, nullptr);
+
+    for (auto iter = m_batches.rbegin(); iter != m_batches.rend(); ++iter) {
+        if (iter->semaphore)
+            vkDestroySemaphore(m_device.vk(), iter->semaphore, nullptr);
+        if (iter->fence)
+            vkDestroyFence(m_device.vk(), iter->fence, nullptr);
+        // Destroying the pool also frees its command buffer
+        if (iter->pool)
+            vkDestroyCommandPool(m_device.vk(), iter->pool, nullptr);
+    }
+}
+
+bool UploadManager::init() {
+    if (max_batches_in_flight == 0) {
+        ATLAS_ERROR("UploadManager needs at least one batch in flight!");
+        return false;
+    }
+    m_transfers_ownership = (m_device.get_queue_family_index(QUEUE_FAMILY_TRANSFER) != m_device.get_queue_family_index(QUEUE_FAMILY_UNIVERSAL));
+
+    // 16 bytes keeps every staging offset a multiple of 4 and of the common texel sizes, as image copies require
+    m_staging_alignment = std::max<VkDeviceSize>(16, m_device.get_physical_device().props.limits.optimalBufferCopyOffsetAlignment);
+    m_staging.size = staging_size;
+    m_staging.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    if (!m_staging.init()) return false;
+
+    // Zero everything first, so the destructor can clean up after a partial init
+    UploadBatch empty = {};
+    m_batches.assign(max_batches_in_flight, empty);
+    for (auto& batch : m_batches) {
+        if (!init_batch(batch)) return false;
+    }
+
+    return true;
+}
+
+bool UploadManager::init_batch(UploadBatch& batch) {
+    VkCommandPoolCreateInfo pool_info = {
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,                 // sType
+        nullptr,                                                    // pNext
+        VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,                       // flags
+        m_device.get_queue_family_index(QUEUE_FAMILY_TRANSFER)      // queueFamilyIndex
+    };
+    VkResult res = vkCreateCommandPool(m_device.vk(), &pool_info, nullptr, &batch.pool);
+    if (!validate(res)) return false;
+
+    VkCommandBufferAllocateInfo alloc_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, // sType
+        nullptr,                                        // pNext
+        batch.pool,                                     // commandPool
+        VK_COMMAND_BUFFER_LEVEL_PRIMARY,                // level
+        1                                               // commandBufferCount
+    };
+    res = vkAllocateCommandBuffers(m_device.vk(), &alloc_info, &batch.buffer);
+    if (!validate(res)) return false;
+
+    VkFenceCreateInfo fence_info = {
+        VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,    // sType
+        nullptr,                                // pNext
+        0                                       // flags
+    };
+    res = vkCreateFence(m_device.vk(), &fence_info, nullptr, &batch.fence);
+    return validate(res);
+}
+
+UploadManager::UploadBatch* UploadManager::get_recording_batch() {
+    if (m_batches[m_batch_index].recording)
+        return &m_batches[m_batch_index];
+
+    // The universal queue hasn't taken ownership of the oldest batch's uploads yet (its semaphore can't be
+    // signaled again until it's waited on), or a thread is still waiting on its fence. Neither may be lost,
+    // so a fresh batch goes in front of it. The ring order is kept: the new batch is the newest once submitted
+    if (m_batches[m_batch_index].needs_acquire || m_batches[m_batch_index].n_waiters) {
+        UploadBatch empty = {};
+        m_batches.insert(m_batches.begin() + m_batch_index, empty);
+        if (!init_batch(m_batches[m_batch_index])) {
+            // A half-made batch can't be recorded, so it doesn't stay in the ring
+            UploadBatch& failed = m_batches[m_batch_index];
+            if (failed.fence)
+                vkDestroyFence(m_device.vk(), failed.fence, nullptr);
+            if (failed.pool)
+                vkDestroyCommandPool(m_device.vk(), failed.pool, nullptr);
+            m_batches.erase(m_batches.begin() + m_batch_index);
+            return nullptr;
+        }
+        ATLAS_LOG("Upload batches are flushed faster than they're acquired; now using " + std::to_string(m_batches.size()));
+    }
+
+    UploadBatch& batch = m_batches[m_batch_index];
+    if (batch.submitted && !retire(batch, std::numeric_limits<uint64_t>::max()))
+        return nullptr;
+    VkResult res = vkResetFences(m_device.vk(), 1, &batch.fence);
+    if (!validate(res)) return nullptr;
+    if (!batch.semaphore) {
+        if (!m_free_semaphores.empty()) {
+            batch.semaphore = m_free_semaphores.back();
+            m_free_semaphores.pop_back();
+        }
+        else {
+            VkSemaphoreCreateInfo semaphore_info = {
+                VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,    // sType
+                nullptr,                                    // pNext
+                0                                           // flags
+            };
+            if (!validate(vkCreateSemaphore(m_device.vk(), &semaphore_info, nullptr, &batch.semaphore)))
+                return nullptr;
+        }
+    }
+
+    res = vkResetCommandPool(m_device.vk(), batch.pool, 0);
+    if (!validate(res)) return nullptr;
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,    // flags
+        nullptr                                         // pInheritanceInfo
+    };
+    res = vkBeginCommandBuffer(batch.buffer, &begin_info);
+    if (!validate(res)) return nullptr;
+
+    batch.dst_stages = 0;
+    batch.acquire_buffer_barriers.clear();
+    batch.acquire_image_barriers.clear();
+    batch.recording = true;
+    return &batch;
+}
+
+uint8_t* UploadManager::allocate_staging(VkDeviceSize size, VkDeviceSize& offset) {
+    if (size > m_staging.size) {
+        ATLAS_ERROR("Upload is larger than the whole staging buffer!");
+        return nullptr;
+    }
+
+    // The batch being recorded gets the next ticket when it's submitted
+    StagingAllocation allocation;
+    while (!m_staging.allocate(size, m_staging_alignment, m_next_ticket, allocation)) {
+        // Out of room; free up whatever the transfer queue has finished with, waiting for the oldest batch if
+        // that isn't enough. If the batch being recorded is the only one holding staging memory, submit it first
+        UploadBatch* oldest = get_oldest_submitted_batch();
+        if (!oldest) {
+            UploadBatch& recording = m_batches[m_batch_index];
+            if (!recording.recording || !submit(recording))
+                return nullptr;
+            oldest = get_oldest_submitted_batch();
+        }
+        if (!poll()) return nullptr;
+        if ( oldest->submitted && !retire(*oldest, std::numeric_limits<uint64_t>::max()) )
+            return nullptr;
+    }
+
+    offset = allocation.offset;
+    return static_cast<uint8_t*>(allocation.data);
+}
+
+bool UploadManager::submit(UploadBatch& batch) {
+    if (!m_staging.flush())
+        return false;
+
+    // Release the destinations to the universal queue (and move images to their final layouts)
+    if (!m_release_buffer_barriers.empty() || !m_release_image_barriers.empty()) {
+        vkCmdPipelineBarrier(batch.buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+            0, nullptr,
+            static_cast<uint32_t>(m_release_buffer_barriers.size()), m_release_buffer_barriers.data(),
+            static_cast<uint32_t>(m_release_image_barriers.size()), m_release_image_barriers.data());
+        m_release_buffer_barriers.clear();
+        m_release_image_barriers.clear();
+    }
+    VkResult res = vkEndCommandBuffer(batch.buffer);
+    if (!validate(res)) return false;
+
+    VkSubmitInfo submit_info = {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,  // sType
+        nullptr,                        // pNext
+        0,                              // waitSemaphoreCount
+        nullptr,                        // pWaitSemaphores
+        nullptr,                        // pWaitDstStageMask
+        1,                              // commandBufferCount
+        &batch.buffer,                  // pCommandBuffers
+        1,                              // signalSemaphoreCount
+        &batch.semaphore                // pSignalSemaphores
+    };
+    res = m_device.submit(m_device.get_queue(QUEUE_FAMILY_TRANSFER), 1, &submit_info, batch.fence);
+    batch.recording = false;
+    if (!validate(res)) return false;
+
+    batch.ticket = m_next_ticket++;
+    batch.submitted = true;
+    batch.needs_acquire = true;
+    m_batch_index = (m_batch_index + 1) % m_batches.size();
+    return true;
+}
+
+bool UploadManager::retire(UploadBatch& batch, uint64_t timeout) {
+    VkResult res = vkWaitForFences(m_device.vk(), 1, &batch.fence, VK_TRUE, timeout);
+    if (res == VK_TIMEOUT || !validate(res)) return false;
+    batch.submitted = false;
+
+    // Batches are submitted to a single queue, so they complete in order
+    m_staging.reclaim(batch.ticket);
+    m_completed_ticket = std::max(m_completed_ticket, batch.ticket);
+    return true;
+}
+
+bool UploadManager::poll() {
+    for (uint32_t i = 0; i < m_batches.size(); ++i) {
+        UploadBatch& batch = m_batches[(m_batch_index + i) % m_batches.size()];
+        if (!batch.submitted)
+            continue;
+        VkResult res = vkGetFenceStatus(m_device.vk(), batch.fence);
+        if (res == VK_NOT_READY)
+            break;
+        if (!validate(res) || !retire(batch, 0))
+            return false;
+    }
+    return true;
+}
+
+UploadManager::UploadBatch* UploadManager::get_oldest_submitted_batch() {
+    for (uint32_t i = 0; i < m_batches.size(); ++i) {
+        UploadBatch& batch = m_batches[(m_batch_index + i) % m_batches.size()];
+        if (batch.submitted)
+            return &batch;
+    }
+    return nullptr;
+}
+
+bool UploadManager::upload_buffer(VkBuffer buffer, VkDeviceSize offset, const void* data, VkDeviceSize size, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    VkDeviceSize staging_offset;
+    uint8_t* staging = allocate_staging(size, staging_offset);
+    if (!staging) return false;
+    memcpy(staging, data, size);
+    UploadBatch* batch = get_recording_batch();
+    if (!batch) return false;
+
+    VkBufferCopy region = {
+        staging_offset, // srcOffset
+        offset,         // dstOffset
+        size            // size
+    };
+    vkCmdCopyBuffer(batch->buffer, m_staging.vk(), buffer, 1, &region);
+    batch->dst_stages |= dst_stages;
+
+    // Within a single queue family, waiting on the batch's semaphore is enough to see the copy
+    if (m_transfers_ownership) {
+        VkBufferMemoryBarrier barrier = {
+            VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,                    // sType
+            nullptr,                                                    // pNext
+            VK_ACCESS_TRANSFER_WRITE_BIT,                               // srcAccessMask
+            0,                                                          // dstAccessMask
+            m_device.get_queue_family_index(QUEUE_FAMILY_TRANSFER),     // srcQueueFamilyIndex
+            m_device.get_queue_family_index(QUEUE_FAMILY_UNIVERSAL),    // dstQueueFamilyIndex
+            buffer,                                                     // buffer
+            offset,                                                     // offset
+            size                                                        // size
+        };
+        m_release_buffer_barriers.push_back(barrier);
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = dst_access;
+        batch->acquire_buffer_barriers.push_back(barrier);
+    }
+    return true;
+}
+
+bool UploadManager::upload_image(VkImage image, const VkImageSubresourceLayers& subresource, VkOffset3D offset, VkExtent3D extent, const void* data, VkDeviceSize size, VkImageLayout final_layout, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    VkDeviceSize staging_offset;
+    uint8_t* staging = allocate_staging(size, staging_offset);
+    if (!staging) return false;
+    memcpy(staging, data, size);
+    UploadBatch* batch = get_recording_batch();
+    if (!batch) return false;
+
+    VkImageMemoryBarrier barrier = {
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, // sType
+        nullptr,                                // pNext
+        0,                                      // srcAccessMask
+        VK_ACCESS_TRANSFER_WRITE_BIT,           // dstAccessMask
+        VK_IMAGE_LAYOUT_UNDEFINED,              // oldLayout
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,   // newLayout
+        VK_QUEUE_FAMILY_IGNORED,                // srcQueueFamilyIndex
+        VK_QUEUE_FAMILY_IGNORED,                // dstQueueFamilyIndex
+        image,                                  // image
+        {   subresource.aspectMask,             // subresourceRange
+            subresource.mipLevel,
+            1,
+            subresource.baseArrayLayer,
+            subresource.layerCount
+        }
+    };
+    vkCmdPipelineBarrier(batch->buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkBufferImageCopy region = {
+        staging_offset, // bufferOffset
+        0,              // bufferRowLength (tightly packed)
+        0,              // bufferImageHeight (tightly packed)
+        subresource,    // imageSubresource
+        offset,         // imageOffset
+        extent          // imageExtent
+    };
+    vkCmdCopyBufferToImage(batch->buffer, m_staging.vk(), image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    batch->dst_stages |= dst_stages;
+
+    // The layout transition happens on the transfer queue either way; with an ownership
+    // transfer, the universal queue repeats it in its acquire barrier
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = final_layout;
+    if (m_transfers_ownership) {
+        barrier.srcQueueFamilyIndex = m_device.get_queue_family_index(QUEUE_FAMILY_TRANSFER);
+        barrier.dstQueueFamilyIndex = m_device.get_queue_family_index(QUEUE_FAMILY_UNIVERSAL);
+    }
+    m_release_image_barriers.push_back(barrier);
+    if (m_transfers_ownership) {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = dst_access;
+        batch->acquire_image_barriers.push_back(barrier);
+    }
+    return true;
+}
+
+UploadTicket UploadManager::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    UploadBatch& batch = m_batches[m_batch_index];
+    if (!batch.recording)
+        return m_next_ticket - 1;
+    if (!submit(batch))
+        return 0;
+    return batch.ticket;
+}
+
+bool UploadManager::acquire(FrameRing& frames, VkCommandBuffer universal_buffer) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Semaphores waited on by frames that have since retired can be signaled again
+    auto waited = std::remove_if(m_waited_semaphores.begin(), m_waited_semaphores.end(), [&](const WaitedSemaphore& w) {
+        if (w.frame_serial > frames.get_retired_serial())
+            return false;
+        m_free_semaphores.push_back(w.semaphore);
+        return true;
+    });
+    m_waited_semaphores.erase(waited, m_waited_semaphores.end());
+
+    for (uint32_t i = 0; i < m_batches.size(); ++i) {
+        UploadBatch& batch = m_batches[(m_batch_index + i) % m_batches.size()];
+        if (!batch.needs_acquire)
+            continue;
+
+        // The barriers' source stages match the semaphore wait, so they chain after it
+        const VkPipelineStageFlags stages = batch.dst_stages ? batch.dst_stages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        if (!batch.acquire_buffer_barriers.empty() || !batch.acquire_image_barriers.empty()) {
+            vkCmdPipelineBarrier(universal_buffer, stages, stages, 0,
+                0, nullptr,
+                static_cast<uint32_t>(batch.acquire_buffer_barriers.size()), batch.acquire_buffer_barriers.data(),
+                static_cast<uint32_t>(batch.acquire_image_barriers.size()), batch.acquire_image_barriers.data());
+        }
+        frames.add_wait_semaphore(batch.semaphore, stages);
+
+        m_waited_semaphores.push_back({batch.semaphore, frames.get_frame_serial()});
+        batch.semaphore = VK_NULL_HANDLE;
+        batch.needs_acquire = false;
+    }
+    return true;
+}
+
+bool UploadManager::is_complete(UploadTicket ticket) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (ticket <= m_completed_ticket)
+        return true;
+    poll();
+    return (ticket <= m_completed_ticket);
+}
+
+bool UploadManager::wait(UploadTicket ticket, uint64_t timeout) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (ticket > m_completed_ticket) {
+        // Tickets are only issued by flush(), so an unknown ticket has nothing to wait for
+        UploadBatch* oldest = get_oldest_submitted_batch();
+        if (!oldest) return false;
+
+        // Blocks without the lock so other threads can keep uploading. The batch's fence isn't reset (and the
+        // batch isn't reused) while it has waiters, but other threads may retire it, or add batches and
+        // move it, so it's looked up again by ticket afterwards
+        const VkFence fence = oldest->fence;
+        const UploadTicket oldest_ticket = oldest->ticket;
+        ++oldest->n_waiters;
+        lock.unlock();
+        VkResult res = vkWaitForFences(m_device.vk(), 1, &fence, VK_TRUE, timeout);
+        lock.lock();
+        for (auto& batch : m_batches) {
+            if (batch.fence == fence)
+                --batch.n_waiters;
+        }
+        if (res == VK_TIMEOUT || !validate(res)) return false;
+
+        // Batches complete in order, so this retires the one waited on and any before it
+        if (oldest_ticket > m_completed_ticket && !poll())
+            return false;
+    }
+    return true;
+}
@@ -1,5 +1,7 @@
 #include "window.h"
 #include "backend.h"
+#include "cache.h"
+#include "trace.h"
 #include <algorithm>
 #include <array>
 #include <assert.h>
@@ -30,7 +32,7 @@ struct Window::xcb_info {
 bool Window::init_xcb() {
     xcb->connection = xcb_connect(NULL, NULL);
     if (xcb_connection_has_error(xcb->connection)) {
-        Backend::error("Could not connect to X server");
+        ATLAS_ERROR("Could not connect to X server");
         return false;
     }
 
@@ -58,7 +60,7 @@ bool Window::init_xcb() {
     xcb_generic_error_t* err = xcb_request_check(xcb->connection, err_cookie);
     if (err != NULL)  {
         std::string err_string = "Could not create window. X11 error code " + err->error_code;
-        Backend::error(err_string);
+        ATLAS_ERROR(err_string);
         free(err);
         return false;
     }
@@ -82,14 +84,14 @@ bool Window::init_xcb() {
     // Cache the atoms which control if the window is fullscreen
     xcb_intern_atom_reply_t* wm_state_reply = xcb_intern_atom_reply(xcb->connection, wm_state_cookie, nullptr);
     if (!wm_state_reply) {
-        Backend::error("Could not retrieve the window's _NET_WM_STATE atom!");
+        ATLAS_ERROR("Could not retrieve the window's _NET_WM_STATE atom!");
         return false;
     }
     xcb->wm_state_atom = wm_state_reply->atom;
     free(wm_state_reply);
     xcb_intern_atom_reply_t* fullscreen_reply = xcb_intern_atom_reply(xcb->connection, fullscreen_cookie, nullptr);
     if (!fullscreen_reply) {
-        Backend::error("Could not retrieve the window's _NET_WM_STATE_FULLSCREEN atom!");
+        ATLAS_ERROR("Could not retrieve the window's _NET_WM_STATE_FULLSCREEN atom!");
         return false;
     }
     xcb->fullscreen_atom = fullscreen_reply->atom;
@@ -99,13 +101,13 @@ bool Window::init_xcb() {
     xcb_intern_atom_reply_t* delete_reply = xcb_intern_atom_reply(
         xcb->connection, delete_cookie, NULL);
     if (!delete_reply) {
-        Backend::error("Could not retrieve the window's WM_DELETE_WINDOW atom!");
+        ATLAS_ERROR("Could not retrieve the window's WM_DELETE_WINDOW atom!");
         return false;
     }
     xcb_intern_atom_reply_t* protocols_reply = xcb_intern_atom_reply(
         xcb->connection, protocols_cookie, NULL);
     if (!delete_reply) {
-        Backend::error("Could not retrieve the window's WM_PROTOCOLS atom!");
+        ATLAS_ERROR("Could not retrieve the window's WM_PROTOCOLS atom!");
         return false;
     }
     err_cookie = xcb_change_property_checked(xcb->connection, XCB_PROP_MODE_REPLACE, xcb->window,
@@ -113,7 +115,7 @@ bool Window::init_xcb() {
     err = xcb_request_check(xcb->connection, err_cookie);
     if (err != NULL)  {
         std::string err_string = "Could not override window delete handler. X11 error code " + err->error_code;
-        Backend::error(err_string);
+        ATLAS_ERROR(err_string);
         free(err);
         return false;
     }
@@ -128,7 +130,7 @@ bool Window::init_xcb() {
     set_fullscreen(m_flags & request_fullscreen);
     
     if (xcb_flush(xcb->connection) <= 0) {
-        Backend::error("Error while flushing xcb stream!");
+        ATLAS_ERROR("Error while flushing xcb stream!");
         return false;
     }
 
@@ -147,7 +149,7 @@ void Window::handle_xcb_events() {
             break;
         }
         case XCB_CONFIGURE_NOTIFY: {
-            Backend::log("Resize requested...");
+            ATLAS_LOG("Resize requested...");
             const xcb_configure_notify_event_t* cfg_event = reinterpret_cast<const xcb_configure_notify_event_t*>(xcb->event);
             if (  ((m_desired_width == m_width) && (m_desired_height == m_height))
             && ((cfg_event->width != m_width) || (cfg_event->height != m_height))  ) {
@@ -258,7 +260,7 @@ bool Window::init_win32() {
 
     if (!RegisterClassEx(&wc)) {
         std::string err_string = "Failed to register WNDCLASSEX! Error code " + GetLastError();
-        Backend::error(err_string);
+        ATLAS_ERROR(err_string);
         return false;
     }
 
@@ -277,7 +279,7 @@ bool Window::init_win32() {
                 NULL);                  // Don't pass anything to WM_CREATE
     
     if (!win32->hwnd) {
-        Backend::error("Failed to create window!\n");
+        ATLAS_ERROR("Failed to create window!\n");
         return false;
     }
 
@@ -323,8 +325,8 @@ Window::Window(const Backend::Instance& instance, const std::string& name, uint3
 Window::Window(const Backend::Instance& instance, uint32_t physical_device_index, const std::string& name, uint32_t width, uint32_t height)
     : m_name(name), m_width(width), m_height(height), m_flags(0), m_n_swapchain_images(3), m_frame_index(0), m_desired_width(width), m_desired_height(height)
     , m_color_format(VK_FORMAT_UNDEFINED), m_depth_format(VK_FORMAT_UNDEFINED), m_color_space(VK_COLOR_SPACE_MAX_ENUM_KHR), m_instance(instance), m_device(nullptr)
-    , m_physical_device_index(physical_device_index), m_surface(VK_NULL_HANDLE), m_swapchain(VK_NULL_HANDLE), m_depth(VK_NULL_HANDLE), m_depth_view(VK_NULL_HANDLE)
-    , vkCreateSwapchainKHR(VK_NULL_HANDLE), vkGetSwapchainImagesKHR(VK_NULL_HANDLE), vkCreateFramebuffer(VK_NULL_HANDLE), vkDestroyFramebuffer(VK_NULL_HANDLE)
+    , m_physical_device_index(physical_device_index), m_surface(VK_NULL_HANDLE), m_swapchain(VK_NULL_HANDLE), m_depth(VK_NULL_HANDLE), m_depth_view(VK_NULL_HANDLE), m_lazy_depth_bytes(0)
+    , vkCreateSwapchainKHR(VK_NULL_HANDLE), vkGetSwapchainImagesKHR(VK_NULL_HANDLE)
     , vkAcquireNextImageKHR(VK_NULL_HANDLE), vkQueuePresentKHR(VK_NULL_HANDLE), vkGetPhysicalDeviceFormatProperties(VK_NULL_HANDLE)
 {
     // Surface functions
@@ -338,6 +340,10 @@ Window::Window(const Backend::Instance& instance, uint32_t physical_device_index
     vkCreateWin32SurfaceKHR = reinterpret_cast<PFN_vkCreateWin32SurfaceKHR>( vkGetInstanceProcAddr(instance.vk(), "vkCreateWin32SurfaceKHR") );
 #else
     vkCreateXcbSurfaceKHR = reinterpret_cast<PFN_vkCreateXcbSurfaceKHR>( vkGetInstanceProcAddr(instance.vk(), "vkCreateXcbSurfaceKHR") );
+#endif
+#ifdef VK_EXT_headless_surface
+    // Null unless the instance enabled VK_EXT_headless_surface
+    vkCreateHeadlessSurfaceEXT = reinterpret_cast<PFN_vkCreateHeadlessSurfaceEXT>( vkGetInstanceProcAddr(instance.vk(), "vkCreateHeadlessSurfaceEXT") );
 #endif
     // Swapchain functions are loaded when the device is initialized
 
@@ -367,26 +373,43 @@ Window::~Window() {
 }
 
 bool Window::init_surface() {
+    if (m_flags & headless) {
+#ifdef VK_EXT_headless_surface
+        if (vkCreateHeadlessSurfaceEXT) {
+            VkHeadlessSurfaceCreateInfoEXT surface_info = {
+                VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT, // sType
+                nullptr,                                            // pNext
+                0                                                   // flags
+            };
+            VkResult res = vkCreateHeadlessSurfaceEXT(m_instance.vk(), &surface_info, nullptr, &m_surface);
+            if (!validate(res)) m_surface = VK_NULL_HANDLE;
+        }
+#endif
+        if (!m_surface)
+            return init_offscreen_target();
+    }
+    else {
 #ifdef _WIN32
-    VkWin32SurfaceCreateInfoKHR surface_info = {
-        VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR,    // sType
-        nullptr,                                            // pNext
-        0,                                                  // flags
-        win32->inst,                                        // hinstance
-        win32->hwnd                                         // hwnd
-    };
-    vkCreateWin32SurfaceKHR(m_instance.vk(), &surface_info, nullptr, &m_surface);
+        VkWin32SurfaceCreateInfoKHR surface_info = {
+            VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR,    // sType
+            nullptr,                                            // pNext
+            0,                                                  // flags
+            win32->inst,                                        // hinstance
+            win32->hwnd                                         // hwnd
+        };
+        vkCreateWin32SurfaceKHR(m_instance.vk(), &surface_info, nullptr, &m_surface);
 
 #else
-    VkXcbSurfaceCreateInfoKHR surface_info = {
-        VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR,  // sType
-        nullptr,                                        // pNext
-        0,                                              // flags
-        xcb->connection,                                // connection
-        xcb->window                                     // window
-    };
-    vkCreateXcbSurfaceKHR(m_instance.vk(), &surface_info, nullptr, &m_surface);
+        VkXcbSurfaceCreateInfoKHR surface_info = {
+            VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR,  // sType
+            nullptr,                                        // pNext
+            0,                                              // flags
+            xcb->connection,                                // connection
+            xcb->window                                     // window
+        };
+        vkCreateXcbSurfaceKHR(m_instance.vk(), &surface_info, nullptr, &m_surface);
 #endif
+    }
 
     VkPhysicalDevice phys = m_instance.get_physical_device(m_physical_device_index).device;
 
@@ -423,7 +446,7 @@ bool Window::init_surface() {
     }
 
     if (no_present_queue) {
-        Backend::error("Couldn't find a present-capable queue family!");
+        ATLAS_ERROR("Couldn't find a present-capable queue family!");
         return false;
     }
 
@@ -454,9 +477,43 @@ bool Window::init_surface() {
     return true;
 }
 
+bool Window::init_offscreen_target() {
+    VkPhysicalDevice phys = m_instance.get_physical_device(m_physical_device_index).device;
+
+    // Nothing is ever handed to a presentation engine, so any queue family can stand in for presenting
+    uint32_t n_physical_device_queues;
+    vkGetPhysicalDeviceQueueFamilyProperties(phys, &n_physical_device_queues, NULL);
+    for (uint32_t queue_family = 0; queue_family < n_physical_device_queues; ++queue_family) {
+        m_present_capable_families.insert(queue_family);
+    }
+
+    // Use the same color format a surface would most likely prefer
+    const std::array<VkFormat, 2> color_formats = {
+        VK_FORMAT_B8G8R8A8_UNORM,
+        VK_FORMAT_R8G8B8A8_UNORM
+    };
+    VkFormatProperties format_props;
+    for (const auto& format : color_formats) {
+        vkGetPhysicalDeviceFormatProperties(phys, format, &format_props);
+        if (format_props.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT) {
+            m_color_format = format;
+            m_color_space = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+            break;
+        }
+    }
+    if (m_color_format == VK_FORMAT_UNDEFINED) {
+        ATLAS_ERROR("No color format supports an offscreen color attachment!");
+        return false;
+    }
+
+    ATLAS_LOG("VK_EXT_headless_surface is unavailable; rendering to offscreen images");
+    return true;
+}
+
 bool Window::init_swapchain(Backend::Device* device) {
+    ATLAS_TRACE_ZONE("Window::init_swapchain");
     if (!device) {
-        Backend::error("init_swapchain called with null device handle!");
+        ATLAS_ERROR("init_swapchain called with null device handle!");
         return false;
     }
 
@@ -465,9 +522,21 @@ bool Window::init_swapchain(Backend::Device* device) {
     // (which is obviously too much for changing vsync)
     VkSwapchainKHR old_swapchain = m_swapchain;
 
+    // The surface may have changed size since the last time it was queried
+    if (m_surface && (old_swapchain != VK_NULL_HANDLE)) {
+        VkResult res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_device->get_physical_device().device, m_surface, &m_surface_caps);
+        if (!validate(res)) return false;
+    }
+
     // Image size
     VkExtent2D extent;
-    if (m_surface_caps.currentExtent.width == (uint32_t)-1) {
+    if (uses_offscreen_images()) {
+        // No surface to match, so the window's size is used as-is
+        extent.width = m_width;
+        extent.height = m_height;
+        return init_offscreen_images(extent) && init_frame_resources(extent);
+    }
+    else if (m_surface_caps.currentExtent.width == (uint32_t)-1) {
         // 0xFFFFFFFF means that the dimensions can be requested
         extent.width = m_width;
         extent.height = m_height;
@@ -475,6 +544,8 @@ bool Window::init_swapchain(Backend::Device* device) {
     else {
         // If the surface size is defined, the swap chain size must match
         extent = m_surface_caps.currentExtent;
+        m_width = extent.width;
+        m_height = extent.height;
     }
 
     // Swapchain present mode
@@ -527,7 +598,7 @@ bool Window::init_swapchain(Backend::Device* device) {
         }
     }
     if (composite_alpha == VK_COMPOSITE_ALPHA_FLAG_BITS_MAX_ENUM_KHR) {
-        Backend::error("Could not find a supported composite alpha for the presentation surface!");
+        ATLAS_ERROR("Could not find a supported composite alpha for the presentation surface!");
         return false;
     }
 
@@ -567,18 +638,9 @@ bool Window::init_swapchain(Backend::Device* device) {
     VkResult res = vkCreateSwapchainKHR(device->vk(), &swapchain_info, nullptr, &m_swapchain);
     if (!validate(res)) return false;
 
-    // If this was a re-creation of an existing swapchain, destroy the old one
-    // (also cleans up all the presentable images and semaphores)
-    if (old_swapchain != VK_NULL_HANDLE) {
-        for (auto& semaphore : m_image_available_semaphores) {
-            vkDestroySemaphore(device->vk(), semaphore, nullptr);
-        }
-        vkDestroyImageView(device->vk(), m_depth_view, nullptr);
-        for (auto& view : m_image_views) {
-            vkDestroyImageView(device->vk(), view, nullptr);
-        }
-        vkDestroySwapchainKHR(device->vk(), old_swapchain, nullptr);
-    }
+    // If this was a re-creation of an existing swapchain, the old one (and the views, semaphores
+    // and depth buffer that went with it) was handed to retire_swapchain() and is released
+    // once the frames using it have finished
 
     // Get the swapchain images
     res = vkGetSwapchainImagesKHR(device->vk(), m_swapchain, &m_n_swapchain_images, nullptr);
@@ -623,6 +685,80 @@ bool Window::init_swapchain(Backend::Device* device) {
         if (!validate(res)) return false;
     }
 
+    return init_frame_resources(extent);
+}
+
+bool Window::init_offscreen_images(VkExtent2D extent) {
+    // Any previous images were handed over to retire_swapchain() by rebuild()
+    m_images.assign(m_n_swapchain_images, VK_NULL_HANDLE);
+    m_image_views.assign(m_n_swapchain_images, VK_NULL_HANDLE);
+    m_image_available_semaphores.assign(m_n_swapchain_images, VK_NULL_HANDLE);
+    m_depth = VK_NULL_HANDLE;
+    m_depth_view = VK_NULL_HANDLE;
+    m_frame_index = 0;
+
+    // Transfer source so that frames can be read back
+    VkImageCreateInfo color_info = {
+        VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,            // sType
+        nullptr,                                        // pNext
+        0,                                              // flags
+        VK_IMAGE_TYPE_2D,                               // imageType
+        m_color_format,                                 // format
+        {   extent.width,                               // extent
+            extent.height,
+            1
+        },
+        1,                                              // mipLevels
+        1,                                              // arrayLayers
+        VK_SAMPLE_COUNT_1_BIT,                          // samples
+        VK_IMAGE_TILING_OPTIMAL,                        // tiling
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT,                // usage
+        VK_SHARING_MODE_EXCLUSIVE,                      // sharingMode
+        0,                                              // queueFamilyIndexCount
+        0,                                              // pQueueFamilyIndices
+        VK_IMAGE_LAYOUT_UNDEFINED                       // initialLayout
+    };
+    VmaMemoryRequirements color_reqs = {
+        VK_FALSE,                   // ownMemory
+        VMA_MEMORY_USAGE_GPU_ONLY   // usage
+        // Fill rest with 0s
+    };
+    VkImageViewCreateInfo color_view_info = {
+        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,   // sType
+        nullptr,                                    // pNext
+        0,                                          // flags
+        VK_NULL_HANDLE,                             // image
+        VK_IMAGE_VIEW_TYPE_2D,                      // viewType
+        m_color_format,                             // format
+        {   VK_COMPONENT_SWIZZLE_R,
+            VK_COMPONENT_SWIZZLE_G,
+            VK_COMPONENT_SWIZZLE_B,
+            VK_COMPONENT_SWIZZLE_A
+        },                                          // components
+        {   VK_IMAGE_ASPECT_COLOR_BIT,              // aspectMask
+            0,                                      // baseMipLevel
+            1,                                      // levelCount
+            0,                                      // baseArrayLayer
+            1                                       // layerCount
+        }                                           // subresourceRange
+    };
+    VkResult res;
+    for (uint32_t i = 0; i < m_n_swapchain_images; ++i) {
+        res = vmaCreateImage(m_device->get_allocator(), &color_info, &color_reqs, &m_images[i], nullptr, nullptr);
+        if (!validate(res)) return false;
+
+        color_view_info.image = m_images[i];
+        res = vkCreateImageView(m_device->vk(), &color_view_info, nullptr, &m_image_views[i]);
+        if (!validate(res)) return false;
+    }
+
+    return true;
+}
+
+bool Window::init_frame_resources(VkExtent2D extent) {
+    VkResult res;
+
     //
     // Create a depth/stencil buffer
     //
@@ -660,7 +796,7 @@ bool Window::init_swapchain(Backend::Device* device) {
         }
     }
     if (m_depth_format == VK_FORMAT_UNDEFINED) {
-        Backend::error("No tiling formats support a depth/stencil attachment!");
+        ATLAS_ERROR("No tiling formats support a depth/stencil attachment!");
         return false;
     }
 
@@ -685,13 +821,13 @@ bool Window::init_swapchain(Backend::Device* device) {
         0,                                              // pQueueFamilyIndices
         VK_IMAGE_LAYOUT_UNDEFINED                       // initialLayout
     };
-    VmaMemoryRequirements depth_reqs = {
-        VK_TRUE,                    // ownMemory
-        VMA_MEMORY_USAGE_GPU_ONLY   // usage
-        // Fill rest with 0s
-    };
-    res = vmaCreateImage(m_device->get_allocator(), &depth_info, &depth_reqs, &m_depth, nullptr, nullptr);
-    if (!validate(res)) return false;
+    // Depth is only ever an attachment, and render passes that don't store it (like the demos') let it
+    // stay in tile memory on GPUs that have it. Storing it still works, it just commits the memory
+    const bool had_lazy_depth = (m_lazy_depth_bytes != 0);
+    if (!m_device->create_transient_attachment(depth_info, m_depth, m_lazy_depth_bytes))
+        return false;
+    if (m_lazy_depth_bytes && !had_lazy_depth)
+        ATLAS_LOG("Depth buffer is lazily allocated, saving " + std::to_string(m_lazy_depth_bytes / 1024) + " KiB");
 
     // Add a stencil attachment if the depth image supports it
     VkImageAspectFlags aspect_mask = VK_IMAGE_ASPECT_DEPTH_BIT;
@@ -737,14 +873,14 @@ bool Window::init_swapchain(Backend::Device* device) {
         0                                           // flags
     };
     for (uint32_t i = 0; i < m_n_swapchain_images; ++i) {
-        res = vkCreateSemaphore(device->vk(), &semaphore_info, nullptr, &m_image_available_semaphores[i]);
+        res = vkCreateSemaphore(m_device->vk(), &semaphore_info, nullptr, &m_image_available_semaphores[i]);
         if (!validate(res)) return false;
     }
 
     return true;
 }
 
-bool Window::init_framebuffers(const Backend::RenderPass& renderpass, const std::vector<VkImageView>& attachments_in) {
+bool Window::init_framebuffers(const Backend::RenderPass& renderpass, Span<VkImageView> attachments_in) {
     std::vector<VkImageView> attachments(attachments_in.size() + 2);
     attachments[1] = m_depth_view;
     std::vector<VkImageView>::iterator copy_start = attachments.begin();
@@ -754,24 +890,29 @@ bool Window::init_framebuffers(const Backend::RenderPass& renderpass, const std:
     VkFramebufferCreateInfo framebufferInfo = {};
     framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     framebufferInfo.renderPass = renderpass.vk();
-    framebufferInfo.attachmentCount = 2;
+    framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
     framebufferInfo.width = m_width;
     framebufferInfo.height = m_height;
     framebufferInfo.layers = 1;
 
     m_framebuffers.resize(m_n_swapchain_images);
 
+    // The cache owns the framebuffers; they're evicted along with the views in release_retired_swapchains()
     for (size_t i = 0; i < m_n_swapchain_images; i++) {
         attachments[0] = m_image_views[i];
         framebufferInfo.pAttachments = attachments.data();
 
-        if (!validate(vkCreateFramebuffer(m_device->vk(), &framebufferInfo, nullptr, &m_framebuffers[i])))
+        m_framebuffers[i] = m_device->get_object_cache().get_framebuffer(framebufferInfo);
+        if (!m_framebuffers[i])
             return false;
     }
     return true;
 }
 
 bool Window::init() {
+    if (m_flags & headless)
+        return init_surface();
+
 #   ifdef _WIN32
         return init_win32() && init_surface();
 #   else
@@ -780,6 +921,10 @@ bool Window::init() {
 }
 
 void Window::handle_events() {
+    ATLAS_TRACE_ZONE("Window::handle_events");
+    if (m_flags & headless)
+        return;
+
 #if _WIN32
     handle_win32_events();
 #else
@@ -788,6 +933,11 @@ void Window::handle_events() {
 }
 
 void Window::close() {
+    if (m_flags & headless) {
+        m_flags |= request_close;
+        return;
+    }
+
 #if _WIN32
     DestroyWindow(win32->hwnd);
     win32->hwnd = 0;
@@ -797,14 +947,67 @@ void Window::close() {
 #endif
 }
 
-bool Window::acquire_next_frame(uint64_t timeout, VkFence fence) {
-    VkResult res = vkAcquireNextImageKHR(m_device->vk(), m_swapchain, timeout, m_image_available_semaphores[m_frame_index], fence, &m_frame_index);
+bool Window::acquire_next_frame(uint64_t timeout, VkFence fence, VkSemaphore semaphore) {
+    ATLAS_TRACE_ZONE("Window::acquire_next_frame");
+    if (!m_retired_swapchains.empty())
+        release_retired_swapchains(false);
+
+    if (uses_offscreen_images()) {
+        // There's no presentation engine to hand images back, so cycle through them in order
+        // and signal the semaphore and fence straight away, like an acquire that never blocks
+        m_frame_index = (m_frame_index + 1) % m_n_swapchain_images;
+        if (!semaphore)
+            semaphore = m_image_available_semaphores[m_frame_index];
+        VkSubmitInfo submit_info = {
+            VK_STRUCTURE_TYPE_SUBMIT_INFO,                  // sType
+            nullptr,                                        // pNext
+            0,                                              // waitSemaphoreCount
+            nullptr,                                        // pWaitSemaphores
+            nullptr,                                        // pWaitDstStageMask
+            0,                                              // commandBufferCount
+            nullptr,                                        // pCommandBuffers
+            1,                                              // signalSemaphoreCount
+            &semaphore                                      // pSignalSemaphores
+        };
+        return validate( m_device->submit(m_present_queue, 1, &submit_info, fence) );
+    }
+
+    if (!semaphore)
+        semaphore = m_image_available_semaphores[m_frame_index];
+    VkResult res = vkAcquireNextImageKHR(m_device->vk(), m_swapchain, timeout, semaphore, fence, &m_frame_index);
     if ((res == VK_SUBOPTIMAL_KHR) || (res == VK_ERROR_OUT_OF_DATE_KHR))
         m_flags |= surface_changed;
     return validate(res);
 }
 
-bool Window::present(const std::vector<VkSemaphore> wait_semaphores) {
+bool Window::present(Span<VkSemaphore> wait_semaphores) {
+    ATLAS_TRACE_ZONE("Window::present");
+    if (wait_semaphores.size() > max_present_wait_semaphores) {
+        ATLAS_ERROR("Window::present() was given more than " + std::to_string(max_present_wait_semaphores) + " semaphores to wait on!");
+        return false;
+    }
+
+    if (uses_offscreen_images()) {
+        // Nothing to present to, but the semaphores still have to be waited on to be reusable
+        if (wait_semaphores.empty())
+            return true;
+
+        VkPipelineStageFlags wait_stages[max_present_wait_semaphores];
+        std::fill(wait_stages, wait_stages + wait_semaphores.size(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+        VkSubmitInfo submit_info = {
+            VK_STRUCTURE_TYPE_SUBMIT_INFO,                      // sType
+            nullptr,                                            // pNext
+            static_cast<uint32_t>(wait_semaphores.size()),      // waitSemaphoreCount
+            wait_semaphores.data(),                             // pWaitSemaphores
+            wait_stages,                                        // pWaitDstStageMask
+            0,                                                  // commandBufferCount
+            nullptr,                                            // pCommandBuffers
+            0,                                                  // signalSemaphoreCount
+            nullptr                                             // pSignalSemaphores
+        };
+        return validate( m_device->submit(m_present_queue, 1, &submit_info, VK_NULL_HANDLE) );
+    }
+
     VkPresentInfoKHR present_info = {
         VK_STRUCTURE_TYPE_PRESENT_INFO_KHR, // sType
         nullptr,                            // pNext
@@ -815,7 +1018,50 @@ bool Window::present(const std::vector<VkSemaphore> wait_semaphores) {
         &m_frame_index,                     // pImageIndices
         nullptr                             // pResults
     };
-    return validate( vkQueuePresentKHR(m_present_queue, &present_info) );
+    VkResult res;
+    {
+        std::lock_guard<std::mutex> lock(m_device->get_queue_mutex());
+        res = vkQueuePresentKHR(m_present_queue, &present_info);
+    }
+    if ((res == VK_SUBOPTIMAL_KHR) || (res == VK_ERROR_OUT_OF_DATE_KHR))
+        m_flags |= surface_changed;
+    return validate(res);
+}
+
+bool Window::set_client_area(uint32_t width, uint32_t height) {
+    if (m_flags & headless) {
+        // No window manager to ask, so the size takes effect on the next rebuild
+        if ( (width != m_width) || (height != m_height) ) {
+            m_desired_width = width;
+            m_desired_height = height;
+            m_flags |= surface_changed;
+        }
+        return true;
+    }
+
+#ifdef _WIN32
+    RECT rect;
+    rect.left = 0;
+    rect.top = 0;
+    rect.right = width;
+    rect.bottom = height;
+    AdjustWindowRect(&rect, static_cast<DWORD>(GetWindowLongPtr(win32->hwnd, GWL_STYLE)), FALSE);
+    return (SetWindowPos(win32->hwnd, NULL, 0, 0, rect.right-rect.left, rect.bottom-rect.top, SWP_NOMOVE | SWP_NOZORDER) != 0);
+#else
+    // The size hints pin the window to its current size, so they have to move along with it
+    xcb_size_hints_t size_hints = {};
+    xcb_icccm_size_hints_set_min_size(&size_hints, width, height);
+    xcb_icccm_size_hints_set_max_size(&size_hints, width, height);
+    xcb_icccm_set_wm_size_hints(xcb->connection, xcb->window, XCB_ATOM_WM_NORMAL_HINTS, &size_hints);
+
+    const uint32_t values[] = { width, height };
+    xcb_configure_window(xcb->connection, xcb->window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+    if (xcb_flush(xcb->connection) <= 0) {
+        ATLAS_ERROR("Error while flushing xcb stream!");
+        return false;
+    }
+    return true;
+#endif
 }
 
 bool Window::set_fullscreen(bool full) {
@@ -866,13 +1112,13 @@ bool Window::set_fullscreen(bool full) {
             xcb_generic_error_t* err = xcb_request_check(xcb->connection, err_cookie);
             if (err != NULL)  {
                 std::string err_string = "Could not toggle fullscreen! X11 error code " + err->error_code;
-                Backend::error(err_string);
+                ATLAS_ERROR(err_string);
                 free(err);
                 return false;
             }
             free(err);
             if (xcb_flush(xcb->connection) <= 0) {
-                Backend::error("Error while flushing xcb stream!");
+                ATLAS_ERROR("Error while flushing xcb stream!");
                 return false;
             }
 
@@ -885,20 +1131,107 @@ bool Window::set_fullscreen(bool full) {
 #endif
 }
 
-bool Window::rebuild(const Backend::RenderPass& renderpass, const std::vector<VkImageView>& attachments) {
+bool Window::rebuild(const Backend::RenderPass& renderpass, Span<VkImageView> attachments) {
+    return rebuild() && init_framebuffers(renderpass, attachments);
+}
+
+bool Window::rebuild() {
     if (m_device) {
         m_width = m_desired_width;
         m_height = m_desired_height;
         m_flags &= (~surface_changed);
 
-        vkDeviceWaitIdle(m_device->vk());
+        // Frames already in flight keep rendering into the old resources,
+        // which get released once they have finished
+        if (!retire_swapchain()) return false;
 
-        for (auto iter = m_framebuffers.rbegin(); iter != m_framebuffers.rend(); ++iter) {
-            if (*iter)
-                vkDestroyFramebuffer(m_device->vk(), *iter, nullptr);
+        return init_swapchain(m_device);
+    }
+    else return false;
+}
+
+bool Window::retire_swapchain() {
+    RetiredSwapchain retired = {};
+
+    // An empty submission's fence signals only after everything submitted before it on the queue
+    // The rendering is on the universal queue, but the last presents of the old swapchain are on the
+    // present queue, so when that's a separate queue it gets a fence of its own
+    VkFenceCreateInfo fence_info = {
+        VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,    // sType
+        nullptr,                                // pNext
+        0                                       // flags
+    };
+    VkQueue queues[2] = { m_device->get_queue(Backend::QUEUE_FAMILY_UNIVERSAL), m_present_queue };
+    const uint32_t n_queues = (queues[1] != queues[0]) ? 2 : 1;
+    for (uint32_t i = 0; i < n_queues; ++i) {
+        VkResult res = vkCreateFence(m_device->vk(), &fence_info, nullptr, &retired.fences[i]);
+        if (validate(res)) {
+            ++retired.n_fences;
+            res = m_device->submit(queues[i], 0, nullptr, retired.fences[i]);
+        }
+        if (!validate(res)) {
+            for (uint32_t j = 0; j < retired.n_fences; ++j)
+                vkDestroyFence(m_device->vk(), retired.fences[j], nullptr);
+            return false;
+        }
+    }
+
+    // The swapchain handle stays in m_swapchain so the new one can be created from it
+    retired.swapchain = m_swapchain;
+    if (uses_offscreen_images())
+        retired.images.swap(m_images);
+    retired.image_views.swap(m_image_views);
+    m_framebuffers.clear();
+    retired.semaphores.swap(m_image_available_semaphores);
+    retired.depth = m_depth;
+    retired.depth_view = m_depth_view;
+
+    m_images.clear();
+    m_depth = VK_NULL_HANDLE;
+    m_depth_view = VK_NULL_HANDLE;
+
+    m_retired_swapchains.push_back(std::move(retired));
+    return true;
+}
+
+void Window::release_retired_swapchains(bool wait) {
+    auto iter = m_retired_swapchains.begin();
+    while (iter != m_retired_swapchains.end()) {
+        // A zero timeout polls the fences
+        VkResult res = vkWaitForFences(m_device->vk(), iter->n_fences, iter->fences, VK_TRUE, wait ? std::numeric_limits<uint64_t>::max() : 0);
+        if (res != VK_SUCCESS) {
+            // Retired in order, so nothing after this one has finished either
+            if (res != VK_TIMEOUT) validate(res);
+            break;
         }
 
-        return init_swapchain(m_device) && init_framebuffers(renderpass, attachments);
+        // Drops the framebuffers made from the views before the handles can be reused
+        Backend::ObjectCache& cache = m_device->get_object_cache();
+        if (iter->depth_view)
+            cache.evict_image_view(iter->depth_view);
+        for (VkImageView view : iter->image_views)
+            cache.evict_image_view(view);
+        for (auto semaphore = iter->semaphores.rbegin(); semaphore != iter->semaphores.rend(); ++semaphore) {
+            if (*semaphore)
+                vkDestroySemaphore(m_device->vk(), *semaphore, nullptr);
+        }
+        if (iter->depth_view)
+            vkDestroyImageView(m_device->vk(), iter->depth_view, nullptr);
+        if (iter->depth)
+            vmaDestroyImage(m_device->get_allocator(), iter->depth);
+        for (auto view = iter->image_views.rbegin(); view != iter->image_views.rend(); ++view) {
+            if (*view)
+                vkDestroyImageView(m_device->vk(), *view, nullptr);
+        }
+        for (auto image = iter->images.rbegin(); image != iter->images.rend(); ++image) {
+            if (*image)
+                vmaDestroyImage(m_device->get_allocator(), *image);
+        }
+        if (iter->swapchain)
+            vkDestroySwapchainKHR(m_device->vk(), iter->swapchain, nullptr);
+        for (uint32_t i = 0; i < iter->n_fences; ++i)
+            vkDestroyFence(m_device->vk(), iter->fences[i], nullptr);
+
+        iter = m_retired_swapchains.erase(iter);
     }
-    else return false;
 }
\ No newline at end of file
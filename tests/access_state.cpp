@@ -0,0 +1,160 @@
+// Checks the barriers update_access_state() asks for, which the ResourceTracker and the RenderGraph both build
+// theirs from: reads after a write wait for it, writes after reads wait for the reads, repeated reads merge
+// into one barrier, and layout transitions count as writes. Runs on the CPU only
+#include "tracker.h"
+#include <stdio.h>
+
+using namespace Atlas;
+
+static bool check(bool condition, const char* what) {
+    if (!condition)
+        printf("%s\n", what);
+    return condition;
+}
+
+// Checks one access asks for a barrier with the given source; dst is always the access itself
+static bool check_barrier(Backend::AccessState& state, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout, bool is_write,
+    bool is_image, VkPipelineStageFlags src_stages, VkAccessFlags src_access, const char* what) {
+    Backend::AccessTransition transition;
+    const VkImageLayout old_layout = state.layout;
+    if (!Backend::update_access_state(state, stages, access, layout, is_write, is_image, transition)) {
+        printf("%s: no barrier\n", what);
+        return false;
+    }
+    bool passed = true;
+    if (transition.src_stages != src_stages || transition.src_access != src_access) {
+        printf("%s: expected source 0x%x/0x%x, got 0x%x/0x%x\n", what, src_stages, src_access, transition.src_stages, transition.src_access);
+        passed = false;
+    }
+    if (transition.dst_stages != stages || transition.dst_access != access) {
+        printf("%s: expected destination 0x%x/0x%x, got 0x%x/0x%x\n", what, stages, access, transition.dst_stages, transition.dst_access);
+        passed = false;
+    }
+    if (transition.old_layout != old_layout || transition.new_layout != layout) {
+        printf("%s: expected layouts %d -> %d, got %d -> %d\n", what, old_layout, layout, transition.old_layout, transition.new_layout);
+        passed = false;
+    }
+    return passed;
+}
+
+static bool check_no_barrier(Backend::AccessState& state, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout, bool is_write,
+    bool is_image, const char* what) {
+    Backend::AccessTransition transition;
+    return check(!Backend::update_access_state(state, stages, access, layout, is_write, is_image, transition), what);
+}
+
+static Backend::AccessState make_state(VkImageLayout layout, VkPipelineStageFlags write_stages = 0, VkAccessFlags write_access = 0) {
+    return {
+        layout,         // layout
+        write_stages,   // write_stages
+        write_access,   // write_access
+        0,              // read_stages
+        0               // read_access
+    };
+}
+
+static bool test_read_after_write() {
+    const VkImageLayout none = VK_IMAGE_LAYOUT_UNDEFINED;
+    // Nothing written yet: nothing to wait for
+    Backend::AccessState state = make_state(none);
+    bool passed = check_no_barrier(state, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false, "Read of an unwritten buffer");
+
+    state = make_state(none, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, "Read after a copy");
+    passed &= check(state.write_stages == VK_PIPELINE_STAGE_TRANSFER_BIT && state.write_access == VK_ACCESS_TRANSFER_WRITE_BIT,
+        "A read changed the last write");
+    passed &= check(state.read_stages == VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT && state.read_access == VK_ACCESS_SHADER_READ_BIT,
+        "The read wasn't recorded as visible");
+
+    // A write's read bits don't make it into the source access mask
+    state = make_state(none);
+    passed &= check_no_barrier(state, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, none, true, false,
+        "First write to a buffer");
+    passed &= check(state.write_access == VK_ACCESS_SHADER_WRITE_BIT, "The write kept its read access");
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, "Indirect read after a compute write");
+    return passed;
+}
+
+static bool test_write_after_read() {
+    const VkImageLayout none = VK_IMAGE_LAYOUT_UNDEFINED;
+    Backend::AccessState state = make_state(none, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    bool passed = check_barrier(state, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, "Read before the write");
+
+    // Waits for the read and the earlier write, but only the write has anything to make available
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, none, true, false,
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, "Write after a read");
+    passed &= check(state.write_stages == VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT && state.write_access == VK_ACCESS_SHADER_WRITE_BIT,
+        "The write didn't replace the last one");
+    passed &= check(state.read_stages == 0 && state.read_access == 0, "Reads of the old contents are still visible");
+
+    // Reads made visible before the write have to wait again
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, "Read after the second write");
+
+    // Write after write with no reads in between
+    state = make_state(none, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, none, true, false,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, "Write after a write");
+    return passed;
+}
+
+static bool test_read_after_read() {
+    const VkImageLayout none = VK_IMAGE_LAYOUT_UNDEFINED;
+    Backend::AccessState state = make_state(none, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+    bool passed = check_barrier(state, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, "First read");
+    passed &= check_no_barrier(state, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false,
+        "The same read again");
+
+    // A stage or access the write wasn't made visible to needs its own barrier, after which both are covered
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, "Read in another stage");
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_UNIFORM_READ_BIT, none, false, false,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, "Read with another access");
+    passed &= check_no_barrier(state, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        VK_ACCESS_SHADER_READ_BIT, none, false, false, "Read in both stages once both are covered");
+    passed &= check(state.read_stages == (VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT)
+        && state.read_access == (VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT), "Reads didn't merge");
+    return passed;
+}
+
+static bool test_layout_transitions() {
+    // Discarding into a copy destination has nothing to wait for but the transition itself
+    Backend::AccessState state = make_state(VK_IMAGE_LAYOUT_UNDEFINED);
+    bool passed = check_barrier(state, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true, true,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, "Transition out of UNDEFINED");
+    passed &= check(state.layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, "The layout wasn't updated");
+
+    // A read in a new layout is a write as far as ordering goes: it waits for the copy...
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false, true,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, "Transition to a sampled layout");
+    passed &= check(state.write_stages == VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT && state.write_access == 0,
+        "The transition wasn't recorded as the last write");
+    // ...and later reads in the same layout only wait for the transition, with no memory to make available
+    passed &= check_no_barrier(state, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false, true,
+        "Read in the stage that transitioned");
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false, true,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, "Read in another stage after the transition");
+
+    // Transitioning away waits for every read since
+    passed &= check_barrier(state, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        true, true, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, "Transition after reads");
+
+    // Buffers have no layout, so a differing one doesn't turn a read into a transition
+    Backend::AccessState buffer = make_state(VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    passed &= check_barrier(buffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, false, false,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, "Buffer read");
+    passed &= check(buffer.write_stages == VK_PIPELINE_STAGE_TRANSFER_BIT, "A buffer read was treated as a transition");
+    return passed;
+}
+
+int main() {
+    bool passed = test_read_after_write();
+    passed &= test_write_after_read();
+    passed &= test_read_after_read();
+    passed &= test_layout_transitions();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+// Fills a small BindlessTable with storage buffers, checks that it refuses more once full, and that a removed
+// handle only comes back after the frame it was removed in has retired. Skipped without bindless support
+#include "backend.h"
+#include "bindless.h"
+#include "frame.h"
+#include <stdio.h>
+
+// Buffer slots in the table
+constexpr uint32_t n_slots = 8;
+// Tells CTest the test was skipped, e.g. when there's no Vulkan device to run on
+constexpr int skip_return_code = 77;
+
+using namespace Atlas;
+
+static bool run_frame(Backend::FrameRing& frames) {
+    if (!frames.begin_frame()) return false;
+
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,    // flags
+        nullptr                                         // pInheritanceInfo
+    };
+    VkCommandBuffer command_buffer = frames.get_command_buffer(Backend::QUEUE_FAMILY_UNIVERSAL);
+    if (!command_buffer || !validate(vkBeginCommandBuffer(command_buffer, &begin_info))) return false;
+    if (!validate(vkEndCommandBuffer(command_buffer))) return false;
+
+    return frames.end_frame(Span<VkCommandBuffer>(&command_buffer, 1));
+}
+
+int main() {
+    Backend::Instance instance("Bindless slots", VK_MAKE_VERSION(0,0,1), VALIDATION_DISABLED);
+    if (!instance.init()) return skip_return_code;
+
+    Window window(instance, "Bindless slots", 640, 360);
+    window.set_headless(true);
+    if (!window.init()) return skip_return_code;
+
+    Backend::Device device(window);
+    if (!device.init()) return skip_return_code;
+    if (!device.supports_bindless()) {
+        printf("Device doesn't support bindless descriptors\n");
+        return skip_return_code;
+    }
+
+    Backend::FrameRing frames(device, window);
+    if (!frames.init()) return 1;
+
+    VkBufferCreateInfo buffer_info = {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,   // sType
+        nullptr,                                // pNext
+        0,                                      // flags
+        256,                                    // size
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,     // usage
+        VK_SHARING_MODE_EXCLUSIVE,              // sharingMode
+        0,                                      // queueFamilyIndexCount
+        nullptr                                 // pQueueFamilyIndices
+    };
+    VmaMemoryRequirements buffer_reqs = {
+        VK_FALSE,                   // ownMemory
+        VMA_MEMORY_USAGE_GPU_ONLY   // usage
+        // Fill rest with 0s
+    };
+    VkBuffer buffer;
+    if (!validate(vmaCreateBuffer(device.get_allocator(), &buffer_info, &buffer_reqs, &buffer, nullptr, nullptr))) return 1;
+
+    bool passed = true;
+    {
+        Backend::BindlessTable table(device);
+        table.max_textures = 1;
+        table.max_buffers = n_slots;
+        if (!table.init()) return 1;
+
+        if (!run_frame(frames)) return 1;
+        // Every slot of the one buffer, at different offsets, so each write is distinct
+        Backend::BindlessHandle handles[n_slots];
+        for (uint32_t i = 0; i < n_slots; ++i) {
+            handles[i] = table.add_buffer(buffer, 0, 16 * (i + 1));
+            if (handles[i] == Backend::invalid_bindless_handle) {
+                printf("Slot %u of %u wasn't handed out\n", i, n_slots);
+                passed = false;
+            }
+        }
+        if (table.add_buffer(buffer) != Backend::invalid_bindless_handle) {
+            printf("Full table handed out another slot\n");
+            passed = false;
+        }
+
+        // Frames in flight may still read the slot, so it stays taken until this frame retires
+        const Backend::BindlessHandle removed = handles[n_slots / 2];
+        table.remove_buffer(removed);
+        if (table.add_buffer(buffer) != Backend::invalid_bindless_handle) {
+            printf("Removed slot was reused before its frame retired\n");
+            passed = false;
+        }
+        if (!run_frame(frames)) return 1;
+        for (uint32_t i = 0; i < frames.max_frames_in_flight; ++i) {
+            if (!run_frame(frames)) return 1;
+        }
+
+        const Backend::BindlessHandle reused = table.add_buffer(buffer, 0, 64);
+        if (reused != removed) {
+            printf("Expected slot %u back once its frame retired, got %u\n", removed, reused);
+            passed = false;
+        }
+        frames.wait_idle();
+    }
+
+    device.destroy_deferred<Backend::DEFERRED_VMA_BUFFER>(buffer);
+    return passed ? 0 : 1;
+}
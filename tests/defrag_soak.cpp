@@ -0,0 +1,163 @@
+// Churns buffers registered with the Defragmenter for many headless frames, replacing a pair with buffers
+// of other sizes every frame while it moves the rest around, and checks that the memory blocks and bytes
+// Device::sample_memory_stats() reports stop growing once the churn has warmed up: moved-from and
+// replaced buffers have to be freed, and moves must not leave blocks behind
+#include "backend.h"
+#include "defrag.h"
+#include "frame.h"
+#include <algorithm>
+#include <stdio.h>
+
+// Buffers alive at any time
+constexpr uint32_t n_buffers = 64;
+// Buffer sizes are a multiple of this, starting out at up to initial_size_steps of them. Each frame replaces
+// two buffers with two others of the same total size, split at random, so only the layout changes
+constexpr VkDeviceSize size_step = 256 * 1024;
+constexpr uint32_t initial_size_steps = 24;
+// Frames per phase; the first phase warms up, and later ones may not go over the peak of the second
+constexpr uint32_t n_frames_per_phase = 256;
+constexpr uint32_t n_phases = 4;
+// Tells CTest the test was skipped, e.g. when there's no Vulkan device to run on
+constexpr int skip_return_code = 77;
+
+using namespace Atlas;
+
+struct SoakBuffer {
+    VkBuffer buffer;
+    uint32_t id;
+    uint32_t size_steps;
+};
+
+struct MemoryPeak {
+    uint32_t n_blocks;
+    VkDeviceSize allocated_bytes;
+};
+
+static uint32_t g_random_state = 12345;
+
+static uint32_t next_random() {
+    g_random_state = g_random_state * 1664525u + 1013904223u;
+    return g_random_state >> 8;
+}
+
+static bool create_buffer(Backend::Device& device, Backend::Defragmenter& defrag, SoakBuffer& soak, uint32_t size_steps) {
+    VkBufferCreateInfo buffer_info = {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,   // sType
+        nullptr,                                // pNext
+        0,                                      // flags
+        size_step * size_steps,                 // size
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,       // usage
+        VK_SHARING_MODE_EXCLUSIVE,              // sharingMode
+        0,                                      // queueFamilyIndexCount
+        nullptr                                 // pQueueFamilyIndices
+    };
+    VmaMemoryRequirements buffer_reqs = {
+        VK_FALSE,                   // ownMemory
+        VMA_MEMORY_USAGE_GPU_ONLY   // usage
+        // Fill rest with 0s
+    };
+    VkMappedMemoryRange memory;
+    VkResult res = vmaCreateBuffer(device.get_allocator(), &buffer_info, &buffer_reqs, &soak.buffer, &memory, nullptr);
+    if (!validate(res)) return false;
+
+    soak.size_steps = size_steps;
+    // Never written, so the copies just move undefined contents around
+    soak.id = defrag.register_buffer(soak.buffer, memory, buffer_info, buffer_reqs, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+    return (soak.id != 0);
+}
+
+static void destroy_buffer(Backend::Device& device, Backend::Defragmenter& defrag, SoakBuffer& soak) {
+    defrag.unregister(soak.id);
+    device.destroy_deferred<Backend::DEFERRED_VMA_BUFFER>(soak.buffer);
+    soak.buffer = VK_NULL_HANDLE;
+    soak.id = 0;
+}
+
+static bool run_frame(Backend::Device& device, Backend::FrameRing& frames, Backend::Defragmenter& defrag, SoakBuffer* buffers) {
+    if (!frames.begin_frame()) return false;
+
+    const uint32_t first = next_random() % n_buffers;
+    const uint32_t second = (first + 1 + next_random() % (n_buffers - 1)) % n_buffers;
+    const uint32_t total_steps = buffers[first].size_steps + buffers[second].size_steps;
+    const uint32_t first_steps = 1 + next_random() % (total_steps - 1);
+    destroy_buffer(device, defrag, buffers[first]);
+    destroy_buffer(device, defrag, buffers[second]);
+    if (!create_buffer(device, defrag, buffers[first], first_steps)) return false;
+    if (!create_buffer(device, defrag, buffers[second], total_steps - first_steps)) return false;
+
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,    // flags
+        nullptr                                         // pInheritanceInfo
+    };
+    VkCommandBuffer command_buffer = frames.get_command_buffer(Backend::QUEUE_FAMILY_UNIVERSAL);
+    if (!command_buffer || !validate(vkBeginCommandBuffer(command_buffer, &begin_info))) return false;
+    if (!defrag.update(command_buffer, device.get_memory_stats())) return false;
+    if (!validate(vkEndCommandBuffer(command_buffer))) return false;
+
+    return frames.end_frame(Span<VkCommandBuffer>(&command_buffer, 1));
+}
+
+static void update_peak(const Backend::MemoryStats& stats, MemoryPeak& peak) {
+    uint32_t n_blocks = 0;
+    VkDeviceSize allocated_bytes = 0;
+    for (const Backend::MemoryHeapStats& heap : stats.heaps) {
+        n_blocks += heap.n_blocks;
+        allocated_bytes += heap.allocated_bytes;
+    }
+    peak.n_blocks = std::max(peak.n_blocks, n_blocks);
+    peak.allocated_bytes = std::max(peak.allocated_bytes, allocated_bytes);
+}
+
+int main() {
+    Backend::Instance instance("Defragmenter soak", VK_MAKE_VERSION(0,0,1), VALIDATION_DISABLED);
+    if (!instance.init()) return skip_return_code;
+
+    Window window(instance, "Defragmenter soak", 640, 360);
+    window.set_headless(true);
+    if (!window.init()) return skip_return_code;
+
+    Backend::Device device(window);
+    if (!device.init()) return skip_return_code;
+
+    Backend::FrameRing frames(device, window);
+    if (!frames.init()) return 1;
+
+    Backend::Defragmenter defrag(device, frames);
+    // Move whenever there's anything to compact
+    defrag.fragmentation_threshold = 0.0f;
+
+    SoakBuffer buffers[n_buffers] = {};
+    for (SoakBuffer& soak : buffers) {
+        if (!create_buffer(device, defrag, soak, 1 + next_random() % initial_size_steps)) return 1;
+    }
+
+    MemoryPeak peaks[n_phases] = {};
+    for (uint32_t phase = 0; phase < n_phases; ++phase) {
+        for (uint32_t i = 0; i < n_frames_per_phase; ++i) {
+            if (!run_frame(device, frames, defrag, buffers)) {
+                printf("Frame %u of phase %u failed\n", i, phase);
+                return 1;
+            }
+            update_peak(device.get_memory_stats(), peaks[phase]);
+        }
+        printf("Phase %u: up to %u blocks, %.1f MiB allocated\n", phase, peaks[phase].n_blocks, peaks[phase].allocated_bytes / 1048576.0);
+    }
+    frames.wait_idle();
+    printf("%llu moves, %.1f MiB moved, %.1f MiB reclaimed\n", static_cast<unsigned long long>(defrag.get_n_moves()),
+        defrag.get_bytes_moved() / 1048576.0, defrag.get_bytes_reclaimed() / 1048576.0);
+
+    for (SoakBuffer& soak : buffers)
+        destroy_buffer(device, defrag, soak);
+
+    for (uint32_t phase = 2; phase < n_phases; ++phase) {
+        if (peaks[phase].n_blocks > peaks[1].n_blocks || peaks[phase].allocated_bytes > peaks[1].allocated_bytes) {
+            printf("Memory kept growing after phase 1\n");
+            return 1;
+        }
+    }
+    return 0;
+}
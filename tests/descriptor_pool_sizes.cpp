@@ -0,0 +1,81 @@
+// Checks the descriptor counts DescriptorAllocator gives new pools: a layout's bindings of one type add up,
+// the usual proportions stay when they're enough, and types they leave out are added. Runs on the CPU only
+#include "descriptors.h"
+#include <stdio.h>
+
+using namespace Atlas;
+
+static VkDescriptorSetLayoutBinding make_binding(uint32_t binding, VkDescriptorType type, uint32_t count) {
+    return {
+        binding,                // binding
+        type,                   // descriptorType
+        count,                  // descriptorCount
+        VK_SHADER_STAGE_ALL,    // stageFlags
+        nullptr                 // pImmutableSamplers
+    };
+}
+
+static uint32_t find_count(const std::vector<VkDescriptorPoolSize>& sizes, VkDescriptorType type, uint32_t& n_entries) {
+    uint32_t count = 0;
+    n_entries = 0;
+    for (const auto& size : sizes) {
+        if (size.type == type) {
+            count = size.descriptorCount;
+            ++n_entries;
+        }
+    }
+    return count;
+}
+
+static bool check(const std::vector<VkDescriptorPoolSize>& sizes, VkDescriptorType type, uint32_t expected, const char* what) {
+    uint32_t n_entries;
+    const uint32_t count = find_count(sizes, type, n_entries);
+    if (n_entries != 1 || count != expected) {
+        printf("%s: expected one entry of %u descriptors, got %u entries, the last of %u\n", what, expected, n_entries, count);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    const std::vector<VkDescriptorPoolSize> usual_sizes = {
+        { VK_DESCRIPTOR_TYPE_SAMPLER, 128 },
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 512 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 512 }
+    };
+
+    Backend::DescriptorLayout layout = {};
+    layout.bindings = {
+        // 700 storage buffers in total, though no one binding has more than 512
+        make_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 300),
+        make_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 400),
+        // Well under the usual count
+        make_binding(2, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100),
+        make_binding(3, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100),
+        // Not in the usual sizes at all, split over two bindings
+        make_binding(4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3),
+        make_binding(5, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 5),
+        // Empty bindings don't need room, and a pool size of 0 is invalid
+        make_binding(6, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 0)
+    };
+
+    std::vector<VkDescriptorPoolSize> sizes;
+    Backend::get_pool_sizes(usual_sizes, layout, sizes);
+
+    bool passed = true;
+    passed &= check(sizes, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 700, "Storage buffers summed over bindings");
+    passed &= check(sizes, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 512, "Uniform buffers within the usual count");
+    passed &= check(sizes, VK_DESCRIPTOR_TYPE_SAMPLER, 128, "Samplers the layout doesn't use");
+    passed &= check(sizes, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 8, "Image samplers missing from the usual sizes");
+    uint32_t n_storage_images;
+    find_count(sizes, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, n_storage_images);
+    if (n_storage_images != 0) {
+        printf("Empty storage image binding got a pool size\n");
+        passed = false;
+    }
+    if (sizes.size() != 4) {
+        printf("Expected 4 pool sizes, got %u\n", static_cast<uint32_t>(sizes.size()));
+        passed = false;
+    }
+    return passed ? 0 : 1;
+}
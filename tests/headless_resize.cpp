@@ -0,0 +1,121 @@
+// Resizes a headless window every few frames while rendering into it, like breakout's --resize-stress but
+// without a display server: each resize goes through Window::rebuild(), which retires the old swapchain
+// while frames are still in flight, and the next frame has to render into framebuffers of the new size
+#include "backend.h"
+#include "frame.h"
+#include <stdio.h>
+
+// Frames rendered in total
+constexpr uint32_t n_frames = 256;
+// Frames between resizes, so some frames render into a swapchain that was rebuilt with others in flight
+constexpr uint32_t frames_per_resize = 3;
+// Tells CTest the test was skipped, e.g. when there's no Vulkan device to run on
+constexpr int skip_return_code = 77;
+
+using namespace Atlas;
+
+static bool record_frame(Window& window, Backend::FrameRing& frames, const Backend::RenderPass& renderpass, VkCommandBuffer& command_buffer) {
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,    // flags
+        nullptr                                         // pInheritanceInfo
+    };
+    command_buffer = frames.get_command_buffer(Backend::QUEUE_FAMILY_UNIVERSAL);
+    if (!command_buffer || !validate(vkBeginCommandBuffer(command_buffer, &begin_info))) return false;
+
+    VkClearValue clear_values[2] = {};
+    clear_values[0].color = {{ 0.0f, 0.0f, 0.0f, 1.0f }};
+    clear_values[1].depthStencil = { 1.0f, 0 };
+    VkRenderPassBeginInfo pass_info = {
+        VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,   // sType
+        nullptr,                                    // pNext
+        renderpass.vk(),                            // renderPass
+        window.get_framebuffer(),                   // framebuffer
+        { { 0, 0 }, window.get_extent() },          // renderArea
+        2,                                          // clearValueCount
+        clear_values                                // pClearValues
+    };
+    vkCmdBeginRenderPass(command_buffer, &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdEndRenderPass(command_buffer);
+
+    return validate(vkEndCommandBuffer(command_buffer));
+}
+
+int main() {
+    Backend::Instance instance("Headless resize", VK_MAKE_VERSION(0,0,1), VALIDATION_DISABLED);
+    if (!instance.init()) return skip_return_code;
+
+    Window window(instance, "Headless resize", 640, 360);
+    window.set_headless(true);
+    if (!window.init()) return skip_return_code;
+
+    Backend::Device device(window);
+    if (!device.init()) return skip_return_code;
+
+    Backend::RenderPass renderpass(device);
+    uint32_t color_index = renderpass.add_attachment(window.get_color_format(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE);
+    uint32_t depth_index = renderpass.add_attachment(window.get_depth_format(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_DONT_CARE);
+    VkAttachmentReference color_ref = { color_index, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    VkAttachmentReference depth_ref = { depth_index, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &color_ref;
+    subpass.pDepthStencilAttachment = &depth_ref;
+    uint32_t subpass_index = renderpass.add_subpass(subpass);
+    // The color transition has to wait for the image-available semaphore, which frames wait on at the color
+    // output stage, and the depth clear for the previous frame's depth writes to the one shared depth buffer
+    VkSubpassDependency acquire_dep = {
+        VK_SUBPASS_EXTERNAL,                                                                                // srcSubpass
+        subpass_index,                                                                                      // dstSubpass
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,          // srcStageMask
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,         // dstStageMask
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,                                                       // srcAccessMask
+        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,                // dstAccessMask
+        0                                                                                                   // dependencyFlags
+    };
+    renderpass.add_dependency(acquire_dep);
+    if (!renderpass.init()) return 1;
+    if (!window.init_framebuffers(renderpass)) return 1;
+
+    Backend::FrameRing frames(device, window);
+    if (!frames.init()) return 1;
+
+    uint32_t n_rendered = 0, n_rebuilds = 0;
+    for (uint32_t i = 0; i < n_frames; ++i) {
+        window.handle_events();
+
+        if ((i % frames_per_resize) == 0) {
+            // Cycles through sizes both larger and smaller than the one the window started with
+            const uint32_t step = (i / frames_per_resize) % 16;
+            if (!window.set_client_area(320 + step * 64, 180 + step * 36)) return 1;
+        }
+
+        if (window.should_rebuild()) {
+            ++n_rebuilds;
+            if (!window.rebuild(renderpass)) {
+                printf("Rebuild %u failed\n", n_rebuilds);
+                return 1;
+            }
+        }
+
+        if (!frames.begin_frame()) {
+            if (window.should_rebuild()) continue;
+            printf("Frame %u failed to begin after %u rebuilds\n", i, n_rebuilds);
+            return 1;
+        }
+
+        VkCommandBuffer command_buffer;
+        if (!record_frame(window, frames, renderpass, command_buffer)) return 1;
+        if (!frames.end_frame(Span<VkCommandBuffer>(&command_buffer, 1)) && !window.should_rebuild()) {
+            printf("Frame %u failed to present after %u rebuilds\n", i, n_rebuilds);
+            return 1;
+        }
+        ++n_rendered;
+    }
+    frames.wait_idle();
+
+    printf("%u frames rendered over %u swapchain rebuilds\n", n_rendered, n_rebuilds);
+    return ((n_rebuilds > 0) && (n_rendered > 0)) ? 0 : 1;
+}
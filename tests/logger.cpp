@@ -0,0 +1,237 @@
+// Checks the background logger with stdout and stderr captured: messages from concurrent producers are either
+// printed or counted as dropped, errors still get in once warnings have filled their part of the ring, repeats
+// collapse into a count, rate-limited repeats are summarized when the writer stops, and flush() returns only
+// once everything before it has been printed. Runs on the CPU only (needs POSIX for capturing the streams)
+#include "backend.h"
+#include "log.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace Atlas;
+
+constexpr uint32_t n_producers = 4;
+constexpr uint32_t n_messages_per_producer = 5000;
+// Errors written once the writer is stuck, fewer than the ring keeps free for them
+constexpr uint32_t n_stuck_errors = 100;
+constexpr uint32_t n_repeats = 5;
+// Writes of each rate-limited message, past max_repeats_per_second
+constexpr uint32_t n_rate_limited = Log::max_repeats_per_second + 5;
+
+// Points stdout and stderr at temporary files (or stdout at a given fd) until end()
+struct Capture {
+    void begin(int out_fd = -1) {
+        fflush(stdout);
+        fflush(stderr);
+        saved_out = dup(STDOUT_FILENO);
+        saved_err = dup(STDERR_FILENO);
+        out = (out_fd < 0) ? tmpfile() : nullptr;
+        err = tmpfile();
+        dup2(out ? fileno(out) : out_fd, STDOUT_FILENO);
+        dup2(fileno(err), STDERR_FILENO);
+    }
+    // Restores the streams and returns what went to them
+    void end() {
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+        out_text = out ? read_all(out) : std::string();
+        err_text = read_all(err);
+    }
+
+    static std::string read_all(FILE* file) {
+        std::string text;
+        char buffer[4096];
+        rewind(file);
+        for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0; )
+            text.append(buffer, n);
+        fclose(file);
+        return text;
+    }
+
+    int saved_out;
+    int saved_err;
+    FILE* out;
+    FILE* err;
+    std::string out_text;
+    std::string err_text;
+};
+
+static bool check(bool condition, const char* what) {
+    if (!condition)
+        printf("%s\n", what);
+    return condition;
+}
+
+static uint32_t count(const std::string& text, const std::string& pattern) {
+    uint32_t n = 0;
+    for (size_t position = text.find(pattern); position != std::string::npos; position = text.find(pattern, position + pattern.size()))
+        ++n;
+    return n;
+}
+
+static void warn(const char* message) {
+    Log::write(VK_DEBUG_REPORT_WARNING_BIT_EXT, "Test", 0, message);
+}
+
+static bool test_concurrent_producers() {
+    const uint64_t n_dropped = Log::get_n_dropped();
+    const uint64_t n_suppressed = Log::get_n_suppressed();
+    Capture capture;
+    capture.begin();
+    Log::start();
+    std::vector<std::thread> producers;
+    for (uint32_t producer = 0; producer < n_producers; ++producer) {
+        producers.emplace_back([producer]() {
+            char message[64];
+            for (uint32_t i = 0; i < n_messages_per_producer; ++i) {
+                snprintf(message, sizeof(message), "producer %u message %05u.", producer, i);
+                warn(message);
+            }
+        });
+    }
+    for (std::thread& producer : producers)
+        producer.join();
+    Log::stop();
+    capture.end();
+
+    // Every message is distinct, so none are suppressed, and each one is printed or dropped exactly once
+    const uint64_t dropped = Log::get_n_dropped() - n_dropped;
+    uint32_t n_printed = 0;
+    bool in_order = true;
+    for (uint32_t producer = 0; producer < n_producers; ++producer) {
+        char pattern[32];
+        snprintf(pattern, sizeof(pattern), "producer %u message ", producer);
+        int last = -1;
+        for (size_t position = capture.out_text.find(pattern); position != std::string::npos; position = capture.out_text.find(pattern, position + 1)) {
+            const int index = atoi(capture.out_text.c_str() + position + strlen(pattern));
+            in_order &= (index > last);
+            last = index;
+            ++n_printed;
+        }
+    }
+    printf("%u of %u concurrent messages printed, %llu dropped\n", n_printed, n_producers * n_messages_per_producer, static_cast<unsigned long long>(dropped));
+    bool passed = check(n_printed + dropped == n_producers * n_messages_per_producer, "Concurrent messages were lost without being counted as dropped");
+    passed &= check(Log::get_n_suppressed() == n_suppressed, "Distinct messages were suppressed");
+    passed &= check(in_order, "A producer's messages were printed out of order");
+    passed &= check((dropped == 0) || (count(capture.out_text, "Log queue was full") > 0), "Dropped messages weren't reported");
+    return passed;
+}
+
+static bool test_errors_get_through() {
+    // The writer blocks on stdout once nobody reads the pipe and it's full, so warnings fill their part of the ring
+    int pipe_fds[2];
+    if (!check(pipe(pipe_fds) == 0, "Couldn't create a pipe")) return false;
+    const uint64_t n_dropped = Log::get_n_dropped();
+    Capture capture;
+    capture.begin(pipe_fds[1]);
+    Log::start();
+    char message[64];
+    uint32_t n_warnings = 0;
+    while (Log::get_n_dropped() == n_dropped) {
+        snprintf(message, sizeof(message), "stuck warning %u", n_warnings++);
+        warn(message);
+    }
+    const uint64_t n_dropped_warnings = Log::get_n_dropped() - n_dropped;
+    for (uint32_t i = 0; i < n_stuck_errors; ++i) {
+        snprintf(message, sizeof(message), "stuck error %u", i);
+        Log::write(VK_DEBUG_REPORT_ERROR_BIT_EXT, "Test", 0, message);
+    }
+    const uint64_t n_dropped_errors = Log::get_n_dropped() - n_dropped - n_dropped_warnings;
+
+    // Unblock the writer
+    std::string piped;
+    std::thread reader([&]() {
+        char buffer[4096];
+        for (ssize_t n; (n = read(pipe_fds[0], buffer, sizeof(buffer))) > 0; )
+            piped.append(buffer, n);
+    });
+    Log::stop();
+    capture.end();
+    close(pipe_fds[1]);
+    reader.join();
+    close(pipe_fds[0]);
+
+    bool passed = check(n_dropped_errors == 0, "Errors were dropped while warnings filled the ring");
+    passed &= check(count(capture.err_text, "stuck error ") == n_stuck_errors, "Not every error was printed");
+    passed &= check(count(piped, "stuck warning ") + n_dropped_warnings == n_warnings, "Warnings were lost without being counted as dropped");
+    return passed;
+}
+
+static bool test_repeats() {
+    const uint64_t n_suppressed = Log::get_n_suppressed();
+    Capture capture;
+    capture.begin();
+    Log::start();
+    for (uint32_t i = 0; i < n_repeats; ++i)
+        warn("repeated warning");
+    warn("after the repeats");
+
+    // Alternating, so they don't collapse, until the rate limit holds back the rest
+    for (uint32_t i = 0; i < n_rate_limited; ++i) {
+        warn("rate limited A");
+        warn("rate limited B");
+    }
+    Log::stop();
+    capture.end();
+
+    const std::string& out = capture.out_text;
+    const size_t repeated = out.find("repeated warning");
+    const size_t count_line = out.find("Last message repeated " + std::to_string(n_repeats - 1) + " more times");
+    const size_t after = out.find("after the repeats");
+    bool passed = check(count(out, "repeated warning") == 1, "A repeated message was printed more than once");
+    passed &= check(repeated < count_line && count_line < after, "The repeat count wasn't printed between the repeated message and the next one");
+
+    // The counts are printed when the writer stops, though neither message came back after its second was up
+    const uint32_t n_held_back = n_rate_limited - Log::max_repeats_per_second;
+    passed &= check(count(out, "): rate limited A") == Log::max_repeats_per_second && count(out, "): rate limited B") == Log::max_repeats_per_second,
+        "The rate limit didn't hold each message to max_repeats_per_second");
+    passed &= check(count(out, "Suppressed " + std::to_string(n_held_back) + " repeats of \"rate limited A\"") == 1
+        && count(out, "Suppressed " + std::to_string(n_held_back) + " repeats of \"rate limited B\"") == 1, "The held back repeats weren't summarized on stop");
+    passed &= check(Log::get_n_suppressed() - n_suppressed == (n_repeats - 1) + 2 * n_held_back, "Unexpected number of suppressed messages");
+    return passed;
+}
+
+static bool test_flush() {
+    Capture capture;
+    capture.begin();
+    Log::start();
+    char message[64];
+    for (uint32_t i = 0; i < 100; ++i) {
+        snprintf(message, sizeof(message), "before flush %u.", i);
+        warn(message);
+    }
+    Log::flush();
+    // Written straight to stdout: everything queued before the flush has to come before it
+    printf("flush returned\n");
+    warn("after flush");
+    // Failed Vulkan calls wait for their error to be printed without a flush
+    report_result(VK_ERROR_DEVICE_LOST);
+    const bool error_printed = (ftell(capture.err) > 0);
+    Log::stop();
+    capture.end();
+
+    const std::string& out = capture.out_text;
+    const size_t marker = out.find("flush returned");
+    bool passed = check(marker != std::string::npos, "The marker wasn't printed");
+    passed &= check(count(out.substr(0, marker), "before flush ") == 100, "flush() returned before everything was printed");
+    passed &= check(out.find("after flush") > marker, "A message written after the flush came before it");
+    passed &= check(error_printed && capture.err_text.find("VkResult") != std::string::npos, "report_result() returned before its error was printed");
+    return passed;
+}
+
+int main() {
+    bool passed = test_concurrent_producers();
+    passed &= test_errors_get_through();
+    passed &= test_repeats();
+    passed &= test_flush();
+    return passed ? 0 : 1;
+}
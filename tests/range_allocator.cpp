@@ -0,0 +1,183 @@
+// Checks RangeAllocator, which places meshes in a GeometryArena: allocating and splitting free ranges, picking
+// the best fit, merging freed neighbours back together, and staying consistent through a long run of random
+// allocations and frees that fragment it. Runs on the CPU only
+#include "geometry.h"
+#include <stdio.h>
+
+using namespace Atlas;
+
+// Capacity of the random run, which keeps a map of which units are allocated
+constexpr uint64_t random_capacity = 1024;
+constexpr uint32_t n_random_steps = 20000;
+
+struct Allocation {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Checks the free ranges agree with each other and that no two of them are left unmerged
+struct CheckedRangeAllocator : public Backend::RangeAllocator {
+    bool is_consistent() const {
+        if (m_free_by_offset.size() != m_free_by_size.size())
+            return false;
+        uint64_t free_size = 0, end = 0;
+        bool first = true;
+        for (const auto& range : m_free_by_offset) {
+            if (range.second == 0 || range.first + range.second > m_capacity)
+                return false;
+            // Touching or overlapping the range before it
+            if (!first && range.first <= end)
+                return false;
+            bool indexed = false;
+            auto sizes = m_free_by_size.equal_range(range.second);
+            for (auto iter = sizes.first; iter != sizes.second; ++iter)
+                indexed |= (iter->second == range.first);
+            if (!indexed)
+                return false;
+            free_size += range.second;
+            end = range.first + range.second;
+            first = false;
+        }
+        return (free_size == m_free_size);
+    }
+};
+
+static uint32_t g_random_state = 54321;
+
+static uint32_t next_random() {
+    g_random_state = g_random_state * 1664525u + 1013904223u;
+    return g_random_state >> 8;
+}
+
+static bool check(bool condition, const char* what) {
+    if (!condition)
+        printf("%s\n", what);
+    return condition;
+}
+
+static bool check_allocate(Backend::RangeAllocator& ranges, uint64_t size, uint64_t expected_offset, const char* what) {
+    uint64_t offset;
+    if (!ranges.allocate(size, offset)) {
+        printf("%s: allocating %llu failed\n", what, static_cast<unsigned long long>(size));
+        return false;
+    }
+    if (offset != expected_offset) {
+        printf("%s: expected offset %llu, got %llu\n", what, static_cast<unsigned long long>(expected_offset), static_cast<unsigned long long>(offset));
+        return false;
+    }
+    return true;
+}
+
+static bool test_split_and_merge() {
+    CheckedRangeAllocator ranges;
+    ranges.init(100);
+    bool passed = check_allocate(ranges, 30, 0, "First allocation");
+    passed &= check_allocate(ranges, 20, 30, "Split off the rest");
+    passed &= check_allocate(ranges, 50, 50, "Exactly the rest");
+    uint64_t offset;
+    passed &= check(!ranges.allocate(1, offset), "A full allocator handed out a range");
+    passed &= check(ranges.get_free_size() == 0 && ranges.get_largest_free_range() == 0, "A full allocator has free space");
+    passed &= check(ranges.allocate(0, offset), "Empty allocations have to succeed even when full");
+
+    // [30, 50) is free; splitting it leaves [40, 50)
+    ranges.free(30, 20);
+    passed &= check_allocate(ranges, 10, 30, "Split a freed range");
+    passed &= check(ranges.get_largest_free_range() == 10, "Expected [40, 50) to be left");
+
+    // Best fit: [40, 50) is a closer fit for 8 than [0, 30)
+    ranges.free(0, 30);
+    passed &= check_allocate(ranges, 8, 40, "Best fit");
+    passed &= check(ranges.get_free_size() == 32 && ranges.get_largest_free_range() == 30, "Expected [0, 30) and [48, 50) to be free");
+
+    // Freeing everything in an order that merges with the previous range, the next one, and both
+    ranges.free(30, 10);
+    passed &= check(ranges.get_largest_free_range() == 40, "[30, 40) didn't merge with [0, 30)");
+    ranges.free(50, 50);
+    passed &= check(ranges.get_largest_free_range() == 52, "[50, 100) didn't merge with [48, 50)");
+    ranges.free(40, 8);
+    passed &= check(ranges.get_largest_free_range() == 100 && ranges.get_free_size() == 100, "[40, 48) didn't merge both neighbours");
+    passed &= check(ranges.is_consistent(), "Free ranges are inconsistent after merging");
+    passed &= check_allocate(ranges, 100, 0, "Everything after merging");
+    return passed;
+}
+
+static bool test_fragmentation() {
+    CheckedRangeAllocator ranges;
+    ranges.init(64);
+    uint64_t offsets[4];
+    bool passed = true;
+    for (uint64_t& offset : offsets)
+        passed &= check(ranges.allocate(16, offset), "Filling with quarters");
+
+    // Every other quarter free: half the space, but nowhere to put 32
+    ranges.free(offsets[0], 16);
+    ranges.free(offsets[2], 16);
+    uint64_t offset;
+    passed &= check(ranges.get_free_size() == 32 && ranges.get_largest_free_range() == 16, "Expected two free quarters");
+    passed &= check(!ranges.allocate(32, offset), "Allocated across a used range");
+    passed &= check(ranges.is_consistent(), "Free ranges are inconsistent when fragmented");
+
+    // Freeing the quarter between them joins the three
+    ranges.free(offsets[1], 16);
+    passed &= check(ranges.get_largest_free_range() == 48, "Freed quarters didn't merge");
+    passed &= check_allocate(ranges, 48, 0, "Three merged quarters");
+    return passed;
+}
+
+static bool test_random() {
+    CheckedRangeAllocator ranges;
+    ranges.init(random_capacity);
+    std::vector<bool> used(random_capacity);
+    std::vector<Allocation> allocations;
+    uint32_t n_failed = 0;
+    for (uint32_t step = 0; step < n_random_steps; ++step) {
+        // Mostly allocating until nearly full, so fragmentation makes some allocations fail, then mostly freeing
+        const bool allocate = allocations.empty() || ((next_random() % 100) < (ranges.get_free_size() > random_capacity / 8 ? 70u : 30u));
+        if (allocate) {
+            Allocation allocation = { 0, 1 + next_random() % 64 };
+            if (!ranges.allocate(allocation.size, allocation.offset)) {
+                // Only allowed when no free range is big enough
+                if (ranges.get_largest_free_range() >= allocation.size) {
+                    printf("Step %u: allocating %llu failed with a free range of %llu\n", step,
+                        static_cast<unsigned long long>(allocation.size), static_cast<unsigned long long>(ranges.get_largest_free_range()));
+                    return false;
+                }
+                ++n_failed;
+                continue;
+            }
+            for (uint64_t i = allocation.offset; i < allocation.offset + allocation.size; ++i) {
+                if (i >= random_capacity || used[i]) {
+                    printf("Step %u: [%llu, %llu) overlaps another range or the end\n", step, static_cast<unsigned long long>(allocation.offset),
+                        static_cast<unsigned long long>(allocation.offset + allocation.size));
+                    return false;
+                }
+                used[i] = true;
+            }
+            allocations.push_back(allocation);
+        } else {
+            const size_t index = next_random() % allocations.size();
+            const Allocation allocation = allocations[index];
+            allocations[index] = allocations.back();
+            allocations.pop_back();
+            ranges.free(allocation.offset, allocation.size);
+            for (uint64_t i = allocation.offset; i < allocation.offset + allocation.size; ++i)
+                used[i] = false;
+        }
+        if (!ranges.is_consistent()) {
+            printf("Step %u: free ranges are inconsistent\n", step);
+            return false;
+        }
+    }
+
+    for (const Allocation& allocation : allocations)
+        ranges.free(allocation.offset, allocation.size);
+    printf("%u random allocations didn't fit\n", n_failed);
+    return check(ranges.get_largest_free_range() == random_capacity && ranges.is_consistent(), "Freeing everything didn't merge back into one range");
+}
+
+int main() {
+    bool passed = test_split_and_merge();
+    passed &= test_fragmentation();
+    passed &= test_random();
+    return passed ? 0 : 1;
+}
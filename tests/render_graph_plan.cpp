@@ -0,0 +1,145 @@
+// Plans a small deferred-shading frame with RenderGraph::plan() and checks what compile() would build from it:
+// the pass nobody reads from is culled, transients with disjoint lifetimes share memory, and the barriers and
+// render pass dependencies wait on the right earlier accesses, including the previous frame's use of aliased
+// memory. Runs on the CPU only
+#include "graph.h"
+#include <stdio.h>
+
+using namespace Atlas;
+
+constexpr VkDeviceSize mib = 1024 * 1024;
+
+// Reads what plan() leaves in the passes
+struct PlannedGraph : public Backend::RenderGraph {
+    const std::vector<Barrier>& get_barriers(uint32_t pass) const {
+        return m_passes[pass].barriers;
+    }
+    const std::vector<VkAttachmentDescription>& get_descriptions(uint32_t pass) const {
+        return m_passes[pass].descriptions;
+    }
+    const std::vector<Barrier>& get_final_barriers() const {
+        return m_final_barriers;
+    }
+};
+
+static bool check(bool condition, const char* what) {
+    if (!condition)
+        printf("%s\n", what);
+    return condition;
+}
+
+static bool check_flags(uint32_t flags, uint32_t expected, const char* what) {
+    if (flags != expected)
+        printf("%s: expected 0x%x, got 0x%x\n", what, expected, flags);
+    return (flags == expected);
+}
+
+static VkMemoryRequirements make_reqs(VkDeviceSize size) {
+    return {
+        size,   // size
+        256,    // alignment
+        0x1     // memoryTypeBits
+    };
+}
+
+int main() {
+    const Backend::PassRecordFunction record = [](VkCommandBuffer, uint32_t) { };
+    const VkExtent2D extent = { 1280, 720 };
+    VkClearValue clear = {};
+
+    PlannedGraph graph;
+    const Backend::GraphResource swapchain = graph.import_image("swapchain", { VK_FORMAT_B8G8R8A8_UNORM, extent, VK_SAMPLE_COUNT_1_BIT },
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    const Backend::GraphResource gbuffer = graph.create_image("gbuffer", { VK_FORMAT_R8G8B8A8_UNORM, extent, VK_SAMPLE_COUNT_1_BIT });
+    const Backend::GraphResource depth = graph.create_image("depth", { VK_FORMAT_D32_SFLOAT, extent, VK_SAMPLE_COUNT_1_BIT });
+    const Backend::GraphResource debug = graph.create_image("debug", { VK_FORMAT_R8G8B8A8_UNORM, extent, VK_SAMPLE_COUNT_1_BIT });
+    const Backend::GraphResource lit = graph.create_image("lit", { VK_FORMAT_R8G8B8A8_UNORM, extent, VK_SAMPLE_COUNT_1_BIT });
+    std::vector<VkMemoryRequirements> reqs(5);
+    reqs[gbuffer] = make_reqs(8 * mib);
+    reqs[depth] = make_reqs(4 * mib);
+    reqs[debug] = make_reqs(4 * mib);
+    reqs[lit] = make_reqs(4 * mib);
+
+    const uint32_t geometry_pass = graph.add_pass("geometry", Backend::GRAPH_PASS_GRAPHICS, record);
+    graph.use(geometry_pass, gbuffer, Backend::GRAPH_USAGE_COLOR_ATTACHMENT, &clear);
+    graph.use(geometry_pass, depth, Backend::GRAPH_USAGE_DEPTH_ATTACHMENT, &clear);
+    const uint32_t debug_pass = graph.add_pass("debug", Backend::GRAPH_PASS_COMPUTE, record);
+    graph.use(debug_pass, gbuffer, Backend::GRAPH_USAGE_STORAGE_READ);
+    graph.use(debug_pass, debug, Backend::GRAPH_USAGE_STORAGE_WRITE);
+    const uint32_t lighting_pass = graph.add_pass("lighting", Backend::GRAPH_PASS_COMPUTE, record);
+    graph.use(lighting_pass, gbuffer, Backend::GRAPH_USAGE_SAMPLED);
+    graph.use(lighting_pass, lit, Backend::GRAPH_USAGE_STORAGE_WRITE);
+    const uint32_t composite_pass = graph.add_pass("composite", Backend::GRAPH_PASS_GRAPHICS, record);
+    graph.use(composite_pass, lit, Backend::GRAPH_USAGE_SAMPLED);
+    graph.use(composite_pass, swapchain, Backend::GRAPH_USAGE_COLOR_ATTACHMENT, &clear);
+
+    bool passed = check(graph.plan(reqs), "Planning failed");
+
+    // Culling: nothing reads the debug image
+    passed &= check(!graph.is_culled(geometry_pass) && !graph.is_culled(lighting_pass) && !graph.is_culled(composite_pass), "A needed pass was culled");
+    passed &= check(graph.is_culled(debug_pass), "The debug pass wasn't culled");
+    passed &= check(graph.get_slot(debug) == Backend::invalid_graph_resource, "The culled pass's image got memory");
+
+    // Aliasing: depth dies in the geometry pass, before lit is first written; gbuffer lives across both
+    passed &= check(graph.get_slot(depth) == graph.get_slot(lit), "depth and lit don't share memory");
+    passed &= check(graph.get_slot(gbuffer) != graph.get_slot(depth), "gbuffer shares memory with depth");
+    passed &= check(graph.get_transient_bytes() == 12 * mib, "Expected 12 MiB of transient memory");
+    passed &= check(graph.get_unaliased_bytes() == 16 * mib, "Expected 16 MiB without aliasing");
+
+    // The geometry pass clears both attachments out of UNDEFINED, after the previous frame's last reads of
+    // their memory: gbuffer in the lighting pass, and lit (which shares depth's memory) in the composite pass
+    const VkSubpassDependency& geometry_dependency = graph.get_dependency(geometry_pass);
+    passed &= check_flags(geometry_dependency.srcStageMask, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+        | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, "Geometry pass source stages");
+    passed &= check_flags(geometry_dependency.dstStageMask, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+        | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, "Geometry pass destination stages");
+    const std::vector<VkAttachmentDescription>& geometry_attachments = graph.get_descriptions(geometry_pass);
+    if (check(geometry_attachments.size() == 2, "Expected two geometry pass attachments")) {
+        passed &= check(geometry_attachments[0].loadOp == VK_ATTACHMENT_LOAD_OP_CLEAR && geometry_attachments[0].storeOp == VK_ATTACHMENT_STORE_OP_STORE,
+            "gbuffer has to be cleared and stored for the lighting pass");
+        passed &= check(geometry_attachments[1].storeOp == VK_ATTACHMENT_STORE_OP_DONT_CARE, "depth is stored though nothing reads it");
+    } else {
+        passed = false;
+    }
+
+    // The lighting pass waits for gbuffer's color writes, and for depth's writes before lit reuses its memory
+    const auto& lighting_barriers = graph.get_barriers(lighting_pass);
+    if (check(lighting_barriers.size() == 2, "Expected two lighting pass barriers")) {
+        passed &= check_flags(lighting_barriers[0].src_stages, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, "gbuffer read source stages");
+        passed &= check_flags(lighting_barriers[0].src_access, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, "gbuffer read source access");
+        passed &= check(lighting_barriers[0].new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, "gbuffer isn't sampled in SHADER_READ_ONLY_OPTIMAL");
+        passed &= check_flags(lighting_barriers[1].src_stages, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+            "lit write source stages");
+        passed &= check_flags(lighting_barriers[1].dst_stages, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, "lit write destination stages");
+        passed &= check(lighting_barriers[1].old_layout == VK_IMAGE_LAYOUT_UNDEFINED && lighting_barriers[1].new_layout == VK_IMAGE_LAYOUT_GENERAL,
+            "lit doesn't go from UNDEFINED to GENERAL");
+    } else {
+        passed = false;
+    }
+
+    // The composite pass samples lit after the compute writes, and renders into the swapchain image once the
+    // acquire semaphore has been waited on; the image is handed back for presenting
+    const auto& composite_barriers = graph.get_barriers(composite_pass);
+    if (check(composite_barriers.size() == 1, "Expected one composite pass barrier")) {
+        passed &= check_flags(composite_barriers[0].src_stages, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, "lit read source stages");
+        passed &= check_flags(composite_barriers[0].src_access, VK_ACCESS_SHADER_WRITE_BIT, "lit read source access");
+    } else {
+        passed = false;
+    }
+    const VkSubpassDependency& composite_dependency = graph.get_dependency(composite_pass);
+    passed &= check_flags(composite_dependency.srcStageMask, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, "Composite pass source stages");
+    passed &= check_flags(composite_dependency.dstStageMask, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, "Composite pass destination stages");
+    const auto& final_barriers = graph.get_final_barriers();
+    passed &= check(final_barriers.size() == 1 && final_barriers[0].resource == swapchain && final_barriers[0].new_layout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        "The swapchain image isn't handed back in PRESENT_SRC_KHR");
+
+    // Keeping the debug image around brings its pass back, and it fits in the memory depth and lit share
+    graph.mark_output(debug);
+    graph.set_image_extent(debug, { 640, 360 });
+    passed &= check(graph.plan(reqs), "Planning with the debug output failed");
+    passed &= check(!graph.is_culled(debug_pass), "The debug pass was culled though its image is an output");
+    passed &= check(graph.get_slot(debug) == graph.get_slot(depth) && graph.get_slot(lit) == graph.get_slot(depth), "debug doesn't share memory with depth and lit");
+    passed &= check(graph.get_transient_bytes() == 12 * mib, "Expected the debug image not to need more memory");
+    passed &= check(graph.get_unaliased_bytes() == 20 * mib, "Expected 20 MiB without aliasing");
+    return passed ? 0 : 1;
+}
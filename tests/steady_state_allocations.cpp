@@ -0,0 +1,119 @@
+// Checks that the per-frame path stops allocating once it has warmed up: runs headless frames through
+// FrameRing::begin_frame()/end_frame() (and so Window::present()) and the GPU profiler, counting calls to
+// operator new and malloc on this thread. Other threads (the logger's, the driver's) aren't counted
+#include "backend.h"
+#include "frame.h"
+#include "profiler.h"
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Frames that may allocate while the rings and the frames' containers size themselves
+constexpr uint32_t n_warmup_frames = 64;
+// Frames that must not allocate at all
+constexpr uint32_t n_measured_frames = 256;
+// Tells CTest the test was skipped, e.g. when there's no Vulkan device to run on
+constexpr int skip_return_code = 77;
+
+static thread_local bool t_counting = false;
+static std::atomic<uint64_t> g_n_allocations(0);
+
+static inline void count_allocation() {
+    if (t_counting)
+        g_n_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* operator new(size_t size) {
+    count_allocation();
+    void* memory = malloc(size ? size : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+#ifdef __GLIBC__
+// Also catches C allocations, e.g. from the Vulkan loader. Counted twice when they come from operator new,
+// which doesn't matter since any allocation at all fails the test
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* memory, size_t size);
+
+extern "C" void* malloc(size_t size) noexcept {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) noexcept {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* memory, size_t size) noexcept {
+    count_allocation();
+    return __libc_realloc(memory, size);
+}
+#endif
+
+using namespace Atlas;
+
+static bool run_frame(Backend::FrameRing& frames, Backend::GpuProfiler& profiler) {
+    if (!frames.begin_frame()) return false;
+
+    VkCommandBufferBeginInfo begin_info = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,    // sType
+        nullptr,                                        // pNext
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,    // flags
+        nullptr                                         // pInheritanceInfo
+    };
+    VkCommandBuffer command_buffer = frames.get_command_buffer(Backend::QUEUE_FAMILY_UNIVERSAL);
+    if (!command_buffer || !validate(vkBeginCommandBuffer(command_buffer, &begin_info))) return false;
+    if (!profiler.begin_frame(command_buffer)) return false;
+    uint32_t scope = profiler.begin_scope(command_buffer, "frame");
+    profiler.end_scope(command_buffer, scope);
+    if (!validate(vkEndCommandBuffer(command_buffer))) return false;
+
+    return frames.end_frame(Span<VkCommandBuffer>(&command_buffer, 1));
+}
+
+int main() {
+    Backend::Instance instance("Steady state allocations", VK_MAKE_VERSION(0,0,1), VALIDATION_DISABLED);
+    if (!instance.init()) return skip_return_code;
+
+    Window window(instance, "Steady state allocations", 640, 360);
+    window.set_headless(true);
+    if (!window.init()) return skip_return_code;
+
+    Backend::Device device(window);
+    if (!device.init()) return skip_return_code;
+
+    Backend::FrameRing frames(device, window);
+    if (!frames.init()) return 1;
+
+    Backend::GpuProfiler profiler(device, frames);
+    // Short enough that the history ring wraps around during the measured frames
+    profiler.history_length = 16;
+    if (!profiler.init()) return 1;
+
+    for (uint32_t i = 0; i < n_warmup_frames; ++i) {
+        if (!run_frame(frames, profiler)) return 1;
+    }
+
+    t_counting = true;
+    for (uint32_t i = 0; i < n_measured_frames; ++i) {
+        if (!run_frame(frames, profiler)) {
+            t_counting = false;
+            return 1;
+        }
+    }
+    t_counting = false;
+    frames.wait_idle();
+
+    const uint64_t n_allocations = g_n_allocations.load(std::memory_order_relaxed);
+    printf("%llu allocations over %u frames after %u warm-up frames\n", static_cast<unsigned long long>(n_allocations), n_measured_frames, n_warmup_frames);
+    return (n_allocations == 0) ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+// Times validate(VK_SUCCESS), which runs after every Vulkan call, against the version it replaced: that one read
+// the clock and split it into hours, minutes, seconds and milliseconds for a log prefix before looking at the result
+#include "backend.h"
+#include <chrono>
+#include <stdio.h>
+
+constexpr uint32_t n_calls = 100000000;
+
+static int g_hr, g_min, g_sec, g_ms;
+static const auto g_startup = std::chrono::high_resolution_clock::now();
+
+// The old validate(), minus the messages for results other than VK_SUCCESS (never reached here)
+#if defined(_MSC_VER)
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static bool validate_with_clock(VkResult result) {
+    auto duration = std::chrono::high_resolution_clock::now() - g_startup;
+    g_hr = std::chrono::duration_cast<std::chrono::hours>(duration).count();
+    g_min = std::chrono::duration_cast<std::chrono::minutes>(duration).count() - g_hr*60;
+    g_sec = std::chrono::duration_cast<std::chrono::seconds>(duration).count() - g_hr*360 - g_min*60;
+    g_ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() - g_hr*360000 - g_min*60000 - g_sec*1000;
+
+    switch (result) {
+    case VK_SUCCESS:
+    case VK_EVENT_SET:
+    case VK_EVENT_RESET:
+        return true;
+    default:
+        return Atlas::report_result(result);
+    }
+}
+
+template <typename Function>
+static double time_calls(Function function) {
+    // Read through a volatile so the calls can't be hoisted out of the loop
+    volatile VkResult result = VK_SUCCESS;
+    uint32_t n_valid = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < n_calls; ++i)
+        n_valid += function(result) ? 1 : 0;
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+    if (n_valid != n_calls)
+        printf("Only %u of %u calls succeeded\n", n_valid, n_calls);
+    return elapsed.count() / n_calls;
+}
+
+int main() {
+    const double inline_ns = time_calls([](VkResult result) { return Atlas::validate(result); });
+    const double clock_ns = time_calls([](VkResult result) { return validate_with_clock(result); });
+    printf("validate(VK_SUCCESS), %u calls:\n", n_calls);
+    printf("  inline:          %.3f ns per call\n", inline_ns);
+    printf("  reads the clock: %.3f ns per call (%.1fx)\n", clock_ns, clock_ns / inline_ns);
+    return 0;
+}